@@ -1,18 +1,50 @@
 // VfxEnc.cpp
 // Win32 + libmpv preview, drag&drop video + mpv .hook GLSL shaders,
 // reorder shaders by drag inside list, and re-encode via ffmpeg+libplacebo.
+// "VfxEnc --batch jobs.txt" runs encodes headless, "VfxEnc --serve
+// service.txt" runs them as a service, "VfxEnc --bench" measures them,
+// "VfxEnc --profile" times each shader in the chain and "VfxEnc --selftest"
+// checks the shader rewriting (in builds with VFXENC_SELFTEST); off Windows
+// those are the only modes (no window, no mpv).
 //
 // Build: link against mpv.lib, ensure mpv-2.dll is available at runtime.
+// Linux: g++ -std=c++17 -O2 -pthread VfxEnc.cpp -o vfxenc
+// Self-test build: add -DVFXENC_SELFTEST, then run vfxenc --selftest.
+// With the in-process engine (needs FFmpeg 6+ development headers; off until
+// libav=1 is set in settings.txt):
+//   g++ -std=c++17 -O2 -pthread -DVFXENC_WITH_LIBAV VfxEnc.cpp -o vfxenc -lavformat -lavcodec -lavfilter -lavutil
 
+#ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#include <winsock2.h>
 #include <windowsx.h>
 #include <shellapi.h>
 #include <commdlg.h>
 #include <commctrl.h>
 #include <ShlObj.h>
+#include <psapi.h>
+#include <share.h>
 
 #include <mpv/client.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <cwctype>
+#endif
 
 #include <string>
 #include <vector>
@@ -20,11 +52,58 @@
 #include <thread>
 #include <fstream>
 #include <sstream>
+#include <atomic>
+#include <mutex>
+#include <functional>
+#include <filesystem>
+#include <string_view>
+#include <charconv>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <cmath>
+#include <memory>
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define VFXENC_GRADE_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define VFXENC_GRADE_NEON 1
+#include <arm_neon.h>
+#endif
+
+#ifdef VFXENC_WITH_LIBAV
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersrc.h>
+#include <libavfilter/buffersink.h>
+#include <libavutil/hwcontext.h>
+#include <libavutil/pixdesc.h>
+}
+#ifdef _MSC_VER
+#pragma comment(lib, "avformat.lib")
+#pragma comment(lib, "avcodec.lib")
+#pragma comment(lib, "avfilter.lib")
+#pragma comment(lib, "avutil.lib")
+#endif
+#endif
 
+#ifdef _WIN32
 #pragma comment(lib, "Comdlg32.lib")
 #pragma comment(lib, "Shell32.lib")
 #pragma comment(lib, "Ole32.lib")
 #pragma comment(lib, "Comctl32.lib")
+#pragma comment(lib, "Ws2_32.lib")
+#pragma comment(lib, "Psapi.lib")
 
 #ifndef LOAD_LIBRARY_SEARCH_DEFAULT_DIRS
 #define LOAD_LIBRARY_SEARCH_DEFAULT_DIRS 0x00001000
@@ -32,10 +111,19 @@
 #ifndef LOAD_LIBRARY_SEARCH_USER_DIRS
 #define LOAD_LIBRARY_SEARCH_USER_DIRS 0x00000400
 #endif
+#else
+// MSVC's array overload, for the fixed buffers the formatting code uses.
+template <size_t N, class... Args>
+static int swprintf_s(wchar_t (&buf)[N], const wchar_t* fmt, Args... args)
+{
+    return swprintf(buf, N, fmt, args...);
+}
+#endif
 
 // ----------------------------
 // Globals (small app, simple)
 // ----------------------------
+#ifdef _WIN32
 static HINSTANCE g_hInst = nullptr;
 static HWND g_hwndMain = nullptr;
 static HWND g_hwndVideo = nullptr;
@@ -49,33 +137,66 @@ static HWND g_hwndAddShader = nullptr;
 static HWND g_hwndFiltersLabel = nullptr;
 static HWND g_hwndEncoder = nullptr;
 static HWND g_hwndEncoderLabel = nullptr;
+static HWND g_hwndSegments = nullptr;
+static HWND g_hwndSegmentsLabel = nullptr;
+static HWND g_hwndEngine = nullptr;
+static HWND g_hwndEngineLabel = nullptr;
 
 static mpv_handle* g_mpv = nullptr;
+#endif
 
+// Constant overrides for one chain entry: name -> value (one number, or one
+// per vector component). See SpecializeShader.
+using ShaderParams = std::map<std::string, std::vector<double>>;
+
 static std::wstring g_loadedVideo;
 static std::vector<std::wstring> g_shaders;
 static std::vector<bool> g_shaderBypass;
+static std::vector<ShaderParams> g_shaderParams; // parallel to g_shaders
+#ifdef _WIN32
 static int g_bitrateMbps = 0; // 0 = same as input
 static std::wstring g_encoderChoice = L"auto";
+static int g_segmentWorkers = 0; // 0 = single ffmpeg process, -1 = auto
+static bool g_checkpoint = false;  // resumable segmented encode
+static bool g_smartRender = false; // reuse the last output's unchanged segments
+static int g_shaderEngine = 0;   // 0 = libplacebo (GPU), 1 = CPU grade, 2 = baked 3D LUT
 static bool g_isPlaying = false;
+#endif
 static std::wstring g_lastVideoDir;
 static std::wstring g_lastShaderDir;
+static std::wstring g_logDir;  // encode logs; empty = <exe dir>\logs
+static int g_logMaxMB = 64;    // per log file before it rotates (0 = no cap)
+static int g_logKeep = 3;      // rotated generations kept per job
+#ifdef VFXENC_WITH_LIBAV
+static bool g_useLibav = false; // in-process engine, opt-in (libav=1 in settings.txt)
+#endif
 
 // (no custom brushes)
 
+#ifdef _WIN32
 // listbox drag reorder state
 static WNDPROC g_listOrigProc = nullptr;
 static bool g_dragging = false;
 static int  g_dragIndex = -1;
+#endif
 
 // ----------------------------
 // Helpers
 // ----------------------------
 static std::wstring JoinPath(const std::wstring& a, const std::wstring& b);
+static std::string WideToUtf8(const std::wstring& s);
+static std::wstring Utf8ToWide(const std::string& s);
+static std::filesystem::path FsPath(const std::wstring& p);
+static void SetWatchedShaders(const std::vector<std::wstring>& paths);
+static void PrefetchMediaProbe(const std::wstring& path);
+#ifdef _WIN32
+static std::wstring LiveShaderCopy(const std::wstring& path, const ShaderParams& params);
 static void ListRefresh();
 static void MpvApplyShaderList();
 static void AddShaderPath(const std::wstring& path);
+#endif
 
+#ifdef _WIN32
 static std::wstring GetExeDir()
 {
     wchar_t path[MAX_PATH];
@@ -120,6 +241,46 @@ static std::wstring GetAppDataDir()
     CreateDirectoryW(dir.c_str(), nullptr);
     return dir;
 }
+#else
+static std::wstring GetExeDir()
+{
+    std::error_code ec;
+    std::filesystem::path exe = std::filesystem::read_symlink("/proc/self/exe", ec);
+    return ec ? L"." : Utf8ToWide(exe.parent_path().string());
+}
+
+// $XDG_CONFIG_HOME/VfxEnc (~/.config/VfxEnc), else next to the binary.
+static std::wstring GetAppDataDir()
+{
+    std::wstring dir;
+    if (const char* xdg = getenv("XDG_CONFIG_HOME"); xdg && *xdg) dir = JoinPath(Utf8ToWide(xdg), L"VfxEnc");
+    else if (const char* home = getenv("HOME"); home && *home) dir = JoinPath(Utf8ToWide(home), L".config/VfxEnc");
+    else dir = GetExeDir();
+    std::error_code ec;
+    std::filesystem::create_directories(FsPath(dir), ec);
+    return dir;
+}
+#endif
+
+// Filesystem paths from the app's wide strings. On POSIX the narrow side is
+// UTF-8 regardless of the C locale.
+static std::filesystem::path FsPath(const std::wstring& p)
+{
+#ifdef _WIN32
+    return std::filesystem::path(p);
+#else
+    return std::filesystem::path(WideToUtf8(p));
+#endif
+}
+
+static std::wstring FromFsPath(const std::filesystem::path& p)
+{
+#ifdef _WIN32
+    return p.wstring();
+#else
+    return Utf8ToWide(p.string());
+#endif
+}
 
 static std::wstring GetShadersSavePath()
 {
@@ -131,6 +292,12 @@ static std::wstring GetSettingsPath()
     return JoinPath(GetAppDataDir(), L"settings.txt");
 }
 
+static std::wstring GetEncoderCachePath()
+{
+    return JoinPath(GetAppDataDir(), L"encoders.txt");
+}
+
+#ifdef _WIN32
 static std::string WideToUtf8(const std::wstring& s)
 {
     if (s.empty()) return {};
@@ -148,21 +315,54 @@ static std::wstring Utf8ToWide(const std::string& s)
     if (len > 1) MultiByteToWideChar(CP_UTF8, 0, s.c_str(), -1, out.data(), len);
     return out;
 }
+#else
+// wchar_t is UTF-32 here.
+static std::string WideToUtf8(const std::wstring& s)
+{
+    std::string out;
+    out.reserve(s.size());
+    for (wchar_t wc : s) {
+        uint32_t c = (uint32_t)wc;
+        if (c < 0x80) {
+            out.push_back((char)c);
+        } else if (c < 0x800) {
+            out.push_back((char)(0xC0 | (c >> 6)));
+            out.push_back((char)(0x80 | (c & 0x3F)));
+        } else if (c < 0x10000) {
+            out.push_back((char)(0xE0 | (c >> 12)));
+            out.push_back((char)(0x80 | ((c >> 6) & 0x3F)));
+            out.push_back((char)(0x80 | (c & 0x3F)));
+        } else {
+            out.push_back((char)(0xF0 | (c >> 18)));
+            out.push_back((char)(0x80 | ((c >> 12) & 0x3F)));
+            out.push_back((char)(0x80 | ((c >> 6) & 0x3F)));
+            out.push_back((char)(0x80 | (c & 0x3F)));
+        }
+    }
+    return out;
+}
 
-static void WriteLogLine(HANDLE h, const std::wstring& line)
+static std::wstring Utf8ToWide(const std::string& s)
 {
-    if (h == INVALID_HANDLE_VALUE) return;
-    std::string utf8 = WideToUtf8(line);
-    if (utf8.empty()) return;
-    DWORD written = 0;
-    WriteFile(h, utf8.data(), (DWORD)utf8.size(), &written, nullptr);
+    std::wstring out;
+    out.reserve(s.size());
+    for (size_t i = 0; i < s.size();) {
+        uint8_t b = (uint8_t)s[i];
+        int extra = (b >= 0xF0) ? 3 : (b >= 0xE0) ? 2 : (b >= 0xC0) ? 1 : 0;
+        uint32_t c = extra ? (b & (0x3F >> extra)) : b;
+        size_t j = i + 1;
+        for (; j < s.size() && j <= i + (size_t)extra; ++j) c = (c << 6) | ((uint8_t)s[j] & 0x3F);
+        out.push_back((wchar_t)c);
+        i = j;
+    }
+    return out;
 }
+#endif
 
 static bool EndsWithI(const std::wstring& s, const std::wstring& suf)
 {
     if (s.size() < suf.size()) return false;
     auto a = s.substr(s.size() - suf.size());
-    auto lower = [](wchar_t c){ return (wchar_t)CharLowerW((LPWSTR)(ULONG_PTR)c); };
     for (size_t i=0;i<suf.size();++i) {
         wchar_t ca = towlower(a[i]);
         wchar_t cb = towlower(suf[i]);
@@ -184,6 +384,7 @@ static bool IsLikelyVideo(const std::wstring& p)
            EndsWithI(p,L".ts") ||EndsWithI(p,L".m2ts")||EndsWithI(p,L".webm")||EndsWithI(p,L".m4v");
 }
 
+#ifdef _WIN32
 static void SetStatus(const std::wstring& msg)
 {
     if (g_hwndStatus) SetWindowTextW(g_hwndStatus, msg.c_str());
@@ -200,7 +401,9 @@ static void UpdatePlayPauseLabel()
     SetWindowTextW(g_hwndPlayPause, L"Play");
     InvalidateRect(g_hwndPlayPause, nullptr, TRUE);
 }
+#endif
 
+#ifdef _WIN32
 static std::wstring Quote(const std::wstring& s)
 {
     std::wstring out = L"\"";
@@ -208,6 +411,19 @@ static std::wstring Quote(const std::wstring& s)
     out += L"\"";
     return out;
 }
+#else
+// Commands run through /bin/sh, so quote for it.
+static std::wstring Quote(const std::wstring& s)
+{
+    std::wstring out = L"'";
+    for (wchar_t c : s) {
+        if (c == L'\'') out += L"'\\''";
+        else out.push_back(c);
+    }
+    out += L"'";
+    return out;
+}
+#endif
 
 static std::wstring BasenameNoExt(const std::wstring& path)
 {
@@ -235,9 +451,14 @@ static std::wstring JoinPath(const std::wstring& a, const std::wstring& b)
     if (a.empty()) return b;
     wchar_t last = a.back();
     if (last == L'\\' || last == L'/') return a + b;
+#ifdef _WIN32
     return a + L"\\" + b;
+#else
+    return a + L"/" + b;
+#endif
 }
 
+#ifdef _WIN32
 static double GetMpvDurationSeconds()
 {
     if (!g_mpv) return 0.0;
@@ -247,8 +468,31 @@ static double GetMpvDurationSeconds()
     }
     return 0.0;
 }
+#endif
+
+// Encoder specs may carry a preset: "libx265:fast".
+static std::wstring EncoderName(const std::wstring& spec)
+{
+    return spec.substr(0, spec.find(L':'));
+}
+
+static std::wstring EncoderPreset(const std::wstring& spec)
+{
+    size_t colon = spec.find(L':');
+    return (colon == std::wstring::npos) ? std::wstring() : spec.substr(colon + 1);
+}
 
-static std::wstring BuildEncoderArgs(const std::wstring& enc, int targetMbps)
+static std::wstring BuildEncoderArgsFor(const std::wstring& enc, int targetMbps);
+
+static std::wstring BuildEncoderArgs(const std::wstring& spec, int targetMbps)
+{
+    std::wstring args = BuildEncoderArgsFor(EncoderName(spec), targetMbps);
+    std::wstring preset = EncoderPreset(spec);
+    if (!preset.empty()) args += L" -preset " + preset; // later -preset wins over a built-in one
+    return args;
+}
+
+static std::wstring BuildEncoderArgsFor(const std::wstring& enc, int targetMbps)
 {
     wchar_t rate[64];
     wchar_t buf[64];
@@ -267,6 +511,9 @@ static std::wstring BuildEncoderArgs(const std::wstring& enc, int targetMbps)
     if (enc == L"hevc_mf") {
         return L"-c:v hevc_mf -b:v " + std::wstring(rate);
     }
+    if (enc == L"libx264") {
+        return L"-c:v libx264 -b:v " + std::wstring(rate) + L" -maxrate " + rate + L" -bufsize " + buf;
+    }
     // software fallback
     return L"-c:v libx265 -b:v " + std::wstring(rate) + L" -maxrate " + rate + L" -bufsize " + buf;
 }
@@ -291,75 +538,373 @@ static int ParseBitrateKbps(const std::string& text)
     return 0;
 }
 
-static int64_t ParseOutTimeMs(const std::string& line)
+// ----------------------------
+// ffmpeg -progress telemetry
+// ----------------------------
+// One snapshot per "progress=" block of ffmpeg's -progress output.
+struct FfmpegProgress {
+    int64_t frame = 0;
+    double fps = 0.0;
+    double bitrateKbps = 0.0; // 0 when ffmpeg reports N/A
+    int64_t totalSize = 0;    // bytes written so far
+    int64_t outTimeUs = 0;
+    double speed = 0.0;       // realtime multiple, 0 when N/A
+    int64_t dupFrames = 0;
+    int64_t dropFrames = 0;
+    double etaSec = -1.0;     // -1 when duration or speed is unknown
+    bool end = false;         // progress=end
+};
+
+static int64_t ParseInt64(std::string_view v)
+{
+    int64_t out = 0;
+    std::from_chars(v.data(), v.data() + v.size(), out);
+    return out;
+}
+
+// Leading number of values like "1234.5kbits/s" or "1.23x"; 0 for "N/A".
+static double ParseLeadingDouble(std::string_view v)
 {
-    const char* key = "out_time_ms=";
-    if (line.rfind(key, 0) != 0) return -1;
-    int64_t v = 0;
-    bool any = false;
-    for (size_t i = strlen(key); i < line.size(); ++i) {
-        char c = line[i];
-        if (c < '0' || c > '9') break;
-        any = true;
-        v = v * 10 + (c - '0');
-    }
-    return any ? v : -1;
+    while (!v.empty() && v.front() == ' ') v.remove_prefix(1);
+    double out = 0.0;
+    std::from_chars(v.data(), v.data() + v.size(), out);
+    return out;
 }
 
-static int ProbeBitrateKbpsWithFfmpeg(const std::wstring& ffmpeg, const std::wstring& file)
+// Incremental key=value parser for -progress output. Lines are parsed straight
+// out of the read buffer (see LineSplitter); nothing is allocated per line.
+struct FfmpegProgressParser {
+    double durationSec = 0.0;
+    FfmpegProgress cur;
+
+    // Returns true when the line completed a snapshot (available in cur).
+    bool FeedLine(std::string_view line)
+    {
+        size_t eq = line.find('=');
+        if (eq == std::string_view::npos) return false;
+        std::string_view key = line.substr(0, eq);
+        std::string_view val = line.substr(eq + 1);
+
+        if (key == "frame") cur.frame = ParseInt64(val);
+        else if (key == "fps") cur.fps = ParseLeadingDouble(val);
+        else if (key == "bitrate") cur.bitrateKbps = ParseLeadingDouble(val);
+        else if (key == "total_size") cur.totalSize = ParseInt64(val);
+        // out_time_ms is microseconds too (long-standing ffmpeg quirk); newer
+        // builds also print out_time_us, older ones only out_time_ms.
+        else if (key == "out_time_us" || key == "out_time_ms") cur.outTimeUs = ParseInt64(val);
+        else if (key == "speed") cur.speed = ParseLeadingDouble(val);
+        else if (key == "dup_frames") cur.dupFrames = ParseInt64(val);
+        else if (key == "drop_frames") cur.dropFrames = ParseInt64(val);
+        else if (key == "progress") {
+            cur.end = (val == "end");
+            cur.etaSec = -1.0;
+            if (durationSec > 0.0 && cur.speed > 0.0) {
+                double remain = durationSec - cur.outTimeUs / 1000000.0;
+                cur.etaSec = (remain > 0.0) ? remain / cur.speed : 0.0;
+            }
+            return true;
+        }
+        return false;
+    }
+};
+
+// ----------------------------
+// Child processes
+// ----------------------------
+// Largest peak working set of any child since the last reset, in KB (the
+// benchmark resets it per case).
+static std::atomic<uint64_t> g_childPeakRssKb{0};
+
+static void NoteChildPeakRss(uint64_t kb)
 {
-    std::wstring cmd = Quote(ffmpeg) + L" -hide_banner -i " + Quote(file);
+    uint64_t cur = g_childPeakRssKb.load();
+    while (kb > cur && !g_childPeakRssKb.compare_exchange_weak(cur, kb)) {}
+}
 
+#ifdef _WIN32
+// CreateProcess hands every inheritable handle that exists at that moment to the
+// child, so two launches racing each other would leak their pipe write ends into
+// the sibling and the reader would never see EOF. Pipe creation + launch is
+// serialized; the read loops still run concurrently.
+static std::mutex g_spawnMutex;
+
+// Runs cmd and hands every stdout chunk to onChunk. stderr shares the stdout
+// pipe unless onStderr is given, in which case it gets its own pipe drained on
+// a helper thread. Returning false from either callback kills the child.
+// If onStdin is given, the child's stdin is a pipe fed from a helper thread:
+// each call supplies the next block, and returning false closes the pipe.
+// Returns the process exit code, or -1 if it could not be started.
+static int RunProcessStreaming(const std::wstring& cmd, const std::wstring& workDir,
+                               const std::function<bool(const char*, size_t)>& onChunk,
+                               const std::function<bool(const char*, size_t)>& onStderr = nullptr,
+                               const std::function<bool(const char*&, size_t&)>& onStdin = nullptr)
+{
     SECURITY_ATTRIBUTES sa{};
     sa.nLength = sizeof(sa);
     sa.bInheritHandle = TRUE;
     sa.lpSecurityDescriptor = nullptr;
 
     HANDLE hRead = nullptr;
-    HANDLE hWrite = nullptr;
-    if (!CreatePipe(&hRead, &hWrite, &sa, 0)) return 0;
-    SetHandleInformation(hRead, HANDLE_FLAG_INHERIT, 0);
+    HANDLE hErrRead = nullptr;
+    HANDLE hInWrite = nullptr;
+    PROCESS_INFORMATION pi{};
+    {
+        std::lock_guard<std::mutex> lock(g_spawnMutex);
+
+        HANDLE hWrite = nullptr;
+        HANDLE hErrWrite = nullptr;
+        if (!CreatePipe(&hRead, &hWrite, &sa, 0)) return -1;
+        SetHandleInformation(hRead, HANDLE_FLAG_INHERIT, 0);
+        if (onStderr) {
+            if (!CreatePipe(&hErrRead, &hErrWrite, &sa, 0)) {
+                CloseHandle(hRead);
+                CloseHandle(hWrite);
+                return -1;
+            }
+            SetHandleInformation(hErrRead, HANDLE_FLAG_INHERIT, 0);
+        }
+        HANDLE hInRead = nullptr;
+        if (onStdin) {
+            if (!CreatePipe(&hInRead, &hInWrite, &sa, 0)) {
+                CloseHandle(hRead);
+                CloseHandle(hWrite);
+                if (hErrRead) CloseHandle(hErrRead);
+                if (hErrWrite) CloseHandle(hErrWrite);
+                return -1;
+            }
+            SetHandleInformation(hInWrite, HANDLE_FLAG_INHERIT, 0);
+        }
 
-    STARTUPINFOW si{};
-    si.cb = sizeof(si);
-    si.dwFlags |= STARTF_USESTDHANDLES;
-    si.hStdOutput = hWrite;
-    si.hStdError = hWrite;
-    si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+        STARTUPINFOW si{};
+        si.cb = sizeof(si);
+        si.dwFlags |= STARTF_USESTDHANDLES;
+        si.hStdOutput = hWrite;
+        si.hStdError = hErrWrite ? hErrWrite : hWrite;
+        si.hStdInput = hInRead ? hInRead : GetStdHandle(STD_INPUT_HANDLE);
+
+        // CreateProcess wants mutable buffer
+        std::wstring mutableCmd = cmd;
+        BOOL ok = CreateProcessW(
+            nullptr,
+            mutableCmd.data(),
+            nullptr, nullptr,
+            TRUE,
+            CREATE_NO_WINDOW,
+            nullptr,
+            workDir.empty() ? nullptr : workDir.c_str(),
+            &si, &pi
+        );
 
-    PROCESS_INFORMATION pi{};
-    std::wstring mutableCmd = cmd;
-    BOOL ok = CreateProcessW(
-        nullptr,
-        mutableCmd.data(),
-        nullptr, nullptr,
-        TRUE,
-        CREATE_NO_WINDOW,
-        nullptr,
-        nullptr,
-        &si, &pi
-    );
+        CloseHandle(hWrite);
+        if (hErrWrite) CloseHandle(hErrWrite);
+        if (hInRead) CloseHandle(hInRead);
+        if (!ok) {
+            CloseHandle(hRead);
+            if (hErrRead) CloseHandle(hErrRead);
+            if (hInWrite) CloseHandle(hInWrite);
+            return -1;
+        }
+    }
 
-    CloseHandle(hWrite);
-    if (!ok) {
-        CloseHandle(hRead);
-        return 0;
+    std::thread inWriter;
+    if (hInWrite) {
+        inWriter = std::thread([&]() {
+            const char* data = nullptr;
+            size_t n = 0;
+            bool open = true;
+            while (open && onStdin(data, n)) {
+                while (n > 0) {
+                    DWORD written = 0;
+                    DWORD chunk = (DWORD)std::min<size_t>(n, 1 << 20);
+                    if (!WriteFile(hInWrite, data, chunk, &written, nullptr)) {
+                        open = false; // child went away
+                        break;
+                    }
+                    data += written;
+                    n -= written;
+                }
+            }
+            CloseHandle(hInWrite);
+        });
     }
 
-    std::string output;
-    char buf[4096];
+    std::thread errReader;
+    if (hErrRead) {
+        errReader = std::thread([&]() {
+            char chunk[4096];
+            DWORD read = 0;
+            while (ReadFile(hErrRead, chunk, sizeof(chunk), &read, nullptr) && read > 0) {
+                if (!onStderr(chunk, read)) {
+                    TerminateProcess(pi.hProcess, 1);
+                    break;
+                }
+            }
+        });
+    }
+
+    char chunk[4096];
     DWORD read = 0;
-    while (ReadFile(hRead, buf, sizeof(buf), &read, nullptr) && read > 0) {
-        output.append(buf, buf + read);
+    while (ReadFile(hRead, chunk, sizeof(chunk), &read, nullptr) && read > 0) {
+        if (onChunk && !onChunk(chunk, read)) {
+            TerminateProcess(pi.hProcess, 1);
+            break;
+        }
     }
+    if (errReader.joinable()) errReader.join();
+    if (inWriter.joinable()) inWriter.join();
     CloseHandle(hRead);
+    if (hErrRead) CloseHandle(hErrRead);
 
     WaitForSingleObject(pi.hProcess, INFINITE);
+
+    DWORD exitCode = 1;
+    GetExitCodeProcess(pi.hProcess, &exitCode);
+    PROCESS_MEMORY_COUNTERS mem{};
+    if (GetProcessMemoryInfo(pi.hProcess, &mem, sizeof(mem))) NoteChildPeakRss(mem.PeakWorkingSetSize / 1024);
     CloseHandle(pi.hThread);
     CloseHandle(pi.hProcess);
+    return (int)exitCode;
+}
+#else
+static std::mutex g_spawnMutex;
+
+// POSIX counterpart: the command goes through /bin/sh (Quote() quotes for
+// it), pipe ends are close-on-exec so siblings can't inherit them, and the
+// child gets its own process group so a kill takes its children too.
+static int RunProcessStreaming(const std::wstring& cmd, const std::wstring& workDir,
+                               const std::function<bool(const char*, size_t)>& onChunk,
+                               const std::function<bool(const char*, size_t)>& onStderr = nullptr,
+                               const std::function<bool(const char*&, size_t&)>& onStdin = nullptr)
+{
+    int out[2] = { -1, -1 };
+    int err[2] = { -1, -1 };
+    int in[2] = { -1, -1 };
+    auto closeAll = [&]() {
+        for (int* p : { out, err, in }) {
+            if (p[0] >= 0) close(p[0]);
+            if (p[1] >= 0) close(p[1]);
+        }
+    };
+    if (pipe2(out, O_CLOEXEC) != 0 || (onStderr && pipe2(err, O_CLOEXEC) != 0) ||
+        (onStdin && pipe2(in, O_CLOEXEC) != 0)) {
+        closeAll();
+        return -1;
+    }
+
+    std::string shellCmd = "exec " + WideToUtf8(cmd);
+    std::string dir = WideToUtf8(workDir);
+    pid_t pid = fork();
+    if (pid < 0) {
+        closeAll();
+        return -1;
+    }
+    if (pid == 0) {
+        setpgid(0, 0);
+        dup2(out[1], 1);
+        dup2(err[1] >= 0 ? err[1] : out[1], 2);
+        if (in[0] >= 0) dup2(in[0], 0);
+        if (!dir.empty() && chdir(dir.c_str()) != 0) _exit(127);
+        execl("/bin/sh", "sh", "-c", shellCmd.c_str(), (char*)nullptr);
+        _exit(127);
+    }
+    close(out[1]);
+    if (err[1] >= 0) close(err[1]);
+    if (in[0] >= 0) close(in[0]);
+    auto kill = [pid]() { ::kill(-pid, SIGKILL); };
+
+    std::thread inWriter;
+    if (in[1] >= 0) {
+        inWriter = std::thread([&]() {
+            const char* data = nullptr;
+            size_t n = 0;
+            bool open = true;
+            while (open && onStdin(data, n)) {
+                while (n > 0) {
+                    ssize_t written = write(in[1], data, std::min<size_t>(n, 1 << 20));
+                    if (written < 0 && errno == EINTR) continue;
+                    if (written <= 0) {
+                        open = false; // child went away
+                        break;
+                    }
+                    data += written;
+                    n -= (size_t)written;
+                }
+            }
+            close(in[1]);
+        });
+    }
+
+    std::thread errReader;
+    if (err[0] >= 0) {
+        errReader = std::thread([&]() {
+            char chunk[4096];
+            ssize_t read = 0;
+            while ((read = ::read(err[0], chunk, sizeof(chunk))) > 0 || (read < 0 && errno == EINTR)) {
+                if (read > 0 && !onStderr(chunk, (size_t)read)) {
+                    kill();
+                    break;
+                }
+            }
+        });
+    }
 
-    return ParseBitrateKbps(output);
+    char chunk[4096];
+    ssize_t read = 0;
+    while ((read = ::read(out[0], chunk, sizeof(chunk))) > 0 || (read < 0 && errno == EINTR)) {
+        if (read > 0 && onChunk && !onChunk(chunk, (size_t)read)) {
+            kill();
+            break;
+        }
+    }
+    if (errReader.joinable()) errReader.join();
+    if (inWriter.joinable()) inWriter.join();
+    close(out[0]);
+    if (err[0] >= 0) close(err[0]);
+
+    int status = 0;
+    rusage usage{};
+    while (wait4(pid, &status, 0, &usage) < 0 && errno == EINTR) {}
+    NoteChildPeakRss((uint64_t)usage.ru_maxrss); // KB on Linux
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    return 1;
 }
+#endif
+
+// Splits pipe chunks into '\n'-terminated lines (CR stripped). Complete lines
+// are handed out as views into the chunk itself; only a line that straddles two
+// reads is copied into the carry buffer.
+struct LineSplitter {
+    std::string partial;
+
+    template <class F>
+    void Feed(const char* data, size_t n, F&& onLine)
+    {
+        const char* p = data;
+        const char* end = data + n;
+        while (p < end) {
+            const char* nl = (const char*)memchr(p, '\n', (size_t)(end - p));
+            if (!nl) {
+                partial.append(p, end);
+                break;
+            }
+            if (!partial.empty()) {
+                partial.append(p, nl);
+                Emit(partial, onLine);
+                partial.clear();
+            } else {
+                Emit(std::string_view(p, (size_t)(nl - p)), onLine);
+            }
+            p = nl + 1;
+        }
+    }
+
+    template <class F>
+    static void Emit(std::string_view line, F& onLine)
+    {
+        if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+        onLine(line);
+    }
+};
 
 static std::wstring FfmpegEscapeFilterValue(const std::wstring& value)
 {
@@ -381,9 +926,23 @@ static std::wstring FfmpegEscapeFilterValue(const std::wstring& value)
     return out;
 }
 
+// Escapes an absolute path for a filter option inside a graph description:
+// option-value escaping, then graph-token escaping on top (a drive letter's
+// ':' must survive both).
+static std::wstring FfmpegGraphPath(const std::wstring& path)
+{
+    std::wstring value = FfmpegEscapeFilterValue(path);
+    std::wstring out;
+    for (wchar_t c : value) {
+        if (c == L'\\' || c == L'\'' || c == L'[' || c == L']' || c == L',' || c == L';') out.push_back(L'\\');
+        out.push_back(c);
+    }
+    return out;
+}
+
 static bool ReadTextFile(const std::wstring& path, std::string& out)
 {
-    std::ifstream f(path, std::ios::binary);
+    std::ifstream f(FsPath(path), std::ios::binary);
     if (!f) return false;
     std::ostringstream ss;
     ss << f.rdbuf();
@@ -391,39 +950,11 @@ static bool ReadTextFile(const std::wstring& path, std::string& out)
     return true;
 }
 
-static std::wstring WriteCombinedShaderTemp(const std::vector<std::wstring>& shaders, std::wstring* outFilename)
-{
-    std::wstring outDir = GetExeDir();
-
-    SYSTEMTIME st{};
-    GetSystemTime(&st);
-
-    wchar_t name[256];
-    swprintf_s(name, L"combined_shaders_%04u%02u%02u_%02u%02u%02u.glsl",
-               st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond);
-
-    if (outFilename) *outFilename = name;
-
-    std::wstring outPath = JoinPath(outDir, name);
-
-    std::ofstream o(outPath, std::ios::binary);
-    if (!o) return L"";
-
-    for (const auto& s : shaders) {
-        std::string text;
-        if (ReadTextFile(s, text)) {
-            o << "\n// ---- BEGIN: " << std::string(s.begin(), s.end()) << "\n";
-            o << text;
-            o << "\n// ---- END\n";
-        }
-    }
-
-    return outPath;
-}
-
+#ifdef _WIN32
+// Only the window changes settings; headless modes just read them.
 static void SaveSettings()
 {
-    std::ofstream o(GetSettingsPath(), std::ios::binary);
+    std::ofstream o(FsPath(GetSettingsPath()), std::ios::binary);
     if (!o) return;
     if (!g_lastVideoDir.empty()) {
         o << "video=" << WideToUtf8(g_lastVideoDir) << "\n";
@@ -431,13 +962,22 @@ static void SaveSettings()
     if (!g_lastShaderDir.empty()) {
         o << "shader=" << WideToUtf8(g_lastShaderDir) << "\n";
     }
+    if (!g_logDir.empty()) {
+        o << "logdir=" << WideToUtf8(g_logDir) << "\n";
+    }
+    o << "logmax=" << g_logMaxMB << "\n";
+    o << "logkeep=" << g_logKeep << "\n";
+#ifdef VFXENC_WITH_LIBAV
+    o << "libav=" << (g_useLibav ? 1 : 0) << "\n";
+#endif
 }
+#endif
 
 static void LoadSettings()
 {
     g_lastVideoDir.clear();
     g_lastShaderDir.clear();
-    std::ifstream f(GetSettingsPath(), std::ios::binary);
+    std::ifstream f(FsPath(GetSettingsPath()), std::ios::binary);
     if (!f) return;
     std::string line;
     while (std::getline(f, line)) {
@@ -445,10 +985,21 @@ static void LoadSettings()
             g_lastVideoDir = Utf8ToWide(line.substr(6));
         } else if (line.rfind("shader=", 0) == 0) {
             g_lastShaderDir = Utf8ToWide(line.substr(7));
+        } else if (line.rfind("logdir=", 0) == 0) {
+            g_logDir = Utf8ToWide(line.substr(7));
+        } else if (line.rfind("logmax=", 0) == 0) {
+            g_logMaxMB = std::max(0, atoi(line.c_str() + 7));
+        } else if (line.rfind("logkeep=", 0) == 0) {
+            g_logKeep = std::clamp(atoi(line.c_str() + 8), 0, 99);
+#ifdef VFXENC_WITH_LIBAV
+        } else if (line.rfind("libav=", 0) == 0) {
+            g_useLibav = atoi(line.c_str() + 6) != 0;
+#endif
         }
     }
 }
 
+#ifdef _WIN32
 static void UpdateLastVideoDir(const std::wstring& path)
 {
     std::wstring dir = Dirname(path);
@@ -466,40 +1017,119 @@ static void UpdateLastShaderDir(const std::wstring& path)
         SaveSettings();
     }
 }
+#endif
+
+// "name=v;name=v,v,v" with values at float precision; sorted by name, so equal
+// sets always format the same.
+static std::string FormatShaderParams(const ShaderParams& params)
+{
+    std::string out;
+    for (const auto& [name, values] : params) {
+        if (!out.empty()) out.push_back(';');
+        out += name + "=";
+        for (size_t i = 0; i < values.size(); ++i) {
+            char num[32];
+            snprintf(num, sizeof(num), "%s%.9g", i ? "," : "", values[i]);
+            out += num;
+        }
+    }
+    return out;
+}
+
+// One "name=value" override; the value is a number, true/false, or
+// comma-separated components.
+static bool ParseShaderParam(const std::string& item, ShaderParams& params)
+{
+    size_t eq = item.find('=');
+    if (eq == 0 || eq == std::string::npos || eq + 1 >= item.size()) return false;
+    std::string name = item.substr(0, eq);
+    if (name[0] >= '0' && name[0] <= '9') return false;
+    for (char c : name) {
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_')) return false;
+    }
+    std::vector<double> values;
+    std::stringstream list(item.substr(eq + 1));
+    for (std::string v; std::getline(list, v, ',');) {
+        if (v == "true" || v == "false") {
+            values.push_back(v == "true" ? 1.0 : 0.0);
+            continue;
+        }
+        char* end = nullptr;
+        double d = strtod(v.c_str(), &end);
+        if (v.empty() || *end || !std::isfinite(d)) return false;
+        values.push_back(d);
+    }
+    if (values.empty()) return false;
+    params[name] = values;
+    return true;
+}
+
+static bool ParseShaderParams(const std::string& text, ShaderParams& params)
+{
+    params.clear();
+    std::stringstream list(text);
+    for (std::string item; std::getline(list, item, ';');) {
+        if (!item.empty() && !ParseShaderParam(item, params)) return false;
+    }
+    return true;
+}
 
+#ifdef _WIN32
 static void SaveShaders()
 {
-    std::ofstream o(GetShadersSavePath(), std::ios::binary);
+    std::ofstream o(FsPath(GetShadersSavePath()), std::ios::binary);
     if (!o) return;
     for (size_t i = 0; i < g_shaders.size(); ++i) {
         bool bypass = (i < g_shaderBypass.size()) ? g_shaderBypass[i] : false;
-        o << (bypass ? "1|" : "0|") << WideToUtf8(g_shaders[i]) << "\n";
+        o << (bypass ? "1|" : "0|") << WideToUtf8(g_shaders[i]);
+        if (i < g_shaderParams.size() && !g_shaderParams[i].empty()) o << "|" << FormatShaderParams(g_shaderParams[i]);
+        o << "\n";
+    }
+}
+#endif
+
+// One shaders.txt entry: "0|path" or "1|path" (1 = bypassed), optionally
+// followed by "|name=value;..." constant overrides, or a bare path.
+static bool ParseShaderLine(std::string line, std::wstring& path, bool& bypass, ShaderParams& params)
+{
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    bypass = false;
+    params.clear();
+    if (line.size() > 2 && (line[0] == '0' || line[0] == '1') && line[1] == '|') {
+        bypass = (line[0] == '1');
+        line = line.substr(2);
+        size_t bar = line.find('|');
+        if (bar != std::string::npos) {
+            if (!ParseShaderParams(line.substr(bar + 1), params)) return false;
+            line.resize(bar);
+        }
     }
+    path = Utf8ToWide(line);
+    return !path.empty() && IsShaderFile(path);
 }
 
 static void LoadShaders()
 {
     g_shaders.clear();
     g_shaderBypass.clear();
-    std::ifstream f(GetShadersSavePath(), std::ios::binary);
+    g_shaderParams.clear();
+    std::ifstream f(FsPath(GetShadersSavePath()), std::ios::binary);
     if (!f) return;
     std::string line;
     while (std::getline(f, line)) {
         if (line.empty()) continue;
+        std::wstring w;
         bool bypass = false;
-        if (line.size() > 2 && (line[0] == '0' || line[0] == '1') && line[1] == '|') {
-            bypass = (line[0] == '1');
-            line = line.substr(2);
-        }
-        std::wstring w = Utf8ToWide(line);
-        if (w.empty()) continue;
-        if (IsShaderFile(w)) {
+        ShaderParams params;
+        if (ParseShaderLine(line, w, bypass, params)) {
             g_shaders.push_back(w);
             g_shaderBypass.push_back(bypass);
+            g_shaderParams.push_back(params);
         }
     }
 }
 
+#ifdef _WIN32
 static void MoveShader(int from, int to)
 {
     if (from < 0 || to < 0 || from >= (int)g_shaders.size() || to >= (int)g_shaders.size()) return;
@@ -509,6 +1139,9 @@ static void MoveShader(int from, int to)
     bool b = g_shaderBypass[from];
     g_shaderBypass.erase(g_shaderBypass.begin() + from);
     g_shaderBypass.insert(g_shaderBypass.begin() + to, b);
+    ShaderParams params = g_shaderParams[from];
+    g_shaderParams.erase(g_shaderParams.begin() + from);
+    g_shaderParams.insert(g_shaderParams.begin() + to, params);
     ListRefresh();
     SendMessageW(g_hwndList, LB_SETCURSEL, to, 0);
     MpvApplyShaderList();
@@ -531,81 +1164,279 @@ static void EditShaderInNotepad(const std::wstring& path)
     }
     ShellExecuteW(nullptr, L"open", npp.c_str(), Quote(path).c_str(), nullptr, SW_SHOWNORMAL);
 }
+#endif
 
 static bool FindFfmpeg(std::wstring& outFfmpeg)
 {
     // Prefer ffmpeg.exe in dist\deps; then next to exe; else rely on PATH.
+#ifdef _WIN32
+    const wchar_t* exe = L"ffmpeg.exe";
+#else
+    const wchar_t* exe = L"ffmpeg";
+#endif
     std::wstring exeDir = GetExeDir();
     std::wstring deps = JoinPath(exeDir, L"deps");
-    std::wstring depsFfmpeg = JoinPath(deps, L"ffmpeg.exe");
-    DWORD attrsDeps = GetFileAttributesW(depsFfmpeg.c_str());
-    if (attrsDeps != INVALID_FILE_ATTRIBUTES && !(attrsDeps & FILE_ATTRIBUTE_DIRECTORY)) {
+    std::error_code ec;
+    std::wstring depsFfmpeg = JoinPath(deps, exe);
+    if (std::filesystem::is_regular_file(FsPath(depsFfmpeg), ec)) {
         outFfmpeg = depsFfmpeg;
         return true;
     }
-    std::wstring local = JoinPath(exeDir, L"ffmpeg.exe");
-    DWORD attrs = GetFileAttributesW(local.c_str());
-    if (attrs != INVALID_FILE_ATTRIBUTES && !(attrs & FILE_ATTRIBUTE_DIRECTORY)) {
+    std::wstring local = JoinPath(exeDir, exe);
+    if (std::filesystem::is_regular_file(FsPath(local), ec)) {
         outFfmpeg = local;
         return true;
     }
-    outFfmpeg = L"ffmpeg.exe";
+    outFfmpeg = exe;
     return true;
-}
-
-// ----------------------------
-// mpv integration
-// ----------------------------
-static void MpvApplyShaderList()
-{
-    if (!g_mpv) return;
+}
 
-    // Build mpv_node array of strings for "glsl-shaders"
-    mpv_node node{};
-    node.format = MPV_FORMAT_NODE_ARRAY;
-
-    mpv_node_list list{};
-    std::vector<mpv_node> elems;
-    size_t activeCount = 0;
-    for (size_t i = 0; i < g_shaders.size(); ++i) {
-        if (i < g_shaderBypass.size() && g_shaderBypass[i]) continue;
-        activeCount++;
+// Full path of the file a bare command name would launch, or empty if PATH has
+// no such file.
+static std::wstring ResolveOnPath(const std::wstring& exe)
+{
+#ifdef _WIN32
+    wchar_t buf[MAX_PATH];
+    DWORD n = SearchPathW(nullptr, exe.c_str(), nullptr, MAX_PATH, buf, nullptr);
+    if (n == 0 || n >= MAX_PATH) return L"";
+    return buf;
+#else
+    const char* path = std::getenv("PATH");
+    if (!path) return L"";
+    std::error_code ec;
+    std::string_view rest = path;
+    while (!rest.empty()) {
+        size_t colon = rest.find(':');
+        std::string_view dir = rest.substr(0, colon);
+        rest = (colon == std::string_view::npos) ? std::string_view() : rest.substr(colon + 1);
+        std::wstring cand = JoinPath(Utf8ToWide(std::string(dir.empty() ? "." : dir)), exe);
+        if (std::filesystem::is_regular_file(FsPath(cand), ec) && access(WideToUtf8(cand).c_str(), X_OK) == 0) {
+            return cand;
+        }
     }
-    elems.resize(activeCount);
-
-    // mpv expects UTF-8 strings
-    std::vector<std::string> utf8;
-    utf8.reserve(activeCount);
+    return L"";
+#endif
+}
 
-    size_t outIdx = 0;
-    for (size_t i = 0; i < g_shaders.size(); ++i) {
-        if (i < g_shaderBypass.size() && g_shaderBypass[i]) continue;
-        int len = WideCharToMultiByte(CP_UTF8, 0, g_shaders[i].c_str(), -1, nullptr, 0, nullptr, nullptr);
-        std::string s(len > 0 ? len-1 : 0, '\0');
-        if (len > 1) WideCharToMultiByte(CP_UTF8, 0, g_shaders[i].c_str(), -1, s.data(), len, nullptr, nullptr);
-        utf8.push_back(s);
+// ----------------------------
+// Encoder capability cache
+// ----------------------------
+// "auto" used to launch a full encode per candidate until one stuck. Instead each
+// candidate gets a tiny synthetic null encode once per ffmpeg binary; the result
+// is kept in encoders.txt and jobs start straight at the first working encoder.
+static const wchar_t* const kAutoEncoders[] = {
+    L"hevc_amf",
+    L"hevc_nvenc",
+    L"hevc_qsv",
+    L"hevc_mf",
+    L"libx265",
+};
 
-        elems[outIdx].format = MPV_FORMAT_STRING;
-        elems[outIdx].u.string = (char*)utf8[outIdx].c_str();
-        outIdx++;
+static std::mutex g_encoderCapsMutex;
+static std::wstring g_encoderCapsKey;             // ffmpeg fingerprint the results belong to
+static std::vector<std::wstring> g_encoderCapsOk; // working encoders, probe order
+
+static uint64_t Fnv1a64(const void* data, size_t n, uint64_t h = 1469598103934665603ull)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i = 0; i < n; ++i) {
+        h ^= p[i];
+        h *= 1099511628211ull;
     }
-
-    list.num = (int)elems.size();
-    list.values = elems.data();
-    node.u.list = &list;
-
-    // This overwrites the shader list with our current vector
-    mpv_set_property(g_mpv, "glsl-shaders", MPV_FORMAT_NODE, &node);
-
-    mpv_command_string(g_mpv, "show-text \"Shaders updated\"");
-}
-
-static void MpvLoadVideo(const std::wstring& path)
+    return h;
+}
+
+static std::wstring HexU64(uint64_t v)
 {
-    if (!g_mpv) return;
+    wchar_t buf[32];
+    swprintf_s(buf, L"%016llx", (unsigned long long)v);
+    return buf;
+}
 
-    g_loadedVideo = path;
-    UpdateLastVideoDir(path);
+// Identifies the ffmpeg build without launching it: path + size + mtime. Any
+// upgrade or swap of the binary changes the key and invalidates the cache. A
+// bare "ffmpeg" is resolved through PATH first (and symlinks followed), or an
+// upgrade of the PATH copy would keep the old results forever.
+static std::wstring FfmpegFingerprint(const std::wstring& ffmpeg)
+{
+    std::filesystem::path p = FsPath(ffmpeg);
+    std::error_code ec;
+    if (!p.has_parent_path()) {
+        std::wstring found = ResolveOnPath(ffmpeg);
+        if (!found.empty()) p = FsPath(found);
+    }
+    std::filesystem::path real = std::filesystem::canonical(p, ec);
+    if (!ec) p = real;
+    std::string id = WideToUtf8(p.wstring());
+    auto size = std::filesystem::file_size(p, ec);
+    if (!ec) id += "|" + std::to_string((unsigned long long)size);
+    auto mtime = std::filesystem::last_write_time(p, ec);
+    if (!ec) id += "|" + std::to_string((long long)mtime.time_since_epoch().count());
+    return HexU64(Fnv1a64(id.data(), id.size()));
+}
+
+enum class ProbeResult { Ok, Failed, Transient };
+
+// A probe that failed because the device was momentarily unavailable (NVENC
+// session limit, VRAM pressure, another process holding the encoder) says
+// nothing about the build, so it must not be cached.
+static bool IsTransientProbeError(const std::string& log)
+{
+    static const char* const kTransient[] = {
+        "out of memory", "OUT_OF_MEMORY", "busy", "BUSY", "Resource temporarily unavailable",
+        "incompatible client key", "Too many concurrent sessions",
+    };
+    for (const char* t : kTransient) {
+        if (log.find(t) != std::string::npos) return true;
+    }
+    return false;
+}
+
+static ProbeResult ProbeEncoder(const std::wstring& ffmpeg, const std::wstring& enc)
+{
+    // Real encoder args at a tiny size; 640x360 clears every hw encoder's minimum.
+    std::wstring cmd =
+        Quote(ffmpeg) + L" -hide_banner -nostdin -f lavfi -i testsrc2=s=640x360:r=30 -frames:v 8 " +
+        BuildEncoderArgs(enc, 2) + L" -f null -";
+    std::string err;
+    int rc = RunProcessStreaming(cmd, L"", nullptr, [&](const char* p, size_t n) {
+        if (err.size() < 64 * 1024) err.append(p, n);
+        return true;
+    });
+    if (rc == 0) return ProbeResult::Ok;
+    return IsTransientProbeError(err) ? ProbeResult::Transient : ProbeResult::Failed;
+}
+
+static bool LoadEncoderCache(const std::wstring& key)
+{
+    std::ifstream f(FsPath(GetEncoderCachePath()), std::ios::binary);
+    if (!f) return false;
+    std::string line;
+    bool keyOk = false;
+    std::vector<std::wstring> ok;
+    while (std::getline(f, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.rfind("ffmpeg=", 0) == 0) {
+            keyOk = (Utf8ToWide(line.substr(7)) == key);
+        } else if (line.size() > 2 && line.compare(line.size() - 2, 2, "=1") == 0) {
+            ok.push_back(Utf8ToWide(line.substr(0, line.size() - 2)));
+        }
+    }
+    if (!keyOk) return false;
+    g_encoderCapsKey = key;
+    g_encoderCapsOk = ok;
+    return true;
+}
+
+static void SaveEncoderCache(const std::wstring& key, const std::vector<std::wstring>& candidates,
+                             const std::vector<bool>& results)
+{
+    std::ofstream o(FsPath(GetEncoderCachePath()), std::ios::binary);
+    if (!o) return;
+    o << "ffmpeg=" << WideToUtf8(key) << "\n";
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        o << WideToUtf8(candidates[i]) << (results[i] ? "=1\n" : "=0\n");
+    }
+}
+
+// Returns the working subset of kAutoEncoders, probing (concurrently, once per
+// ffmpeg binary) if neither memory nor disk has results for this build. If any
+// probe hit a transient device error nothing is cached and that encoder stays in
+// the list, so the job itself gets to try it.
+static std::vector<std::wstring> GetAvailableEncoders(const std::wstring& ffmpeg)
+{
+    std::lock_guard<std::mutex> lock(g_encoderCapsMutex);
+    std::wstring key = FfmpegFingerprint(ffmpeg);
+    if (g_encoderCapsKey == key || LoadEncoderCache(key)) {
+        return g_encoderCapsOk;
+    }
+
+    std::vector<std::wstring> candidates(std::begin(kAutoEncoders), std::end(kAutoEncoders));
+    std::vector<ProbeResult> probed(candidates.size(), ProbeResult::Failed);
+    std::vector<std::thread> probes;
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        probes.emplace_back([&, i]() { probed[i] = ProbeEncoder(ffmpeg, candidates[i]); });
+    }
+    for (auto& t : probes) t.join();
+
+    std::vector<bool> results;
+    std::vector<std::wstring> okList;
+    bool transient = false;
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        results.push_back(probed[i] == ProbeResult::Ok);
+        if (probed[i] != ProbeResult::Failed) okList.push_back(candidates[i]);
+        if (probed[i] == ProbeResult::Transient) transient = true;
+    }
+    if (transient) return okList;
+    g_encoderCapsKey = key;
+    g_encoderCapsOk = okList;
+    SaveEncoderCache(key, candidates, results);
+    return g_encoderCapsOk;
+}
+
+// Encoder list for "auto": probed-good encoders in priority order. If the probe
+// found nothing (ffmpeg missing, odd build) the full list is tried as before.
+static std::vector<std::wstring> GetAutoEncoderOrder(const std::wstring& ffmpeg)
+{
+    std::vector<std::wstring> ok = GetAvailableEncoders(ffmpeg);
+    if (!ok.empty()) return ok;
+    return std::vector<std::wstring>(std::begin(kAutoEncoders), std::end(kAutoEncoders));
+}
+
+#ifdef _WIN32
+// ----------------------------
+// mpv integration
+// ----------------------------
+static void MpvApplyShaderList()
+{
+    if (!g_mpv) return;
+
+    // Build mpv_node array of strings for "glsl-shaders"
+    mpv_node node{};
+    node.format = MPV_FORMAT_NODE_ARRAY;
+
+    // Edits to the active shaders reload them (see LiveShaderCopy).
+    std::vector<std::wstring> active;
+    std::vector<ShaderParams> params;
+    for (size_t i = 0; i < g_shaders.size(); ++i) {
+        if (i < g_shaderBypass.size() && g_shaderBypass[i]) continue;
+        active.push_back(g_shaders[i]);
+        params.push_back(i < g_shaderParams.size() ? g_shaderParams[i] : ShaderParams());
+    }
+    SetWatchedShaders(active);
+
+    mpv_node_list list{};
+    std::vector<mpv_node> elems(active.size());
+
+    // mpv expects UTF-8 strings
+    std::vector<std::string> utf8;
+    utf8.reserve(active.size());
+
+    size_t outIdx = 0;
+    for (const auto& shader : active) {
+        utf8.push_back(WideToUtf8(LiveShaderCopy(shader, params[outIdx])));
+
+        elems[outIdx].format = MPV_FORMAT_STRING;
+        elems[outIdx].u.string = (char*)utf8[outIdx].c_str();
+        outIdx++;
+    }
+
+    list.num = (int)elems.size();
+    list.values = elems.data();
+    node.u.list = &list;
+
+    // This overwrites the shader list with our current vector
+    mpv_set_property(g_mpv, "glsl-shaders", MPV_FORMAT_NODE, &node);
+
+    mpv_command_string(g_mpv, "show-text \"Shaders updated\"");
+}
+
+static void MpvLoadVideo(const std::wstring& path)
+{
+    if (!g_mpv) return;
+
+    g_loadedVideo = path;
+    UpdateLastVideoDir(path);
 
     int pause = 1;
     mpv_set_property(g_mpv, "pause", MPV_FORMAT_FLAG, &pause);
@@ -617,6 +1448,9 @@ static void MpvLoadVideo(const std::wstring& path)
     const char* cmd[] = {"loadfile", u8.c_str(), "replace", nullptr};
     mpv_command(g_mpv, cmd);
 
+    // Warm the probe cache now so Re-encode doesn't wait on it.
+    PrefetchMediaProbe(path);
+
     pause = 1;
     mpv_set_property(g_mpv, "pause", MPV_FORMAT_FLAG, &pause);
     UpdatePlayPauseLabel();
@@ -678,369 +1512,8551 @@ static void OpenShaderDialog()
         AddShaderPath(dir);
         return;
     }
-    while (*p) {
-        std::wstring name = p;
-        AddShaderPath(JoinPath(dir, name));
-        p += name.size() + 1;
+    while (*p) {
+        std::wstring name = p;
+        AddShaderPath(JoinPath(dir, name));
+        p += name.size() + 1;
+    }
+}
+
+static bool MpvInit(HWND hwndVideo)
+{
+    g_mpv = mpv_create();
+    if (!g_mpv) return false;
+
+    // Keep UI snappy / no console noise
+    mpv_set_option_string(g_mpv, "terminal", "no");
+    mpv_set_option_string(g_mpv, "msg-level", "all=no");
+
+    // Tell mpv to render inside our child window
+    int64_t wid = (int64_t)(intptr_t)hwndVideo;
+    mpv_set_option(g_mpv, "wid", MPV_FORMAT_INT64, &wid);
+
+    // Useful defaults
+    mpv_set_option_string(g_mpv, "keep-open", "yes");
+    mpv_set_option_string(g_mpv, "loop-file", "inf");
+
+    if (mpv_initialize(g_mpv) < 0) return false;
+
+    return true;
+}
+
+static void MpvShutdown()
+{
+    if (g_mpv) {
+        mpv_terminate_destroy(g_mpv);
+        g_mpv = nullptr;
+    }
+}
+
+// ----------------------------
+// UI list helpers
+// ----------------------------
+static void ListRefresh()
+{
+    SendMessageW(g_hwndList, LB_RESETCONTENT, 0, 0);
+    for (size_t i = 0; i < g_shaders.size(); ++i) {
+        std::wstring name = FilenameOnly(g_shaders[i]);
+        if (i < g_shaderParams.size() && !g_shaderParams[i].empty()) {
+            name += L" [" + Utf8ToWide(FormatShaderParams(g_shaderParams[i])) + L"]";
+        }
+        if (i < g_shaderBypass.size() && g_shaderBypass[i]) {
+            name += L" (Bypassed)";
+        }
+        SendMessageW(g_hwndList, LB_ADDSTRING, 0, (LPARAM)name.c_str());
+    }
+}
+
+static void AddShaderPath(const std::wstring& path)
+{
+    if (std::find(g_shaders.begin(), g_shaders.end(), path) != g_shaders.end())
+        return;
+
+    g_shaders.push_back(path);
+    g_shaderBypass.push_back(false);
+    g_shaderParams.push_back({});
+    UpdateLastShaderDir(path);
+    ListRefresh();
+    MpvApplyShaderList();
+    SaveShaders();
+}
+
+static void RemoveSelectedShader()
+{
+    int sel = (int)SendMessageW(g_hwndList, LB_GETCURSEL, 0, 0);
+    if (sel == LB_ERR) return;
+
+    g_shaders.erase(g_shaders.begin() + sel);
+    if (sel >= 0 && sel < (int)g_shaderBypass.size()) {
+        g_shaderBypass.erase(g_shaderBypass.begin() + sel);
+    }
+    if (sel >= 0 && sel < (int)g_shaderParams.size()) {
+        g_shaderParams.erase(g_shaderParams.begin() + sel);
+    }
+    ListRefresh();
+    MpvApplyShaderList();
+    SaveShaders();
+}
+
+static void ClearShaders()
+{
+    g_shaders.clear();
+    g_shaderBypass.clear();
+    g_shaderParams.clear();
+    ListRefresh();
+    MpvApplyShaderList();
+    SaveShaders();
+}
+#endif
+
+static std::vector<std::wstring> GetActiveShaders()
+{
+    std::vector<std::wstring> out;
+    out.reserve(g_shaders.size());
+    for (size_t i = 0; i < g_shaders.size(); ++i) {
+        if (i < g_shaderBypass.size() && g_shaderBypass[i]) continue;
+        out.push_back(g_shaders[i]);
+    }
+    return out;
+}
+
+// Overrides for GetActiveShaders(), index for index.
+static std::vector<ShaderParams> GetActiveShaderParams()
+{
+    std::vector<ShaderParams> out;
+    for (size_t i = 0; i < g_shaders.size(); ++i) {
+        if (i < g_shaderBypass.size() && g_shaderBypass[i]) continue;
+        out.push_back(i < g_shaderParams.size() ? g_shaderParams[i] : ShaderParams());
+    }
+    return out;
+}
+
+// ----------------------------
+// Hook shader pass graph
+// ----------------------------
+// mpv/libplacebo user shaders are a sequence of blocks, each a run of "//!KEY"
+// directive lines followed by GLSL. Joining a chain blindly makes libplacebo
+// run every pass, including passes whose //!SAVE target nobody //!BINDs. These
+// helpers parse the blocks, keep only passes that feed the video (directly or
+// through saved textures), collapse recomputations of an identical saved
+// pass, and re-emit the rest. Pure text in, text out.
+enum class HookBlockKind { Pass, Texture, Buffer, Param };
+
+struct HookBlock {
+    HookBlockKind kind = HookBlockKind::Pass;
+    std::string source;                // shader file the block came from
+    std::string directives;            // directive lines, verbatim
+    std::string body;                  // GLSL after the directives
+    std::string name;                  // TEXTURE/BUFFER/PARAM name
+    std::string desc;
+    std::vector<std::string> hooks;
+    std::vector<std::string> binds;
+    std::string save;
+    std::string width, height, when, components;
+};
+
+struct HookPruneStats {
+    int passesIn = 0;
+    int passesOut = 0;
+    int passesFused = 0;
+    int texturesDropped = 0;
+};
+
+static std::string_view TrimView(std::string_view s)
+{
+    auto space = [](char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; };
+    while (!s.empty() && space(s.front())) s.remove_prefix(1);
+    while (!s.empty() && space(s.back())) s.remove_suffix(1);
+    return s;
+}
+
+// Appends the blocks of one shader file. Text before the first directive is
+// ignored, as libplacebo does.
+static void ParseHookShader(const std::string& text, const std::string& source, std::vector<HookBlock>& out)
+{
+    HookBlock* cur = nullptr;
+    bool inDirectives = false;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t eol = text.find('\n', pos);
+        size_t next = (eol == std::string::npos) ? text.size() : eol + 1;
+        std::string_view line(text.data() + pos, next - pos);
+        pos = next;
+
+        std::string_view t = TrimView(line);
+        if (t.size() >= 3 && t.substr(0, 3) == "//!") {
+            if (!inDirectives || !cur) {
+                out.emplace_back();
+                cur = &out.back();
+                cur->source = source;
+                inDirectives = true;
+            }
+            cur->directives.append(line);
+            if (line.empty() || line.back() != '\n') cur->directives.push_back('\n');
+
+            std::string_view rest = t.substr(3);
+            size_t sp = rest.find_first_of(" \t");
+            std::string key(rest.substr(0, sp));
+            std::string arg(sp == std::string_view::npos ? std::string_view() : TrimView(rest.substr(sp)));
+            if (key == "HOOK") cur->hooks.push_back(arg);
+            else if (key == "BIND") cur->binds.push_back(arg);
+            else if (key == "SAVE") cur->save = arg;
+            else if (key == "DESC") cur->desc = arg;
+            else if (key == "WIDTH") cur->width = arg;
+            else if (key == "HEIGHT") cur->height = arg;
+            else if (key == "WHEN") cur->when = arg;
+            else if (key == "COMPONENTS") cur->components = arg;
+            else if (key == "TEXTURE") { cur->kind = HookBlockKind::Texture; cur->name = arg; }
+            else if (key == "BUFFER") { cur->kind = HookBlockKind::Buffer; cur->name = arg; }
+            else if (key == "PARAM") { cur->kind = HookBlockKind::Param; cur->name = arg; }
+        } else {
+            inDirectives = false;
+            if (cur) cur->body.append(line);
+        }
+    }
+}
+
+// Textures owned by the renderer. Writing one of these is visible output.
+static bool IsPipelineTexture(const std::string& name)
+{
+    static const char* const kNames[] = {
+        "HOOKED", "MAIN", "MAINPRESUB", "NATIVE", "LUMA", "CHROMA", "ALPHA", "RGB", "XYZ",
+        "CHROMA_SCALED", "ALPHA_SCALED", "LINEAR", "SIGMOID", "PREKERNEL", "POSTKERNEL",
+        "SCALED", "PREOUTPUT", "OUTPUT",
+    };
+    for (const char* n : kNames) {
+        if (name == n) return true;
+    }
+    return false;
+}
+
+// Textures a pass overwrites: its SAVE target, else the stage(s) it hooks.
+static std::vector<std::string> HookPassWrites(const HookBlock& b)
+{
+    if (!b.save.empty()) return { b.save };
+    return b.hooks;
+}
+
+static bool HookPassIsOutput(const HookBlock& b)
+{
+    return b.save.empty() || IsPipelineTexture(b.save) ||
+           std::find(b.hooks.begin(), b.hooks.end(), b.save) != b.hooks.end();
+}
+
+// Identity of a pass for duplicate detection: directives minus DESC (which
+// also covers ones not modelled above, like OFFSET or COMPUTE) plus the body
+// with surrounding whitespace trimmed.
+static std::string HookPassKey(const HookBlock& b)
+{
+    std::string key;
+    std::string_view d(b.directives);
+    size_t pos = 0;
+    while (pos < d.size()) {
+        size_t eol = d.find('\n', pos);
+        if (eol == std::string_view::npos) eol = d.size();
+        std::string_view line = TrimView(d.substr(pos, eol - pos));
+        if (line.substr(0, 7) != "//!DESC") {
+            key.append(line);
+            key.push_back('\n');
+        }
+        pos = eol + 1;
+    }
+    key.append(TrimView(b.body));
+    return key;
+}
+
+// Drops dead passes and redundant recomputations from a parsed chain, in place.
+static HookPruneStats PruneHookBlocks(std::vector<HookBlock>& blocks)
+{
+    HookPruneStats stats;
+    std::vector<bool> keep(blocks.size(), true);
+
+    // Storage buffers are side effects the graph can't see; leave such chains alone.
+    for (const auto& b : blocks) {
+        if (b.kind == HookBlockKind::Buffer) {
+            for (const auto& p : blocks) stats.passesIn += (p.kind == HookBlockKind::Pass) ? 1 : 0;
+            stats.passesOut = stats.passesIn;
+            return stats;
+        }
+    }
+
+    // A saved pass recomputed with identical code and inputs produces the same
+    // texture; the repeat is redundant as long as nothing in between rewrote
+    // what it hooks or binds.
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        const HookBlock& b = blocks[i];
+        if (b.kind != HookBlockKind::Pass) continue;
+        stats.passesIn++;
+        if (HookPassIsOutput(b)) continue;
+        std::string key = HookPassKey(b);
+        for (size_t j = i; j-- > 0;) {
+            const HookBlock& prev = blocks[j];
+            if (prev.kind != HookBlockKind::Pass || !keep[j]) continue;
+            if (HookPassKey(prev) == key) {
+                keep[i] = false;
+                break;
+            }
+            bool clobbers = false;
+            for (const auto& w : HookPassWrites(prev)) {
+                clobbers = clobbers || w == b.save ||
+                           std::find(b.binds.begin(), b.binds.end(), w) != b.binds.end() ||
+                           std::find(b.hooks.begin(), b.hooks.end(), w) != b.hooks.end();
+            }
+            if (clobbers) break;
+        }
+    }
+
+    // Liveness: passes writing renderer textures are roots; a saved texture is
+    // live if a live pass binds it.
+    std::vector<bool> live(blocks.size(), false);
+    std::vector<std::string> liveBinds;
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        if (blocks[i].kind == HookBlockKind::Pass && keep[i] && HookPassIsOutput(blocks[i])) {
+            live[i] = true;
+            liveBinds.insert(liveBinds.end(), blocks[i].binds.begin(), blocks[i].binds.end());
+        }
+    }
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t i = 0; i < blocks.size(); ++i) {
+            const HookBlock& b = blocks[i];
+            if (live[i] || b.kind != HookBlockKind::Pass || !keep[i]) continue;
+            if (std::find(liveBinds.begin(), liveBinds.end(), b.save) != liveBinds.end()) {
+                live[i] = true;
+                liveBinds.insert(liveBinds.end(), b.binds.begin(), b.binds.end());
+                changed = true;
+            }
+        }
+    }
+
+    std::vector<HookBlock> out;
+    out.reserve(blocks.size());
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        HookBlock& b = blocks[i];
+        if (b.kind == HookBlockKind::Pass && !live[i]) continue;
+        // Lookup textures are uploads; skip the ones no surviving pass reads.
+        if (b.kind == HookBlockKind::Texture &&
+            std::find(liveBinds.begin(), liveBinds.end(), b.name) == liveBinds.end()) {
+            stats.texturesDropped++;
+            continue;
+        }
+        if (b.kind == HookBlockKind::Pass) stats.passesOut++;
+        out.push_back(std::move(b));
+    }
+    blocks.swap(out);
+    return stats;
+}
+
+// Point-wise pass fusion. A pass that hooks one stage, binds only HOOKED,
+// writes back in place and reads HOOKED solely at the current pixel is a pure
+// per-pixel function. A run of such passes on the same stage is merged into
+// one pass: each body gets its top-level names suffixed, its HOOKED sample
+// replaced by the running colour, and a generated hook() calls them in order.
+// One full-frame read and write instead of N.
+static bool IsIdentChar(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+// GLSL with comments blanked out (same length, so offsets still line up).
+static std::string StripGlslComments(const std::string& src)
+{
+    std::string out = src;
+    for (size_t i = 0; i + 1 < out.size(); ++i) {
+        if (out[i] == '/' && out[i + 1] == '/') {
+            while (i < out.size() && out[i] != '\n') out[i++] = ' ';
+        } else if (out[i] == '/' && out[i + 1] == '*') {
+            size_t end = out.find("*/", i + 2);
+            end = (end == std::string::npos) ? out.size() : end + 2;
+            for (; i < end; ++i) {
+                if (out[i] != '\n') out[i] = ' ';
+            }
+            --i;
+        }
+    }
+    return out;
+}
+
+static std::string LastIdentifier(std::string_view s)
+{
+    size_t end = s.size();
+    while (end > 0 && !IsIdentChar(s[end - 1])) --end;
+    size_t begin = end;
+    while (begin > 0 && IsIdentChar(s[begin - 1])) --begin;
+    return std::string(s.substr(begin, end - begin));
+}
+
+// Names a pass body declares at file scope: functions, globals, structs and
+// macros. These would collide once several bodies share one program.
+static std::vector<std::string> CollectTopLevelNames(const std::string& code)
+{
+    std::vector<std::string> names;
+    auto add = [&](std::string n) {
+        if (!n.empty() && !(n[0] >= '0' && n[0] <= '9') && std::find(names.begin(), names.end(), n) == names.end()) {
+            names.push_back(std::move(n));
+        }
+    };
+
+    int depth = 0;
+    size_t stmt = 0;
+    for (size_t i = 0; i < code.size(); ++i) {
+        char c = code[i];
+        if (depth == 0 && c == '#') {
+            size_t eol = code.find('\n', i);
+            if (eol == std::string::npos) eol = code.size();
+            std::string_view line(code.data() + i, eol - i);
+            if (line.substr(0, 7) == "#define") {
+                std::string_view rest = TrimView(line.substr(7));
+                size_t n = 0;
+                while (n < rest.size() && IsIdentChar(rest[n])) ++n;
+                add(std::string(rest.substr(0, n)));
+            }
+            i = eol;
+            stmt = i + 1;
+            continue;
+        }
+        if (c == '{') {
+            if (depth == 0) {
+                std::string_view head(code.data() + stmt, i - stmt);
+                size_t paren = head.find('(');
+                if (paren != std::string_view::npos) add(LastIdentifier(head.substr(0, paren)));
+                else if (TrimView(head).substr(0, 6) == "struct") add(LastIdentifier(head));
+            }
+            ++depth;
+        } else if (c == '}') {
+            if (depth > 0) --depth;
+            if (depth == 0) stmt = i + 1;
+        } else if (c == ';' && depth == 0) {
+            std::string_view st(code.data() + stmt, i - stmt);
+            size_t cut = st.find_first_of("=[(");
+            if (cut != std::string_view::npos) st = st.substr(0, cut);
+            add(LastIdentifier(st));
+            stmt = i + 1;
+        }
+    }
+    return names;
+}
+
+static std::string RenameIdentifiers(const std::string& code, const std::vector<std::string>& names, const std::string& suffix)
+{
+    std::string out;
+    out.reserve(code.size() + names.size() * 8);
+    size_t i = 0;
+    while (i < code.size()) {
+        if (IsIdentChar(code[i]) && (i == 0 || !IsIdentChar(code[i - 1]))) {
+            size_t j = i;
+            while (j < code.size() && IsIdentChar(code[j])) ++j;
+            std::string_view word(code.data() + i, j - i);
+            out.append(word);
+            if (std::find(names.begin(), names.end(), word) != names.end()) out += suffix;
+            i = j;
+        } else {
+            out.push_back(code[i++]);
+        }
+    }
+    return out;
+}
+
+// Replaces the current-pixel HOOKED reads with `with`. Fails if HOOKED is used
+// any other way (neighbour taps, HOOKED_pt/size, raw texture access, ...).
+static bool ReplaceHookedSamples(const std::string& code, const std::string& with, std::string& out)
+{
+    static const char* const kSamples[] = {
+        "HOOKED_texOff(0)", "HOOKED_texOff(vec2(0))", "HOOKED_texOff(vec2(0.0))",
+        "HOOKED_tex(HOOKED_pos)",
+    };
+    std::string stripped = StripGlslComments(code);
+    out.clear();
+    size_t i = 0;
+    while (i < code.size()) {
+        if (stripped.compare(i, 7, "HOOKED_") == 0 && (i == 0 || !IsIdentChar(stripped[i - 1]))) {
+            // Compare with whitespace removed so "HOOKED_texOff( 0 )" still counts.
+            size_t j = i;
+            std::string squeezed;
+            int depth = 0;
+            for (; j < stripped.size(); ++j) {
+                char c = stripped[j];
+                if (c == ' ' || c == '\t' || c == '\r' || c == '\n') continue;
+                squeezed.push_back(c);
+                if (c == '(') ++depth;
+                if (c == ')' && --depth == 0) { ++j; break; }
+                if (depth == 0 && !IsIdentChar(c)) break;
+            }
+            bool matched = false;
+            for (const char* s : kSamples) {
+                if (squeezed == s) matched = true;
+            }
+            if (!matched) return false;
+            out += with;
+            i = j;
+        } else {
+            out.push_back(code[i++]);
+        }
+    }
+    return true;
+}
+
+static bool IsPointwiseHookPass(const HookBlock& b)
+{
+    if (b.kind != HookBlockKind::Pass || b.hooks.size() != 1) return false;
+    if (!b.save.empty() && b.save != b.hooks.front()) return false;
+    if (!b.width.empty() || !b.height.empty()) return false;
+    for (const auto& bind : b.binds) {
+        if (bind != "HOOKED") return false;
+    }
+    // Anything else that changes how the pass runs (OFFSET, COMPUTE, ...).
+    std::string_view d(b.directives);
+    size_t pos = 0;
+    while (pos < d.size()) {
+        size_t eol = d.find('\n', pos);
+        if (eol == std::string_view::npos) eol = d.size();
+        std::string_view line = TrimView(d.substr(pos, eol - pos));
+        pos = eol + 1;
+        if (line.size() < 3) continue;
+        std::string_view rest = line.substr(3);
+        std::string_view key = rest.substr(0, rest.find_first_of(" \t"));
+        if (key != "HOOK" && key != "BIND" && key != "SAVE" && key != "DESC" && key != "WHEN" && key != "COMPONENTS") return false;
+    }
+    std::string code = StripGlslComments(b.body);
+    std::vector<std::string> names = CollectTopLevelNames(code);
+    if (std::find(names.begin(), names.end(), "hook") == names.end()) return false;
+    std::string replaced;
+    return ReplaceHookedSamples(b.body, "vfx_in", replaced);
+}
+
+static bool CanFuseHookPasses(const HookBlock& a, const HookBlock& b)
+{
+    return a.hooks.front() == b.hooks.front() && a.when == b.when && a.components == b.components;
+}
+
+static HookBlock FuseHookPasses(const std::vector<const HookBlock*>& run)
+{
+    const HookBlock& first = *run.front();
+    HookBlock fused;
+    fused.kind = HookBlockKind::Pass;
+    fused.hooks = first.hooks;
+    fused.binds = { "HOOKED" };
+    fused.when = first.when;
+    fused.components = first.components;
+    fused.source = first.source;
+
+    std::string desc;
+    for (const HookBlock* b : run) {
+        if (b->source != fused.source) fused.source = "fused chain";
+        if (!desc.empty()) desc += " + ";
+        desc += b->desc.empty() ? std::string("pass") : b->desc;
+    }
+    fused.desc = "fused: " + desc;
+
+    fused.directives = "//!HOOK " + fused.hooks.front() + "\n//!BIND HOOKED\n//!DESC " + fused.desc + "\n";
+    if (!fused.when.empty()) fused.directives += "//!WHEN " + fused.when + "\n";
+    if (!fused.components.empty()) fused.directives += "//!COMPONENTS " + fused.components + "\n";
+
+    std::string body = "\nvec4 vfx_in;\n";
+    std::string calls;
+    for (size_t k = 0; k < run.size(); ++k) {
+        std::string suffix = "_f" + std::to_string(k);
+        std::string sampled;
+        ReplaceHookedSamples(run[k]->body, "vfx_in", sampled);
+        std::vector<std::string> names = CollectTopLevelNames(StripGlslComments(sampled));
+        body += "\n// ---- " + (run[k]->desc.empty() ? std::string("pass") : run[k]->desc) + "\n";
+        body += RenameIdentifiers(sampled, names, suffix);
+        calls += "    vfx_in = hook" + suffix + "();\n";
+    }
+    body += "\nvec4 hook()\n{\n    vfx_in = HOOKED_texOff(0);\n" + calls + "    return vfx_in;\n}\n";
+    fused.body = body;
+    return fused;
+}
+
+// Merges runs of consecutive point-wise passes; returns how many passes were
+// folded away.
+static int FuseHookBlocks(std::vector<HookBlock>& blocks)
+{
+    int folded = 0;
+    std::vector<HookBlock> out;
+    out.reserve(blocks.size());
+    size_t i = 0;
+    while (i < blocks.size()) {
+        if (!IsPointwiseHookPass(blocks[i])) {
+            out.push_back(std::move(blocks[i++]));
+            continue;
+        }
+        // Non-pass blocks (textures, params) don't break a run.
+        std::vector<const HookBlock*> run = { &blocks[i] };
+        size_t last = i;
+        for (size_t j = i + 1; j < blocks.size(); ++j) {
+            if (blocks[j].kind != HookBlockKind::Pass) continue;
+            if (!IsPointwiseHookPass(blocks[j]) || !CanFuseHookPasses(blocks[i], blocks[j])) break;
+            run.push_back(&blocks[j]);
+            last = j;
+        }
+        if (run.size() == 1) {
+            out.push_back(std::move(blocks[i++]));
+            continue;
+        }
+        out.push_back(FuseHookPasses(run));
+        for (size_t k = i + 1; k < last; ++k) {
+            if (blocks[k].kind != HookBlockKind::Pass) out.push_back(std::move(blocks[k]));
+        }
+        folded += (int)run.size() - 1;
+        i = last + 1;
+    }
+    blocks.swap(out);
+    return folded;
+}
+
+static std::string EmitHookBlocks(const std::vector<HookBlock>& blocks)
+{
+    std::string out;
+    const std::string* source = nullptr;
+    for (const auto& b : blocks) {
+        if (!source || *source != b.source) {
+            if (source) out += "\n// ---- END\n";
+            out += "\n// ---- BEGIN: " + b.source + "\n";
+            source = &b.source;
+        }
+        out += b.directives;
+        out += b.body;
+        if (!out.empty() && out.back() != '\n') out.push_back('\n');
+    }
+    if (source) out += "\n// ---- END\n";
+    return out;
+}
+
+// ----------------------------
+// Shader parameter specialization
+// ----------------------------
+// Per-entry overrides are written into the shader text as literals instead of
+// being bound as uniforms, so the GPU compiler can still fold them. Three
+// forms are rewritten:
+//   const [precision] <type> name = ...;   the initializer
+//   #define name value                     object-like macros
+//   //!PARAM name                          libplacebo parameters: the value,
+//                                          with the type forced to CONSTANT
+// Literals are formatted canonically, so equal overrides give byte-identical
+// text and the content-named caches downstream hit.
+
+// `values` as a literal of `type` (float, int, uint, bool or a vector of
+// them); one value fills every component. Empty if they don't fit.
+static std::string GlslLiteral(const std::string& type, const std::vector<double>& values)
+{
+    static const struct { const char* prefix; const char* scalar; } kVectors[] = {
+        { "vec", "float" }, { "ivec", "int" }, { "uvec", "uint" }, { "bvec", "bool" },
+    };
+    std::string scalar = type;
+    int n = 1;
+    for (const auto& v : kVectors) {
+        size_t len = strlen(v.prefix);
+        if (type.size() == len + 1 && type.compare(0, len, v.prefix) == 0 && type[len] >= '2' && type[len] <= '4') {
+            scalar = v.scalar;
+            n = type[len] - '0';
+        }
+    }
+    if (values.empty() || (values.size() != 1 && (int)values.size() != n)) return "";
+
+    auto one = [&](double v) -> std::string {
+        char buf[40];
+        if (scalar == "float") {
+            snprintf(buf, sizeof(buf), "%.9g", v);
+            std::string s = buf;
+            if (s.find_first_of(".e") == std::string::npos) s += ".0";
+            return s;
+        }
+        if (scalar == "int") snprintf(buf, sizeof(buf), "%lld", (long long)std::llround(v));
+        else if (scalar == "uint") snprintf(buf, sizeof(buf), "%lluu", (unsigned long long)std::llround(std::max(0.0, v)));
+        else if (scalar == "bool") return v != 0.0 ? "true" : "false";
+        else return "";
+        return buf;
+    };
+    if (n == 1) return one(values[0]);
+    // Spelled out even for one value: vec3(x) would read the same to GLSL but
+    // not to ParseColorTrans3, which matches the source's vec3(#,#,#) shape.
+    std::string out = type + "(";
+    for (int i = 0; i < n; ++i) out += (i ? ", " : "") + one(values[values.size() == 1 ? 0 : i]);
+    return out + ")";
+}
+
+// Next identifier at or after p (skipping whitespace); p ends just past it.
+static std::string NextGlslIdent(const std::string& code, size_t& p)
+{
+    while (p < code.size() && (code[p] == ' ' || code[p] == '\t' || code[p] == '\r' || code[p] == '\n')) ++p;
+    size_t begin = p;
+    while (p < code.size() && IsIdentChar(code[p])) ++p;
+    return code.substr(begin, p - begin);
+}
+
+// `text` with every override applied. Names with nothing to rewrite (or a
+// value of the wrong shape) are appended to `unmatched`.
+static std::string SpecializeShader(const std::string& text, const ShaderParams& params,
+                                    std::vector<std::string>* unmatched = nullptr)
+{
+    if (params.empty()) return text;
+    std::unordered_set<std::string> used;
+
+    // //!PARAM blocks, line by line: the TYPE directive becomes CONSTANT and
+    // the value lines become the literal.
+    std::string out;
+    out.reserve(text.size());
+    const std::vector<double>* param = nullptr; // override for the block being read
+    std::string paramName, paramType;
+    bool paramTyped = false, paramBody = false;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t eol = text.find('\n', pos);
+        size_t next = (eol == std::string::npos) ? text.size() : eol + 1;
+        std::string_view line(text.data() + pos, next - pos);
+        pos = next;
+        std::string_view t = TrimView(line);
+        bool directive = t.size() >= 3 && t.substr(0, 3) == "//!";
+        if (directive && paramBody) param = nullptr;
+        if (directive) {
+            paramBody = false;
+            std::string_view rest = t.substr(3);
+            size_t sp = rest.find_first_of(" \t");
+            std::string_view key = rest.substr(0, sp);
+            std::string arg(sp == std::string_view::npos ? std::string_view() : TrimView(rest.substr(sp)));
+            if (key == "PARAM") {
+                auto it = params.find(arg);
+                param = (it == params.end()) ? nullptr : &it->second;
+                paramName = arg;
+                paramType = "float";
+                paramTyped = false;
+            } else if (key == "TYPE" && param) {
+                std::stringstream words(arg);
+                std::string word;
+                paramType.clear();
+                while (words >> word) {
+                    if (word == "ENUM") param = nullptr; // named values; left alone
+                    else if (word != "DYNAMIC" && word != "CONSTANT") paramType = word;
+                }
+                if (param) {
+                    out += "//!TYPE CONSTANT " + paramType + "\n";
+                    paramTyped = true;
+                    continue;
+                }
+            }
+            out.append(line);
+            continue;
+        }
+        if (param) {
+            if (!paramBody) {
+                std::string lit = GlslLiteral(paramType, *param);
+                if (lit.empty()) {
+                    param = nullptr;
+                    out.append(line);
+                    continue;
+                }
+                if (!paramTyped) out += "//!TYPE CONSTANT float\n";
+                out += lit + "\n";
+                used.insert(paramName);
+                paramBody = true;
+            }
+            continue;
+        }
+        out.append(line);
+    }
+
+    // const initializers and #defines. Offsets into the comment-stripped copy
+    // are offsets into `out`.
+    struct Edit {
+        size_t begin, end;
+        std::string text;
+    };
+    std::vector<Edit> edits;
+    std::string code = StripGlslComments(out);
+    for (size_t i = 0; i < code.size(); ++i) {
+        if (i > 0 && IsIdentChar(code[i - 1])) continue;
+        if (code.compare(i, 5, "const") == 0 && i + 5 < code.size() && !IsIdentChar(code[i + 5])) {
+            size_t p = i + 5;
+            std::string type = NextGlslIdent(code, p);
+            while (type == "highp" || type == "mediump" || type == "lowp" || type == "precise") {
+                type = NextGlslIdent(code, p);
+            }
+            std::string name = NextGlslIdent(code, p);
+            while (p < code.size() && (code[p] == ' ' || code[p] == '\t' || code[p] == '\r' || code[p] == '\n')) ++p;
+            auto it = params.find(name);
+            if (it == params.end() || p >= code.size() || code[p] != '=') continue;
+            size_t end = p + 1;
+            for (int depth = 0; end < code.size(); ++end) {
+                char c = code[end];
+                if (c == '(' || c == '[') ++depth;
+                else if (c == ')' || c == ']') --depth;
+                else if (depth == 0 && (c == ';' || c == ',')) break;
+            }
+            std::string lit = GlslLiteral(type, it->second);
+            if (end >= code.size() || lit.empty()) continue;
+            edits.push_back({ p + 1, end, " " + lit });
+            used.insert(name);
+        } else if (code[i] == '#') {
+            size_t p = i + 1;
+            if (NextGlslIdent(code, p) != "define") continue;
+            std::string name = NextGlslIdent(code, p);
+            auto it = params.find(name);
+            if (it == params.end() || p >= code.size() || code[p] == '(') continue; // function-like
+            size_t eol = code.find('\n', p);
+            if (eol == std::string::npos) eol = code.size();
+            std::string value(TrimView(std::string_view(code).substr(p, eol - p)));
+            size_t paren = value.find('(');
+            std::string type;
+            if (value == "true" || value == "false") type = "bool";
+            else if (paren != std::string::npos && paren > 0 && IsIdentChar(value[0])) type = value.substr(0, paren);
+            else if (value.find_first_of(".eE") != std::string::npos && value.find('x') == std::string::npos) type = "float";
+            else type = "int";
+            std::string lit = GlslLiteral(type, it->second);
+            if (lit.empty()) continue;
+            size_t end = eol;
+            while (end > p && (code[end - 1] == ' ' || code[end - 1] == '\t' || code[end - 1] == '\r')) --end;
+            edits.push_back({ p, end, " " + lit });
+            used.insert(name);
+        }
+    }
+    for (auto e = edits.rbegin(); e != edits.rend(); ++e) out.replace(e->begin, e->end - e->begin, e->text);
+
+    if (unmatched) {
+        for (const auto& p : params) {
+            if (!used.count(p.first)) unmatched->push_back(p.first);
+        }
+    }
+    return out;
+}
+
+// Overrides that the shader at `path` has nothing to rewrite for.
+static std::vector<std::string> UnmatchedShaderParams(const std::wstring& path, const ShaderParams& params)
+{
+    std::vector<std::string> unmatched;
+    std::string text;
+    if (params.empty()) return unmatched;
+    if (!ReadTextFile(path, text)) {
+        for (const auto& p : params) unmatched.push_back(p.first);
+        return unmatched;
+    }
+    SpecializeShader(text, params, &unmatched);
+    return unmatched;
+}
+
+// ----------------------------
+// Combined shader cache
+// ----------------------------
+// libplacebo takes a single custom_shader_path, so the active chain is joined
+// into one file (after pass-graph pruning and point-wise fusion). Files are
+// named by a hash of their exact contents, which means identical chains (same
+// shaders, order and bypass state) share one file across concurrent and
+// repeated encodes. In-use files are reference counted; idle ones are evicted
+// least-recently-used once the store grows past kMaxCombinedShaders. Shader
+// sources are re-read only when their size or mtime changes.
+struct ShaderSourceEntry {
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    std::string text;
+};
+
+struct CombinedShaderEntry {
+    int refs = 0;
+    uint64_t lastUse = 0;
+};
+
+struct CombinedShaderRef {
+    uint64_t key = 0;
+    std::wstring path;    // absolute
+    std::wstring relName; // relative to the exe dir (ffmpeg's working dir)
+    HookPruneStats passes;
+};
+
+static const size_t kMaxCombinedShaders = 32;
+
+static std::mutex g_shaderCacheMutex;
+static bool g_shaderCacheIndexed = false;
+static uint64_t g_shaderCacheTick = 0;
+static std::unordered_map<std::wstring, ShaderSourceEntry> g_shaderSources;
+static std::unordered_map<uint64_t, CombinedShaderEntry> g_combinedShaders;
+
+static bool StatFile(const std::wstring& path, uint64_t& size, int64_t& mtime)
+{
+    std::error_code ec;
+    std::filesystem::path p = FsPath(path);
+    size = std::filesystem::file_size(p, ec);
+    if (ec) return false;
+    auto t = std::filesystem::last_write_time(p, ec);
+    if (ec) return false;
+    mtime = (int64_t)t.time_since_epoch().count();
+    return true;
+}
+
+static std::wstring GetShaderCacheDir()
+{
+    return JoinPath(GetExeDir(), L"shader_cache");
+}
+
+static std::wstring CombinedShaderName(uint64_t key)
+{
+    return HexU64(key) + L".glsl";
+}
+
+static bool ReadShaderSourceLocked(const std::wstring& path, std::string& text)
+{
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    if (!StatFile(path, size, mtime)) return false;
+
+    ShaderSourceEntry& e = g_shaderSources[path];
+    if (e.size != size || e.mtime != mtime || e.text.size() != size) {
+        if (!ReadTextFile(path, e.text)) {
+            g_shaderSources.erase(path);
+            return false;
+        }
+        e.size = size;
+        e.mtime = mtime;
+    }
+    text = e.text;
+    return true;
+}
+
+// Adopt files left by earlier runs so they count toward the LRU limit (oldest
+// first) instead of piling up.
+static void IndexShaderCacheLocked()
+{
+    if (g_shaderCacheIndexed) return;
+    g_shaderCacheIndexed = true;
+
+    std::error_code ec;
+    std::filesystem::create_directories(FsPath(GetShaderCacheDir()), ec);
+
+    std::vector<std::pair<int64_t, uint64_t>> found;
+    for (const auto& de : std::filesystem::directory_iterator(FsPath(GetShaderCacheDir()), ec)) {
+        std::filesystem::path p = de.path();
+        if (p.extension() != ".glsl") continue;
+        std::wstring stem = FromFsPath(p.stem());
+        uint64_t key = 0;
+        if (stem.size() != 16 || swscanf(stem.c_str(), L"%16llx", (unsigned long long*)&key) != 1) {
+            std::filesystem::remove(p, ec); // partial write or foreign file
+            continue;
+        }
+        std::error_code tec;
+        auto t = std::filesystem::last_write_time(p, tec);
+        found.push_back({ tec ? 0 : (int64_t)t.time_since_epoch().count(), key });
+    }
+    std::sort(found.begin(), found.end());
+    for (const auto& f : found) g_combinedShaders[f.second].lastUse = ++g_shaderCacheTick;
+}
+
+static void EvictCombinedShadersLocked()
+{
+    while (g_combinedShaders.size() > kMaxCombinedShaders) {
+        auto victim = g_combinedShaders.end();
+        for (auto it = g_combinedShaders.begin(); it != g_combinedShaders.end(); ++it) {
+            if (it->second.refs > 0) continue;
+            if (victim == g_combinedShaders.end() || it->second.lastUse < victim->second.lastUse) victim = it;
+        }
+        if (victim == g_combinedShaders.end()) return; // everything is in use
+
+        std::error_code ec;
+        std::filesystem::remove(FsPath(JoinPath(GetShaderCacheDir(), CombinedShaderName(victim->first))), ec);
+        g_combinedShaders.erase(victim);
+    }
+}
+
+// Returns the shared combined file for `shaders`, writing it only if this exact
+// chain isn't already stored. params[i] (if present) specializes shaders[i].
+// Every successful call needs a matching ReleaseCombinedShader.
+// Fails (with error set) if a shader in the chain can't be read or the combined
+// file can't be written; an encode without part of its chain is never wanted.
+static bool AcquireCombinedShader(const std::vector<std::wstring>& shaders, const std::vector<ShaderParams>& params,
+                                  CombinedShaderRef& out, std::wstring* error = nullptr)
+{
+    std::lock_guard<std::mutex> lock(g_shaderCacheMutex);
+    IndexShaderCacheLocked();
+
+    std::vector<HookBlock> blocks;
+    for (size_t i = 0; i < shaders.size(); ++i) {
+        std::string text;
+        if (!ReadShaderSourceLocked(shaders[i], text)) {
+            if (error) *error = L"Cannot read shader: " + shaders[i];
+            return false;
+        }
+        if (i < params.size()) text = SpecializeShader(text, params[i]);
+        ParseHookShader(text, WideToUtf8(shaders[i]), blocks);
+    }
+    CombinedShaderRef ref;
+    ref.passes = PruneHookBlocks(blocks);
+    ref.passes.passesFused = FuseHookBlocks(blocks);
+    ref.passes.passesOut -= ref.passes.passesFused;
+    std::string combined = EmitHookBlocks(blocks);
+    if (combined.empty()) return false;
+
+    ref.key = Fnv1a64(combined.data(), combined.size());
+    ref.path = JoinPath(GetShaderCacheDir(), CombinedShaderName(ref.key));
+    ref.relName = L"shader_cache/" + CombinedShaderName(ref.key);
+
+    std::error_code ec;
+    auto it = g_combinedShaders.find(ref.key);
+    if (it == g_combinedShaders.end() || !std::filesystem::exists(FsPath(ref.path), ec)) {
+        // Write then rename, so a crash never leaves a truncated file under a
+        // valid content name.
+        std::wstring tmp = ref.path + L".tmp";
+        bool written = false;
+        {
+            std::ofstream o(FsPath(tmp), std::ios::binary | std::ios::trunc);
+            if (o) o.write(combined.data(), (std::streamsize)combined.size());
+            written = (bool)o;
+        }
+        if (written) std::filesystem::rename(FsPath(tmp), FsPath(ref.path), ec);
+        if (!written || ec) {
+            std::filesystem::remove(FsPath(tmp), ec);
+            if (error) *error = L"Cannot write combined shader: " + ref.path;
+            return false;
+        }
+    }
+
+    CombinedShaderEntry& e = g_combinedShaders[ref.key];
+    e.refs++;
+    e.lastUse = ++g_shaderCacheTick;
+    EvictCombinedShadersLocked();
+    out = ref;
+    return true;
+}
+
+static void ReleaseCombinedShader(const CombinedShaderRef& ref)
+{
+    if (ref.path.empty()) return;
+    std::lock_guard<std::mutex> lock(g_shaderCacheMutex);
+    auto it = g_combinedShaders.find(ref.key);
+    if (it == g_combinedShaders.end()) return;
+    if (it->second.refs > 0) it->second.refs--;
+    it->second.lastUse = ++g_shaderCacheTick;
+    EvictCombinedShadersLocked();
+}
+
+// ----------------------------
+// Shader file watcher
+// ----------------------------
+// Watches the directories of a set of shader files (ReadDirectoryChangesW on
+// Windows, inotify on Linux, a 500 ms rescan elsewhere). Events only arm a
+// debounce: once kShaderDebounceMs pass without another, the watched files
+// are re-hashed and onChange gets the ones whose contents actually differ, so
+// an editor's save dance (truncate, write, rename, touch) is one reload and a
+// save without edits is none. onChange runs on the watcher thread.
+static const int kShaderDebounceMs = 120;
+
+struct ShaderWatcher {
+    std::mutex m;
+    std::unordered_map<std::wstring, uint64_t> hashes; // watched file -> content hash (0 = unreadable)
+    uint64_t generation = 0;                           // bumped when the set changes
+    std::atomic<bool> stop{false};
+    std::thread thread;
+    std::function<void(const std::vector<std::wstring>&, double)> onChange; // changed files, ms since the last event
+#ifdef _WIN32
+    HANDLE wake = nullptr;
+#endif
+};
+
+static ShaderWatcher g_shaderWatcher;
+
+static uint64_t HashShaderFile(const std::wstring& path)
+{
+    std::string data;
+    if (!ReadTextFile(path, data)) return 0;
+    return Fnv1a64(data.data(), data.size()) | 1; // never 0
+}
+
+static void SetWatchedShaders(const std::vector<std::wstring>& paths)
+{
+    std::unordered_map<std::wstring, uint64_t> hashes;
+    for (const auto& p : paths) hashes[p] = HashShaderFile(p);
+    std::lock_guard<std::mutex> lock(g_shaderWatcher.m);
+    if (hashes.size() == g_shaderWatcher.hashes.size() &&
+        std::all_of(hashes.begin(), hashes.end(), [](const auto& h) { return g_shaderWatcher.hashes.count(h.first); })) {
+        g_shaderWatcher.hashes = hashes;
+        return; // same files: the watches stay as they are
+    }
+    g_shaderWatcher.hashes = hashes;
+    g_shaderWatcher.generation++;
+#ifdef _WIN32
+    if (g_shaderWatcher.wake) SetEvent(g_shaderWatcher.wake);
+#endif
+}
+
+static std::vector<std::wstring> RehashWatchedShaders()
+{
+    std::vector<std::wstring> paths;
+    {
+        std::lock_guard<std::mutex> lock(g_shaderWatcher.m);
+        for (const auto& h : g_shaderWatcher.hashes) paths.push_back(h.first);
+    }
+    std::vector<std::wstring> changed;
+    for (const auto& p : paths) {
+        uint64_t hash = HashShaderFile(p);
+        std::lock_guard<std::mutex> lock(g_shaderWatcher.m);
+        auto it = g_shaderWatcher.hashes.find(p);
+        // An unreadable file is mid-save; keep the old hash until it settles.
+        if (it == g_shaderWatcher.hashes.end() || hash == 0 || hash == it->second) continue;
+        it->second = hash;
+        changed.push_back(p);
+    }
+    return changed;
+}
+
+static std::vector<std::wstring> WatchedShaderDirs(uint64_t& generation)
+{
+    std::lock_guard<std::mutex> lock(g_shaderWatcher.m);
+    generation = g_shaderWatcher.generation;
+    std::vector<std::wstring> dirs;
+    for (const auto& h : g_shaderWatcher.hashes) {
+        std::wstring dir = Dirname(h.first);
+        if (std::find(dirs.begin(), dirs.end(), dir) == dirs.end()) dirs.push_back(dir);
+    }
+    return dirs;
+}
+
+static void ShaderWatcherThread()
+{
+    uint64_t generation = ~0ull;
+    bool armed = false;
+    auto lastEvent = std::chrono::steady_clock::now();
+#ifdef _WIN32
+    struct DirWatch {
+        HANDLE dir = INVALID_HANDLE_VALUE;
+        OVERLAPPED ov{};
+        alignas(DWORD) char buf[4096];
+    };
+    std::vector<std::unique_ptr<DirWatch>> watches;
+    auto arm = [](DirWatch& w) {
+        return ReadDirectoryChangesW(w.dir, w.buf, sizeof(w.buf), FALSE,
+                                     FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME |
+                                         FILE_NOTIFY_CHANGE_SIZE,
+                                     nullptr, &w.ov, nullptr);
+    };
+    auto closeAll = [&]() {
+        for (auto& w : watches) {
+            CancelIoEx(w->dir, &w->ov);
+            DWORD bytes = 0;
+            GetOverlappedResult(w->dir, &w->ov, &bytes, TRUE);
+            CloseHandle(w->dir);
+            CloseHandle(w->ov.hEvent);
+        }
+        watches.clear();
+    };
+#elif defined(__linux__)
+    int fd = -1;
+    auto closeAll = [&]() {
+        if (fd >= 0) close(fd);
+        fd = -1;
+    };
+#endif
+
+    while (!g_shaderWatcher.stop) {
+        uint64_t current = 0;
+        {
+            std::lock_guard<std::mutex> lock(g_shaderWatcher.m);
+            current = g_shaderWatcher.generation;
+        }
+        if (current != generation) {
+            std::vector<std::wstring> dirs = WatchedShaderDirs(generation);
+#ifdef _WIN32
+            closeAll();
+            // One slot stays for the wake event.
+            for (size_t i = 0; i < dirs.size() && watches.size() + 1 < MAXIMUM_WAIT_OBJECTS; ++i) {
+                auto w = std::make_unique<DirWatch>();
+                w->dir = CreateFileW(dirs[i].c_str(), FILE_LIST_DIRECTORY,
+                                     FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+                                     FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, nullptr);
+                if (w->dir == INVALID_HANDLE_VALUE) continue;
+                w->ov.hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+                if (!arm(*w)) {
+                    CloseHandle(w->dir);
+                    CloseHandle(w->ov.hEvent);
+                    continue;
+                }
+                watches.push_back(std::move(w));
+            }
+#elif defined(__linux__)
+            closeAll();
+            fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            for (size_t i = 0; fd >= 0 && i < dirs.size(); ++i) {
+                inotify_add_watch(fd, WideToUtf8(dirs[i]).c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_MODIFY);
+            }
+#endif
+        }
+
+        int timeoutMs = armed ? kShaderDebounceMs / 4 : 500;
+        bool event = false;
+#ifdef _WIN32
+        std::vector<HANDLE> handles{ g_shaderWatcher.wake };
+        for (auto& w : watches) handles.push_back(w->ov.hEvent);
+        DWORD r = WaitForMultipleObjects((DWORD)handles.size(), handles.data(), FALSE, (DWORD)timeoutMs);
+        if (r > WAIT_OBJECT_0 && r < WAIT_OBJECT_0 + handles.size()) {
+            DirWatch& w = *watches[r - WAIT_OBJECT_0 - 1];
+            DWORD bytes = 0;
+            GetOverlappedResult(w.dir, &w.ov, &bytes, FALSE);
+            ResetEvent(w.ov.hEvent);
+            arm(w);
+            event = true;
+        }
+#elif defined(__linux__)
+        if (fd >= 0) {
+            pollfd pfd{ fd, POLLIN, 0 };
+            if (poll(&pfd, 1, timeoutMs) > 0) {
+                alignas(inotify_event) char buf[4096];
+                while (read(fd, buf, sizeof(buf)) > 0) {}
+                event = true;
+            }
+        } else {
+            std::this_thread::sleep_for(std::chrono::milliseconds(timeoutMs));
+        }
+#else
+        std::this_thread::sleep_for(std::chrono::milliseconds(timeoutMs));
+        event = !armed; // no notifications: every idle tick is a rescan
+#endif
+        auto now = std::chrono::steady_clock::now();
+        if (event) {
+            armed = true;
+            lastEvent = now;
+            continue;
+        }
+        if (!armed || now - lastEvent < std::chrono::milliseconds(kShaderDebounceMs)) continue;
+        armed = false;
+        std::vector<std::wstring> changed = RehashWatchedShaders();
+        double sinceEventMs =
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - lastEvent).count();
+        if (!changed.empty() && g_shaderWatcher.onChange) g_shaderWatcher.onChange(changed, sinceEventMs);
+    }
+#if defined(_WIN32) || defined(__linux__)
+    closeAll();
+#endif
+}
+
+static void StartShaderWatcher(std::function<void(const std::vector<std::wstring>&, double)> onChange)
+{
+    g_shaderWatcher.onChange = std::move(onChange);
+#ifdef _WIN32
+    g_shaderWatcher.wake = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+#endif
+    g_shaderWatcher.thread = std::thread(ShaderWatcherThread);
+}
+
+#ifdef _WIN32
+static void StopShaderWatcher()
+{
+    if (!g_shaderWatcher.thread.joinable()) return;
+    g_shaderWatcher.stop = true;
+#ifdef _WIN32
+    SetEvent(g_shaderWatcher.wake);
+#endif
+    g_shaderWatcher.thread.join();
+#ifdef _WIN32
+    CloseHandle(g_shaderWatcher.wake);
+    g_shaderWatcher.wake = nullptr;
+#endif
+}
+
+// mpv caches a user shader's text by path for the life of the player, so an
+// edited file is never re-read under its own name. The preview therefore runs
+// content-addressed copies (shader_cache/live/<hash>.glsl): an edit changes
+// only that shader's path, and mpv recompiles only that pass. Overrides are
+// baked into the copy, keyed by the specialized text.
+//
+// Every save makes a new copy, so the one it replaces is deleted unless
+// another entry still runs it, and the first call of a session clears what
+// the previous session left.
+static std::map<std::wstring, std::wstring> g_liveShaderCopies; // path|overrides -> current copy
+
+// Current content hash of a watched file, or a fresh one for any other file.
+static uint64_t WatchedShaderHash(const std::wstring& path)
+{
+    {
+        std::lock_guard<std::mutex> lock(g_shaderWatcher.m);
+        auto it = g_shaderWatcher.hashes.find(path);
+        if (it != g_shaderWatcher.hashes.end() && it->second) return it->second;
+    }
+    return HashShaderFile(path);
+}
+
+static std::wstring WriteLiveShaderCopy(const std::wstring& path, const ShaderParams& params)
+{
+    uint64_t hash = WatchedShaderHash(path);
+    if (!hash) return path;
+    std::string data;
+    if (!params.empty()) {
+        if (!ReadTextFile(path, data)) return path;
+        data = SpecializeShader(data, params);
+        hash = Fnv1a64(data.data(), data.size());
+    }
+    std::wstring dir = JoinPath(GetShaderCacheDir(), L"live");
+    std::wstring live = JoinPath(dir, HexU64(hash) + L".glsl");
+    std::error_code ec;
+    if (std::filesystem::exists(FsPath(live), ec)) return live;
+    std::filesystem::create_directories(FsPath(dir), ec);
+    if (data.empty() && !ReadTextFile(path, data)) return path;
+    std::wstring tmp = live + L".tmp";
+    {
+        std::ofstream o(FsPath(tmp), std::ios::binary | std::ios::trunc);
+        if (!o.write(data.data(), (std::streamsize)data.size())) return path;
+    }
+    std::filesystem::rename(FsPath(tmp), FsPath(live), ec);
+    return ec ? path : live;
+}
+
+static std::wstring LiveShaderCopy(const std::wstring& path, const ShaderParams& params)
+{
+    static bool pruned = false;
+    std::error_code ec;
+    if (!pruned) {
+        pruned = true;
+        std::filesystem::remove_all(FsPath(JoinPath(GetShaderCacheDir(), L"live")), ec);
+    }
+
+    std::wstring live = WriteLiveShaderCopy(path, params);
+    if (live == path) return live; // unreadable: mpv gets the original
+
+    std::wstring& current = g_liveShaderCopies[path + L"|" + Utf8ToWide(FormatShaderParams(params))];
+    std::wstring old = current;
+    current = live;
+    if (old.empty() || old == live) return live;
+    for (const auto& kv : g_liveShaderCopies) {
+        if (kv.second == old) return live;
+    }
+    std::filesystem::remove(FsPath(old), ec);
+    return live;
+}
+#endif
+
+// ----------------------------
+// CPU colour grade (colortrans3)
+// ----------------------------
+// The colortrans3 grade is point-wise arithmetic, so boxes without a GPU can
+// run it natively: decoded RGB frames are graded in float, tiled across a
+// worker pool, with an AVX2 or NEON kernel when the CPU has one. A shader is
+// accepted only if its code matches colortrans3 apart from numeric constants
+// (the tuning knobs), which are read from the file.
+struct CpuGradeParams {
+    bool reverse = true;
+    float yoff = 0.0f;      // (y_offset_10b / 1023) * strength
+    float blackLift = 0.0f;
+    float m[3][3] = {};     // reverse ColorTrans rows
+    float gamma = 1.0f;
+    float lift = 0.0f;
+    float gain = 1.0f;
+    float rgbMult[3] = { 1.0f, 1.0f, 1.0f };
+    float sat = 1.0f;       // 1 + mpv_saturation / 100
+};
+
+enum class CpuFrameFormat { Rgb24, Gbrp, Gbrp10, X2Rgb10 };
+
+enum class GradeIsa { Scalar, Avx2, Neon };
+
+// Skeleton hash of glsl/colortrans3.glsl's pass body: comments, whitespace and
+// numeric literals removed (see GlslSkeletonHash).
+static const uint64_t kColorTrans3Skeleton = 0x11043763d3b3795bull;
+
+// Hash of GLSL with comments, whitespace, numeric literals (and their sign)
+// and boolean literals erased, so retuned constants still match.
+static uint64_t GlslSkeletonHash(const std::string& code)
+{
+    std::string src = StripGlslComments(code);
+    std::string sk;
+    sk.reserve(src.size());
+    for (size_t i = 0; i < src.size();) {
+        char c = src[i];
+        bool numStart = (c >= '0' && c <= '9') ||
+                        (c == '.' && i + 1 < src.size() && src[i + 1] >= '0' && src[i + 1] <= '9');
+        if (numStart && (i == 0 || !IsIdentChar(src[i - 1]))) {
+            while (i < src.size() && ((src[i] >= '0' && src[i] <= '9') || src[i] == '.' || src[i] == 'f' || src[i] == 'F' ||
+                                      ((src[i] == 'e' || src[i] == 'E') && i + 1 < src.size()))) {
+                if ((src[i] == 'e' || src[i] == 'E') && (src[i + 1] == '-' || src[i + 1] == '+')) ++i;
+                ++i;
+            }
+            // A sign right after '=', '(' or ',' belongs to the literal.
+            if (!sk.empty() && (sk.back() == '-' || sk.back() == '+')) {
+                size_t k = sk.size() - 1;
+                if (k == 0 || sk[k - 1] == '=' || sk[k - 1] == '(' || sk[k - 1] == ',') sk.pop_back();
+            }
+            sk.push_back('#');
+            continue;
+        }
+        if (IsIdentChar(c)) {
+            size_t j = i;
+            while (j < src.size() && IsIdentChar(src[j])) ++j;
+            std::string_view word(src.data() + i, j - i);
+            sk.append(word == "true" || word == "false" ? std::string_view("?") : word);
+            i = j;
+            continue;
+        }
+        if (c != ' ' && c != '\t' && c != '\r' && c != '\n') sk.push_back(c);
+        ++i;
+    }
+    return Fnv1a64(sk.data(), sk.size());
+}
+
+// Numbers in the initializer of `const <type> name = ...;`.
+static bool ReadGlslConst(const std::string& code, const char* name, std::vector<double>& out)
+{
+    std::string needle = std::string(" ") + name;
+    size_t pos = 0;
+    while ((pos = code.find(needle, pos)) != std::string::npos) {
+        size_t p = pos + needle.size();
+        pos = p;
+        if (p < code.size() && IsIdentChar(code[p])) continue;
+        while (p < code.size() && (code[p] == ' ' || code[p] == '\t')) ++p;
+        if (p >= code.size() || code[p] != '=') continue;
+        size_t end = code.find(';', p);
+        if (end == std::string::npos) return false;
+        std::string init = code.substr(p + 1, end - p - 1);
+        out.clear();
+        if (init.find("true") != std::string::npos) out.push_back(1.0);
+        else if (init.find("false") != std::string::npos) out.push_back(0.0);
+        for (size_t i = 0; i < init.size();) {
+            char c = init[i];
+            bool num = (c >= '0' && c <= '9') || ((c == '-' || c == '+' || c == '.') && i + 1 < init.size() &&
+                                                  ((init[i + 1] >= '0' && init[i + 1] <= '9') || init[i + 1] == '.'));
+            if (num && (i == 0 || !IsIdentChar(init[i - 1]))) {
+                char* stop = nullptr;
+                out.push_back(strtod(init.c_str() + i, &stop));
+                i = (size_t)(stop - init.c_str());
+                if (stop == init.c_str()) ++i;
+            } else {
+                ++i;
+            }
+        }
+        return !out.empty();
+    }
+    return false;
+}
+
+// Recognizes a colortrans3 shader and reads its constants, with the same clamps
+// the shader applies.
+static bool ParseColorTrans3(const std::string& text, CpuGradeParams& p)
+{
+    std::vector<HookBlock> blocks;
+    ParseHookShader(text, "", blocks);
+    if (blocks.size() != 1 || !IsPointwiseHookPass(blocks[0])) return false;
+    if (GlslSkeletonHash(blocks[0].body) != kColorTrans3Skeleton) return false;
+
+    std::string code = StripGlslComments(blocks[0].body);
+    std::vector<double> v;
+    auto scalar = [&](const char* name, double& dst) {
+        if (!ReadGlslConst(code, name, v) || v.size() != 1) return false;
+        dst = v[0];
+        return true;
+    };
+    auto vec3 = [&](const char* name, float* dst) {
+        if (!ReadGlslConst(code, name, v) || (v.size() != 3 && v.size() != 1)) return false;
+        for (int i = 0; i < 3; ++i) dst[i] = (float)v[v.size() == 3 ? i : 0];
+        return true;
+    };
+
+    double offset10b = 0, strength = 0, blackLift = 0, gamma = 1, lift = 0, gain = 1, sat = 0, reverse = 1;
+    if (!scalar("colortrans_y_offset_10b", offset10b) || !scalar("colortrans_yoff_strength", strength) ||
+        !scalar("reverse_black_lift", blackLift) || !scalar("gamma_pow", gamma) || !scalar("lift", lift) ||
+        !scalar("gain", gain) || !scalar("mpv_saturation_default", sat) ||
+        !scalar("REVERSE_COLORTRANS_ENABLE", reverse) ||
+        !vec3("row0", p.m[0]) || !vec3("row1", p.m[1]) || !vec3("row2", p.m[2]) || !vec3("rgb_mult", p.rgbMult)) {
+        return false;
+    }
+
+    p.reverse = reverse != 0.0;
+    p.yoff = (float)((offset10b / 1023.0) * strength);
+    p.blackLift = (float)blackLift;
+    p.gamma = std::clamp((float)gamma, 0.10f, 5.0f);
+    p.lift = std::clamp((float)lift, -1.0f, 1.0f);
+    p.gain = std::clamp((float)gain, 0.0f, 10.0f);
+    for (float& m : p.rgbMult) m = std::clamp(m, 0.0f, 4.0f);
+    p.sat = std::clamp(1.0f + (float)sat / 100.0f, 0.0f, 3.0f);
+    return true;
+}
+
+// The whole active chain as CPU grades, or false if any shader isn't one.
+// Overrides are applied first, so they tune the CPU grade like the GPU one.
+static bool ParseCpuGradeChain(const std::vector<std::wstring>& shaders, const std::vector<ShaderParams>& params,
+                               std::vector<CpuGradeParams>& chain)
+{
+    chain.clear();
+    for (size_t i = 0; i < shaders.size(); ++i) {
+        std::string text;
+        CpuGradeParams p;
+        if (!ReadTextFile(shaders[i], text)) return false;
+        if (i < params.size()) text = SpecializeShader(text, params[i]);
+        if (!ParseColorTrans3(text, p)) return false;
+        chain.push_back(p);
+    }
+    return !chain.empty();
+}
+
+// Reference implementation; mirrors the GLSL operation for operation.
+static void GradePlanesScalar(const CpuGradeParams& p, float* r, float* g, float* b, int n)
+{
+    for (int i = 0; i < n; ++i) {
+        float cr = r[i], cg = g[i], cb = b[i];
+        if (p.reverse) {
+            float x0 = cr - p.yoff, x1 = cg - p.yoff, x2 = cb - p.yoff;
+            cr = p.m[0][0] * x0 + p.m[0][1] * x1 + p.m[0][2] * x2 + p.blackLift;
+            cg = p.m[1][0] * x0 + p.m[1][1] * x1 + p.m[1][2] * x2 + p.blackLift;
+            cb = p.m[2][0] * x0 + p.m[2][1] * x1 + p.m[2][2] * x2 + p.blackLift;
+        }
+        cr = std::clamp(cr, 0.0f, 1.0f);
+        cg = std::clamp(cg, 0.0f, 1.0f);
+        cb = std::clamp(cb, 0.0f, 1.0f);
+        if (p.gamma != 1.0f) {
+            cr = std::pow(cr, p.gamma);
+            cg = std::pow(cg, p.gamma);
+            cb = std::pow(cb, p.gamma);
+        }
+        cr = (cr + p.lift) * p.gain * p.rgbMult[0];
+        cg = (cg + p.lift) * p.gain * p.rgbMult[1];
+        cb = (cb + p.lift) * p.gain * p.rgbMult[2];
+        float y = 0.2126f * cr + 0.7152f * cg + 0.0722f * cb;
+        r[i] = std::clamp(y + (cr - y) * p.sat, 0.0f, 1.0f);
+        g[i] = std::clamp(y + (cg - y) * p.sat, 0.0f, 1.0f);
+        b[i] = std::clamp(y + (cb - y) * p.sat, 0.0f, 1.0f);
+    }
+}
+
+// Vector kernel shared by the AVX2 and NEON back ends. S supplies the lane
+// type and primitive ops; pow is exp2(g * log2(x)) with polynomial log2/exp2
+// (~1e-6 relative error, far below a 10-bit step).
+#define VFXENC_GRADE_KERNEL                                                                  \
+    static V Pow01(V x, float e)                                                             \
+    {                                                                                        \
+        V zero = Set(0.0f);                                                                  \
+        V positive = CmpGt(x, zero);                                                         \
+        V ex, m;                                                                             \
+        SplitExponent(Max(x, Set(1e-30f)), ex, m);                                           \
+        V big = CmpGt(m, Set(1.41421356f));                                                  \
+        m = Select(big, Mul(m, Set(0.5f)), m);                                               \
+        ex = Add(ex, Select(big, Set(1.0f), zero));                                          \
+        V t = Div(Sub(m, Set(1.0f)), Add(m, Set(1.0f)));                                     \
+        V t2 = Mul(t, t);                                                                    \
+        V poly = Add(Set(2.88539008f / 5.0f), Mul(t2, Set(2.88539008f / 7.0f)));             \
+        poly = Add(Set(2.88539008f / 3.0f), Mul(t2, poly));                                  \
+        poly = Add(Set(2.88539008f), Mul(t2, poly));                                         \
+        V l = Add(ex, Mul(t, poly));                                                         \
+        V y = Max(Mul(l, Set(e)), Set(-126.0f));                                             \
+        V fi = Round(y);                                                                     \
+        V u = Mul(Sub(y, fi), Set(0.69314718f));                                             \
+        V q = Add(Set(1.0f / 120.0f), Mul(u, Set(1.0f / 720.0f)));                           \
+        q = Add(Set(1.0f / 24.0f), Mul(u, q));                                               \
+        q = Add(Set(1.0f / 6.0f), Mul(u, q));                                                \
+        q = Add(Set(0.5f), Mul(u, q));                                                       \
+        q = Add(Set(1.0f), Mul(u, q));                                                       \
+        q = Add(Set(1.0f), Mul(u, q));                                                       \
+        return Select(positive, Mul(q, Exp2Int(fi)), zero);                                  \
+    }                                                                                        \
+                                                                                             \
+    static int Run(const CpuGradeParams& p, float* r, float* g, float* b, int n)              \
+    {                                                                                        \
+        V zero = Set(0.0f), one = Set(1.0f);                                                 \
+        int i = 0;                                                                           \
+        for (; i + kLanes <= n; i += kLanes) {                                               \
+            V cr = Load(r + i), cg = Load(g + i), cb = Load(b + i);                          \
+            if (p.reverse) {                                                                 \
+                V off = Set(p.yoff), bl = Set(p.blackLift);                                  \
+                V x0 = Sub(cr, off), x1 = Sub(cg, off), x2 = Sub(cb, off);                   \
+                cr = Add(Add(Add(Mul(Set(p.m[0][0]), x0), Mul(Set(p.m[0][1]), x1)),          \
+                             Mul(Set(p.m[0][2]), x2)), bl);                                  \
+                cg = Add(Add(Add(Mul(Set(p.m[1][0]), x0), Mul(Set(p.m[1][1]), x1)),          \
+                             Mul(Set(p.m[1][2]), x2)), bl);                                  \
+                cb = Add(Add(Add(Mul(Set(p.m[2][0]), x0), Mul(Set(p.m[2][1]), x1)),          \
+                             Mul(Set(p.m[2][2]), x2)), bl);                                  \
+            }                                                                                \
+            cr = Min(Max(cr, zero), one);                                                    \
+            cg = Min(Max(cg, zero), one);                                                    \
+            cb = Min(Max(cb, zero), one);                                                    \
+            if (p.gamma != 1.0f) {                                                           \
+                cr = Pow01(cr, p.gamma);                                                     \
+                cg = Pow01(cg, p.gamma);                                                     \
+                cb = Pow01(cb, p.gamma);                                                     \
+            }                                                                                \
+            V lift = Set(p.lift), gain = Set(p.gain);                                        \
+            cr = Mul(Mul(Add(cr, lift), gain), Set(p.rgbMult[0]));                           \
+            cg = Mul(Mul(Add(cg, lift), gain), Set(p.rgbMult[1]));                           \
+            cb = Mul(Mul(Add(cb, lift), gain), Set(p.rgbMult[2]));                           \
+            V y = Add(Add(Mul(Set(0.2126f), cr), Mul(Set(0.7152f), cg)), Mul(Set(0.0722f), cb)); \
+            V sat = Set(p.sat);                                                              \
+            Store(r + i, Min(Max(Add(y, Mul(Sub(cr, y), sat)), zero), one));                 \
+            Store(g + i, Min(Max(Add(y, Mul(Sub(cg, y), sat)), zero), one));                 \
+            Store(b + i, Min(Max(Add(y, Mul(Sub(cb, y), sat)), zero), one));                 \
+        }                                                                                    \
+        return i;                                                                            \
+    }
+
+#if VFXENC_GRADE_X86
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx2"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+struct GradeAvx2 {
+    using V = __m256;
+    static constexpr int kLanes = 8;
+    static V Load(const float* p) { return _mm256_loadu_ps(p); }
+    static void Store(float* p, V v) { _mm256_storeu_ps(p, v); }
+    static V Set(float f) { return _mm256_set1_ps(f); }
+    static V Add(V a, V b) { return _mm256_add_ps(a, b); }
+    static V Sub(V a, V b) { return _mm256_sub_ps(a, b); }
+    static V Mul(V a, V b) { return _mm256_mul_ps(a, b); }
+    static V Div(V a, V b) { return _mm256_div_ps(a, b); }
+    static V Min(V a, V b) { return _mm256_min_ps(a, b); }
+    static V Max(V a, V b) { return _mm256_max_ps(a, b); }
+    static V CmpGt(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+    static V Select(V mask, V a, V b) { return _mm256_blendv_ps(b, a, mask); }
+    static V Round(V a) { return _mm256_round_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+    static void SplitExponent(V x, V& ex, V& m)
+    {
+        __m256i bits = _mm256_castps_si256(x);
+        ex = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(127)));
+        m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007FFFFF)),
+                                                _mm256_set1_epi32(0x3F800000)));
+    }
+    static V Exp2Int(V fi)
+    {
+        __m256i e = _mm256_add_epi32(_mm256_cvtps_epi32(fi), _mm256_set1_epi32(127));
+        return _mm256_castsi256_ps(_mm256_slli_epi32(e, 23));
+    }
+    VFXENC_GRADE_KERNEL
+};
+
+static int GradePlanesAvx2(const CpuGradeParams& p, float* r, float* g, float* b, int n)
+{
+    return GradeAvx2::Run(p, r, g, b, n);
+}
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+static bool CpuHasAvx2()
+{
+#if defined(_MSC_VER)
+    int info[4] = {};
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0;
+    if (!osxsave || (_xgetbv(0) & 6) != 6) return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+#if VFXENC_GRADE_NEON
+struct GradeNeon {
+    using V = float32x4_t;
+    static constexpr int kLanes = 4;
+    static V Load(const float* p) { return vld1q_f32(p); }
+    static void Store(float* p, V v) { vst1q_f32(p, v); }
+    static V Set(float f) { return vdupq_n_f32(f); }
+    static V Add(V a, V b) { return vaddq_f32(a, b); }
+    static V Sub(V a, V b) { return vsubq_f32(a, b); }
+    static V Mul(V a, V b) { return vmulq_f32(a, b); }
+    static V Div(V a, V b) { return vdivq_f32(a, b); }
+    static V Min(V a, V b) { return vminq_f32(a, b); }
+    static V Max(V a, V b) { return vmaxq_f32(a, b); }
+    static V CmpGt(V a, V b) { return vreinterpretq_f32_u32(vcgtq_f32(a, b)); }
+    static V Select(V mask, V a, V b) { return vbslq_f32(vreinterpretq_u32_f32(mask), a, b); }
+    static V Round(V a) { return vrndnq_f32(a); }
+    static void SplitExponent(V x, V& ex, V& m)
+    {
+        int32x4_t bits = vreinterpretq_s32_f32(x);
+        ex = vcvtq_f32_s32(vsubq_s32(vshrq_n_s32(bits, 23), vdupq_n_s32(127)));
+        m = vreinterpretq_f32_s32(vorrq_s32(vandq_s32(bits, vdupq_n_s32(0x007FFFFF)), vdupq_n_s32(0x3F800000)));
+    }
+    static V Exp2Int(V fi)
+    {
+        int32x4_t e = vaddq_s32(vcvtnq_s32_f32(fi), vdupq_n_s32(127));
+        return vreinterpretq_f32_s32(vshlq_n_s32(e, 23));
+    }
+    VFXENC_GRADE_KERNEL
+};
+#endif
+#undef VFXENC_GRADE_KERNEL
+
+static GradeIsa DetectGradeIsa()
+{
+#if VFXENC_GRADE_X86
+    if (CpuHasAvx2()) return GradeIsa::Avx2;
+#endif
+#if VFXENC_GRADE_NEON
+    return GradeIsa::Neon;
+#else
+    return GradeIsa::Scalar;
+#endif
+}
+
+static const wchar_t* GradeIsaName(GradeIsa isa)
+{
+    switch (isa) {
+    case GradeIsa::Avx2: return L"AVX2";
+    case GradeIsa::Neon: return L"NEON";
+    default:             return L"scalar";
+    }
+}
+
+static void GradePlanes(GradeIsa isa, const CpuGradeParams& p, float* r, float* g, float* b, int n)
+{
+    int done = 0;
+#if VFXENC_GRADE_X86
+    if (isa == GradeIsa::Avx2) done = GradePlanesAvx2(p, r, g, b, n);
+#endif
+#if VFXENC_GRADE_NEON
+    if (isa == GradeIsa::Neon) done = GradeNeon::Run(p, r, g, b, n);
+#endif
+    GradePlanesScalar(p, r + done, g + done, b + done, n - done);
+}
+
+static const wchar_t* CpuFramePixFmt(CpuFrameFormat f)
+{
+    switch (f) {
+    case CpuFrameFormat::Rgb24:   return L"rgb24";
+    case CpuFrameFormat::Gbrp:    return L"gbrp";
+    case CpuFrameFormat::Gbrp10:  return L"gbrp10le";
+    default:                      return L"x2rgb10le";
+    }
+}
+
+static size_t CpuFrameBytes(CpuFrameFormat f, int w, int h)
+{
+    size_t px = (size_t)w * (size_t)h;
+    switch (f) {
+    case CpuFrameFormat::Gbrp10:  return px * 6;
+    case CpuFrameFormat::X2Rgb10: return px * 4;
+    default:                      return px * 3;
+    }
+}
+
+// Row y of a frame to/from float planes in [0, 1]. Planar formats are G, B, R
+// plane order, as ffmpeg's gbrp* lay them out.
+static void UnpackGradeRow(CpuFrameFormat f, const uint8_t* frame, int w, int h, int y, float* r, float* g, float* b)
+{
+    size_t plane = (size_t)w * (size_t)h;
+    switch (f) {
+    case CpuFrameFormat::Rgb24: {
+        const uint8_t* s = frame + (size_t)y * w * 3;
+        for (int x = 0; x < w; ++x) {
+            r[x] = s[x * 3 + 0] * (1.0f / 255.0f);
+            g[x] = s[x * 3 + 1] * (1.0f / 255.0f);
+            b[x] = s[x * 3 + 2] * (1.0f / 255.0f);
+        }
+        break;
+    }
+    case CpuFrameFormat::Gbrp: {
+        const uint8_t* row = frame + (size_t)y * w;
+        for (int x = 0; x < w; ++x) {
+            g[x] = row[x] * (1.0f / 255.0f);
+            b[x] = row[plane + x] * (1.0f / 255.0f);
+            r[x] = row[plane * 2 + x] * (1.0f / 255.0f);
+        }
+        break;
+    }
+    case CpuFrameFormat::Gbrp10: {
+        const uint16_t* row = (const uint16_t*)frame + (size_t)y * w;
+        for (int x = 0; x < w; ++x) {
+            g[x] = (row[x] & 0x3FF) * (1.0f / 1023.0f);
+            b[x] = (row[plane + x] & 0x3FF) * (1.0f / 1023.0f);
+            r[x] = (row[plane * 2 + x] & 0x3FF) * (1.0f / 1023.0f);
+        }
+        break;
+    }
+    case CpuFrameFormat::X2Rgb10: {
+        const uint32_t* row = (const uint32_t*)frame + (size_t)y * w;
+        for (int x = 0; x < w; ++x) {
+            r[x] = ((row[x] >> 20) & 0x3FF) * (1.0f / 1023.0f);
+            g[x] = ((row[x] >> 10) & 0x3FF) * (1.0f / 1023.0f);
+            b[x] = (row[x] & 0x3FF) * (1.0f / 1023.0f);
+        }
+        break;
+    }
+    }
+}
+
+static void PackGradeRow(CpuFrameFormat f, uint8_t* frame, int w, int h, int y, const float* r, const float* g, const float* b)
+{
+    size_t plane = (size_t)w * (size_t)h;
+    auto q8 = [](float v) { return (uint8_t)(v * 255.0f + 0.5f); };
+    auto q10 = [](float v) { return (uint32_t)(v * 1023.0f + 0.5f); };
+    switch (f) {
+    case CpuFrameFormat::Rgb24: {
+        uint8_t* d = frame + (size_t)y * w * 3;
+        for (int x = 0; x < w; ++x) {
+            d[x * 3 + 0] = q8(r[x]);
+            d[x * 3 + 1] = q8(g[x]);
+            d[x * 3 + 2] = q8(b[x]);
+        }
+        break;
+    }
+    case CpuFrameFormat::Gbrp: {
+        uint8_t* row = frame + (size_t)y * w;
+        for (int x = 0; x < w; ++x) {
+            row[x] = q8(g[x]);
+            row[plane + x] = q8(b[x]);
+            row[plane * 2 + x] = q8(r[x]);
+        }
+        break;
+    }
+    case CpuFrameFormat::Gbrp10: {
+        uint16_t* row = (uint16_t*)frame + (size_t)y * w;
+        for (int x = 0; x < w; ++x) {
+            row[x] = (uint16_t)q10(g[x]);
+            row[plane + x] = (uint16_t)q10(b[x]);
+            row[plane * 2 + x] = (uint16_t)q10(r[x]);
+        }
+        break;
+    }
+    case CpuFrameFormat::X2Rgb10: {
+        uint32_t* row = (uint32_t*)frame + (size_t)y * w;
+        for (int x = 0; x < w; ++x) {
+            row[x] = (row[x] & 0xC0000000u) | (q10(r[x]) << 20) | (q10(g[x]) << 10) | q10(b[x]);
+        }
+        break;
+    }
+    }
+}
+
+// Persistent workers for per-frame parallel loops; the calling thread joins in.
+struct WorkerPool {
+    std::vector<std::thread> threads;
+    std::mutex m;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    const std::function<void(int)>* task = nullptr;
+    int count = 0;
+    std::atomic<int> next{0};
+    int busy = 0;
+    uint64_t generation = 0;
+    bool stop = false;
+
+    explicit WorkerPool(int workers)
+    {
+        for (int i = 0; i < workers; ++i) {
+            threads.emplace_back([this]() {
+                uint64_t seen = 0;
+                while (true) {
+                    {
+                        std::unique_lock<std::mutex> lock(m);
+                        wake.wait(lock, [&]() { return stop || generation != seen; });
+                        if (stop) return;
+                        seen = generation;
+                    }
+                    Drain();
+                    std::lock_guard<std::mutex> lock(m);
+                    if (--busy == 0) idle.notify_one();
+                }
+            });
+        }
+    }
+
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stop = true;
+        }
+        wake.notify_all();
+        for (auto& t : threads) t.join();
+    }
+
+    void Drain()
+    {
+        for (int i = next++; i < count; i = next++) (*task)(i);
+    }
+
+    void ParallelFor(int n, const std::function<void(int)>& fn)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            task = &fn;
+            count = n;
+            next = 0;
+            busy = (int)threads.size();
+            generation++;
+        }
+        wake.notify_all();
+        Drain();
+        std::unique_lock<std::mutex> lock(m);
+        idle.wait(lock, [&]() { return busy == 0; });
+    }
+};
+
+// Grades one frame in place, in bands of rows spread over the pool.
+static void GradeFrame(const std::vector<CpuGradeParams>& chain, GradeIsa isa, CpuFrameFormat f,
+                       uint8_t* frame, int w, int h, WorkerPool& pool)
+{
+    int bands = std::min(h, (int)(pool.threads.size() + 1) * 4);
+    int rowsPerBand = (h + bands - 1) / bands;
+    pool.ParallelFor(bands, [&](int band) {
+        std::vector<float> scratch((size_t)w * 3);
+        float* r = scratch.data();
+        float* g = r + w;
+        float* b = g + w;
+        int y1 = std::min(h, (band + 1) * rowsPerBand);
+        for (int y = band * rowsPerBand; y < y1; ++y) {
+            UnpackGradeRow(f, frame, w, h, y, r, g, b);
+            for (const auto& p : chain) GradePlanes(isa, p, r, g, b, w);
+            PackGradeRow(f, frame, w, h, y, r, g, b);
+        }
+    });
+}
+
+// Grades a pseudo-random frame in every format with both the vector kernel and
+// the scalar reference; the kernel is used only if no code value differs by
+// more than one step.
+static bool CpuGradeSelfCheck(GradeIsa isa, int& maxDiff)
+{
+    maxDiff = 0;
+    if (isa == GradeIsa::Scalar) return true;
+
+    CpuGradeParams base;
+    base.yoff = (200.0f / 1023.0f) * 0.25f;
+    base.blackLift = 0.02f;
+    const float m[3][3] = { { 1.17866031f, 0.17460893f, 0.01571472f },
+                            { -0.11147506f, 1.55408099f, -0.07362197f },
+                            { 0.03243649f, 0.11275820f, 1.22378927f } };
+    memcpy(base.m, m, sizeof(m));
+    base.lift = -0.15f;
+    base.gain = 1.75f;
+    base.sat = 0.775f;
+    CpuGradeParams curved = base;
+    curved.gamma = 0.8f;
+    curved.rgbMult[2] = 1.1f;
+    curved.sat = 1.3f;
+    std::vector<CpuGradeParams> chain = { base, curved };
+
+    const int w = 261, h = 37;
+    WorkerPool pool(2);
+    const CpuFrameFormat formats[] = { CpuFrameFormat::Rgb24, CpuFrameFormat::Gbrp, CpuFrameFormat::Gbrp10, CpuFrameFormat::X2Rgb10 };
+    for (CpuFrameFormat f : formats) {
+        std::vector<uint8_t> a(CpuFrameBytes(f, w, h));
+        uint32_t seed = 12345;
+        for (auto& byte : a) {
+            seed = seed * 1664525u + 1013904223u;
+            byte = (uint8_t)(seed >> 24);
+        }
+        if (f == CpuFrameFormat::Gbrp10) {
+            for (size_t i = 0; i < a.size(); i += 2) a[i + 1] &= 0x03;
+        }
+        std::vector<uint8_t> b = a;
+        GradeFrame(chain, isa, f, a.data(), w, h, pool);
+        GradeFrame(chain, GradeIsa::Scalar, f, b.data(), w, h, pool);
+
+        for (int y = 0; y < h; ++y) {
+            std::vector<float> ra(w * 3), rb(w * 3);
+            UnpackGradeRow(f, a.data(), w, h, y, ra.data(), ra.data() + w, ra.data() + w * 2);
+            UnpackGradeRow(f, b.data(), w, h, y, rb.data(), rb.data() + w, rb.data() + w * 2);
+            float scale = (f == CpuFrameFormat::Gbrp10 || f == CpuFrameFormat::X2Rgb10) ? 1023.0f : 255.0f;
+            for (size_t i = 0; i < ra.size(); ++i) {
+                maxDiff = std::max(maxDiff, (int)(std::fabs(ra[i] - rb[i]) * scale + 0.5f));
+            }
+        }
+    }
+    return maxDiff <= 1;
+}
+
+// ISA to grade with, after a one-time self-check of the vector kernel.
+static GradeIsa GetGradeIsa(std::wstring* note = nullptr)
+{
+    static std::once_flag once;
+    static GradeIsa isa = GradeIsa::Scalar;
+    static std::wstring checkNote;
+    std::call_once(once, []() {
+        GradeIsa detected = DetectGradeIsa();
+        int maxDiff = 0;
+        if (CpuGradeSelfCheck(detected, maxDiff)) {
+            isa = detected;
+            checkNote = std::wstring(GradeIsaName(isa)) + L" (self-check max diff " + std::to_wstring(maxDiff) + L")";
+        } else {
+            checkNote = std::wstring(L"scalar; ") + GradeIsaName(detected) + L" failed self-check (max diff " +
+                        std::to_wstring(maxDiff) + L")";
+        }
+    });
+    if (note) *note = checkNote;
+    return isa;
+}
+
+// ----------------------------
+// Baked 3D LUT
+// ----------------------------
+// A chain of CPU grades is a fixed RGB -> RGB function, so it can be sampled
+// once on a 65^3 lattice and applied with ffmpeg's lut3d: one tetrahedral
+// lookup per pixel however long the chain, and no GPU. LUTs are cached in
+// lut_cache/ by a hash of the chain's parameters; each bake is checked
+// against direct evaluation and the error is reported in the encode log.
+static const int kLutSize = 65;
+static const size_t kMaxCachedLuts = 16;
+
+static std::mutex g_lutCacheMutex;
+
+static uint64_t GradeChainKey(const std::vector<CpuGradeParams>& chain)
+{
+    std::vector<float> v;
+    v.push_back((float)kLutSize);
+    for (const auto& p : chain) {
+        v.push_back(p.reverse ? 1.0f : 0.0f);
+        v.push_back(p.yoff);
+        v.push_back(p.blackLift);
+        for (int i = 0; i < 3; ++i) v.insert(v.end(), p.m[i], p.m[i] + 3);
+        v.push_back(p.gamma);
+        v.push_back(p.lift);
+        v.push_back(p.gain);
+        v.insert(v.end(), p.rgbMult, p.rgbMult + 3);
+        v.push_back(p.sat);
+    }
+    return Fnv1a64(v.data(), v.size() * sizeof(float));
+}
+
+// Lattice values, red fastest (the .cube order), 3 floats per entry.
+static void EvaluateGradeLattice(const std::vector<CpuGradeParams>& chain, GradeIsa isa, std::vector<float>& lut)
+{
+    const int n = kLutSize;
+    lut.assign((size_t)n * n * n * 3, 0.0f);
+    std::vector<float> r(n), g(n), b(n);
+    for (int bi = 0; bi < n; ++bi) {
+        for (int gi = 0; gi < n; ++gi) {
+            for (int ri = 0; ri < n; ++ri) {
+                r[ri] = ri / (float)(n - 1);
+                g[ri] = gi / (float)(n - 1);
+                b[ri] = bi / (float)(n - 1);
+            }
+            for (const auto& p : chain) GradePlanes(isa, p, r.data(), g.data(), b.data(), n);
+            float* out = &lut[((size_t)bi * n + gi) * n * 3];
+            for (int ri = 0; ri < n; ++ri) {
+                out[ri * 3 + 0] = r[ri];
+                out[ri * 3 + 1] = g[ri];
+                out[ri * 3 + 2] = b[ri];
+            }
+        }
+    }
+}
+
+// Tetrahedral interpolation, as lut3d=interp=tetrahedral does it.
+static void SampleLutTetrahedral(const std::vector<float>& lut, float r, float g, float b, float out[3])
+{
+    const int n = kLutSize;
+    float x = r * (n - 1), y = g * (n - 1), z = b * (n - 1);
+    int x0 = std::min((int)x, n - 2), y0 = std::min((int)y, n - 2), z0 = std::min((int)z, n - 2);
+    float fr = x - x0, fg = y - y0, fb = z - z0;
+    auto at = [&](int dr, int dg, int db) { return &lut[(((size_t)(z0 + db) * n + (y0 + dg)) * n + (x0 + dr)) * 3]; };
+    const float* c000 = at(0, 0, 0);
+    const float* c111 = at(1, 1, 1);
+    for (int c = 0; c < 3; ++c) {
+        float v;
+        if (fr > fg) {
+            if (fg > fb)      v = (1 - fr) * c000[c] + (fr - fg) * at(1, 0, 0)[c] + (fg - fb) * at(1, 1, 0)[c] + fb * c111[c];
+            else if (fr > fb) v = (1 - fr) * c000[c] + (fr - fb) * at(1, 0, 0)[c] + (fb - fg) * at(1, 0, 1)[c] + fg * c111[c];
+            else              v = (1 - fb) * c000[c] + (fb - fr) * at(0, 0, 1)[c] + (fr - fg) * at(1, 0, 1)[c] + fg * c111[c];
+        } else {
+            if (fb > fg)      v = (1 - fb) * c000[c] + (fb - fg) * at(0, 0, 1)[c] + (fg - fr) * at(0, 1, 1)[c] + fr * c111[c];
+            else if (fb > fr) v = (1 - fg) * c000[c] + (fg - fb) * at(0, 1, 0)[c] + (fb - fr) * at(0, 1, 1)[c] + fr * c111[c];
+            else              v = (1 - fg) * c000[c] + (fg - fr) * at(0, 1, 0)[c] + (fr - fb) * at(1, 1, 0)[c] + fb * c111[c];
+        }
+        out[c] = v;
+    }
+}
+
+// Largest and mean |LUT - direct| over pseudo-random colours, in 10-bit code
+// values. Hard clamps inside the grade put kinks between lattice points, so the
+// max is expected to be a few steps; the mean should stay well under one.
+static double ValidateGradeLut(const std::vector<CpuGradeParams>& chain, const std::vector<float>& lut, double& meanErr)
+{
+    const int samples = 4096;
+    std::vector<float> r(samples), g(samples), b(samples);
+    uint32_t seed = 0x9E3779B9u;
+    auto next = [&]() {
+        seed = seed * 1664525u + 1013904223u;
+        return (seed >> 8) * (1.0f / 16777216.0f);
+    };
+    for (int i = 0; i < samples; ++i) {
+        r[i] = next();
+        g[i] = next();
+        b[i] = next();
+    }
+    std::vector<float> dr = r, dg = g, db = b;
+    for (const auto& p : chain) GradePlanesScalar(p, dr.data(), dg.data(), db.data(), samples);
+
+    double maxErr = 0.0;
+    double sum = 0.0;
+    for (int i = 0; i < samples; ++i) {
+        float v[3];
+        SampleLutTetrahedral(lut, r[i], g[i], b[i], v);
+        double e[3] = { std::fabs(v[0] - dr[i]), std::fabs(v[1] - dg[i]), std::fabs(v[2] - db[i]) };
+        for (double x : e) {
+            maxErr = std::max(maxErr, x);
+            sum += x;
+        }
+    }
+    meanErr = sum / (samples * 3) * 1023.0;
+    return maxErr * 1023.0;
+}
+
+static std::wstring GetLutCacheDir()
+{
+    return JoinPath(GetExeDir(), L"lut_cache");
+}
+
+// Keeps the newest kMaxCachedLuts files.
+static void TrimLutCacheLocked()
+{
+    std::error_code ec;
+    std::vector<std::pair<std::filesystem::file_time_type, std::filesystem::path>> files;
+    for (const auto& de : std::filesystem::directory_iterator(FsPath(GetLutCacheDir()), ec)) {
+        if (de.path().extension() != ".cube") continue;
+        std::error_code tec;
+        files.push_back({ std::filesystem::last_write_time(de.path(), tec), de.path() });
+    }
+    if (files.size() <= kMaxCachedLuts) return;
+    std::sort(files.begin(), files.end());
+    for (size_t i = 0; i + kMaxCachedLuts < files.size(); ++i) std::filesystem::remove(files[i].second, ec);
+}
+
+// Writes (or reuses) the .cube for `chain`. relPath is relative to the exe dir
+// (ffmpeg's working dir); note describes the bake for the log.
+static bool BakeGradeLut(const std::vector<CpuGradeParams>& chain, std::wstring& relPath, std::wstring& note)
+{
+    std::wstring name = HexU64(GradeChainKey(chain)) + L".cube";
+    std::wstring path = JoinPath(GetLutCacheDir(), name);
+    relPath = L"lut_cache/" + name;
+
+    std::lock_guard<std::mutex> lock(g_lutCacheMutex);
+    std::error_code ec;
+    if (std::filesystem::exists(FsPath(path), ec)) {
+        std::filesystem::last_write_time(FsPath(path), std::filesystem::file_time_type::clock::now(), ec);
+        note = L"cached " + relPath;
+        return true;
+    }
+
+    std::vector<float> lut;
+    EvaluateGradeLattice(chain, GetGradeIsa(), lut);
+    double meanErr = 0.0;
+    double maxErr = ValidateGradeLut(chain, lut, meanErr);
+
+    std::string text = "TITLE \"VfxEnc baked grade\"\nLUT_3D_SIZE " + std::to_string(kLutSize) +
+                       "\nDOMAIN_MIN 0 0 0\nDOMAIN_MAX 1 1 1\n";
+    text.reserve(text.size() + lut.size() * 9);
+    char line[96];
+    for (size_t i = 0; i < lut.size(); i += 3) {
+        int len = snprintf(line, sizeof(line), "%.6f %.6f %.6f\n", lut[i], lut[i + 1], lut[i + 2]);
+        text.append(line, (size_t)len);
+    }
+
+    std::filesystem::create_directories(FsPath(GetLutCacheDir()), ec);
+    std::wstring tmp = path + L".tmp";
+    {
+        std::ofstream o(FsPath(tmp), std::ios::binary | std::ios::trunc);
+        if (!o) return false;
+        o.write(text.data(), (std::streamsize)text.size());
+        if (!o) return false;
+    }
+    std::filesystem::rename(FsPath(tmp), FsPath(path), ec);
+    if (ec) {
+        std::filesystem::remove(FsPath(tmp), ec);
+        return false;
+    }
+    TrimLutCacheLocked();
+
+    wchar_t buf[200];
+    swprintf_s(buf, L"baked %ls (%d^3; error vs direct, 10-bit steps: mean %.2f, max %.2f)",
+               relPath.c_str(), kLutSize, meanErr, maxErr);
+    note = buf;
+    return true;
+}
+
+// ----------------------------
+// Filtergraph planner
+// ----------------------------
+// One libplacebo instance runs the shader chain, scales, converts the pixel
+// format and retags the colorspace in a single pass, so everything the output
+// needs is folded into it rather than chained as further instances (each one
+// another upload/download and a full-size intermediate frame). Shaders hooked
+// on OUTPUT therefore run at the target size, as they do in mpv. The CPU grade
+// and the baked LUT get the same target from RgbToYuvFilter.
+enum class FitMode {
+    Fit,  // scale inside the box and pad
+    Fill, // scale to cover the box and crop
+};
+
+struct OutputTarget {
+    int width = 0;              // 0 = from the height and the source aspect
+    int height = 0;             // 0 = from the width (both 0 = source size)
+    FitMode fit = FitMode::Fit; // when the box's aspect differs from the source's
+    std::wstring pixFmt;        // empty = the filter's default
+    std::wstring colorspace;    // empty = as the source; else a kOutputColorspaces name
+};
+
+struct OutputColorspace {
+    const wchar_t* name;
+    const wchar_t* matrix;
+    const wchar_t* primaries;
+    const wchar_t* trc;
+};
+
+static const OutputColorspace kOutputColorspaces[] = {
+    { L"bt709",  L"bt709",     L"bt709",     L"bt709" },
+    { L"bt601",  L"smpte170m", L"smpte170m", L"smpte170m" },
+    { L"bt2020", L"bt2020nc",  L"bt2020",    L"bt2020-10" },
+};
+
+static const OutputColorspace* FindOutputColorspace(const std::wstring& name)
+{
+    for (const auto& c : kOutputColorspaces) {
+        if (name == c.name) return &c;
+    }
+    return nullptr;
+}
+
+// Output dimensions as filter values. A dimension the target leaves open is
+// derived from the source aspect when the source size is known and left to
+// the filter as -2 (aspect-preserving, even) otherwise. box is set when both
+// are fixed and the aspect differs, i.e. fit/fill has something to do.
+struct OutputSize {
+    std::wstring w, h;
+    bool scale = false;
+    bool box = false;
+};
+
+static OutputSize PlanOutputSize(const OutputTarget& t, int srcW, int srcH)
+{
+    OutputSize s;
+    if (t.width <= 0 && t.height <= 0) return s;
+    s.scale = true;
+    bool known = srcW > 0 && srcH > 0;
+    int w = t.width, h = t.height;
+    if (w <= 0 && known) w = (int)((double)srcW * h / srcH + 0.5) & ~1;
+    if (h <= 0 && known) h = (int)((double)srcH * w / srcW + 0.5) & ~1;
+    s.w = w > 0 ? std::to_wstring(w) : L"-2";
+    s.h = h > 0 ? std::to_wstring(h) : L"-2";
+    // Within a pixel of the source aspect counts as the same shape.
+    s.box = t.width > 0 && t.height > 0 &&
+            (!known || std::abs((int64_t)srcW * t.height - (int64_t)srcH * t.width) > std::max(srcW, srcH));
+    return s;
+}
+
+// The whole GPU graph; shaderValue is an escaped custom_shader_path value, or empty.
+static std::wstring PlanLibplaceboFilter(const std::wstring& shaderValue, const OutputTarget& t, int srcW, int srcH)
+{
+    std::vector<std::wstring> opts;
+    if (!shaderValue.empty()) opts.push_back(L"custom_shader_path=" + shaderValue);
+    OutputSize s = PlanOutputSize(t, srcW, srcH);
+    if (s.scale) {
+        opts.push_back(L"w=" + s.w);
+        opts.push_back(L"h=" + s.h);
+    }
+    if (s.box) {
+        opts.push_back(L"normalize_sar=1");
+        opts.push_back(t.fit == FitMode::Fill ? L"pad_crop_ratio=1" : L"pad_crop_ratio=0");
+    }
+    if (!t.pixFmt.empty()) opts.push_back(L"format=" + t.pixFmt);
+    if (const OutputColorspace* c = FindOutputColorspace(t.colorspace)) {
+        opts.push_back(std::wstring(L"colorspace=") + c->matrix);
+        opts.push_back(std::wstring(L"color_primaries=") + c->primaries);
+        opts.push_back(std::wstring(L"color_trc=") + c->trc);
+        opts.push_back(L"range=tv");
+    }
+    std::wstring vf = L"libplacebo";
+    for (size_t i = 0; i < opts.size(); ++i) vf += (i ? L":" : L"=") + opts[i];
+    return vf;
+}
+
+// Filter chains around an RGB-domain operation (the baked LUT, the CPU grade).
+// Untagged HD sources are taken as BT.709 like libplacebo does; output is
+// limited-range BT.709, 4:2:0 unless the target says otherwise.
+static std::wstring YuvToRgbFilter(int srcHeight, const wchar_t* pixFmt)
+{
+    return std::wstring(L"scale=in_color_matrix=") + (srcHeight <= 0 || srcHeight >= 720 ? L"bt709" : L"bt601") +
+           L":flags=accurate_rnd+full_chroma_int,format=" + pixFmt;
+}
+
+static std::wstring RgbToYuvFilter(const OutputTarget& t, int srcW, int srcH)
+{
+    OutputSize s = PlanOutputSize(t, srcW, srcH);
+    std::wstring vf = L"scale=";
+    if (s.scale) vf += s.w + L":" + s.h + L":flags=lanczos:";
+    if (s.box) {
+        vf += t.fit == FitMode::Fill ? L"force_original_aspect_ratio=increase" : L"force_original_aspect_ratio=decrease";
+        vf += L":force_divisible_by=2:";
+    }
+    vf += L"out_color_matrix=bt709:out_range=tv";
+    if (s.box) {
+        vf += (t.fit == FitMode::Fill ? L",crop=" : L",pad=") + s.w + L":" + s.h;
+        if (t.fit == FitMode::Fit) vf += L":(ow-iw)/2:(oh-ih)/2";
+    }
+    return vf + L",format=" + (t.pixFmt.empty() ? L"yuv420p" : t.pixFmt);
+}
+
+// ----------------------------
+// Native container probe (MP4 / Matroska)
+// ----------------------------
+// Reads stream layout and sizes straight from the container indexes so bitrate
+// and duration don't need an ffmpeg launch per file. MP4 sums stsz sample sizes
+// per track; Matroska uses the muxer's statistics tags when present, otherwise
+// it measures each track's share of the block bytes in clusters sampled via Cues.
+struct MediaStreamInfo {
+    char type = '?';          // 'v' video, 'a' audio, 's' subtitle, '?' other
+    std::string codec;        // MP4 sample entry fourcc or Matroska CodecID
+    int width = 0;
+    int height = 0;
+    double fps = 0.0;
+    int64_t durationUs = 0;
+    int64_t bytes = 0;        // payload bytes, 0 if unknown
+    double bitrateKbps = 0.0; // 0 if unknown
+};
+
+struct MediaInfo {
+    int64_t durationUs = 0;
+    int64_t fileBytes = 0;
+    std::vector<MediaStreamInfo> streams;
+
+    const MediaStreamInfo* FirstVideo() const
+    {
+        for (const auto& s : streams) {
+            if (s.type == 'v') return &s;
+        }
+        return nullptr;
+    }
+};
+
+// Positioned reads over a file; every probe read goes through here.
+struct ProbeReader {
+    std::ifstream f;
+    int64_t size = 0;
+
+    bool Open(const std::wstring& path)
+    {
+        f.open(FsPath(path), std::ios::binary);
+        if (!f) return false;
+        f.seekg(0, std::ios::end);
+        size = (int64_t)f.tellg();
+        return size > 0;
+    }
+
+    bool Read(int64_t pos, void* dst, size_t n)
+    {
+        if (pos < 0 || pos + (int64_t)n > size) return false;
+        f.clear();
+        f.seekg(pos);
+        f.read((char*)dst, (std::streamsize)n);
+        return (size_t)f.gcount() == n;
+    }
+
+    bool ReadBlob(int64_t pos, int64_t n, std::vector<uint8_t>& out)
+    {
+        if (n < 0 || n > (int64_t)256 * 1024 * 1024) return false;
+        out.resize((size_t)n);
+        return n == 0 || Read(pos, out.data(), (size_t)n);
+    }
+};
+
+static uint32_t ReadBe32(const uint8_t* p) { return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]; }
+static uint16_t ReadBe16(const uint8_t* p) { return (uint16_t)((p[0] << 8) | p[1]); }
+static uint64_t ReadBe64(const uint8_t* p) { return ((uint64_t)ReadBe32(p) << 32) | ReadBe32(p + 4); }
+
+static double BitrateKbps(int64_t bytes, int64_t durationUs)
+{
+    return (bytes > 0 && durationUs > 0) ? (double)bytes * 8000.0 / (double)durationUs : 0.0;
+}
+
+// ---- MP4 / MOV ----
+
+struct Mp4Box {
+    uint32_t type = 0;
+    const uint8_t* data = nullptr; // payload
+    size_t size = 0;               // payload size
+};
+
+static uint32_t FourCC(const char* s) { return ReadBe32((const uint8_t*)s); }
+
+// Iterates the boxes inside an in-memory payload.
+template <class F>
+static void ForEachMp4Box(const uint8_t* p, size_t n, F&& fn)
+{
+    size_t pos = 0;
+    while (pos + 8 <= n) {
+        uint64_t size = ReadBe32(p + pos);
+        uint32_t type = ReadBe32(p + pos + 4);
+        size_t hdr = 8;
+        if (size == 1) {
+            if (pos + 16 > n) return;
+            size = ReadBe64(p + pos + 8);
+            hdr = 16;
+        } else if (size == 0) {
+            size = n - pos;
+        }
+        if (size < hdr || size > n - pos) return;
+        Mp4Box box;
+        box.type = type;
+        box.data = p + pos + hdr;
+        box.size = (size_t)size - hdr;
+        fn(box);
+        pos += (size_t)size;
+    }
+}
+
+static void ParseMp4Trak(const Mp4Box& trak, MediaInfo& info)
+{
+    MediaStreamInfo s;
+    uint32_t timescale = 0;
+    uint64_t mdhdDuration = 0;
+    uint64_t sampleCount = 0;
+    uint64_t sampleTicks = 0;
+
+    std::function<void(const Mp4Box&)> visit = [&](const Mp4Box& b) {
+        const uint8_t* d = b.data;
+        if (b.type == FourCC("mdia") || b.type == FourCC("minf") || b.type == FourCC("stbl")) {
+            ForEachMp4Box(d, b.size, visit);
+        } else if (b.type == FourCC("tkhd") && b.size >= 84) {
+            size_t off = (d[0] == 1) ? 88 : 76;
+            if (b.size >= off + 8) {
+                s.width = (int)(ReadBe32(d + off) >> 16);
+                s.height = (int)(ReadBe32(d + off + 4) >> 16);
+            }
+        } else if (b.type == FourCC("mdhd") && b.size >= 24) {
+            if (d[0] == 1 && b.size >= 32) {
+                timescale = ReadBe32(d + 20);
+                mdhdDuration = ReadBe64(d + 24);
+            } else {
+                timescale = ReadBe32(d + 12);
+                mdhdDuration = ReadBe32(d + 16);
+            }
+        } else if (b.type == FourCC("hdlr") && b.size >= 12) {
+            uint32_t h = ReadBe32(d + 8);
+            s.type = (h == FourCC("vide")) ? 'v' : (h == FourCC("soun")) ? 'a' :
+                     (h == FourCC("sbtl") || h == FourCC("subt") || h == FourCC("text")) ? 's' : '?';
+        } else if (b.type == FourCC("stsd") && b.size >= 16) {
+            s.codec.assign((const char*)d + 12, 4);
+            if (b.size >= 8 + 36) {
+                int w = ReadBe16(d + 8 + 32);
+                int h = ReadBe16(d + 8 + 34);
+                if (s.type == 'v' && w > 0 && h > 0) {
+                    s.width = w;
+                    s.height = h;
+                }
+            }
+        } else if (b.type == FourCC("stts") && b.size >= 8) {
+            uint32_t entries = ReadBe32(d + 4);
+            for (uint32_t i = 0; i < entries && 8 + (size_t)i * 8 + 8 <= b.size; ++i) {
+                uint32_t count = ReadBe32(d + 8 + (size_t)i * 8);
+                uint32_t delta = ReadBe32(d + 12 + (size_t)i * 8);
+                sampleCount += count;
+                sampleTicks += (uint64_t)count * delta;
+            }
+        } else if (b.type == FourCC("stsz") && b.size >= 12) {
+            uint32_t fixed = ReadBe32(d + 4);
+            uint32_t count = ReadBe32(d + 8);
+            if (fixed != 0) {
+                s.bytes = (int64_t)fixed * count;
+            } else {
+                int64_t total = 0;
+                for (uint32_t i = 0; i < count && 12 + (size_t)i * 4 + 4 <= b.size; ++i) {
+                    total += ReadBe32(d + 12 + (size_t)i * 4);
+                }
+                s.bytes = total;
+            }
+        }
+    };
+    ForEachMp4Box(trak.data, trak.size, visit);
+
+    if (timescale > 0) {
+        s.durationUs = (int64_t)((double)mdhdDuration * 1000000.0 / timescale);
+        if (s.type == 'v' && sampleTicks > 0) {
+            s.fps = (double)sampleCount * timescale / (double)sampleTicks;
+        }
+    }
+    s.bitrateKbps = BitrateKbps(s.bytes, s.durationUs);
+    info.streams.push_back(s);
+}
+
+static bool ProbeMp4(ProbeReader& r, MediaInfo& info)
+{
+    // Walk top-level boxes by header only; mdat is never read.
+    int64_t pos = 0;
+    std::vector<uint8_t> moov;
+    while (pos + 8 <= r.size) {
+        uint8_t hdr[16];
+        if (!r.Read(pos, hdr, 8)) break;
+        uint64_t size = ReadBe32(hdr);
+        uint32_t type = ReadBe32(hdr + 4);
+        int64_t hdrLen = 8;
+        if (size == 1) {
+            if (!r.Read(pos, hdr, 16)) break;
+            size = ReadBe64(hdr + 8);
+            hdrLen = 16;
+        } else if (size == 0) {
+            size = (uint64_t)(r.size - pos);
+        }
+        if ((int64_t)size < hdrLen) break;
+        if (type == FourCC("moov")) {
+            if (!r.ReadBlob(pos + hdrLen, (int64_t)size - hdrLen, moov)) return false;
+            break;
+        }
+        pos += (int64_t)size;
+    }
+    if (moov.empty()) return false;
+
+    ForEachMp4Box(moov.data(), moov.size(), [&](const Mp4Box& b) {
+        if (b.type == FourCC("mvhd") && b.size >= 20) {
+            const uint8_t* d = b.data;
+            uint32_t timescale = (d[0] == 1) ? ReadBe32(d + 20) : ReadBe32(d + 12);
+            uint64_t duration = (d[0] == 1 && b.size >= 32) ? ReadBe64(d + 24) : ReadBe32(d + 16);
+            if (timescale > 0) info.durationUs = (int64_t)((double)duration * 1000000.0 / timescale);
+        } else if (b.type == FourCC("trak")) {
+            ParseMp4Trak(b, info);
+        }
+    });
+    return !info.streams.empty();
+}
+
+// ---- Matroska / WebM ----
+
+enum : uint32_t {
+    kMkvEbml = 0x1A45DFA3,
+    kMkvSegment = 0x18538067,
+    kMkvSeekHead = 0x114D9B74,
+    kMkvSeek = 0x4DBB,
+    kMkvSeekId = 0x53AB,
+    kMkvSeekPosition = 0x53AC,
+    kMkvInfo = 0x1549A966,
+    kMkvTimecodeScale = 0x2AD7B1,
+    kMkvDuration = 0x4489,
+    kMkvTracks = 0x1654AE6B,
+    kMkvTrackEntry = 0xAE,
+    kMkvTrackNumber = 0xD7,
+    kMkvTrackUid = 0x73C5,
+    kMkvTrackType = 0x83,
+    kMkvCodecId = 0x86,
+    kMkvDefaultDuration = 0x23E383,
+    kMkvVideo = 0xE0,
+    kMkvPixelWidth = 0xB0,
+    kMkvPixelHeight = 0xBA,
+    kMkvCluster = 0x1F43B675,
+    kMkvSimpleBlock = 0xA3,
+    kMkvBlockGroup = 0xA0,
+    kMkvBlock = 0xA1,
+    kMkvCues = 0x1C53BB6B,
+    kMkvCuePoint = 0xBB,
+    kMkvCueTrackPositions = 0xB7,
+    kMkvCueClusterPosition = 0xF1,
+    kMkvTags = 0x1254C367,
+    kMkvTag = 0x7373,
+    kMkvTargets = 0x63C0,
+    kMkvTagTrackUid = 0x63C5,
+    kMkvSimpleTag = 0x67C8,
+    kMkvTagName = 0x45A3,
+    kMkvTagString = 0x4487,
+};
+
+struct EbmlElement {
+    uint32_t id = 0;
+    int64_t dataPos = 0;  // absolute file offset of the payload
+    int64_t size = 0;     // payload size (unknown sizes are clamped to the parent)
+};
+
+// Reads an element header at pos. EBML IDs keep their length marker, sizes don't.
+static bool ReadEbmlHeader(ProbeReader& r, int64_t pos, int64_t limit, EbmlElement& el)
+{
+    uint8_t b[12];
+    size_t avail = (size_t)std::min<int64_t>(12, limit - pos);
+    if (avail < 2 || !r.Read(pos, b, avail)) return false;
+
+    int idLen = 1;
+    while (idLen <= 4 && !(b[0] & (0x80 >> (idLen - 1)))) idLen++;
+    if (idLen > 4 || (size_t)idLen >= avail) return false;
+    uint32_t id = 0;
+    for (int i = 0; i < idLen; ++i) id = (id << 8) | b[i];
+
+    const uint8_t* s = b + idLen;
+    int szLen = 1;
+    while (szLen <= 8 && !(s[0] & (0x80 >> (szLen - 1)))) szLen++;
+    if (szLen > 8 || (size_t)(idLen + szLen) > avail) return false;
+    uint64_t size = s[0] & (0xFF >> szLen);
+    bool unknown = (size == (0xFFull >> szLen));
+    for (int i = 1; i < szLen; ++i) {
+        size = (size << 8) | s[i];
+        if (s[i] != 0xFF) unknown = false;
+    }
+
+    el.id = id;
+    el.dataPos = pos + idLen + szLen;
+    el.size = (unknown || el.dataPos + (int64_t)size > limit) ? limit - el.dataPos : (int64_t)size;
+    return true;
+}
+
+template <class F>
+static void ForEachEbmlChild(ProbeReader& r, int64_t pos, int64_t end, F&& fn)
+{
+    EbmlElement el;
+    while (pos < end && ReadEbmlHeader(r, pos, end, el)) {
+        if (!fn(el)) return;
+        pos = el.dataPos + el.size;
+    }
+}
+
+static uint64_t ReadEbmlUint(ProbeReader& r, const EbmlElement& el)
+{
+    uint8_t b[8];
+    if (el.size <= 0 || el.size > 8 || !r.Read(el.dataPos, b, (size_t)el.size)) return 0;
+    uint64_t v = 0;
+    for (int64_t i = 0; i < el.size; ++i) v = (v << 8) | b[i];
+    return v;
+}
+
+static double ReadEbmlFloat(ProbeReader& r, const EbmlElement& el)
+{
+    uint8_t b[8];
+    if ((el.size != 4 && el.size != 8) || !r.Read(el.dataPos, b, (size_t)el.size)) return 0.0;
+    if (el.size == 4) {
+        uint32_t u = ReadBe32(b);
+        float f;
+        memcpy(&f, &u, 4);
+        return f;
+    }
+    uint64_t u = ReadBe64(b);
+    double d;
+    memcpy(&d, &u, 8);
+    return d;
+}
+
+static std::string ReadEbmlString(ProbeReader& r, const EbmlElement& el)
+{
+    std::vector<uint8_t> b;
+    if (el.size > 4096 || !r.ReadBlob(el.dataPos, el.size, b)) return {};
+    std::string s(b.begin(), b.end());
+    size_t nul = s.find('\0');
+    if (nul != std::string::npos) s.resize(nul);
+    return s;
+}
+
+// "HH:MM:SS.nnnnnnnnn" as written in Matroska DURATION tags.
+static int64_t ParseMkvDurationTag(const std::string& s)
+{
+    int h = 0, m = 0;
+    double sec = 0.0;
+    if (sscanf(s.c_str(), "%d:%d:%lf", &h, &m, &sec) != 3) return 0;
+    return (int64_t)(((h * 60.0 + m) * 60.0 + sec) * 1000000.0);
+}
+
+static bool ProbeMkv(ProbeReader& r, MediaInfo& info)
+{
+    EbmlElement head;
+    if (!ReadEbmlHeader(r, 0, r.size, head) || head.id != kMkvEbml) return false;
+    EbmlElement seg;
+    if (!ReadEbmlHeader(r, head.dataPos + head.size, r.size, seg) || seg.id != kMkvSegment) return false;
+    const int64_t segStart = seg.dataPos;
+    const int64_t segEnd = seg.dataPos + seg.size;
+
+    // Locate the top-level elements: SeekHead when present, plus a linear walk
+    // up to the first Cluster (which is where Info/Tracks normally live anyway).
+    int64_t infoPos = -1, tracksPos = -1, cuesPos = -1, tagsPos = -1, firstCluster = -1;
+    auto note = [&](uint32_t id, int64_t pos) {
+        if (id == kMkvInfo && infoPos < 0) infoPos = pos;
+        else if (id == kMkvTracks && tracksPos < 0) tracksPos = pos;
+        else if (id == kMkvCues && cuesPos < 0) cuesPos = pos;
+        else if (id == kMkvTags && tagsPos < 0) tagsPos = pos;
+    };
+    int64_t pos = segStart;
+    EbmlElement el;
+    while (pos < segEnd && ReadEbmlHeader(r, pos, segEnd, el)) {
+        if (el.id == kMkvCluster) {
+            firstCluster = pos;
+            break;
+        }
+        note(el.id, pos);
+        if (el.id == kMkvSeekHead) {
+            ForEachEbmlChild(r, el.dataPos, el.dataPos + el.size, [&](const EbmlElement& seek) {
+                if (seek.id != kMkvSeek) return true;
+                uint32_t id = 0;
+                int64_t at = -1;
+                ForEachEbmlChild(r, seek.dataPos, seek.dataPos + seek.size, [&](const EbmlElement& c) {
+                    if (c.id == kMkvSeekId) id = (uint32_t)ReadEbmlUint(r, c);
+                    else if (c.id == kMkvSeekPosition) at = segStart + (int64_t)ReadEbmlUint(r, c);
+                    return true;
+                });
+                if (at >= segStart && at < segEnd) note(id, at);
+                return true;
+            });
+        }
+        pos = el.dataPos + el.size;
+    }
+
+    uint64_t timecodeScale = 1000000; // ns per tick
+    double segDurationTicks = 0.0;
+    if (infoPos >= 0 && ReadEbmlHeader(r, infoPos, segEnd, el) && el.id == kMkvInfo) {
+        ForEachEbmlChild(r, el.dataPos, el.dataPos + el.size, [&](const EbmlElement& c) {
+            if (c.id == kMkvTimecodeScale) timecodeScale = ReadEbmlUint(r, c);
+            else if (c.id == kMkvDuration) segDurationTicks = ReadEbmlFloat(r, c);
+            return true;
+        });
+    }
+    info.durationUs = (int64_t)(segDurationTicks * (double)timecodeScale / 1000.0);
+
+    std::vector<uint64_t> trackNumbers, trackUids;
+    if (tracksPos >= 0 && ReadEbmlHeader(r, tracksPos, segEnd, el) && el.id == kMkvTracks) {
+        ForEachEbmlChild(r, el.dataPos, el.dataPos + el.size, [&](const EbmlElement& te) {
+            if (te.id != kMkvTrackEntry) return true;
+            MediaStreamInfo s;
+            uint64_t number = 0, uid = 0;
+            ForEachEbmlChild(r, te.dataPos, te.dataPos + te.size, [&](const EbmlElement& c) {
+                switch (c.id) {
+                case kMkvTrackNumber: number = ReadEbmlUint(r, c); break;
+                case kMkvTrackUid: uid = ReadEbmlUint(r, c); break;
+                case kMkvTrackType: {
+                    uint64_t t = ReadEbmlUint(r, c);
+                    s.type = (t == 1) ? 'v' : (t == 2) ? 'a' : (t == 17) ? 's' : '?';
+                    break;
+                }
+                case kMkvCodecId: s.codec = ReadEbmlString(r, c); break;
+                case kMkvDefaultDuration: {
+                    uint64_t ns = ReadEbmlUint(r, c);
+                    if (ns > 0) s.fps = 1e9 / (double)ns;
+                    break;
+                }
+                case kMkvVideo:
+                    ForEachEbmlChild(r, c.dataPos, c.dataPos + c.size, [&](const EbmlElement& v) {
+                        if (v.id == kMkvPixelWidth) s.width = (int)ReadEbmlUint(r, v);
+                        else if (v.id == kMkvPixelHeight) s.height = (int)ReadEbmlUint(r, v);
+                        return true;
+                    });
+                    break;
+                }
+                return true;
+            });
+            s.durationUs = info.durationUs;
+            trackNumbers.push_back(number);
+            trackUids.push_back(uid);
+            info.streams.push_back(s);
+            return true;
+        });
+    }
+    if (info.streams.empty()) return false;
+
+    // Statistics tags (mkvmerge: BPS/NUMBER_OF_BYTES, ffmpeg: DURATION) per track.
+    if (tagsPos >= 0 && ReadEbmlHeader(r, tagsPos, segEnd, el) && el.id == kMkvTags) {
+        ForEachEbmlChild(r, el.dataPos, el.dataPos + el.size, [&](const EbmlElement& tag) {
+            if (tag.id != kMkvTag) return true;
+            uint64_t targetUid = 0;
+            std::vector<std::pair<std::string, std::string>> simple;
+            ForEachEbmlChild(r, tag.dataPos, tag.dataPos + tag.size, [&](const EbmlElement& c) {
+                if (c.id == kMkvTargets) {
+                    ForEachEbmlChild(r, c.dataPos, c.dataPos + c.size, [&](const EbmlElement& t) {
+                        if (t.id == kMkvTagTrackUid) targetUid = ReadEbmlUint(r, t);
+                        return true;
+                    });
+                } else if (c.id == kMkvSimpleTag) {
+                    std::string name, value;
+                    ForEachEbmlChild(r, c.dataPos, c.dataPos + c.size, [&](const EbmlElement& t) {
+                        if (t.id == kMkvTagName) name = ReadEbmlString(r, t);
+                        else if (t.id == kMkvTagString) value = ReadEbmlString(r, t);
+                        return true;
+                    });
+                    simple.emplace_back(name, value);
+                }
+                return true;
+            });
+            for (size_t i = 0; i < trackUids.size(); ++i) {
+                if (targetUid == 0 || trackUids[i] != targetUid) continue;
+                MediaStreamInfo& s = info.streams[i];
+                for (const auto& kv : simple) {
+                    if (kv.first == "NUMBER_OF_BYTES") s.bytes = atoll(kv.second.c_str());
+                    else if (kv.first == "BPS") s.bitrateKbps = atof(kv.second.c_str()) / 1000.0;
+                    else if (kv.first == "DURATION") {
+                        int64_t us = ParseMkvDurationTag(kv.second);
+                        if (us > 0) s.durationUs = us;
+                    }
+                }
+                if (s.bitrateKbps <= 0.0) s.bitrateKbps = BitrateKbps(s.bytes, s.durationUs);
+            }
+            return true;
+        });
+    }
+
+    bool haveRates = true;
+    for (const auto& s : info.streams) {
+        if (s.bitrateKbps <= 0.0 && s.type != 's') haveRates = false;
+    }
+    if (haveRates || info.durationUs <= 0) return true;
+
+    // No statistics: measure each track's share of block bytes over a spread of
+    // clusters (from Cues, else the first few clusters) and scale the segment size.
+    std::vector<int64_t> clusters;
+    if (cuesPos >= 0 && ReadEbmlHeader(r, cuesPos, segEnd, el) && el.id == kMkvCues) {
+        ForEachEbmlChild(r, el.dataPos, el.dataPos + el.size, [&](const EbmlElement& cp) {
+            if (cp.id != kMkvCuePoint) return true;
+            ForEachEbmlChild(r, cp.dataPos, cp.dataPos + cp.size, [&](const EbmlElement& tp) {
+                if (tp.id != kMkvCueTrackPositions) return true;
+                ForEachEbmlChild(r, tp.dataPos, tp.dataPos + tp.size, [&](const EbmlElement& c) {
+                    if (c.id == kMkvCueClusterPosition) clusters.push_back(segStart + (int64_t)ReadEbmlUint(r, c));
+                    return true;
+                });
+                return true;
+            });
+            return true;
+        });
+        std::sort(clusters.begin(), clusters.end());
+        clusters.erase(std::unique(clusters.begin(), clusters.end()), clusters.end());
+    }
+    const size_t kSampleClusters = 32;
+    std::vector<int64_t> sample;
+    if (clusters.size() > kSampleClusters) {
+        for (size_t i = 0; i < kSampleClusters; ++i) sample.push_back(clusters[i * clusters.size() / kSampleClusters]);
+    } else if (!clusters.empty()) {
+        sample = clusters;
+    } else if (firstCluster >= 0) {
+        int64_t p = firstCluster;
+        while (sample.size() < kSampleClusters && p < segEnd && ReadEbmlHeader(r, p, segEnd, el) && el.id == kMkvCluster) {
+            sample.push_back(p);
+            p = el.dataPos + el.size;
+        }
+    }
+
+    std::vector<int64_t> trackBytes(info.streams.size(), 0);
+    int64_t totalBytes = 0;
+    auto countBlock = [&](const EbmlElement& blk) {
+        uint8_t b[8];
+        size_t n = (size_t)std::min<int64_t>(8, blk.size);
+        if (n == 0 || !r.Read(blk.dataPos, b, n)) return;
+        int len = 1;
+        while (len <= 8 && !(b[0] & (0x80 >> (len - 1)))) len++;
+        if ((size_t)len > n) return;
+        uint64_t track = b[0] & (0xFF >> len);
+        for (int i = 1; i < len; ++i) track = (track << 8) | b[i];
+        for (size_t i = 0; i < trackNumbers.size(); ++i) {
+            if (trackNumbers[i] == track) trackBytes[i] += blk.size;
+        }
+        totalBytes += blk.size;
+    };
+    for (int64_t cpos : sample) {
+        EbmlElement cl;
+        if (!ReadEbmlHeader(r, cpos, segEnd, cl) || cl.id != kMkvCluster) continue;
+        ForEachEbmlChild(r, cl.dataPos, cl.dataPos + cl.size, [&](const EbmlElement& c) {
+            if (c.id == kMkvSimpleBlock) {
+                countBlock(c);
+            } else if (c.id == kMkvBlockGroup) {
+                ForEachEbmlChild(r, c.dataPos, c.dataPos + c.size, [&](const EbmlElement& g) {
+                    if (g.id == kMkvBlock) countBlock(g);
+                    return true;
+                });
+            }
+            return true;
+        });
+    }
+    if (totalBytes <= 0) return true;
+
+    int64_t mediaBytes = segEnd - (firstCluster >= 0 ? firstCluster : segStart);
+    for (size_t i = 0; i < info.streams.size(); ++i) {
+        MediaStreamInfo& s = info.streams[i];
+        if (s.bitrateKbps > 0.0) continue;
+        s.bytes = (int64_t)((double)mediaBytes * (double)trackBytes[i] / (double)totalBytes);
+        s.bitrateKbps = BitrateKbps(s.bytes, info.durationUs);
+    }
+    return true;
+}
+
+// Probes an MP4/MOV or Matroska/WebM file in-process. False for other
+// containers or damaged files; callers fall back to the slower paths.
+static bool ProbeMediaFile(const std::wstring& path, MediaInfo& info)
+{
+    info = MediaInfo{};
+    ProbeReader r;
+    if (!r.Open(path)) return false;
+    info.fileBytes = r.size;
+
+    uint8_t magic[8];
+    if (!r.Read(0, magic, sizeof(magic))) return false;
+    if (ReadBe32(magic) == kMkvEbml) return ProbeMkv(r, info);
+    return ProbeMp4(r, info);
+}
+
+// ----------------------------
+// Encoding (ffmpeg + libplacebo)
+// ----------------------------
+#ifdef _WIN32
+static bool GetMpvVideoSize(int& w, int& h)
+{
+    w = h = 0;
+    if (!g_mpv) return false;
+
+    // mpv properties "width"/"height" refer to current video size
+    mpv_get_property(g_mpv, "width", MPV_FORMAT_INT64, &w);
+    mpv_get_property(g_mpv, "height", MPV_FORMAT_INT64, &h);
+    return (w > 0 && h > 0);
+}
+#endif
+
+// ----------------------------
+// Media probe cache
+// ----------------------------
+// Probes run on a small worker pool, never on the caller's thread. Results are
+// kept in memory and appended to probe_cache.bin, keyed by (path, size, mtime),
+// so re-opening or re-queuing known files costs one stat each. Concurrent
+// requests for a file that is still being probed share the one in flight.
+struct MediaProbeResult {
+    bool ok = false;
+    MediaInfo info;
+};
+
+struct MediaProbeEntry {
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    MediaProbeResult result;
+};
+
+static const char kProbeCacheMagic[8] = { 'V', 'F', 'X', 'P', 'R', 'B', '0', '1' };
+
+static std::mutex g_probeMutex;
+static bool g_probeCacheLoaded = false;
+static size_t g_probeCacheRecords = 0; // records in the file, including superseded ones
+static std::unordered_map<std::string, MediaProbeEntry> g_probeCache;                    // by path
+static std::unordered_map<std::string, std::shared_future<MediaProbeResult>> g_probeInflight; // by path|size|mtime
+
+static std::mutex g_probeQueueMutex;
+static std::condition_variable g_probeQueueCv;
+static std::deque<std::function<void()>> g_probeQueue;
+static int g_probeWorkers = 0;
+
+static std::wstring GetProbeCachePath()
+{
+    return JoinPath(GetAppDataDir(), L"probe_cache.bin");
+}
+
+// Little-endian record encoding for the probe cache.
+struct BinWriter {
+    std::string buf;
+    void Raw(const void* p, size_t n) { buf.append((const char*)p, n); }
+    void U8(uint8_t v) { Raw(&v, 1); }
+    void U16(uint16_t v) { uint8_t b[2] = { (uint8_t)v, (uint8_t)(v >> 8) }; Raw(b, 2); }
+    void U32(uint32_t v) { U16((uint16_t)v); U16((uint16_t)(v >> 16)); }
+    void U64(uint64_t v) { U32((uint32_t)v); U32((uint32_t)(v >> 32)); }
+    void F64(double v) { uint64_t u; memcpy(&u, &v, 8); U64(u); }
+    void Str(const std::string& s) { U16((uint16_t)std::min<size_t>(s.size(), 0xFFFF)); Raw(s.data(), std::min<size_t>(s.size(), 0xFFFF)); }
+};
+
+struct BinReader {
+    const uint8_t* p = nullptr;
+    const uint8_t* end = nullptr;
+    bool ok = true;
+    bool Need(size_t n) { if ((size_t)(end - p) < n) ok = false; return ok; }
+    uint8_t U8() { if (!Need(1)) return 0; return *p++; }
+    uint16_t U16() { if (!Need(2)) return 0; uint16_t v = (uint16_t)(p[0] | (p[1] << 8)); p += 2; return v; }
+    uint32_t U32() { uint32_t lo = U16(); return lo | ((uint32_t)U16() << 16); }
+    uint64_t U64() { uint64_t lo = U32(); return lo | ((uint64_t)U32() << 32); }
+    double F64() { uint64_t u = U64(); double d; memcpy(&d, &u, 8); return d; }
+    std::string Str() { uint16_t n = U16(); if (!Need(n)) return {}; std::string s((const char*)p, n); p += n; return s; }
+};
+
+static void EncodeProbeRecord(BinWriter& w, const std::string& path, const MediaProbeEntry& e)
+{
+    BinWriter body;
+    body.Str(path);
+    body.U64(e.size);
+    body.U64((uint64_t)e.mtime);
+    body.U8(e.result.ok ? 1 : 0);
+    body.U64((uint64_t)e.result.info.durationUs);
+    body.U64((uint64_t)e.result.info.fileBytes);
+    body.U8((uint8_t)std::min<size_t>(e.result.info.streams.size(), 255));
+    for (size_t i = 0; i < e.result.info.streams.size() && i < 255; ++i) {
+        const MediaStreamInfo& s = e.result.info.streams[i];
+        body.U8((uint8_t)s.type);
+        body.Str(s.codec);
+        body.U32((uint32_t)s.width);
+        body.U32((uint32_t)s.height);
+        body.F64(s.fps);
+        body.U64((uint64_t)s.durationUs);
+        body.U64((uint64_t)s.bytes);
+        body.F64(s.bitrateKbps);
+    }
+    w.U32((uint32_t)body.buf.size());
+    w.buf += body.buf;
+}
+
+static bool DecodeProbeRecord(BinReader& r, std::string& path, MediaProbeEntry& e)
+{
+    path = r.Str();
+    e.size = r.U64();
+    e.mtime = (int64_t)r.U64();
+    e.result.ok = r.U8() != 0;
+    e.result.info.durationUs = (int64_t)r.U64();
+    e.result.info.fileBytes = (int64_t)r.U64();
+    uint8_t count = r.U8();
+    e.result.info.streams.clear();
+    for (uint8_t i = 0; i < count && r.ok; ++i) {
+        MediaStreamInfo s;
+        s.type = (char)r.U8();
+        s.codec = r.Str();
+        s.width = (int)r.U32();
+        s.height = (int)r.U32();
+        s.fps = r.F64();
+        s.durationUs = (int64_t)r.U64();
+        s.bytes = (int64_t)r.U64();
+        s.bitrateKbps = r.F64();
+        e.result.info.streams.push_back(s);
+    }
+    return r.ok;
+}
+
+static void RewriteProbeCacheLocked()
+{
+    BinWriter w;
+    w.Raw(kProbeCacheMagic, sizeof(kProbeCacheMagic));
+    for (const auto& kv : g_probeCache) EncodeProbeRecord(w, kv.first, kv.second);
+    std::ofstream o(FsPath(GetProbeCachePath()), std::ios::binary | std::ios::trunc);
+    if (o) o.write(w.buf.data(), (std::streamsize)w.buf.size());
+    g_probeCacheRecords = g_probeCache.size();
+}
+
+static void LoadProbeCacheLocked()
+{
+    if (g_probeCacheLoaded) return;
+    g_probeCacheLoaded = true;
+
+    std::string data;
+    if (!ReadTextFile(GetProbeCachePath(), data)) return;
+    if (data.size() < sizeof(kProbeCacheMagic) || memcmp(data.data(), kProbeCacheMagic, sizeof(kProbeCacheMagic)) != 0) {
+        RewriteProbeCacheLocked(); // unknown/old format: start over
+        return;
+    }
+
+    BinReader r;
+    r.p = (const uint8_t*)data.data() + sizeof(kProbeCacheMagic);
+    r.end = (const uint8_t*)data.data() + data.size();
+    while (r.ok && r.p < r.end) {
+        uint32_t len = r.U32();
+        if (!r.Need(len)) break; // torn tail from a crash mid-append
+        BinReader rec;
+        rec.p = r.p;
+        rec.end = r.p + len;
+        r.p += len;
+        std::string path;
+        MediaProbeEntry e;
+        if (DecodeProbeRecord(rec, path, e)) {
+            g_probeCache[path] = std::move(e); // later records supersede earlier ones
+            g_probeCacheRecords++;
+        }
+    }
+
+    // The file is append-only; compact it once superseded records dominate.
+    if (g_probeCacheRecords > 2 * g_probeCache.size() + 64 || !r.ok) {
+        RewriteProbeCacheLocked();
+    }
+}
+
+static void AppendProbeRecordLocked(const std::string& path, const MediaProbeEntry& e)
+{
+    BinWriter w;
+    std::error_code ec;
+    if (!std::filesystem::exists(FsPath(GetProbeCachePath()), ec)) {
+        w.Raw(kProbeCacheMagic, sizeof(kProbeCacheMagic));
+    }
+    EncodeProbeRecord(w, path, e);
+    std::ofstream o(FsPath(GetProbeCachePath()), std::ios::binary | std::ios::app);
+    if (o) o.write(w.buf.data(), (std::streamsize)w.buf.size());
+    g_probeCacheRecords++;
+}
+
+// "Duration: 00:01:02.50," from ffmpeg's input banner.
+static int64_t ParseDurationUs(const std::string& text)
+{
+    size_t pos = text.find("Duration:");
+    if (pos == std::string::npos) return 0;
+    int h = 0, m = 0;
+    double s = 0.0;
+    if (sscanf(text.c_str() + pos + 9, " %d:%d:%lf", &h, &m, &s) != 3) return 0;
+    return (int64_t)(((h * 60.0 + m) * 60.0 + s) * 1000000.0);
+}
+
+// Containers the native probe doesn't handle: one ffmpeg -i for duration and
+// the container bitrate (which includes audio).
+static bool ProbeMediaWithFfmpeg(const std::wstring& path, MediaInfo& info)
+{
+    std::wstring ffmpeg;
+    if (!FindFfmpeg(ffmpeg)) return false;
+    std::string output;
+    RunProcessStreaming(Quote(ffmpeg) + L" -hide_banner -i " + Quote(path), L"", [&](const char* data, size_t n) {
+        output.append(data, data + n);
+        return true;
+    });
+    info.durationUs = ParseDurationUs(output);
+    int kbps = ParseBitrateKbps(output);
+    if (info.durationUs <= 0 && kbps <= 0) return false;
+    MediaStreamInfo v;
+    v.type = 'v';
+    v.durationUs = info.durationUs;
+    v.bitrateKbps = kbps;
+    info.streams.push_back(v);
+    return true;
+}
+
+static void EnqueueProbeJob(std::function<void()> job)
+{
+    std::lock_guard<std::mutex> lock(g_probeQueueMutex);
+    g_probeQueue.push_back(std::move(job));
+    int maxWorkers = std::clamp((int)std::thread::hardware_concurrency(), 2, 8);
+    if (g_probeWorkers < maxWorkers && g_probeWorkers < (int)g_probeQueue.size()) {
+        g_probeWorkers++;
+        std::thread([]() {
+            while (true) {
+                std::function<void()> next;
+                {
+                    std::unique_lock<std::mutex> lock(g_probeQueueMutex);
+                    g_probeQueueCv.wait(lock, []() { return !g_probeQueue.empty(); });
+                    next = std::move(g_probeQueue.front());
+                    g_probeQueue.pop_front();
+                }
+                next();
+            }
+        }).detach();
+    }
+    g_probeQueueCv.notify_one();
+}
+
+// Returns a future for the probe of `path`: ready immediately on a cache hit,
+// otherwise shared with any probe of the same file version already running.
+static std::shared_future<MediaProbeResult> ProbeMediaAsync(const std::wstring& path)
+{
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    if (!StatFile(path, size, mtime)) {
+        std::promise<MediaProbeResult> missing;
+        missing.set_value(MediaProbeResult{});
+        return missing.get_future().share();
+    }
+
+    std::string key = WideToUtf8(path);
+    std::string flightKey = key + "|" + std::to_string(size) + "|" + std::to_string(mtime);
+
+    std::lock_guard<std::mutex> lock(g_probeMutex);
+    LoadProbeCacheLocked();
+
+    auto hit = g_probeCache.find(key);
+    if (hit != g_probeCache.end() && hit->second.size == size && hit->second.mtime == mtime) {
+        std::promise<MediaProbeResult> ready;
+        ready.set_value(hit->second.result);
+        return ready.get_future().share();
+    }
+    auto inflight = g_probeInflight.find(flightKey);
+    if (inflight != g_probeInflight.end()) return inflight->second;
+
+    auto promise = std::make_shared<std::promise<MediaProbeResult>>();
+    std::shared_future<MediaProbeResult> fut = promise->get_future().share();
+    g_probeInflight[flightKey] = fut;
+
+    EnqueueProbeJob([path, key, flightKey, size, mtime, promise]() {
+        MediaProbeEntry e;
+        e.size = size;
+        e.mtime = mtime;
+        e.result.ok = ProbeMediaFile(path, e.result.info) || ProbeMediaWithFfmpeg(path, e.result.info);
+        {
+            std::lock_guard<std::mutex> lock(g_probeMutex);
+            g_probeCache[key] = e;
+            g_probeInflight.erase(flightKey);
+            AppendProbeRecordLocked(key, e);
+        }
+        promise->set_value(e.result);
+    });
+    return fut;
+}
+
+static void PrefetchMediaProbe(const std::wstring& path)
+{
+    ProbeMediaAsync(path);
+}
+
+static int KbpsToMbps(double kbps)
+{
+    int mbps = (int)((kbps + 500.0) / 1000.0);
+    return (mbps < 1) ? 1 : mbps;
+}
+
+// Video bitrate of a file from the (cached) probe: the video stream's own rate
+// when the container tells us, else size over duration.
+static int EstimateVideoBitrateMbps(const std::wstring& path, double durationSec)
+{
+    MediaProbeResult probe = ProbeMediaAsync(path).get();
+    if (probe.ok) {
+        const MediaStreamInfo* v = probe.info.FirstVideo();
+        if (v && v->bitrateKbps > 0.0) return KbpsToMbps(v->bitrateKbps);
+        if (durationSec <= 0.0) durationSec = probe.info.durationUs / 1000000.0;
+    }
+
+    // Fallback: estimate from file size and duration
+    std::error_code ec;
+    auto size = std::filesystem::file_size(FsPath(path), ec);
+    if (!ec && durationSec > 0.0) {
+        double bits = (double)size * 8.0;
+        return KbpsToMbps((bits / durationSec) / 1000.0);
+    }
+    return 0;
+}
+
+// Live bitrate from mpv if playback has measured one; 0 otherwise (the caller
+// then resolves it from the probe cache off the UI thread).
+#ifdef _WIN32
+static int GetMpvVideoBitrateMbps()
+{
+    if (!g_mpv) return 0;
+    int64_t bps = 0;
+    if (mpv_get_property(g_mpv, "video-bitrate", MPV_FORMAT_INT64, &bps) >= 0 && bps > 0) {
+        return KbpsToMbps(bps / 1000.0);
+    }
+    return 0;
+}
+
+// One-off status line messages from worker threads (job results). Headless
+// runs have no window; they report per job instead. Running jobs publish
+// through the progress table below, not here.
+static void PostStatus(const std::wstring& msg)
+{
+    if (!g_hwndMain) return;
+    auto* p = new std::wstring(msg);
+    if (!PostMessageW(g_hwndMain, WM_APP + 1, 0, (LPARAM)p)) delete p; // window gone
+}
+#endif
+
+// ----------------------------
+// Job progress table
+// ----------------------------
+// Progress used to be a heap-allocated string per tick posted to the window,
+// leaked if the window was gone, and the status line showed whichever job
+// posted last. Each running job now owns a slot in a fixed table and writes
+// typed progress into it under a sequence lock: no allocation, no locks, no
+// messages. Consumers (the window's status timer, batch --progress, the
+// service's status op) read the table at their own pace, so any number of
+// ticks between two reads coalesce into the latest one.
+static const int kProgressSlots = 64;
+static const int kProgressNameLen = 64;
+static const int kProgressTextLen = 96;
+
+struct ProgressSlot {
+    std::atomic<uint32_t> seq{0};   // odd while a writer is inside
+    std::atomic<bool> claimed{false};
+    std::atomic<bool> active{false}; // written under seq, like the rest
+    std::atomic<uint64_t> jobId{0};
+    std::atomic<double> pct{-1.0};   // -1 = a stage without one ("Joining segments...")
+    std::atomic<double> fps{0.0};
+    std::atomic<double> speed{0.0};
+    std::atomic<double> etaSec{-1.0};
+    std::atomic<wchar_t> name[kProgressNameLen];
+    std::atomic<wchar_t> text[kProgressTextLen];
+};
+
+static ProgressSlot g_progressSlots[kProgressSlots];
+
+struct ProgressSnapshot {
+    uint64_t jobId = 0;
+    std::wstring name;  // input file name
+    std::wstring text;  // "Encoding (hevc_nvenc)...", "Joining segments..."
+    double pct = -1.0;
+    double fps = 0.0;
+    double speed = 0.0;
+    double etaSec = -1.0;
+};
+
+// Concatenates parts into a slot string, truncating at cap.
+static void StoreProgressText(std::atomic<wchar_t>* dst, int cap, std::initializer_list<const wchar_t*> parts)
+{
+    int n = 0;
+    for (const wchar_t* part : parts) {
+        for (; *part && n < cap - 1; ++part) dst[n++].store(*part, std::memory_order_relaxed);
+    }
+    dst[n].store(L'\0', std::memory_order_relaxed);
+}
+
+// Enters the slot's write section. A slot busy with another of the job's
+// threads (parallel segments) makes a tick skip instead of waiting, since the
+// next tick supersedes it; stage changes and slot hand-over wait.
+static bool BeginProgressWrite(ProgressSlot& s, bool wait)
+{
+    for (;;) {
+        uint32_t seq = s.seq.load(std::memory_order_relaxed);
+        if (!(seq & 1) && s.seq.compare_exchange_weak(seq, seq + 1, std::memory_order_relaxed)) break;
+        if (!wait) return false;
+        std::this_thread::yield();
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    return true;
+}
+
+static void EndProgressWrite(ProgressSlot& s)
+{
+    s.seq.fetch_add(1, std::memory_order_release);
+}
+
+// Claims a slot for a job; -1 if all are taken (the job then runs without
+// reporting progress).
+static int AcquireProgressSlot(uint64_t jobId, const std::wstring& name)
+{
+    for (int i = 0; i < kProgressSlots; ++i) {
+        ProgressSlot& s = g_progressSlots[i];
+        bool expected = false;
+        if (!s.claimed.compare_exchange_strong(expected, true, std::memory_order_acquire)) continue;
+        BeginProgressWrite(s, true);
+        s.active.store(true, std::memory_order_relaxed);
+        s.jobId.store(jobId, std::memory_order_relaxed);
+        s.pct.store(-1.0, std::memory_order_relaxed);
+        s.fps.store(0.0, std::memory_order_relaxed);
+        s.speed.store(0.0, std::memory_order_relaxed);
+        s.etaSec.store(-1.0, std::memory_order_relaxed);
+        StoreProgressText(s.name, kProgressNameLen, { name.c_str() });
+        StoreProgressText(s.text, kProgressTextLen, { L"Starting..." });
+        EndProgressWrite(s);
+        return i;
+    }
+    return -1;
+}
+
+static void ReleaseProgressSlot(int slot)
+{
+    if (slot < 0) return;
+    ProgressSlot& s = g_progressSlots[slot];
+    BeginProgressWrite(s, true);
+    s.active.store(false, std::memory_order_relaxed);
+    EndProgressWrite(s);
+    s.claimed.store(false, std::memory_order_release);
+}
+
+// One encode tick, shown as "Encoding (<label>)... pct  fps  speed  ETA".
+static void PublishProgress(int slot, const std::wstring& label, double pct, double fps, double speed, double etaSec)
+{
+    if (slot < 0) return;
+    ProgressSlot& s = g_progressSlots[slot];
+    if (!BeginProgressWrite(s, false)) return;
+    s.pct.store(std::clamp(pct, 0.0, 100.0), std::memory_order_relaxed);
+    s.fps.store(fps, std::memory_order_relaxed);
+    s.speed.store(speed, std::memory_order_relaxed);
+    s.etaSec.store(etaSec, std::memory_order_relaxed);
+    StoreProgressText(s.text, kProgressTextLen, { L"Encoding (", label.c_str(), L")..." });
+    EndProgressWrite(s);
+}
+
+// A phase without a percentage ("Splitting at keyframes...").
+static void PublishStage(int slot, const std::wstring& text)
+{
+    if (slot < 0) return;
+    ProgressSlot& s = g_progressSlots[slot];
+    BeginProgressWrite(s, true);
+    s.pct.store(-1.0, std::memory_order_relaxed);
+    s.etaSec.store(-1.0, std::memory_order_relaxed);
+    StoreProgressText(s.text, kProgressTextLen, { text.c_str() });
+    EndProgressWrite(s);
+}
+
+static std::wstring LoadProgressText(const std::atomic<wchar_t>* src, int cap)
+{
+    wchar_t buf[kProgressTextLen > kProgressNameLen ? kProgressTextLen : kProgressNameLen];
+    int n = 0;
+    for (; n < cap - 1; ++n) {
+        buf[n] = src[n].load(std::memory_order_relaxed);
+        if (!buf[n]) break;
+    }
+    return std::wstring(buf, n);
+}
+
+// Consistent copies of the running jobs' slots. Never blocks writers; a slot
+// that keeps changing under the reader is skipped until the next call.
+static std::vector<ProgressSnapshot> SnapshotProgress()
+{
+    std::vector<ProgressSnapshot> out;
+    for (ProgressSlot& s : g_progressSlots) {
+        if (!s.claimed.load(std::memory_order_acquire)) continue;
+        for (int attempt = 0; attempt < 8; ++attempt) {
+            uint32_t before = s.seq.load(std::memory_order_acquire);
+            if (before & 1) {
+                std::this_thread::yield();
+                continue;
+            }
+            ProgressSnapshot p;
+            bool active = s.active.load(std::memory_order_relaxed);
+            p.jobId = s.jobId.load(std::memory_order_relaxed);
+            p.pct = s.pct.load(std::memory_order_relaxed);
+            p.fps = s.fps.load(std::memory_order_relaxed);
+            p.speed = s.speed.load(std::memory_order_relaxed);
+            p.etaSec = s.etaSec.load(std::memory_order_relaxed);
+            p.name = LoadProgressText(s.name, kProgressNameLen);
+            p.text = LoadProgressText(s.text, kProgressTextLen);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (s.seq.load(std::memory_order_relaxed) != before) continue;
+            if (active) out.push_back(std::move(p));
+            break;
+        }
+    }
+    return out;
+}
+
+// "Encoding (x264)... 42.0%  120.0 fps  4.00x  ETA 0:00:05" (the old status
+// line); short: "a.mp4 42.0%" or "a.mp4: Joining segments...".
+static std::wstring FormatProgress(const ProgressSnapshot& p, bool shortForm)
+{
+    if (p.pct < 0.0) return shortForm ? p.name + L": " + p.text : p.text;
+    wchar_t buf[128];
+    if (shortForm) {
+        swprintf_s(buf, L" %.1f%%", p.pct);
+        return p.name + buf;
+    }
+    int n = swprintf_s(buf, L" %.1f%%", p.pct);
+    if (n > 0 && p.fps > 0.0) n += swprintf(buf + n, 128 - n, L"  %.1f fps  %.2fx", p.fps, p.speed);
+    if (n > 0 && p.etaSec >= 0.0) {
+        int eta = (int)(p.etaSec + 0.5);
+        swprintf(buf + n, 128 - n, L"  ETA %d:%02d:%02d", eta / 3600, (eta / 60) % 60, eta % 60);
+    }
+    return p.text + buf;
+}
+
+// The status line for every running job: the full line for one, a short
+// entry each for several.
+static std::wstring FormatProgressLine(const std::vector<ProgressSnapshot>& jobs)
+{
+    if (jobs.size() == 1) return FormatProgress(jobs[0], false);
+    std::wstring line;
+    for (const auto& p : jobs) line += (line.empty() ? L"" : L"  |  ") + FormatProgress(p, true);
+    return line;
+}
+
+// A stretch of the input to encode on its own (preview encodes), in seconds.
+struct PreviewRange {
+    double inSec = 0.0;
+    double outSec = 0.0;
+};
+
+// Extra shaders run after the chain over part of the input.
+struct SceneChain {
+    double inSec = 0.0;
+    double outSec = 0.0;
+    std::vector<std::wstring> shaders;
+};
+
+struct SceneVf {
+    double inSec = 0.0;
+    double outSec = 0.0;
+    std::wstring vf;
+};
+
+// Everything the encode thread needs, captured by value so the UI can keep
+// changing globals (or load another video) while a job runs.
+struct EncodeJob {
+    std::wstring ffmpeg;
+    std::wstring input;
+    std::wstring output;
+    std::wstring vf;
+    std::wstring vfInProcess; // vf with absolute paths, for the in-process engine
+    std::wstring workDir;
+    std::wstring logPath;
+    std::wstring shaderError; // set by PrepareEncodeJob; the job fails without running
+    std::vector<std::wstring> encoders;
+    int targetMbps = 0;
+    double durationSec = 0.0;
+    int segmentWorkers = 0; // 0 = one ffmpeg process for the whole file
+    bool checkpoint = false; // keep finished segments across failures and restarts
+    bool dispatch = false;   // run lanes (or every available encoder) at once
+    std::vector<std::wstring> lanes; // "enc" or "enc:preset"
+    OutputTarget target;
+    std::vector<PreviewRange> previewRanges; // non-empty: encode only these
+    int previewSamples = 0;  // or spread this many samples around previewAt
+    double previewAt = 0.0;
+    std::vector<SceneVf> scenes;                   // segments mostly inside one use its vf
+    std::vector<CombinedShaderRef> sceneShaders;   // held until the job ends
+    bool smart = false;      // reuse the previous output's unchanged segments
+
+    // Native CPU grade, when every active shader is one it understands.
+    bool cpuGradeOk = false;
+    bool preferCpuGrade = false;
+    bool preferLut = false;   // bake cpuGrade into a 3D LUT and use lut3d instead
+    bool cpuFallback = true;  // grade on the CPU if libplacebo can't start (off for benchmarks)
+    int engineRan = -1;       // set by RunEncodeJob, numbered like EncodeRequest::engine
+    int srcWidth = 0;
+    int srcHeight = 0;
+    std::vector<CpuGradeParams> cpuGrade;
+
+    uint64_t progressId = 0; // the caller's id for the job in the progress table
+    int progressSlot = -1;   // held while RunEncodeJob runs; -1 = table full
+
+    // Set from any thread to stop the job: checked per frame in-process and on
+    // every chunk of ffmpeg output. Shared so the job stays copyable.
+    std::shared_ptr<std::atomic<bool>> cancel = std::make_shared<std::atomic<bool>>(false);
+};
+
+// ----------------------------
+// Encode log (async ring buffer)
+// ----------------------------
+// The pipe readers used to WriteFile every chunk themselves, so a slow disk or
+// a chatty filter stalled them and back-pressured ffmpeg. Writers now copy the
+// chunk into a fixed ring of slots (a bounded MPMC sequence queue, no locks)
+// and a background thread flushes in batches. A full ring drops the chunk and
+// counts it instead of waiting. Files rotate at g_logMaxMB, keeping g_logKeep
+// old generations (<name>.1.log is the newest).
+static std::wstring GetLogDir()
+{
+    return g_logDir.empty() ? JoinPath(GetExeDir(), L"logs") : g_logDir;
+}
+
+struct EncodeLog {
+    static constexpr size_t kSlotBytes = 4096;
+    static constexpr size_t kSlots = 512; // power of two; 2 MB in flight
+
+    struct Slot {
+        std::atomic<size_t> seq{0};
+        uint32_t n = 0;
+        char data[kSlotBytes];
+    };
+
+    std::unique_ptr<Slot[]> slots;
+    std::atomic<size_t> enqueuePos{0};
+    size_t dequeuePos = 0; // writer thread only
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<bool> pending{false};
+    std::atomic<bool> stop{false};
+    std::mutex wakeMutex;
+    std::condition_variable wake;
+    std::thread writer;
+
+    std::filesystem::path path;
+    FILE* file = nullptr;
+    uint64_t fileBytes = 0;
+    uint64_t maxBytes = 0;
+    int keep = 0;
+
+    ~EncodeLog() { Close(); }
+
+    bool Open(const std::wstring& p, uint64_t maxFileBytes, int keepFiles)
+    {
+        path = FsPath(p);
+        maxBytes = maxFileBytes;
+        keep = keepFiles;
+        std::error_code ec;
+        std::filesystem::create_directories(path.parent_path(), ec);
+        if (!Reopen()) return false;
+
+        slots.reset(new Slot[kSlots]);
+        for (size_t i = 0; i < kSlots; ++i) slots[i].seq.store(i, std::memory_order_relaxed);
+        writer = std::thread([this]() { Run(); });
+        return true;
+    }
+
+    // Never blocks: whatever doesn't fit in the ring is dropped and counted.
+    void Write(const char* data, size_t n)
+    {
+        if (!slots) return;
+        while (n > 0) {
+            size_t take = std::min(n, kSlotBytes);
+            if (!TryPush(data, take)) {
+                dropped.fetch_add(n, std::memory_order_relaxed);
+                break;
+            }
+            data += take;
+            n -= take;
+        }
+        if (!pending.exchange(true, std::memory_order_acq_rel)) wake.notify_one();
+    }
+
+    void WriteLine(const std::wstring& line)
+    {
+        std::string utf8 = WideToUtf8(line);
+        Write(utf8.data(), utf8.size());
+    }
+
+    // Flushes everything written so far; call once the producers are done.
+    void Close()
+    {
+        if (!writer.joinable()) return;
+        stop.store(true, std::memory_order_release);
+        wake.notify_one();
+        writer.join();
+        if (file) fclose(file);
+        file = nullptr;
+    }
+
+    // Not inherited by the ffmpeg children (they get inheritable pipe ends).
+    bool Reopen(const std::filesystem::path& p, bool append = false)
+    {
+#ifdef _WIN32
+        file = _wfsopen(p.wstring().c_str(), append ? L"abN" : L"wbN", _SH_DENYWR);
+#else
+        file = fopen(p.c_str(), append ? "abe" : "wbe");
+#endif
+        fileBytes = 0;
+        return file != nullptr;
+    }
+
+    bool Reopen() { return Reopen(path); }
+
+    bool TryPush(const char* data, size_t n)
+    {
+        size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        Slot* s = nullptr;
+        while (true) {
+            s = &slots[pos & (kSlots - 1)];
+            size_t seq = s->seq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+            if (dif == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (dif < 0) {
+                return false; // full
+            } else {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        memcpy(s->data, data, n);
+        s->n = (uint32_t)n;
+        s->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool TryPop(std::string& batch)
+    {
+        Slot& s = slots[dequeuePos & (kSlots - 1)];
+        if (s.seq.load(std::memory_order_acquire) != dequeuePos + 1) return false;
+        batch.append(s.data, s.n);
+        s.seq.store(dequeuePos + kSlots, std::memory_order_release);
+        dequeuePos++;
+        return true;
+    }
+
+    void Run()
+    {
+        std::string batch;
+        batch.reserve(kSlotBytes * 64);
+        while (true) {
+            bool stopping = stop.load(std::memory_order_acquire);
+            pending.store(false, std::memory_order_release);
+            while (TryPop(batch)) {
+                if (batch.size() >= kSlotBytes * 64) Flush(batch);
+            }
+            if (uint64_t lost = dropped.exchange(0, std::memory_order_relaxed)) {
+                batch += "\r\n[log: " + std::to_string(lost) + " bytes dropped, writer fell behind]\r\n";
+            }
+            Flush(batch);
+            if (stopping) break;
+            std::unique_lock<std::mutex> lock(wakeMutex);
+            // Timed, since producers notify without taking the lock.
+            wake.wait_for(lock, std::chrono::milliseconds(100), [&]() {
+                return pending.load(std::memory_order_acquire) || stop.load(std::memory_order_acquire);
+            });
+        }
+    }
+
+    void Flush(std::string& batch)
+    {
+        if (!file) batch.clear(); // nowhere left to write (see Rotate)
+        if (batch.empty()) return;
+        fwrite(batch.data(), 1, batch.size(), file);
+        fflush(file);
+        fileBytes += batch.size();
+        batch.clear();
+        if (maxBytes != 0 && fileBytes >= maxBytes) Rotate();
+    }
+
+    std::filesystem::path Generation(int i) const
+    {
+        std::filesystem::path g = path;
+        g.replace_extension(FsPath(L"." + std::to_wstring(i)) += path.extension());
+        return g;
+    }
+
+    // If the log can't be moved aside or a fresh one created (a viewer holding
+    // the file, a full disk), writing goes on at the end of the file just
+    // closed, with a note, and rotation stops for this job.
+    void Rotate()
+    {
+        fclose(file);
+        file = nullptr;
+        std::error_code ec;
+        bool moved = true;
+        if (keep > 0) {
+            std::filesystem::remove(Generation(keep), ec);
+            for (int i = keep - 1; i >= 1; --i) std::filesystem::rename(Generation(i), Generation(i + 1), ec);
+            std::filesystem::rename(path, Generation(1), ec);
+            moved = !ec;
+        }
+        if (moved && Reopen()) return;
+        maxBytes = 0;
+        if (!Reopen(moved && keep > 0 ? Generation(1) : path, true)) return;
+        const char note[] = "\r\n[log: rotation failed, continuing here]\r\n";
+        fwrite(note, 1, sizeof(note) - 1, file);
+    }
+};
+
+// ----------------------------
+// ffmpeg failure classification
+// ----------------------------
+// A failed attempt used to be just a nonzero exit code, so a broken input or
+// shader went through every encoder in the fallback list. The output of each
+// attempt is now classified line by line: the child is killed on the first
+// fatal message, and only encoder-specific failures move on to the next encoder.
+enum class FfmpegFailure {
+    None,
+    Unknown,     // nonzero exit with nothing recognizable in the log
+    EncoderInit, // encoder missing / device unavailable / parameters rejected
+    FilterInit,  // filtergraph or libplacebo shader setup failed
+    InputIO,     // input (or output) could not be opened/read
+    MidStream,   // failed after frames started flowing
+};
+
+struct FfmpegResult {
+    bool ok = false;
+    FfmpegFailure failure = FfmpegFailure::None;
+    bool encoderBlamed = false; // the failing message came from the encoder itself
+    std::string message;        // first fatal line, for the log/status
+};
+
+static const wchar_t* FfmpegFailureName(FfmpegFailure f)
+{
+    switch (f) {
+    case FfmpegFailure::None:        return L"none";
+    case FfmpegFailure::Unknown:     return L"unknown error";
+    case FfmpegFailure::EncoderInit: return L"encoder init failure";
+    case FfmpegFailure::FilterInit:  return L"filter/shader failure";
+    case FfmpegFailure::InputIO:     return L"I/O error";
+    case FfmpegFailure::MidStream:   return L"mid-stream failure";
+    }
+    return L"?";
+}
+
+// Whether the fallback loop should try the next encoder after this result.
+static bool ShouldTryNextEncoder(const FfmpegResult& r)
+{
+    switch (r.failure) {
+    case FfmpegFailure::EncoderInit: return true;
+    case FfmpegFailure::MidStream:   return r.encoderBlamed;
+    case FfmpegFailure::Unknown:     return true; // can't tell; keep the old behavior
+    default:                         return false;
+    }
+}
+
+// What a job stopped through EncodeJob::cancel reports; no fallback retries it.
+static FfmpegResult CancelledResult()
+{
+    FfmpegResult r;
+    r.failure = FfmpegFailure::MidStream;
+    r.message = "cancelled";
+    return r;
+}
+
+struct FfmpegErrorPattern {
+    const char* text;
+    FfmpegFailure kind;
+};
+
+// Checked in order during startup (before the first progress tick).
+static const FfmpegErrorPattern kFfmpegErrorPatterns[] = {
+    { "Unknown encoder",                           FfmpegFailure::EncoderInit },
+    { "Encoder not found",                         FfmpegFailure::EncoderInit },
+    { "Error while opening encoder",               FfmpegFailure::EncoderInit },
+    { "Could not open encoder",                    FfmpegFailure::EncoderInit },
+    { "Error initializing output stream",          FfmpegFailure::EncoderInit },
+    { "No such filter",                            FfmpegFailure::FilterInit },
+    { "Error initializing filter",                 FfmpegFailure::FilterInit },
+    { "Error reinitializing filters",              FfmpegFailure::FilterInit },
+    { "Error initializing complex filters",        FfmpegFailure::FilterInit },
+    { "Error parsing filterchain",                 FfmpegFailure::FilterInit },
+    { "Failed to configure output pad",            FfmpegFailure::FilterInit },
+    { "Failed parsing shader",                     FfmpegFailure::FilterInit },
+    { "Failed creating Vulkan device",             FfmpegFailure::FilterInit },
+    { "No such file or directory",                 FfmpegFailure::InputIO },
+    { "Invalid data found when processing input",  FfmpegFailure::InputIO },
+    { "moov atom not found",                       FfmpegFailure::InputIO },
+    { "Error opening input",                       FfmpegFailure::InputIO },
+    { "Error opening output",                      FfmpegFailure::InputIO },
+    { "Permission denied",                         FfmpegFailure::InputIO },
+};
+
+static bool ContainsAny(std::string_view s, std::initializer_list<const char*> needles)
+{
+    for (const char* n : needles) {
+        if (s.find(n) != std::string::npos) return true;
+    }
+    return false;
+}
+
+// Tracks one running attempt; Feed() returns false once the attempt is known dead.
+struct FfmpegErrorClassifier {
+    std::string encoderTag; // "[hevc_nvenc @" style log prefix, empty if no encoder
+    bool started = false;
+    FfmpegResult result;
+
+    explicit FfmpegErrorClassifier(const std::wstring& enc)
+    {
+        if (!enc.empty()) encoderTag = "[" + WideToUtf8(EncoderName(enc)) + " @";
+    }
+
+    bool IsEncoderLine(std::string_view line) const
+    {
+        if (encoderTag.empty()) return false;
+        if (line.compare(0, encoderTag.size(), encoderTag) == 0) return true;
+        return encoderTag == "[libx265 @" && line.rfind("x265 [error]", 0) == 0;
+    }
+
+    bool Fail(FfmpegFailure kind, bool blamed, std::string_view line)
+    {
+        result.failure = kind;
+        result.encoderBlamed = blamed;
+        result.message = std::string(line);
+        return false;
+    }
+
+    // Fed from the log (stderr) channel; `started` is set from the progress channel.
+    bool Feed(std::string_view line)
+    {
+        if (result.failure != FfmpegFailure::None) return false;
+
+        bool errorish = ContainsAny(line, { "rror", "ailed", "No capable devices", "annot load" });
+        if (IsEncoderLine(line) && errorish) {
+            return Fail(started ? FfmpegFailure::MidStream : FfmpegFailure::EncoderInit, true, line);
+        }
+        // Once frames flow, decoders routinely report (non-fatal) damage with the
+        // same wording as a bad input; leave those to the exit code.
+        if (started) return true;
+        if (line.find("decod") != std::string_view::npos) return true;
+
+        for (const auto& pat : kFfmpegErrorPatterns) {
+            if (line.find(pat.text) != std::string_view::npos) {
+                return Fail(pat.kind, pat.kind == FfmpegFailure::EncoderInit, line);
+            }
+        }
+        if (line.rfind("[Parsed_libplacebo", 0) == 0 && errorish) {
+            return Fail(FfmpegFailure::FilterInit, false, line);
+        }
+        return true;
+    }
+
+    void Finish(int exitCode)
+    {
+        if (exitCode == 0 && result.failure == FfmpegFailure::None) {
+            result.ok = true;
+            return;
+        }
+        if (result.failure == FfmpegFailure::None) {
+            result.failure = started ? FfmpegFailure::MidStream : FfmpegFailure::Unknown;
+        }
+    }
+};
+
+// Runs one ffmpeg command. stderr is the log channel: teed into the log and
+// classified, and the attempt is killed as soon as a fatal error shows up (or
+// when *cancel becomes true). stdout carries -progress pipe:1 and is parsed into
+// snapshots for onProgress.
+static FfmpegResult RunFfmpegLogged(const std::wstring& cmd, const std::wstring& workDir, EncodeLog& log,
+                                    const std::function<void(const FfmpegProgress&)>& onProgress,
+                                    double durationSec = 0.0,
+                                    const std::wstring& enc = L"",
+                                    const std::atomic<bool>* cancel = nullptr,
+                                    const std::function<bool(const char*&, size_t&)>& feedStdin = nullptr)
+{
+    log.WriteLine(cmd + L"\r\n");
+
+    LineSplitter progressLines;
+    FfmpegProgressParser progress;
+    progress.durationSec = durationSec;
+    std::atomic<bool> started{false};
+
+    LineSplitter logLines;
+    FfmpegErrorClassifier classifier(enc);
+
+    int rc = RunProcessStreaming(cmd, workDir, [&](const char* data, size_t n) {
+        progressLines.Feed(data, n, [&](std::string_view line) {
+            if (!progress.FeedLine(line)) return;
+            if (progress.cur.outTimeUs > 0) started = true;
+            if (onProgress) onProgress(progress.cur);
+        });
+        return !(cancel && *cancel);
+    }, [&](const char* data, size_t n) {
+        log.Write(data, n);
+        bool alive = true;
+        classifier.started = started;
+        logLines.Feed(data, n, [&](std::string_view line) {
+            if (!classifier.Feed(line)) alive = false;
+        });
+        return alive && !(cancel && *cancel);
+    }, feedStdin);
+    classifier.started = started;
+    classifier.Finish(rc);
+    if (!classifier.result.ok && cancel && *cancel) {
+        // Killed on purpose; whatever the log showed last isn't the cause.
+        classifier.result.failure = FfmpegFailure::MidStream;
+        classifier.result.encoderBlamed = false;
+        classifier.result.message = "cancelled";
+    }
+
+    if (!classifier.result.ok) {
+        log.WriteLine(L"\r\n=== Attempt failed: " + std::wstring(FfmpegFailureName(classifier.result.failure)) +
+                      L" ===\r\n");
+    }
+    return classifier.result;
+}
+
+#ifdef VFXENC_WITH_LIBAV
+// ----------------------------
+// In-process libav engine
+// ----------------------------
+// Built with VFXENC_WITH_LIBAV, encodes run inside this process against the
+// libav* libraries instead of spawning ffmpeg.exe: demux -> decode -> the same
+// filter graph -> encode -> mux, with progress and cancellation checked per
+// frame. The Vulkan device libplacebo renders on is created once and shared by
+// every graph, which is most of libplacebo's start-up cost; decoder, encoder
+// and graph are per job since they depend on the file's format. Only used when
+// settings.txt has libav=1; otherwise encodes spawn ffmpeg as without it.
+
+struct LibavEngine {
+    std::mutex m;
+    AVBufferRef* vulkan = nullptr;
+    bool vulkanTried = false;
+
+    // New reference to the shared device, or null if there is none.
+    AVBufferRef* Vulkan()
+    {
+        std::lock_guard<std::mutex> lock(m);
+        if (!vulkanTried) {
+            vulkanTried = true;
+            if (av_hwdevice_ctx_create(&vulkan, AV_HWDEVICE_TYPE_VULKAN, nullptr, nullptr, 0) < 0) vulkan = nullptr;
+        }
+        return vulkan ? av_buffer_ref(vulkan) : nullptr;
+    }
+};
+
+static LibavEngine g_libav;
+
+// Filter graph(s) for one in-process encode. With a frameHook, decoded frames
+// go through `graph`, the hook (in place), then `postGraph`; otherwise just
+// through `graph`.
+struct LibavGraphSpec {
+    std::string graph;
+    std::string postGraph;
+    std::function<void(AVFrame*)> frameHook;
+    bool tagBt709 = false; // tag the output bt709 (the graph converted to it)
+};
+
+struct LibavFilterChain {
+    AVFilterGraph* graph = nullptr;
+    AVFilterContext* src = nullptr;
+    AVFilterContext* sink = nullptr;
+
+    ~LibavFilterChain() { avfilter_graph_free(&graph); }
+};
+
+struct LibavJob {
+    AVFormatContext* in = nullptr;
+    AVFormatContext* out = nullptr;
+    AVCodecContext* dec = nullptr;
+    AVCodecContext* enc = nullptr;
+    AVPacket* pkt = nullptr;
+    AVFrame* frame = nullptr;
+    AVFrame* filtered = nullptr;
+    LibavFilterChain chains[2];
+
+    ~LibavJob()
+    {
+        av_frame_free(&filtered);
+        av_frame_free(&frame);
+        av_packet_free(&pkt);
+        avcodec_free_context(&enc);
+        avcodec_free_context(&dec);
+        avformat_close_input(&in);
+        if (out) {
+            if (!(out->oformat->flags & AVFMT_NOFILE)) avio_closep(&out->pb);
+            avformat_free_context(out);
+        }
+    }
+};
+
+static std::string LibavError(int err)
+{
+    char buf[AV_ERROR_MAX_STRING_SIZE] = {};
+    av_strerror(err, buf, sizeof(buf));
+    return buf;
+}
+
+static int BuildLibavFilterChain(LibavFilterChain& fc, const std::string& spec, int w, int h, int pixFmt,
+                                 AVRational timeBase, AVRational sar, AVRational frameRate)
+{
+    fc.graph = avfilter_graph_alloc();
+    if (!fc.graph) return AVERROR(ENOMEM);
+
+    char args[256];
+    snprintf(args, sizeof(args), "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d:frame_rate=%d/%d",
+             w, h, pixFmt, timeBase.num, timeBase.den, sar.num, sar.den ? sar.den : 1, frameRate.num, frameRate.den ? frameRate.den : 1);
+    int err = avfilter_graph_create_filter(&fc.src, avfilter_get_by_name("buffer"), "in", args, nullptr, fc.graph);
+    if (err < 0) return err;
+    err = avfilter_graph_create_filter(&fc.sink, avfilter_get_by_name("buffersink"), "out", nullptr, nullptr, fc.graph);
+    if (err < 0) return err;
+
+    // Parse and create first so libplacebo gets the shared device before its
+    // init runs.
+    AVFilterGraphSegment* seg = nullptr;
+    err = avfilter_graph_segment_parse(fc.graph, spec.c_str(), 0, &seg);
+    if (err >= 0) err = avfilter_graph_segment_create_filters(seg, 0);
+    if (err >= 0) {
+        for (size_t i = 0; i < seg->nb_chains; ++i) {
+            for (size_t j = 0; j < seg->chains[i]->nb_filters; ++j) {
+                AVFilterContext* f = seg->chains[i]->filters[j]->filter;
+                if (f && strcmp(f->filter->name, "libplacebo") == 0 && !f->hw_device_ctx) f->hw_device_ctx = g_libav.Vulkan();
+            }
+        }
+    }
+    AVFilterInOut* inputs = nullptr;
+    AVFilterInOut* outputs = nullptr;
+    if (err >= 0) err = avfilter_graph_segment_apply(seg, 0, &inputs, &outputs);
+    avfilter_graph_segment_free(&seg);
+    if (err >= 0 && (!inputs || !outputs || inputs->next || outputs->next)) err = AVERROR(EINVAL); // one in, one out
+    if (err >= 0) err = avfilter_link(fc.src, 0, inputs->filter_ctx, inputs->pad_idx);
+    if (err >= 0) err = avfilter_link(outputs->filter_ctx, outputs->pad_idx, fc.sink, 0);
+    avfilter_inout_free(&inputs);
+    avfilter_inout_free(&outputs);
+    if (err >= 0) err = avfilter_graph_config(fc.graph, nullptr);
+    return err;
+}
+
+// Mirrors BuildEncoderArgs for an encoder opened through libavcodec.
+static void SetLibavEncoderOptions(const std::wstring& spec, AVCodecContext* c, AVDictionary** opts, int targetMbps)
+{
+    std::wstring enc = EncoderName(spec);
+    c->bit_rate = (int64_t)targetMbps * 1000000;
+    if (enc != L"hevc_mf") {
+        c->rc_max_rate = c->bit_rate;
+        c->rc_buffer_size = (int)std::min<int64_t>(c->bit_rate * 2, INT32_MAX);
+    }
+    if (enc == L"hevc_amf") {
+        av_dict_set(opts, "rc", "cbr", 0);
+    } else if (enc == L"hevc_nvenc") {
+        av_dict_set(opts, "preset", "p5", 0);
+        av_dict_set(opts, "rc", "vbr", 0);
+        av_dict_set(opts, "cq", "23", 0);
+    }
+    if (!EncoderPreset(spec).empty()) av_dict_set(opts, "preset", WideToUtf8(EncoderPreset(spec)).c_str(), 0);
+}
+
+// One in-process encode with encoder `encName`. Failures are classified like
+// the ffmpeg.exe path so the encoder fallback logic is shared.
+static FfmpegResult RunLibavEncode(const EncodeJob& job, EncodeLog& log, const std::wstring& encName,
+                                   const LibavGraphSpec& spec,
+                                   const std::function<void(const FfmpegProgress&)>& onProgress,
+                                   const std::atomic<bool>* cancel = nullptr)
+{
+    FfmpegResult result;
+    auto fail = [&](FfmpegFailure kind, const std::string& what, int err) {
+        result.ok = false;
+        result.failure = kind;
+        result.encoderBlamed = (kind == FfmpegFailure::EncoderInit || kind == FfmpegFailure::MidStream);
+        result.message = what + ": " + LibavError(err);
+        log.WriteLine(L"\r\n=== Attempt failed: " + std::wstring(FfmpegFailureName(kind)) + L" (" +
+                      Utf8ToWide(result.message) + L") ===\r\n");
+        return result;
+    };
+
+    log.WriteLine(L"[in-process] " + encName + L" | " + Utf8ToWide(spec.graph) +
+                  (spec.postGraph.empty() ? L"" : L" | <grade> | " + Utf8ToWide(spec.postGraph)) + L"\r\n");
+
+    LibavJob j;
+    std::string inPath = WideToUtf8(job.input);
+    std::string outPath = WideToUtf8(job.output);
+
+    int err = avformat_open_input(&j.in, inPath.c_str(), nullptr, nullptr);
+    if (err < 0) return fail(FfmpegFailure::InputIO, "open input", err);
+    if ((err = avformat_find_stream_info(j.in, nullptr)) < 0) return fail(FfmpegFailure::InputIO, "stream info", err);
+
+    const AVCodec* decoder = nullptr;
+    int vIdx = av_find_best_stream(j.in, AVMEDIA_TYPE_VIDEO, -1, -1, &decoder, 0);
+    if (vIdx < 0) return fail(FfmpegFailure::InputIO, "no video stream", vIdx);
+    int aIdx = av_find_best_stream(j.in, AVMEDIA_TYPE_AUDIO, -1, vIdx, nullptr, 0);
+    AVStream* vin = j.in->streams[vIdx];
+
+    j.dec = avcodec_alloc_context3(decoder);
+    if (!j.dec) return fail(FfmpegFailure::InputIO, "decoder", AVERROR(ENOMEM));
+    avcodec_parameters_to_context(j.dec, vin->codecpar);
+    j.dec->pkt_timebase = vin->time_base;
+    j.dec->framerate = av_guess_frame_rate(j.in, vin, nullptr);
+    j.dec->thread_count = 0;
+    if ((err = avcodec_open2(j.dec, decoder, nullptr)) < 0) return fail(FfmpegFailure::InputIO, "open decoder", err);
+
+    const AVCodec* encoder = avcodec_find_encoder_by_name(WideToUtf8(EncoderName(encName)).c_str());
+    if (!encoder) return fail(FfmpegFailure::EncoderInit, "unknown encoder", AVERROR_ENCODER_NOT_FOUND);
+
+    // The CLI negotiates the encoder's input format on its own; here the last
+    // graph ends in a format filter listing what the encoder takes.
+    std::string graphs[2] = { spec.graph, spec.postGraph };
+    // pix_fmts is deprecated from FFmpeg 7.1 (libavcodec 61.13).
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(61, 13, 100)
+    const void* configs = nullptr;
+    int numConfigs = 0;
+    if (avcodec_get_supported_config(nullptr, encoder, AV_CODEC_CONFIG_PIX_FORMAT, 0, &configs, &numConfigs) < 0) {
+        configs = nullptr;
+    }
+    const AVPixelFormat* pixFmts = (const AVPixelFormat*)configs;
+#else
+    const AVPixelFormat* pixFmts = encoder->pix_fmts;
+#endif
+    if (pixFmts) {
+        std::string fmts;
+        for (const AVPixelFormat* p = pixFmts; *p != AV_PIX_FMT_NONE; ++p) {
+            if (const char* name = av_get_pix_fmt_name(*p)) fmts += (fmts.empty() ? "" : "|") + std::string(name);
+        }
+        if (!fmts.empty()) graphs[spec.frameHook ? 1 : 0] += ",format=" + fmts;
+    }
+
+    AVRational frameRate = j.dec->framerate;
+    err = BuildLibavFilterChain(j.chains[0], graphs[0], j.dec->width, j.dec->height, j.dec->pix_fmt,
+                                vin->time_base, j.dec->sample_aspect_ratio, frameRate);
+    if (err < 0) return fail(FfmpegFailure::FilterInit, "filter graph", err);
+    LibavFilterChain* last = &j.chains[0];
+    if (spec.frameHook) {
+        AVFilterContext* s = j.chains[0].sink;
+        err = BuildLibavFilterChain(j.chains[1], graphs[1], av_buffersink_get_w(s), av_buffersink_get_h(s),
+                                    av_buffersink_get_format(s), av_buffersink_get_time_base(s),
+                                    av_buffersink_get_sample_aspect_ratio(s), frameRate);
+        if (err < 0) return fail(FfmpegFailure::FilterInit, "post-grade filter graph", err);
+        last = &j.chains[1];
+    }
+
+    if ((err = avformat_alloc_output_context2(&j.out, nullptr, nullptr, outPath.c_str())) < 0) {
+        return fail(FfmpegFailure::InputIO, "output format", err);
+    }
+
+    j.enc = avcodec_alloc_context3(encoder);
+    if (!j.enc) return fail(FfmpegFailure::EncoderInit, "encoder", AVERROR(ENOMEM));
+    j.enc->width = av_buffersink_get_w(last->sink);
+    j.enc->height = av_buffersink_get_h(last->sink);
+    j.enc->pix_fmt = (AVPixelFormat)av_buffersink_get_format(last->sink);
+    j.enc->sample_aspect_ratio = av_buffersink_get_sample_aspect_ratio(last->sink);
+    j.enc->time_base = av_buffersink_get_time_base(last->sink);
+    j.enc->framerate = frameRate;
+    j.enc->thread_count = 0;
+    if (spec.tagBt709) {
+        j.enc->colorspace = AVCOL_SPC_BT709;
+        j.enc->color_primaries = AVCOL_PRI_BT709;
+        j.enc->color_trc = AVCOL_TRC_BT709;
+        j.enc->color_range = AVCOL_RANGE_MPEG;
+    }
+    if (j.out->oformat->flags & AVFMT_GLOBALHEADER) j.enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    AVDictionary* encOpts = nullptr;
+    SetLibavEncoderOptions(encName, j.enc, &encOpts, job.targetMbps);
+    err = avcodec_open2(j.enc, encoder, &encOpts);
+    av_dict_free(&encOpts);
+    if (err < 0) return fail(FfmpegFailure::EncoderInit, "open encoder", err);
+
+    AVStream* vout = avformat_new_stream(j.out, nullptr);
+    if (!vout) return fail(FfmpegFailure::InputIO, "output stream", AVERROR(ENOMEM));
+    avcodec_parameters_from_context(vout->codecpar, j.enc);
+    vout->time_base = j.enc->time_base;
+    AVStream* aout = nullptr;
+    if (aIdx >= 0) {
+        aout = avformat_new_stream(j.out, nullptr);
+        if (!aout) return fail(FfmpegFailure::InputIO, "output stream", AVERROR(ENOMEM));
+        avcodec_parameters_copy(aout->codecpar, j.in->streams[aIdx]->codecpar);
+        aout->codecpar->codec_tag = 0;
+        aout->time_base = j.in->streams[aIdx]->time_base;
+    }
+    if (!(j.out->oformat->flags & AVFMT_NOFILE) && (err = avio_open(&j.out->pb, outPath.c_str(), AVIO_FLAG_WRITE)) < 0) {
+        return fail(FfmpegFailure::InputIO, "open output", err);
+    }
+    if ((err = avformat_write_header(j.out, nullptr)) < 0) return fail(FfmpegFailure::InputIO, "write header", err);
+
+    j.pkt = av_packet_alloc();
+    j.frame = av_frame_alloc();
+    j.filtered = av_frame_alloc();
+    if (!j.pkt || !j.frame || !j.filtered) return fail(FfmpegFailure::Unknown, "alloc", AVERROR(ENOMEM));
+
+    FfmpegProgress progress;
+    auto t0 = std::chrono::steady_clock::now();
+
+    // Drains the encoder into the muxer; frame == nullptr flushes it.
+    auto encode = [&](AVFrame* f) -> int {
+        int e = avcodec_send_frame(j.enc, f);
+        if (e < 0) return e;
+        while ((e = avcodec_receive_packet(j.enc, j.pkt)) >= 0) {
+            int64_t pts = j.pkt->pts;
+            av_packet_rescale_ts(j.pkt, j.enc->time_base, vout->time_base);
+            j.pkt->stream_index = vout->index;
+            progress.totalSize += j.pkt->size;
+            if ((e = av_interleaved_write_frame(j.out, j.pkt)) < 0) return e;
+
+            progress.frame++;
+            if (pts != AV_NOPTS_VALUE) progress.outTimeUs = av_rescale_q(pts, j.enc->time_base, AVRational{ 1, 1000000 });
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+            if (elapsed > 0.0) {
+                progress.fps = progress.frame / elapsed;
+                progress.speed = (progress.outTimeUs / 1000000.0) / elapsed;
+                if (progress.outTimeUs > 0) progress.bitrateKbps = progress.totalSize * 8.0 / (progress.outTimeUs / 1000.0);
+            }
+            progress.etaSec = (job.durationSec > 0.0 && progress.speed > 0.0)
+                ? std::max(0.0, (job.durationSec - progress.outTimeUs / 1000000.0) / progress.speed) : -1.0;
+            if (onProgress) onProgress(progress);
+        }
+        return (e == AVERROR(EAGAIN) || e == AVERROR_EOF) ? 0 : e;
+    };
+
+    // Feeds `f` to a stage and pushes whatever comes out into the next one;
+    // f == nullptr signals EOF.
+    std::function<int(int, AVFrame*)> filter = [&](int stage, AVFrame* f) -> int {
+        LibavFilterChain& fc = j.chains[stage];
+        int e = av_buffersrc_add_frame_flags(fc.src, f, AV_BUFFERSRC_FLAG_KEEP_REF);
+        if (e < 0) return e;
+        while (true) {
+            AVFrame* out = av_frame_alloc();
+            if (!out) return AVERROR(ENOMEM);
+            e = av_buffersink_get_frame(fc.sink, out);
+            if (e < 0) {
+                av_frame_free(&out);
+                break;
+            }
+            if (stage == 0 && spec.frameHook) {
+                if ((e = av_frame_make_writable(out)) < 0) {
+                    av_frame_free(&out);
+                    return e;
+                }
+                spec.frameHook(out);
+                e = filter(1, out);
+            } else {
+                out->pict_type = AV_PICTURE_TYPE_NONE;
+                e = encode(out);
+            }
+            av_frame_free(&out);
+            if (e < 0) return e;
+        }
+        if (e == AVERROR_EOF && stage == 0 && spec.frameHook) return filter(1, nullptr);
+        if (e == AVERROR_EOF && last == &fc) return encode(nullptr);
+        return (e == AVERROR(EAGAIN) || e == AVERROR_EOF) ? 0 : e;
+    };
+
+    auto decode = [&](AVPacket* p) -> int {
+        int e = avcodec_send_packet(j.dec, p);
+        if (e < 0 && e != AVERROR_EOF) return 0; // corrupt packet: skip it like ffmpeg does
+        while ((e = avcodec_receive_frame(j.dec, j.frame)) >= 0) {
+            j.frame->pts = j.frame->best_effort_timestamp;
+            e = filter(0, j.frame);
+            av_frame_unref(j.frame);
+            if (e < 0) return e;
+        }
+        if (e == AVERROR_EOF) return filter(0, nullptr);
+        return (e == AVERROR(EAGAIN)) ? 0 : e;
+    };
+
+    while ((err = av_read_frame(j.in, j.pkt)) >= 0) {
+        if (cancel && *cancel) {
+            av_packet_unref(j.pkt);
+            result.failure = FfmpegFailure::MidStream; // not the encoder's fault: stop
+            result.message = "cancelled";
+            return result;
+        }
+        int e = 0;
+        if (j.pkt->stream_index == vIdx) {
+            e = decode(j.pkt);
+        } else if (aout && j.pkt->stream_index == aIdx) {
+            av_packet_rescale_ts(j.pkt, j.in->streams[aIdx]->time_base, aout->time_base);
+            j.pkt->stream_index = aout->index;
+            e = av_interleaved_write_frame(j.out, j.pkt);
+        }
+        av_packet_unref(j.pkt);
+        if (e < 0) return fail(FfmpegFailure::MidStream, "encode", e);
+    }
+    if (err != AVERROR_EOF) return fail(FfmpegFailure::InputIO, "read", err);
+    if ((err = decode(nullptr)) < 0) return fail(FfmpegFailure::MidStream, "flush", err);
+    if ((err = av_write_trailer(j.out)) < 0) return fail(FfmpegFailure::InputIO, "write trailer", err);
+
+    progress.end = true;
+    if (onProgress) onProgress(progress);
+    result.ok = true;
+    result.failure = FfmpegFailure::None;
+    return result;
+}
+
+// Grades a decoded gbrp10 frame in place (see the CPU grade engine).
+static void GradeLibavFrame(const std::vector<CpuGradeParams>& chain, GradeIsa isa, WorkerPool& pool, AVFrame* f)
+{
+    const int w = f->width, h = f->height;
+    int bands = std::min(h, (int)(pool.threads.size() + 1) * 4);
+    int rowsPerBand = (h + bands - 1) / bands;
+    pool.ParallelFor(bands, [&](int band) {
+        std::vector<float> scratch((size_t)w * 3);
+        float* r = scratch.data();
+        float* g = r + w;
+        float* b = g + w;
+        int y1 = std::min(h, (band + 1) * rowsPerBand);
+        for (int y = band * rowsPerBand; y < y1; ++y) {
+            uint16_t* gp = (uint16_t*)(f->data[0] + (size_t)y * f->linesize[0]);
+            uint16_t* bp = (uint16_t*)(f->data[1] + (size_t)y * f->linesize[1]);
+            uint16_t* rp = (uint16_t*)(f->data[2] + (size_t)y * f->linesize[2]);
+            for (int x = 0; x < w; ++x) {
+                g[x] = (gp[x] & 0x3FF) * (1.0f / 1023.0f);
+                b[x] = (bp[x] & 0x3FF) * (1.0f / 1023.0f);
+                r[x] = (rp[x] & 0x3FF) * (1.0f / 1023.0f);
+            }
+            for (const auto& p : chain) GradePlanes(isa, p, r, g, b, w);
+            for (int x = 0; x < w; ++x) {
+                gp[x] = (uint16_t)(g[x] * 1023.0f + 0.5f);
+                bp[x] = (uint16_t)(b[x] * 1023.0f + 0.5f);
+                rp[x] = (uint16_t)(r[x] * 1023.0f + 0.5f);
+            }
+        }
+    });
+}
+
+// Runs `spec` with each of the job's encoders until one succeeds or the
+// failure isn't the encoder's fault.
+static FfmpegResult RunLibavWithEncoders(const EncodeJob& job, EncodeLog& log, const LibavGraphSpec& spec,
+                                         const std::wstring& label)
+{
+    FfmpegResult result;
+    result.failure = FfmpegFailure::Unknown;
+    for (const auto& enc : job.encoders) {
+        std::wstring tag = enc + (label.empty() ? L"" : L", " + label);
+        log.WriteLine(L"\r\n=== Attempt encoder: " + tag + L" (in-process) ===\r\n");
+        PublishStage(job.progressSlot, L"Encoding (" + tag + L")...");
+
+        result = RunLibavEncode(job, log, enc, spec, [&](const FfmpegProgress& p) {
+            if (job.durationSec > 0.0) {
+                double pct = (p.outTimeUs / (job.durationSec * 1000000.0)) * 100.0;
+                PublishProgress(job.progressSlot, tag, pct, p.fps, p.speed, p.etaSec);
+            }
+        }, job.cancel.get());
+        if (result.ok || !ShouldTryNextEncoder(result)) break;
+    }
+    return result;
+}
+#endif // VFXENC_WITH_LIBAV
+
+// ----------------------------
+// Segmented encode
+// ----------------------------
+// The source video is stream-copied into keyframe-aligned chunks, the chunks
+// are encoded concurrently with the same -vf chain and encoder settings, and
+// the results are stream-copy concatenated with the original audio.
+struct EncodeSegment {
+    std::wstring source;  // stream-copied slice of the input
+    std::wstring encoded; // shaded + re-encoded slice
+    double durationSec = 0.0;
+    std::wstring doneBy;  // encoder that finished `encoded`; empty = still to do
+    double seekSec = -1.0; // >= 0: source is the whole input, encode from here (previews)
+    double startSec = 0.0; // position in the input
+    std::wstring vf;       // empty = job.vf
+};
+
+// Checkpointed encodes keep the segment directory when an attempt fails.
+// manifest.txt records what the directory was split from and each segment as
+// it finishes, so a crash, a reboot or an encoder fallback picks up at the
+// first missing segment instead of frame 0:
+//   source <tab> path|size|mtime
+//   vf <tab> filter chain
+//   rate <tab> Mbps
+//   split                                (segments.csv is complete)
+//   done <tab> index <tab> encoder <tab> bytes
+static const double kCheckpointSegmentSec = 30.0;
+static const double kSmartSegmentSec = 10.0; // grid for smart re-encodes (see LoadSmartCache)
+
+struct SegmentCheckpoint {
+    std::wstring manifest;
+    std::mutex m;
+
+    void Append(const std::string& record)
+    {
+        std::lock_guard<std::mutex> lock(m);
+        std::ofstream o(FsPath(manifest), std::ios::binary | std::ios::app);
+        if (o) o.write(record.data(), (std::streamsize)record.size());
+    }
+};
+
+// Segments from another encoder can be joined only if the bitstream format matches.
+static std::wstring EncoderCodec(const std::wstring& enc)
+{
+    if (EncoderName(enc) == L"libx264") return L"h264";
+    return L"hevc"; // hevc_* and the libx265 fallback
+}
+
+// Whether a segment finished by doneBy ("enc" or "enc:preset") can stand in the
+// output of an encode with enc. A checkpoint only needs a codec that joins; a
+// smart segment must come from the same encoder and preset, since its cache key
+// covers the picture but not how it was encoded.
+static bool SegmentReusable(bool smart, const std::wstring& doneBy, const std::wstring& enc)
+{
+    if (doneBy.empty()) return false;
+    return smart ? doneBy == enc : EncoderCodec(doneBy) == EncoderCodec(enc);
+}
+
+static int ResolveSegmentWorkers(int requested)
+{
+    if (requested >= 0) return requested;
+    int cores = (int)std::thread::hardware_concurrency();
+    if (cores <= 0) cores = 4;
+    return std::clamp(cores / 4, 2, 16);
+}
+
+static bool IsSoftwareEncoder(const std::wstring& spec)
+{
+    std::wstring enc = EncoderName(spec);
+    return enc == L"libx265" || enc == L"libx264";
+}
+
+static std::wstring ConcatListPath(const std::wstring& path)
+{
+    // concat demuxer list syntax: file '<path>' with ' escaped as '\''
+    std::wstring out = L"file '";
+    for (wchar_t c : path) {
+        if (c == L'\\') out.push_back(L'/');
+        else if (c == L'\'') out += L"'\\''";
+        else out.push_back(c);
+    }
+    out += L"'\n";
+    return out;
+}
+
+// segments.csv rows: <segment file>,<start>,<end>
+static bool ReadSegmentList(const std::wstring& segDir, std::vector<EncodeSegment>& segments)
+{
+    std::ifstream f(FsPath(JoinPath(segDir, L"segments.csv")), std::ios::binary);
+    if (!f) return false;
+    segments.clear();
+    std::string row;
+    while (std::getline(f, row)) {
+        if (!row.empty() && row.back() == '\r') row.pop_back();
+        size_t c1 = row.find(',');
+        size_t c2 = (c1 == std::string::npos) ? std::string::npos : row.find(',', c1 + 1);
+        if (c2 == std::string::npos) continue;
+
+        EncodeSegment seg;
+        std::wstring name = Utf8ToWide(row.substr(0, c1));
+        seg.source = JoinPath(segDir, FilenameOnly(name));
+        seg.encoded = JoinPath(segDir, L"enc_" + FilenameOnly(name).substr(4));
+        seg.startSec = atof(row.c_str() + c1 + 1);
+        seg.durationSec = atof(row.c_str() + c2 + 1) - seg.startSec;
+        segments.push_back(seg);
+    }
+    return !segments.empty();
+}
+
+// The filter chain for a stretch of the input: a scene's when the stretch
+// lies mostly inside it, else the job's.
+static const std::wstring& SegmentVf(const EncodeJob& job, double startSec, double endSec)
+{
+    for (const auto& scene : job.scenes) {
+        double overlap = std::min(endSec, scene.outSec) - std::max(startSec, scene.inSec);
+        if (overlap > (endSec - startSec) / 2.0) return scene.vf;
+    }
+    return job.vf;
+}
+
+static bool SplitAtKeyframes(const EncodeJob& job, const std::wstring& segDir, int workers,
+                             EncodeLog& log, std::vector<EncodeSegment>& segments)
+{
+    // Aim for a few chunks per worker so a slow scene doesn't leave cores idle,
+    // but keep chunks long enough for the encoder's rate control to settle.
+    double segSec = job.durationSec / (double)(workers * 3);
+    // Checkpointed: short chunks bound what a crash can lose.
+    if (job.checkpoint) segSec = std::min(segSec, kCheckpointSegmentSec);
+    if (segSec < 10.0) segSec = 10.0;
+
+    // Smart re-encodes cut on a fixed grid so unchanged stretches split the
+    // same way every run; scene edges are cuts of their own (the muxer moves
+    // each to the next keyframe) and displace grid cuts within a second.
+    std::wstring timing;
+    if (job.smart || !job.scenes.empty()) {
+        if (job.smart) segSec = kSmartSegmentSec;
+        std::vector<double> cuts;
+        for (const auto& scene : job.scenes) {
+            cuts.push_back(scene.inSec);
+            cuts.push_back(scene.outSec);
+        }
+        size_t edges = cuts.size();
+        for (double t = segSec; t < job.durationSec; t += segSec) {
+            bool nearEdge = false;
+            for (size_t e = 0; e < edges; ++e) nearEdge = nearEdge || std::abs(cuts[e] - t) < 1.0;
+            if (!nearEdge) cuts.push_back(t);
+        }
+        std::sort(cuts.begin(), cuts.end());
+        for (double t : cuts) {
+            if (t <= 0.0 || t >= job.durationSec) continue;
+            wchar_t cut[32];
+            swprintf_s(cut, L"%.3f", t);
+            timing += (timing.empty() ? L" -segment_times " : L",") + std::wstring(cut);
+        }
+    }
+    if (timing.empty()) {
+        wchar_t segTime[64];
+        swprintf_s(segTime, L"%.3f", segSec);
+        timing = L" -segment_time " + std::wstring(segTime);
+    }
+
+    std::wstring listPath = JoinPath(segDir, L"segments.csv");
+
+    // With -c copy the segment muxer can only cut on keyframes, so every chunk
+    // starts with one and decodes independently.
+    std::wstring cmd =
+        Quote(job.ffmpeg) + L" -hide_banner -y -i " + Quote(job.input) +
+        L" -map 0:v:0 -c copy -f segment" + timing +
+        L" -reset_timestamps 1 -segment_format matroska -segment_list " + Quote(listPath) +
+        L" -segment_list_type csv " + Quote(JoinPath(segDir, L"src_%05d.mkv"));
+
+    log.WriteLine(L"\r\n=== Split at keyframes ===\r\n");
+    if (!RunFfmpegLogged(cmd, job.workDir, log, nullptr).ok) return false;
+    if (!ReadSegmentList(segDir, segments)) return false;
+    for (auto& seg : segments) seg.vf = SegmentVf(job, seg.startSec, seg.startSec + seg.durationSec);
+    return true;
+}
+
+// Encodes every segment not yet done; finished ones are recorded in
+// `checkpoint` when it is set.
+static FfmpegResult EncodeSegments(const EncodeJob& job, const std::wstring& enc, int workers,
+                                   std::vector<EncodeSegment>& segments, SegmentCheckpoint* checkpoint,
+                                   EncodeLog& log)
+{
+    std::wstring encArgs = BuildEncoderArgs(enc, job.targetMbps);
+
+    // Hardware encoders have a handful of sessions at best; software encoders
+    // get their thread pools split across workers instead of oversubscribing.
+    if (!IsSoftwareEncoder(enc)) {
+        workers = std::min(workers, 2);
+    } else {
+        int cores = (int)std::thread::hardware_concurrency();
+        int threads = std::max(1, (cores > 0 ? cores : 4) / workers);
+        wchar_t t[64];
+        if (EncoderName(enc) == L"libx265") swprintf_s(t, L" -x265-params pools=%d", threads);
+        else swprintf_s(t, L" -threads %d", threads);
+        encArgs += t;
+    }
+    // Parameter sets in band on every keyframe, so segments from different
+    // runs (or a same-codec fallback encoder) still decode after the join.
+    if (checkpoint || job.smart) encArgs += L" -bsf:v dump_extra=freq=keyframe";
+
+    // Latest snapshot per segment; aggregate rate = sum over segments in flight.
+    std::mutex snapMutex;
+    std::vector<FfmpegProgress> snaps(segments.size());
+    std::vector<size_t> todo;
+    for (size_t i = 0; i < segments.size(); ++i) {
+        if (segments[i].doneBy.empty()) {
+            todo.push_back(i);
+        } else {
+            snaps[i].outTimeUs = (int64_t)(segments[i].durationSec * 1000000.0);
+            snaps[i].end = true;
+        }
+    }
+    workers = std::min(workers, (int)todo.size());
+    std::wstring label = enc + L", " + std::to_wstring(workers) + L" segments in parallel";
+
+    std::atomic<size_t> next{0};
+    std::atomic<bool> failed{false};
+    std::mutex resultMutex;
+    FfmpegResult result;
+    result.ok = true;
+
+    auto worker = [&]() {
+        while (!failed) {
+            size_t t = next++;
+            if (t >= todo.size()) break;
+            size_t i = todo[t];
+            EncodeSegment& seg = segments[i];
+
+            std::wstring input = L" -i " + Quote(seg.source);
+            if (seg.seekSec >= 0.0) {
+                wchar_t range[96];
+                swprintf_s(range, L" -ss %.3f -t %.3f", seg.seekSec, seg.durationSec);
+                input = range + input;
+            }
+            std::wstring cmd =
+                Quote(job.ffmpeg) + L" -hide_banner -y" + input +
+                L" -vf " + Quote(seg.vf.empty() ? job.vf : seg.vf) + L" " + encArgs +
+                L" -an -progress pipe:1 -nostats " + Quote(seg.encoded);
+
+            log.WriteLine(L"\r\n=== Segment " + std::to_wstring(i) + L" (" + enc + L") ===\r\n");
+            FfmpegResult r = RunFfmpegLogged(cmd, job.workDir, log, [&](const FfmpegProgress& p) {
+                if (*job.cancel) failed = true; // kills this attempt and stops the others
+                double doneSec = 0.0, fps = 0.0, speed = 0.0;
+                {
+                    std::lock_guard<std::mutex> lock(snapMutex);
+                    snaps[i] = p;
+                    for (const auto& s : snaps) {
+                        doneSec += s.outTimeUs / 1000000.0;
+                        if (!s.end) {
+                            fps += s.fps;
+                            speed += s.speed;
+                        }
+                    }
+                }
+                double eta = (speed > 0.0) ? std::max(0.0, job.durationSec - doneSec) / speed : -1.0;
+                PublishProgress(job.progressSlot, label, (doneSec / job.durationSec) * 100.0, fps, speed, eta);
+            }, seg.durationSec, enc, &failed);
+            if (r.ok) {
+                seg.doneBy = enc;
+                uint64_t bytes = 0;
+                int64_t mtime = 0;
+                if (checkpoint && StatFile(seg.encoded, bytes, mtime)) {
+                    checkpoint->Append("done\t" + std::to_string(i) + "\t" + WideToUtf8(enc) + "\t" +
+                                       std::to_string(bytes) + "\n");
+                }
+            } else {
+                // The first failure decides; siblings killed by the cancel flag don't count.
+                std::lock_guard<std::mutex> lock(resultMutex);
+                if (!failed.exchange(true)) result = r;
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (int w = 0; w < workers; ++w) pool.emplace_back(worker);
+    for (auto& t : pool) t.join();
+    return *job.cancel ? CancelledResult() : result;
+}
+
+// Multi-encoder dispatch: with job.lanes every listed encoder runs at the same
+// time, each pulling the next segment off one shared queue, so a fast encoder
+// simply ends up taking more of them. Near the end a lane leaves a segment
+// alone when a lane measured faster would finish it sooner even after its
+// current one. A lane whose encoder fails is retired and its segment requeued.
+struct EncoderLane {
+    std::wstring enc;    // ffmpeg encoder name
+    std::wstring preset; // "enc:preset" in the lane list
+    std::wstring args;
+    double speed = 0.0;  // seconds of source per second (running average), 0 = not yet measured
+    double busyUntil = 0.0;
+    bool retired = false;
+    int segments = 0;
+};
+
+// Rate control shared by every lane, so segments from different encoders sit
+// in the same bitrate envelope: peak-constrained VBR at the target, a 2x
+// buffer and one GOP length. (BuildEncoderArgs tunes each encoder on its own:
+// nvenc by CQ, amf as CBR, which shows at segment boundaries.)
+static std::wstring BuildLaneEncoderArgs(const EncoderLane& lane, int targetMbps)
+{
+    std::wstring args = L"-c:v " + lane.enc;
+    if (lane.enc == L"hevc_amf") args += L" -rc vbr_peak";
+    else if (lane.enc == L"hevc_nvenc") args += L" -rc vbr";
+    else if (lane.enc == L"hevc_mf") args += L" -rate_control pc_vbr";
+    wchar_t rc[128];
+    swprintf_s(rc, L" -b:v %dM -maxrate %dM -bufsize %dM -g 250", targetMbps, targetMbps, targetMbps * 2);
+    args += rc;
+    if (!lane.preset.empty()) args += L" -preset " + lane.preset;
+    return args;
+}
+
+static std::wstring LaneSpec(const EncoderLane& lane)
+{
+    return lane.preset.empty() ? lane.enc : lane.enc + L":" + lane.preset;
+}
+
+static FfmpegResult DispatchSegments(const EncodeJob& job, std::vector<EncodeSegment>& segments,
+                                     SegmentCheckpoint* checkpoint, EncodeLog& log)
+{
+    std::vector<EncoderLane> lanes;
+    for (const auto& spec : job.lanes) {
+        EncoderLane lane;
+        lane.enc = EncoderName(spec);
+        lane.preset = EncoderPreset(spec);
+        // Segments are joined by stream copy, so every lane has to produce the same codec.
+        if (!lanes.empty() && EncoderCodec(lane.enc) != EncoderCodec(lanes[0].enc)) {
+            log.WriteLine(L"Dispatch: skipping " + spec + L" (not " + EncoderCodec(lanes[0].enc) + L")\r\n");
+            continue;
+        }
+        lanes.push_back(lane);
+    }
+    FfmpegResult result;
+    result.failure = FfmpegFailure::EncoderInit;
+    if (lanes.empty()) return result;
+
+    // Software lanes split the cores between them.
+    int softLanes = (int)std::count_if(lanes.begin(), lanes.end(), [](const EncoderLane& l) { return IsSoftwareEncoder(l.enc); });
+    int cores = (int)std::thread::hardware_concurrency();
+    int threads = std::max(1, (cores > 0 ? cores : 4) / std::max(1, softLanes));
+    for (auto& lane : lanes) {
+        lane.args = BuildLaneEncoderArgs(lane, job.targetMbps);
+        wchar_t t[64];
+        if (lane.enc == L"libx265") swprintf_s(t, L" -x265-params pools=%d", threads);
+        else swprintf_s(t, L" -threads %d", threads);
+        if (IsSoftwareEncoder(lane.enc)) lane.args += t;
+        // Lanes differ in their parameter sets; carry them in band (see EncodeSegments).
+        lane.args += L" -bsf:v dump_extra=freq=keyframe";
+    }
+
+    std::mutex m;
+    std::condition_variable cv;
+    std::deque<size_t> pending;
+    size_t inFlight = 0; // segments a lane has taken but not finished; under m
+    std::vector<FfmpegProgress> snaps(segments.size());
+    for (size_t i = 0; i < segments.size(); ++i) {
+        bool reuse = false;
+        for (const auto& lane : lanes) reuse = reuse || SegmentReusable(job.smart, segments[i].doneBy, LaneSpec(lane));
+        if (!reuse) {
+            segments[i].doneBy.clear();
+            pending.push_back(i);
+        } else {
+            snaps[i].outTimeUs = (int64_t)(segments[i].durationSec * 1000000.0);
+            snaps[i].end = true;
+        }
+    }
+    std::atomic<bool> failed{false};
+    result.ok = true;
+    std::wstring label = std::to_wstring(lanes.size()) + L" encoders in parallel";
+    auto t0 = std::chrono::steady_clock::now();
+    auto elapsed = [&]() { return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count(); };
+
+    auto laneWorker = [&](size_t li) {
+        EncoderLane& lane = lanes[li];
+        std::unique_lock<std::mutex> lock(m);
+        while (!failed) {
+            // Nothing queued, but a segment still running elsewhere may come
+            // back if its lane retires, so stay until those are done too.
+            if (pending.empty()) {
+                if (inFlight == 0) break;
+                cv.wait_for(lock, std::chrono::milliseconds(250));
+                continue;
+            }
+            size_t i = pending.front();
+            double now = elapsed();
+            double dur = segments[i].durationSec;
+            // Tail handling: once no more segments are left than there are
+            // faster lanes (each takes at most one more), defer to a faster
+            // lane that would still finish this one first. Earlier, every lane
+            // keeps taking work, however slow.
+            bool defer = false;
+            if (lane.speed > 0.0) {
+                size_t faster = 0;
+                for (const auto& other : lanes) {
+                    if (&other != &lane && !other.retired && other.speed > lane.speed) faster++;
+                }
+                double mine = now + dur / lane.speed;
+                for (const auto& other : lanes) {
+                    if (pending.size() > faster) break;
+                    if (&other != &lane && !other.retired && other.speed > lane.speed &&
+                        std::max(now, other.busyUntil) + dur / other.speed < mine) {
+                        defer = true;
+                    }
+                }
+            }
+            if (defer) {
+                cv.wait_for(lock, std::chrono::milliseconds(250));
+                continue;
+            }
+            pending.pop_front();
+            inFlight++;
+            lane.busyUntil = (lane.speed > 0.0) ? now + dur / lane.speed : now;
+            lock.unlock();
+
+            const EncodeSegment& seg = segments[i];
+            std::wstring name = lane.preset.empty() ? lane.enc : lane.enc + L":" + lane.preset;
+            std::wstring cmd =
+                Quote(job.ffmpeg) + L" -hide_banner -y -i " + Quote(seg.source) +
+                L" -vf " + Quote(seg.vf.empty() ? job.vf : seg.vf) + L" " + lane.args +
+                L" -an -progress pipe:1 -nostats " + Quote(seg.encoded);
+            log.WriteLine(L"\r\n=== Segment " + std::to_wstring(i) + L" (" + name + L") ===\r\n");
+            double start = elapsed();
+            FfmpegResult r = RunFfmpegLogged(cmd, job.workDir, log, [&](const FfmpegProgress& p) {
+                if (*job.cancel) failed = true; // kills this attempt and stops the others
+                double doneSec = 0.0, fps = 0.0, speed = 0.0;
+                {
+                    std::lock_guard<std::mutex> snapLock(m);
+                    snaps[i] = p;
+                    for (const auto& s : snaps) {
+                        doneSec += s.outTimeUs / 1000000.0;
+                        if (!s.end) {
+                            fps += s.fps;
+                            speed += s.speed;
+                        }
+                    }
+                }
+                double eta = (speed > 0.0) ? std::max(0.0, job.durationSec - doneSec) / speed : -1.0;
+                PublishProgress(job.progressSlot, label, (doneSec / job.durationSec) * 100.0, fps, speed, eta);
+            }, seg.durationSec, lane.enc, &failed);
+
+            lock.lock();
+            inFlight--;
+            if (r.ok) {
+                double took = std::max(0.001, elapsed() - start);
+                lane.speed = (lane.speed > 0.0) ? 0.5 * lane.speed + 0.5 * (dur / took) : dur / took;
+                lane.busyUntil = 0.0;
+                lane.segments++;
+                segments[i].doneBy = LaneSpec(lane);
+                uint64_t bytes = 0;
+                int64_t mtime = 0;
+                if (checkpoint && StatFile(seg.encoded, bytes, mtime)) {
+                    checkpoint->Append("done\t" + std::to_string(i) + "\t" + WideToUtf8(lane.enc) + "\t" +
+                                       std::to_string(bytes) + "\n");
+                }
+            } else if (!failed) {
+                lane.retired = true;
+                bool anyLeft = std::any_of(lanes.begin(), lanes.end(), [](const EncoderLane& l) { return !l.retired; });
+                if (ShouldTryNextEncoder(r) && anyLeft) {
+                    // This encoder is out; the others pick up its segment.
+                    log.WriteLine(L"\r\n=== Dispatch: retiring " + name + L" ===\r\n");
+                    snaps[i] = FfmpegProgress();
+                    pending.push_front(i);
+                } else {
+                    failed = true;
+                    result = r;
+                }
+            }
+            cv.notify_all();
+            if (lane.retired) break;
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (size_t li = 0; li < lanes.size(); ++li) pool.emplace_back(laneWorker, li);
+    for (auto& t : pool) t.join();
+    if (*job.cancel) result = CancelledResult();
+    for (size_t i = 0; result.ok && i < segments.size(); ++i) {
+        if (segments[i].doneBy.empty()) {
+            result.ok = false;
+            result.failure = FfmpegFailure::MidStream;
+            result.message = "segment " + std::to_string(i) + " was never encoded";
+        }
+    }
+
+    for (const auto& lane : lanes) {
+        wchar_t line[256];
+        swprintf_s(line, L"Dispatch: %ls%ls%ls %d segments, %.2fx%ls\r\n", lane.enc.c_str(),
+                   lane.preset.empty() ? L"" : L":", lane.preset.c_str(), lane.segments, lane.speed,
+                   lane.retired ? L" (retired)" : L"");
+        log.WriteLine(line);
+    }
+    return result;
+}
+
+// sourceAudio copies the input's audio alongside (whole-file encodes only).
+static bool ConcatSegments(const EncodeJob& job, const std::wstring& segDir,
+                           const std::vector<EncodeSegment>& segments, bool sourceAudio, EncodeLog& log)
+{
+    std::wstring listPath = JoinPath(segDir, L"concat.txt");
+    {
+        std::ofstream o(FsPath(listPath), std::ios::binary);
+        if (!o) return false;
+        for (const auto& seg : segments) {
+            o << WideToUtf8(ConcatListPath(seg.encoded));
+        }
+    }
+
+    std::wstring cmd =
+        Quote(job.ffmpeg) + L" -hide_banner -y -f concat -safe 0 -i " + Quote(listPath) +
+        (sourceAudio ? L" -i " + Quote(job.input) + L" -map 0:v:0 -map 1:a? -c:v copy -c:a copy "
+                     : std::wstring(L" -map 0:v:0 -c:v copy ")) + Quote(job.output);
+
+    log.WriteLine(L"\r\n=== Concat segments ===\r\n");
+    return RunFfmpegLogged(cmd, job.workDir, log, nullptr).ok;
+}
+
+// What a checkpoint directory must have been split from to be reused.
+static std::string CheckpointHeader(const EncodeJob& job)
+{
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    StatFile(job.input, size, mtime);
+    std::string header = "source\t" + WideToUtf8(job.input) + "|" + std::to_string(size) + "|" +
+                         std::to_string(mtime) + "\nvf\t" + WideToUtf8(job.vf);
+    for (const auto& scene : job.scenes) {
+        char range[64];
+        snprintf(range, sizeof(range), "\nscene\t%.3f-%.3f\t", scene.inSec, scene.outSec);
+        header += range + WideToUtf8(scene.vf);
+    }
+    return header + "\nrate\t" + std::to_string(job.targetMbps) + "\n";
+}
+
+// Reuses segDir when its manifest matches this job and the split finished;
+// segments whose recorded output is intact come back marked done.
+static bool LoadCheckpoint(const EncodeJob& job, const std::wstring& segDir, std::vector<EncodeSegment>& segments)
+{
+    std::string data;
+    std::string header = CheckpointHeader(job);
+    if (!ReadTextFile(JoinPath(segDir, L"manifest.txt"), data) || data.compare(0, header.size(), header) != 0 ||
+        data.find("\nsplit\n") == std::string::npos || !ReadSegmentList(segDir, segments)) {
+        return false;
+    }
+    for (auto& seg : segments) seg.vf = SegmentVf(job, seg.startSec, seg.startSec + seg.durationSec);
+    std::istringstream in(data.substr(header.size()));
+    std::string line;
+    while (std::getline(in, line)) {
+        char enc[64] = {};
+        size_t index = 0;
+        unsigned long long bytes = 0;
+        if (sscanf(line.c_str(), "done\t%zu\t%63[^\t]\t%llu", &index, enc, &bytes) != 3 || index >= segments.size()) {
+            continue; // a torn last line just means that segment runs again
+        }
+        uint64_t size = 0;
+        int64_t mtime = 0;
+        if (StatFile(segments[index].encoded, size, mtime) && size == bytes) segments[index].doneBy = Utf8ToWide(enc);
+    }
+    return true;
+}
+
+// Smart re-encode: encoded segments are kept in <output>_smart/ under a key
+// hashing everything that generated them (source file, slice, filter chain,
+// rate), and manifest.txt lists the previous output's segments:
+//   source <tab> path|size|mtime
+//   seg <tab> key <tab> start <tab> end <tab> encoder <tab> bytes
+// The next run splits at the same fixed grid (plus scene edges), so a segment
+// whose key and bytes still match is stream-copied from the cache and only the
+// rest is decoded, shaded and encoded again. Each segment starts on a source
+// keyframe and is encoded as its own closed GOPs, which is what makes the
+// joins clean. Stale entries are dropped once an output succeeds.
+
+static std::wstring SmartCacheDir(const EncodeJob& job)
+{
+    return JoinPath(Dirname(job.output), BasenameNoExt(job.output) + L"_smart");
+}
+
+static std::string SourceIdentity(const EncodeJob& job)
+{
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    StatFile(job.input, size, mtime);
+    return WideToUtf8(job.input) + "|" + std::to_string(size) + "|" + std::to_string(mtime);
+}
+
+static std::wstring SmartSegmentKey(const EncodeJob& job, const std::string& source, const EncodeSegment& seg)
+{
+    char slice[64];
+    snprintf(slice, sizeof(slice), "%.3f+%.3f", seg.startSec, seg.durationSec);
+    std::string id = source + "\n" + slice + "\n" + WideToUtf8(seg.vf.empty() ? job.vf : seg.vf) + "\n" +
+                     std::to_string(job.targetMbps);
+    return HexU64(Fnv1a64(id.data(), id.size()));
+}
+
+// Points segments at their cache files and marks the ones still valid done.
+static void LoadSmartCache(const EncodeJob& job, std::vector<EncodeSegment>& segments, EncodeLog& log)
+{
+    std::wstring cacheDir = SmartCacheDir(job);
+    std::error_code ec;
+    std::filesystem::create_directories(FsPath(cacheDir), ec);
+
+    std::string source = SourceIdentity(job);
+    std::unordered_map<std::string, std::pair<std::string, uint64_t>> cached; // key -> encoder, bytes
+    std::string data;
+    if (ReadTextFile(JoinPath(cacheDir, L"manifest.txt"), data)) {
+        std::istringstream in(data);
+        std::string line;
+        while (std::getline(in, line)) {
+            char key[32] = {}, enc[64] = {};
+            double start = 0.0, end = 0.0;
+            unsigned long long bytes = 0;
+            if (sscanf(line.c_str(), "seg\t%31[^\t]\t%lf\t%lf\t%63[^\t]\t%llu", key, &start, &end, enc, &bytes) == 5) {
+                cached[key] = { enc, bytes };
+            }
+        }
+    }
+
+    size_t reused = 0;
+    for (auto& seg : segments) {
+        std::wstring key = SmartSegmentKey(job, source, seg);
+        seg.encoded = JoinPath(cacheDir, key + L".mkv");
+        seg.doneBy.clear();
+        auto it = cached.find(WideToUtf8(key));
+        uint64_t size = 0;
+        int64_t mtime = 0;
+        if (it != cached.end() && StatFile(seg.encoded, size, mtime) && size == it->second.second) {
+            seg.doneBy = Utf8ToWide(it->second.first);
+            ++reused;
+        }
+    }
+    log.WriteLine(L"\r\n=== Smart re-encode: " + std::to_wstring(reused) + L" of " +
+                  std::to_wstring(segments.size()) + L" segments unchanged ===\r\n");
+}
+
+// Records every finished segment; after a successful output, files no longer
+// referenced are removed.
+static void SaveSmartCache(const EncodeJob& job, const std::vector<EncodeSegment>& segments, bool prune)
+{
+    std::wstring cacheDir = SmartCacheDir(job);
+    std::string source = SourceIdentity(job);
+    std::string manifest = "source\t" + source + "\n";
+    std::unordered_set<std::wstring> keep;
+    for (const auto& seg : segments) {
+        uint64_t size = 0;
+        int64_t mtime = 0;
+        if (seg.doneBy.empty() || !StatFile(seg.encoded, size, mtime)) continue;
+        char line[256];
+        snprintf(line, sizeof(line), "seg\t%s\t%.3f\t%.3f\t%s\t%llu\n",
+                 WideToUtf8(BasenameNoExt(seg.encoded)).c_str(), seg.startSec, seg.startSec + seg.durationSec,
+                 WideToUtf8(seg.doneBy).c_str(), (unsigned long long)size);
+        manifest += line;
+        keep.insert(FilenameOnly(seg.encoded));
+    }
+    std::wstring path = JoinPath(cacheDir, L"manifest.txt");
+    std::wstring tmp = path + L".tmp";
+    {
+        std::ofstream o(FsPath(tmp), std::ios::binary | std::ios::trunc);
+        o << manifest;
+    }
+    std::error_code ec;
+    std::filesystem::rename(FsPath(tmp), FsPath(path), ec);
+    if (!prune) return;
+    for (const auto& entry : std::filesystem::directory_iterator(FsPath(cacheDir), ec)) {
+        std::wstring name = FilenameOnly(Utf8ToWide(entry.path().string()));
+        if (name.rfind(L"manifest.txt", 0) != 0 && !keep.count(name)) std::filesystem::remove(entry.path(), ec);
+    }
+}
+
+static FfmpegResult RunSegmentedEncode(const EncodeJob& job, EncodeLog& log)
+{
+    int workers = std::max(ResolveSegmentWorkers(job.segmentWorkers), (int)job.lanes.size());
+    std::wstring segDir = JoinPath(Dirname(job.output), BasenameNoExt(job.output) + L"_segments");
+    SegmentCheckpoint checkpoint;
+    checkpoint.manifest = JoinPath(segDir, L"manifest.txt");
+
+    std::error_code ec;
+    FfmpegResult result;
+    result.failure = FfmpegFailure::InputIO;
+    std::vector<EncodeSegment> segments;
+    bool split = job.checkpoint && LoadCheckpoint(job, segDir, segments);
+    if (split) {
+        size_t done = std::count_if(segments.begin(), segments.end(),
+                                    [](const EncodeSegment& s) { return !s.doneBy.empty(); });
+        log.WriteLine(L"\r\n=== Resuming checkpoint: " + std::to_wstring(done) + L" of " +
+                      std::to_wstring(segments.size()) + L" segments done ===\r\n");
+    } else {
+        std::filesystem::remove_all(FsPath(segDir), ec);
+        std::filesystem::create_directories(FsPath(segDir), ec);
+        PublishStage(job.progressSlot, L"Splitting at keyframes...");
+        split = SplitAtKeyframes(job, segDir, workers, log, segments);
+        if (split && job.checkpoint) checkpoint.Append(CheckpointHeader(job) + "split\n");
+        if (split && job.smart) LoadSmartCache(job, segments, log);
+    }
+
+    if (split && job.dispatch) {
+        log.WriteLine(L"\r\n=== Dispatch across " + std::to_wstring(job.lanes.size()) + L" encoders ===\r\n");
+        result = DispatchSegments(job, segments, job.checkpoint ? &checkpoint : nullptr, log);
+        if (result.ok) {
+            PublishStage(job.progressSlot, L"Joining segments...");
+            if (!ConcatSegments(job, segDir, segments, true, log)) {
+                result.ok = false;
+                result.failure = FfmpegFailure::InputIO;
+            }
+        }
+    } else if (split) {
+        for (const auto& enc : job.encoders) {
+            log.WriteLine(L"\r\n=== Attempt encoder: " + enc + L" (segmented) ===\r\n");
+            PublishStage(job.progressSlot, L"Encoding (" + enc + L")...");
+            for (auto& seg : segments) {
+                if (!SegmentReusable(job.smart, seg.doneBy, enc)) seg.doneBy.clear();
+            }
+            result = EncodeSegments(job, enc, workers, segments, job.checkpoint ? &checkpoint : nullptr, log);
+            if (!result.ok) {
+                if (ShouldTryNextEncoder(result)) continue;
+                break;
+            }
+            PublishStage(job.progressSlot, L"Joining segments...");
+            if (!ConcatSegments(job, segDir, segments, true, log)) {
+                result.ok = false;
+                result.failure = FfmpegFailure::InputIO;
+            }
+            break;
+        }
+    }
+
+    if (split && job.smart) SaveSmartCache(job, segments, result.ok);
+    if (result.ok || !job.checkpoint) {
+        std::filesystem::remove_all(FsPath(segDir), ec);
+    } else {
+        log.WriteLine(L"\r\n=== Checkpoint kept in " + segDir + L" ===\r\n");
+    }
+    return result;
+}
+
+static FfmpegResult RunSingleEncode(const EncodeJob& job, EncodeLog& log)
+{
+#ifdef VFXENC_WITH_LIBAV
+    if (g_useLibav) {
+        LibavGraphSpec spec;
+        spec.graph = WideToUtf8(job.vfInProcess);
+        return RunLibavWithEncoders(job, log, spec, L"");
+    }
+#endif
+    FfmpegResult result;
+    result.failure = FfmpegFailure::Unknown;
+    for (const auto& enc : job.encoders) {
+        std::wstring cmd =
+            Quote(job.ffmpeg) + L" -hide_banner -y -i " + Quote(job.input) +
+            L" -vf " + Quote(job.vf) + L" " + BuildEncoderArgs(enc, job.targetMbps) +
+            L" -c:a copy -progress pipe:1 -nostats " + Quote(job.output);
+
+        log.WriteLine(L"\r\n=== Attempt encoder: " + enc + L" ===\r\n");
+        PublishStage(job.progressSlot, L"Encoding (" + enc + L")...");
+
+        result = RunFfmpegLogged(cmd, job.workDir, log, [&](const FfmpegProgress& p) {
+            if (job.durationSec > 0.0) {
+                double pct = (p.outTimeUs / (job.durationSec * 1000000.0)) * 100.0;
+                PublishProgress(job.progressSlot, enc, pct, p.fps, p.speed, p.etaSec);
+            }
+        }, job.durationSec, enc, job.cancel.get());
+        if (result.ok || !ShouldTryNextEncoder(result)) break;
+    }
+    return result;
+}
+
+// ----------------------------
+// Preview encode (sample ranges)
+// ----------------------------
+// Encodes only a few ranges of the input, through the job's filter and encoder
+// settings, so a look can be judged in seconds rather than after a full pass:
+// explicit in/out ranges, or short samples spread evenly around a position.
+// Each range is read straight from the input with an input-side -ss (a seek to
+// the keyframe before it, then at most one GOP decoded and dropped); ranges
+// encode concurrently like segments and are joined, without audio, into one file.
+static const double kPreviewSampleSec = 4.0;
+static const int kPreviewDefaultSamples = 5;
+
+// count samples of kPreviewSampleSec centred on atSec, at most 15 s apart and
+// closer in short files; the set shifts as a whole to stay inside the video.
+static std::vector<PreviewRange> SpreadPreviewSamples(int count, double atSec, double durationSec)
+{
+    std::vector<PreviewRange> out;
+    if (count <= 0 || durationSec <= 0.0) return out;
+    double len = std::min(kPreviewSampleSec, durationSec);
+    double spacing = std::clamp(durationSec / (count + 1), len, 15.0);
+    double first = std::clamp(atSec - spacing * (count - 1) / 2.0, 0.0,
+                              std::max(0.0, durationSec - len - spacing * (count - 1)));
+    for (int i = 0; i < count; ++i) {
+        double in = std::min(first + spacing * i, durationSec - len);
+        if (!out.empty() && in < out.back().outSec) break; // too short a file for them all
+        out.push_back({ in, in + len });
+    }
+    return out;
+}
+
+static FfmpegResult RunPreviewEncode(const EncodeJob& job, EncodeLog& log)
+{
+    std::wstring segDir = JoinPath(Dirname(job.output), BasenameNoExt(job.output) + L"_segments");
+    std::error_code ec;
+    std::filesystem::remove_all(FsPath(segDir), ec);
+    std::filesystem::create_directories(FsPath(segDir), ec);
+
+    // EncodeSegments reports progress against the job's duration.
+    EncodeJob preview = job;
+    preview.durationSec = 0.0;
+    std::vector<EncodeSegment> segments;
+    for (const auto& r : job.previewRanges) {
+        double outSec = (job.durationSec > 0.0) ? std::min(r.outSec, job.durationSec) : r.outSec;
+        if (outSec - r.inSec < 0.1) continue;
+        wchar_t name[32];
+        swprintf_s(name, L"range_%05zu.mkv", segments.size());
+        EncodeSegment seg;
+        seg.source = job.input;
+        seg.seekSec = std::max(0.0, r.inSec);
+        seg.durationSec = outSec - seg.seekSec;
+        seg.vf = SegmentVf(job, seg.seekSec, outSec);
+        seg.encoded = JoinPath(segDir, name);
+        preview.durationSec += seg.durationSec;
+        segments.push_back(seg);
+    }
+
+    FfmpegResult result;
+    result.failure = FfmpegFailure::InputIO;
+    if (segments.empty()) {
+        result.message = "no preview range inside the video";
+        log.WriteLine(L"\r\n=== Preview: no range inside the video ===\r\n");
+        std::filesystem::remove_all(FsPath(segDir), ec);
+        return result;
+    }
+    wchar_t note[128];
+    swprintf_s(note, L"\r\n=== Preview: %zu range(s), %.1f s ===\r\n", segments.size(), preview.durationSec);
+    log.WriteLine(note);
+
+    for (const auto& enc : job.encoders) {
+        log.WriteLine(L"\r\n=== Attempt encoder: " + enc + L" (preview) ===\r\n");
+        PublishStage(job.progressSlot, L"Encoding preview (" + enc + L")...");
+        for (auto& seg : segments) seg.doneBy.clear();
+        result = EncodeSegments(preview, enc, (int)segments.size(), segments, nullptr, log);
+        if (!result.ok) {
+            if (ShouldTryNextEncoder(result)) continue;
+            break;
+        }
+        if (!ConcatSegments(preview, segDir, segments, false, log)) {
+            result.ok = false;
+            result.failure = FfmpegFailure::InputIO;
+        }
+        break;
+    }
+    std::filesystem::remove_all(FsPath(segDir), ec);
+    return result;
+}
+
+// ----------------------------
+// CPU grade encode (raw frames)
+// ----------------------------
+// For chains the CPU grade understands: one ffmpeg decodes to raw planar
+// 10-bit RGB on stdout, frames are graded in place here, and a second ffmpeg
+// encodes them from stdin (audio is taken from the source). A small bounded
+// queue between the two keeps decode, grade and encode overlapped without
+// buffering the whole file.
+struct RawFrameQueue {
+    std::mutex m;
+    std::condition_variable cv;
+    std::deque<std::vector<uint8_t>> frames;
+    std::vector<std::vector<uint8_t>> spare;
+    size_t capacity = 4;
+    size_t frameBytes = 0;
+    bool closed = false;
+
+    std::vector<uint8_t> Acquire()
+    {
+        std::lock_guard<std::mutex> lock(m);
+        if (spare.empty()) return std::vector<uint8_t>(frameBytes);
+        std::vector<uint8_t> f = std::move(spare.back());
+        spare.pop_back();
+        return f;
+    }
+
+    void Recycle(std::vector<uint8_t>&& f)
+    {
+        std::lock_guard<std::mutex> lock(m);
+        spare.push_back(std::move(f));
+    }
+
+    bool Push(std::vector<uint8_t>&& f)
+    {
+        std::unique_lock<std::mutex> lock(m);
+        cv.wait(lock, [&]() { return closed || frames.size() < capacity; });
+        if (closed) return false;
+        frames.push_back(std::move(f));
+        cv.notify_all();
+        return true;
+    }
+
+    // Frames queued before Close() are still handed out.
+    bool Pop(std::vector<uint8_t>& out)
+    {
+        std::unique_lock<std::mutex> lock(m);
+        cv.wait(lock, [&]() { return closed || !frames.empty(); });
+        if (frames.empty()) return false;
+        out = std::move(frames.front());
+        frames.pop_front();
+        cv.notify_all();
+        return true;
+    }
+
+    void Close()
+    {
+        std::lock_guard<std::mutex> lock(m);
+        closed = true;
+        cv.notify_all();
+    }
+};
+
+static FfmpegResult RunCpuGradeEncode(const EncodeJob& job, EncodeLog& log)
+{
+    FfmpegResult result;
+    result.failure = FfmpegFailure::InputIO;
+
+    MediaProbeResult probe = ProbeMediaAsync(job.input).get();
+    const MediaStreamInfo* v = probe.ok ? probe.info.FirstVideo() : nullptr;
+    if (!v || v->width <= 0 || v->height <= 0) {
+        result.message = "CPU grade needs the frame size, and the probe didn't find one";
+        log.WriteLine(L"\r\n=== CPU grade: unknown frame size ===\r\n");
+        return result;
+    }
+    const int w = v->width;
+    const int h = v->height;
+    const double fps = (v->fps > 0.0) ? v->fps : 30.0;
+    const CpuFrameFormat fmt = CpuFrameFormat::Gbrp10;
+    const size_t frameBytes = CpuFrameBytes(fmt, w, h);
+
+    std::wstring isaNote;
+    GradeIsa isa = GetGradeIsa(&isaNote);
+    int threads = std::clamp((int)std::thread::hardware_concurrency() - 1, 0, 63);
+    WorkerPool pool(threads);
+
+    wchar_t size[64];
+    wchar_t rate[64];
+    swprintf_s(size, L"%dx%d", w, h);
+    swprintf_s(rate, L"%.6f", fps);
+    log.WriteLine(L"\r\n=== CPU grade: " + isaNote + L", " + std::to_wstring(job.cpuGrade.size()) + L" stage(s), " +
+                  size + L" @ " + rate + L" fps, " + std::to_wstring(threads + 1) + L" threads ===\r\n");
+    if (v->fps <= 0.0) log.WriteLine(L"(frame rate unknown, assuming 30)\r\n");
+
+#ifdef VFXENC_WITH_LIBAV
+    if (g_useLibav) {
+        LibavGraphSpec spec;
+        spec.graph = WideToUtf8(YuvToRgbFilter(h, L"gbrp10le"));
+        spec.postGraph = WideToUtf8(RgbToYuvFilter(job.target, w, h));
+        spec.frameHook = [&](AVFrame* f) { GradeLibavFrame(job.cpuGrade, isa, pool, f); };
+        spec.tagBt709 = true;
+        return RunLibavWithEncoders(job, log, spec, L"CPU grade");
+    }
+#endif
+
+    std::wstring pixFmt = CpuFramePixFmt(fmt);
+    std::wstring decodeCmd =
+        Quote(job.ffmpeg) + L" -hide_banner -nostdin -v error -i " + Quote(job.input) +
+        L" -map 0:v:0 -vf " + YuvToRgbFilter(h, pixFmt.c_str()) + L" -f rawvideo pipe:1";
+
+    std::wstring vf = RgbToYuvFilter(job.target, w, h);
+
+    result.failure = FfmpegFailure::Unknown;
+    for (const auto& enc : job.encoders) {
+        std::wstring encodeCmd =
+            Quote(job.ffmpeg) + L" -hide_banner -y -f rawvideo -pix_fmt " + pixFmt + L" -s " + size +
+            L" -framerate " + rate + L" -i pipe:0 -i " + Quote(job.input) +
+            L" -map 0:v:0 -map 1:a? -vf " + Quote(vf) +
+            L" -colorspace bt709 -color_primaries bt709 -color_trc bt709 " + BuildEncoderArgs(enc, job.targetMbps) +
+            L" -c:a copy -progress pipe:1 -nostats " + Quote(job.output);
+
+        log.WriteLine(L"\r\n=== Attempt encoder: " + enc + L" (CPU grade) ===\r\n");
+        log.WriteLine(decodeCmd + L"\r\n");
+        std::wstring label = enc + L", CPU grade";
+        PublishStage(job.progressSlot, L"Encoding (" + label + L")...");
+
+        RawFrameQueue queue;
+        queue.frameBytes = frameBytes;
+        std::atomic<bool> stop{false};
+        int decodeRc = 0;
+
+        std::thread decoder([&]() {
+            std::vector<uint8_t> frame = queue.Acquire();
+            size_t filled = 0;
+            decodeRc = RunProcessStreaming(decodeCmd, job.workDir, [&](const char* data, size_t n) {
+                while (n > 0) {
+                    size_t take = std::min(n, frameBytes - filled);
+                    memcpy(frame.data() + filled, data, take);
+                    filled += take;
+                    data += take;
+                    n -= take;
+                    if (filled == frameBytes) {
+                        GradeFrame(job.cpuGrade, isa, fmt, frame.data(), w, h, pool);
+                        if (!queue.Push(std::move(frame))) return false;
+                        frame = queue.Acquire();
+                        filled = 0;
+                    }
+                }
+                return !stop.load();
+            }, [&](const char* data, size_t n) {
+                log.Write(data, n);
+                return true;
+            });
+            queue.Close();
+        });
+
+        std::vector<uint8_t> writing;
+        result = RunFfmpegLogged(encodeCmd, job.workDir, log, [&](const FfmpegProgress& p) {
+            if (job.durationSec > 0.0) {
+                double pct = (p.outTimeUs / (job.durationSec * 1000000.0)) * 100.0;
+                PublishProgress(job.progressSlot, label, pct, p.fps, p.speed, p.etaSec);
+            }
+        }, job.durationSec, enc, job.cancel.get(), [&](const char*& data, size_t& n) {
+            if (!writing.empty()) queue.Recycle(std::move(writing));
+            if (!queue.Pop(writing)) return false;
+            data = (const char*)writing.data();
+            n = writing.size();
+            return true;
+        });
+
+        stop = true;
+        queue.Close();
+        decoder.join();
+
+        if (result.ok && decodeRc != 0) {
+            result.ok = false;
+            result.failure = FfmpegFailure::InputIO;
+            result.message = "decoder exited with " + std::to_string(decodeRc);
+            log.WriteLine(L"\r\n=== Decoder failed ===\r\n");
+        }
+        if (result.ok || !ShouldTryNextEncoder(result)) break;
+    }
+    return result;
+}
+
+// ----------------------------
+// Encode jobs
+// ----------------------------
+// What to encode, independent of where the settings came from (the window or
+// a batch job file).
+struct EncodeRequest {
+    std::wstring input;
+    std::wstring outputDir;            // empty = next to the input
+    std::vector<std::wstring> shaders; // active chain, in order
+    std::vector<ShaderParams> shaderParams; // per shaders[i] constant overrides (may be shorter)
+    OutputTarget target;               // size, fit, pixel format, colorspace
+    std::vector<PreviewRange> previewRanges; // encode only these (a preview)
+    int previewSamples = 0;            // or this many short samples around previewAt
+    double previewAt = 0.0;
+    std::vector<SceneChain> scenes;    // extra shaders over parts of the input
+    bool smart = false;                // re-encode only segments that changed
+    int bitrateMbps = 0;               // 0 = same as input
+    std::wstring encoder = L"auto";
+    int segmentWorkers = 0;
+    bool checkpoint = false;           // resumable segmented encode
+    int engine = 0;                    // as g_shaderEngine
+    int srcWidth = 0;                  // 0 = unknown
+    int srcHeight = 0;
+    double durationSec = 0.0;          // 0 = unknown (probed on the job thread)
+};
+
+// <name>_shaded.mp4, or with _<H>p / _<W>w / _<W>x<H> when scaling and
+// _preview for sample ranges. IsEncodeOutputName undoes exactly this suffix;
+// change both together.
+static std::wstring EncodeOutputSuffix(const EncodeRequest& req)
+{
+    std::wstring suffix = L"_shaded";
+    const OutputTarget& t = req.target;
+    if (t.width > 0 && t.height > 0) suffix += L"_" + std::to_wstring(t.width) + L"x" + std::to_wstring(t.height);
+    else if (t.height > 0) suffix += L"_" + std::to_wstring(t.height) + L"p";
+    else if (t.width > 0) suffix += L"_" + std::to_wstring(t.width) + L"w";
+    if (!req.previewRanges.empty() || req.previewSamples > 0) suffix += L"_preview";
+    return suffix;
+}
+
+static std::wstring EncodeOutputPath(const EncodeRequest& req)
+{
+    std::wstring dir = req.outputDir.empty() ? Dirname(req.input) : req.outputDir;
+    return JoinPath(dir, BasenameNoExt(req.input) + EncodeOutputSuffix(req) + L".mp4");
+}
+
+// Whether a file name ends in a suffix EncodeOutputSuffix can produce (our own
+// output landing in a watched folder), stripping its parts from the end.
+static bool IsEncodeOutputName(const std::wstring& path)
+{
+    std::wstring name = BasenameNoExt(path);
+    if (EndsWithI(name, L"_preview")) name.resize(name.size() - 8);
+    size_t bar = name.rfind(L'_');
+    if (bar != std::wstring::npos) {
+        std::wstring size = name.substr(bar + 1);
+        size_t digits = 0;
+        while (digits < size.size() && iswdigit(size[digits])) ++digits;
+        bool scaled = false;
+        if (digits > 0 && digits + 1 == size.size()) {
+            scaled = (size.back() == L'p' || size.back() == L'w');
+        } else if (digits > 0 && digits + 1 < size.size() && size[digits] == L'x') {
+            scaled = std::all_of(size.begin() + digits + 1, size.end(), [](wchar_t c) { return iswdigit(c) != 0; });
+        }
+        if (scaled) name.resize(bar);
+    }
+    return EndsWithI(name, L"_shaded");
+}
+
+// Turns a request into a job. The combined shader stays acquired until
+// RunEncodeJob finishes. warning is set when the chosen engine can't run the
+// chain and libplacebo is used instead.
+static void PrepareEncodeJob(const EncodeRequest& req, EncodeJob& job, CombinedShaderRef& combined,
+                             std::wstring& warning)
+{
+    job.input = req.input;
+    FindFfmpeg(job.ffmpeg);
+
+    // Combine shaders into one file for libplacebo custom_shader_path
+    if (!req.shaders.empty()) AcquireCombinedShader(req.shaders, req.shaderParams, combined, &job.shaderError);
+
+    job.output = EncodeOutputPath(req);
+
+    // ffmpeg runs in the exe dir; the in-process engine can't rely on the
+    // working directory, so it gets the absolute path (escaped for the graph).
+    job.vf = PlanLibplaceboFilter(combined.path.empty() ? L"" : FfmpegEscapeFilterValue(combined.relName),
+                                  req.target, req.srcWidth, req.srcHeight);
+    job.vfInProcess = PlanLibplaceboFilter(combined.path.empty() ? L"" : FfmpegGraphPath(combined.path),
+                                           req.target, req.srcWidth, req.srcHeight);
+    job.target = req.target;
+
+    // An empty chain is a plain re-encode, which the CPU path handles too.
+    job.cpuGradeOk = req.shaders.empty() || ParseCpuGradeChain(req.shaders, req.shaderParams, job.cpuGrade);
+    // The CPU grade has no filter form to run per range, so previews of it
+    // use the same chain baked into a LUT.
+    bool preview = !req.previewRanges.empty() || req.previewSamples > 0;
+    job.preferCpuGrade = (req.engine == 1) && !preview;
+    job.preferLut = (req.engine == 2 || (req.engine == 1 && preview)) && !job.cpuGrade.empty();
+    if (req.engine != 0 && !job.cpuGradeOk) {
+        warning = L"CPU and LUT engines only run colortrans3 grades; using libplacebo.";
+    } else if (req.engine != 0 && !req.target.colorspace.empty() && req.target.colorspace != L"bt709") {
+        warning = L"CPU and LUT engines always output BT.709.";
+    }
+    // Scenes run the chain plus their own shaders over part of the input,
+    // switching per segment, which only the libplacebo path does.
+    for (const auto& scene : req.scenes) {
+        std::vector<std::wstring> chain = req.shaders;
+        chain.insert(chain.end(), scene.shaders.begin(), scene.shaders.end());
+        CombinedShaderRef ref;
+        std::wstring error;
+        if (!AcquireCombinedShader(chain, req.shaderParams, ref, &error) && job.shaderError.empty()) {
+            job.shaderError = error;
+        }
+        SceneVf sv;
+        sv.inSec = scene.inSec;
+        sv.outSec = scene.outSec;
+        sv.vf = PlanLibplaceboFilter(ref.path.empty() ? L"" : FfmpegEscapeFilterValue(ref.relName), req.target,
+                                     req.srcWidth, req.srcHeight);
+        job.scenes.push_back(sv);
+        job.sceneShaders.push_back(ref);
+    }
+    if (!req.scenes.empty()) {
+        if (req.engine != 0) warning = L"Scene shaders need the GPU engine; using libplacebo.";
+        job.preferCpuGrade = job.preferLut = job.cpuGradeOk = false;
+    }
+    if (!job.shaderError.empty()) warning.clear(); // the job fails on that instead
+    job.srcWidth = req.srcWidth;
+    job.srcHeight = req.srcHeight;
+
+    // "auto" is resolved on the encode thread from the capability cache, since
+    // the first run against a new ffmpeg build has to probe.
+    // "all" or a comma list dispatches segments to several encoders at once.
+    if (req.encoder == L"all") {
+        job.dispatch = true;
+    } else if (req.encoder.find(L',') != std::wstring::npos) {
+        job.dispatch = true;
+        std::wstringstream list(req.encoder);
+        for (std::wstring lane; std::getline(list, lane, L',');) {
+            if (!lane.empty()) job.lanes.push_back(lane);
+        }
+    } else if (req.encoder != L"auto") {
+        job.encoders.push_back(req.encoder);
+    }
+
+    // 0 = same as input; resolved on the encode thread.
+    job.targetMbps = req.bitrateMbps;
+
+    // One log per output (helps troubleshooting ffmpeg failures).
+    job.logPath = JoinPath(GetLogDir(), BasenameNoExt(job.output) + L".log");
+    job.workDir = GetExeDir();
+
+    job.durationSec = req.durationSec;
+    job.segmentWorkers = req.segmentWorkers;
+    job.checkpoint = req.checkpoint;
+    job.previewRanges = req.previewRanges;
+    job.previewSamples = req.previewSamples;
+    job.previewAt = req.previewAt;
+    job.smart = req.smart;
+}
+
+// Runs a prepared job on the calling thread and releases its shader.
+static FfmpegResult RunEncodeJob(EncodeJob& job, CombinedShaderRef& combined)
+{
+    job.progressSlot = AcquireProgressSlot(job.progressId, FilenameOnly(job.input));
+    if (job.targetMbps <= 0 || job.durationSec <= 0.0) {
+        MediaProbeResult probe = ProbeMediaAsync(job.input).get();
+        if (job.durationSec <= 0.0 && probe.ok) job.durationSec = probe.info.durationUs / 1000000.0;
+        if (job.targetMbps <= 0) job.targetMbps = EstimateVideoBitrateMbps(job.input, job.durationSec);
+        if (job.targetMbps <= 0) job.targetMbps = 20;
+    }
+    if (job.previewSamples > 0 && job.previewRanges.empty()) {
+        job.previewRanges = SpreadPreviewSamples(job.previewSamples, job.previewAt, job.durationSec);
+    }
+    // Smart segments persist on their own; scenes need per-segment chains.
+    if (job.smart) job.checkpoint = false;
+    if ((job.smart || !job.scenes.empty()) && job.segmentWorkers == 0) job.segmentWorkers = -1;
+    // Checkpoints are per segment; one worker keeps the encode sequential.
+    if (job.checkpoint && job.segmentWorkers == 0) job.segmentWorkers = 1;
+    // Dispatch is per segment too (one worker per lane).
+    if (job.dispatch && job.segmentWorkers == 0) job.segmentWorkers = 1;
+    // Segmenting needs a known duration to size the chunks.
+    if (job.durationSec <= 0.0) job.segmentWorkers = 0;
+
+    for (const auto& lane : job.lanes) {
+        std::wstring enc = EncoderName(lane);
+        if (std::find(job.encoders.begin(), job.encoders.end(), enc) == job.encoders.end()) job.encoders.push_back(enc);
+    }
+    if (job.encoders.empty()) {
+        PublishStage(job.progressSlot, L"Checking available encoders...");
+        job.encoders = GetAutoEncoderOrder(job.ffmpeg);
+    }
+    if (job.dispatch && job.lanes.empty()) job.lanes = job.encoders; // "all"
+
+    EncodeLog log;
+    log.Open(job.logPath, (uint64_t)g_logMaxMB << 20, g_logKeep);
+
+    if (!combined.path.empty()) {
+        log.WriteLine(L"Shader passes: " + std::to_wstring(combined.passes.passesOut) + L" of " +
+                      std::to_wstring(combined.passes.passesIn) + L" after pruning and fusing " +
+                      std::to_wstring(combined.passes.passesFused) + L" (" + combined.relName + L")\r\n");
+    }
+
+    job.engineRan = 0;
+    if (job.preferLut && job.shaderError.empty()) {
+        std::wstring lutPath, note;
+        if (BakeGradeLut(job.cpuGrade, lutPath, note)) {
+            job.engineRan = 2;
+            job.vf = YuvToRgbFilter(job.srcHeight, L"gbrp16le") + L",lut3d=file=" +
+                     FfmpegEscapeFilterValue(lutPath) + L":interp=tetrahedral," +
+                     RgbToYuvFilter(job.target, job.srcWidth, job.srcHeight);
+            job.vfInProcess = YuvToRgbFilter(job.srcHeight, L"gbrp16le") + L",lut3d=file=" +
+                              FfmpegGraphPath(JoinPath(GetExeDir(), lutPath)) + L":interp=tetrahedral," +
+                              RgbToYuvFilter(job.target, job.srcWidth, job.srcHeight);
+            log.WriteLine(L"3D LUT: " + note + L"\r\n");
+        } else {
+            log.WriteLine(L"3D LUT: bake failed, using libplacebo\r\n");
+        }
+    }
+
+    FfmpegResult result;
+    if (*job.cancel) {
+        result = CancelledResult();
+    } else if (!job.shaderError.empty()) {
+        log.WriteLine(job.shaderError + L"\r\n");
+        result.failure = FfmpegFailure::InputIO;
+        result.message = WideToUtf8(job.shaderError);
+    } else if (job.preferCpuGrade && job.cpuGradeOk) {
+        job.engineRan = 1;
+        result = RunCpuGradeEncode(job, log);
+    } else if (!job.previewRanges.empty() || job.previewSamples > 0) {
+        result = RunPreviewEncode(job, log);
+    } else {
+        result = (job.segmentWorkers != 0) ? RunSegmentedEncode(job, log) : RunSingleEncode(job, log);
+        // No usable Vulkan device (headless box): the grade can still run natively.
+        if (!result.ok && result.failure == FfmpegFailure::FilterInit && job.cpuGradeOk && job.cpuFallback &&
+            !*job.cancel) {
+            log.WriteLine(L"\r\n=== libplacebo unavailable, falling back to CPU grade ===\r\n");
+            job.engineRan = 1;
+            result = RunCpuGradeEncode(job, log);
+        }
+    }
+
+    log.Close();
+
+    ReleaseCombinedShader(combined);
+    for (const auto& ref : job.sceneShaders) ReleaseCombinedShader(ref);
+    ReleaseProgressSlot(job.progressSlot);
+    job.progressSlot = -1;
+    return result;
+}
+
+// ----------------------------
+// Batch mode (headless)
+// ----------------------------
+// VfxEnc --batch jobs.txt [--jobs N] [--summary results.json] [--progress]
+//
+// The job file is line based like settings.txt. Setting lines apply to every
+// input= line after them, so one file can switch chains part way through:
+//   shader=0|D:\shaders\grade.glsl   (shaders.txt syntax, 1| = bypassed)
+//   shader=0|D:\shaders\grade.glsl|lift=-0.1;gain=1.6 (with constant overrides)
+//   shaders=clear                    (start a new chain)
+//   param=lift=-0.12                 (override a constant in the chain so far)
+//   params=clear                     (back to the shaders' own values)
+//   height=1440                      (0 = source size)
+//   width=0                          (0 = from height and the source aspect)
+//   fit=fit | fill                   (pad or crop when both are set)
+//   pixfmt=yuv420p10le               (empty = the filter's default)
+//   colorspace=bt709 | bt601 | bt2020 (empty = as the source)
+//   bitrate=20                       (Mbps, 0 = same as input)
+//   encoder=auto                     (or all / hevc_nvenc,libx265:fast: run at once)
+//   engine=gpu | cpu | lut
+//   segments=0                       (-1 = auto)
+//   checkpoint=1                     (resume from finished segments after a failure)
+//   range=12.5-20                    (preview: encode only this, repeatable)
+//   ranges=clear
+//   samples=5                        (preview: short samples spread around at=)
+//   at=95                            (seconds)
+//   scene=610-655|D:\shaders\fix.glsl (add shaders over a range, repeatable)
+//   scenes=clear
+//   smart=1                          (re-encode only what changed since the last output)
+//   outdir=D:\out                    (empty = next to each input)
+//   jobs=4                           (concurrency; --jobs overrides)
+//   input=D:\clips\a.mp4
+// Blank lines and lines starting with '#' are skipped. Results go to a JSON
+// summary (default <jobs file>.results.json); the exit code is 0 only if
+// every job succeeded. --progress prints the running jobs' progress every
+// kBatchProgressMs.
+struct BatchResult {
+    std::wstring input;
+    std::wstring output;
+    std::wstring logPath;
+    FfmpegResult result;
+    double seconds = 0.0;
+};
+
+// One job-file setting applied to `cur`. Shared by batch files, the service
+// config and journal, and service submissions.
+static bool ApplyJobSetting(EncodeRequest& cur, const std::string& key, const std::string& value,
+                            std::wstring& error)
+{
+    if (key == "input") {
+        cur.input = Utf8ToWide(value);
+    } else if (key == "shader") {
+        std::wstring shader;
+        bool bypass = false;
+        ShaderParams params;
+        if (!ParseShaderLine(value, shader, bypass, params)) {
+            error = L"not a shader: " + Utf8ToWide(value);
+            return false;
+        }
+        std::vector<std::string> unmatched = UnmatchedShaderParams(shader, params);
+        if (!unmatched.empty()) {
+            error = FilenameOnly(shader) + L" has no constant " + Utf8ToWide(unmatched[0]) + L" of that shape";
+            return false;
+        }
+        if (!bypass) {
+            cur.shaderParams.resize(cur.shaders.size());
+            cur.shaders.push_back(shader);
+            cur.shaderParams.push_back(params);
+        }
+    } else if (key == "shaders" && value == "clear") {
+        cur.shaders.clear();
+        cur.shaderParams.clear();
+    } else if (key == "param") {
+        // Applies to every shader in the chain that declares the constant.
+        ShaderParams param;
+        if (!ParseShaderParam(value, param)) {
+            error = L"param must be name=value";
+            return false;
+        }
+        cur.shaderParams.resize(cur.shaders.size());
+        bool found = false;
+        for (size_t i = 0; i < cur.shaders.size(); ++i) {
+            if (!UnmatchedShaderParams(cur.shaders[i], param).empty()) continue;
+            cur.shaderParams[i][param.begin()->first] = param.begin()->second;
+            found = true;
+        }
+        if (!found) {
+            error = L"no shader in the chain has a constant " + Utf8ToWide(param.begin()->first) + L" of that shape";
+            return false;
+        }
+    } else if (key == "params" && value == "clear") {
+        cur.shaderParams.clear();
+    } else if (key == "height") {
+        cur.target.height = std::max(0, atoi(value.c_str())) & ~1;
+    } else if (key == "width") {
+        cur.target.width = std::max(0, atoi(value.c_str())) & ~1;
+    } else if (key == "fit") {
+        if (value != "fit" && value != "fill") {
+            error = L"fit must be fit or fill";
+            return false;
+        }
+        cur.target.fit = (value == "fill") ? FitMode::Fill : FitMode::Fit;
+    } else if (key == "pixfmt") {
+        cur.target.pixFmt = Utf8ToWide(value);
+    } else if (key == "colorspace") {
+        if (!value.empty() && !FindOutputColorspace(Utf8ToWide(value))) {
+            error = L"unknown colorspace " + Utf8ToWide(value);
+            return false;
+        }
+        cur.target.colorspace = Utf8ToWide(value);
+    } else if (key == "bitrate") {
+        cur.bitrateMbps = std::max(0, atoi(value.c_str()));
+    } else if (key == "encoder") {
+        cur.encoder = value.empty() ? L"auto" : Utf8ToWide(value);
+    } else if (key == "engine") {
+        cur.engine = (value == "cpu") ? 1 : (value == "lut") ? 2 : 0;
+    } else if (key == "segments") {
+        cur.segmentWorkers = std::max(-1, atoi(value.c_str()));
+    } else if (key == "checkpoint") {
+        cur.checkpoint = atoi(value.c_str()) != 0;
+    } else if (key == "range") {
+        PreviewRange r;
+        if (sscanf(value.c_str(), "%lf-%lf", &r.inSec, &r.outSec) != 2 || r.outSec <= r.inSec) {
+            error = L"range must be in-out seconds";
+            return false;
+        }
+        cur.previewRanges.push_back(r);
+    } else if (key == "ranges" && value == "clear") {
+        cur.previewRanges.clear();
+    } else if (key == "samples") {
+        cur.previewSamples = std::clamp(atoi(value.c_str()), 0, 64);
+    } else if (key == "at") {
+        cur.previewAt = std::max(0.0, atof(value.c_str()));
+    } else if (key == "scene") {
+        SceneChain scene;
+        size_t bar = value.find('|');
+        if (sscanf(value.c_str(), "%lf-%lf", &scene.inSec, &scene.outSec) != 2 || scene.outSec <= scene.inSec ||
+            bar == std::string::npos) {
+            error = L"scene must be in-out|shader[|shader...]";
+            return false;
+        }
+        std::stringstream list(value.substr(bar + 1));
+        for (std::string path; std::getline(list, path, '|');) {
+            std::wstring shader = Utf8ToWide(path);
+            if (!IsShaderFile(shader)) {
+                error = L"not a shader: " + shader;
+                return false;
+            }
+            scene.shaders.push_back(shader);
+        }
+        cur.scenes.push_back(scene);
+    } else if (key == "scenes" && value == "clear") {
+        cur.scenes.clear();
+    } else if (key == "smart") {
+        cur.smart = atoi(value.c_str()) != 0;
+    } else if (key == "outdir") {
+        cur.outputDir = Utf8ToWide(value);
+    } else {
+        error = L"unknown key " + Utf8ToWide(key);
+        return false;
+    }
+    return true;
+}
+
+// The request as job-file lines (inverse of ApplyJobSetting).
+static std::vector<std::string> SerializeJobSettings(const EncodeRequest& r)
+{
+    static const char* const kEngines[] = { "gpu", "cpu", "lut" };
+    std::vector<std::string> out;
+    out.push_back("input=" + WideToUtf8(r.input));
+    for (size_t i = 0; i < r.shaders.size(); ++i) {
+        std::string line = "shader=0|" + WideToUtf8(r.shaders[i]);
+        if (i < r.shaderParams.size() && !r.shaderParams[i].empty()) line += "|" + FormatShaderParams(r.shaderParams[i]);
+        out.push_back(line);
+    }
+    out.push_back("width=" + std::to_string(r.target.width));
+    out.push_back("height=" + std::to_string(r.target.height));
+    out.push_back(std::string("fit=") + (r.target.fit == FitMode::Fill ? "fill" : "fit"));
+    if (!r.target.pixFmt.empty()) out.push_back("pixfmt=" + WideToUtf8(r.target.pixFmt));
+    if (!r.target.colorspace.empty()) out.push_back("colorspace=" + WideToUtf8(r.target.colorspace));
+    out.push_back("bitrate=" + std::to_string(r.bitrateMbps));
+    out.push_back("encoder=" + WideToUtf8(r.encoder));
+    out.push_back(std::string("engine=") + kEngines[std::clamp(r.engine, 0, 2)]);
+    out.push_back("segments=" + std::to_string(r.segmentWorkers));
+    out.push_back(std::string("checkpoint=") + (r.checkpoint ? "1" : "0"));
+    for (const auto& range : r.previewRanges) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "range=%.3f-%.3f", range.inSec, range.outSec);
+        out.push_back(buf);
+    }
+    if (r.previewSamples > 0) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "at=%.3f", r.previewAt);
+        out.push_back("samples=" + std::to_string(r.previewSamples));
+        out.push_back(buf);
+    }
+    for (const auto& scene : r.scenes) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "scene=%.3f-%.3f", scene.inSec, scene.outSec);
+        std::string line = buf;
+        for (const auto& shader : scene.shaders) line += "|" + WideToUtf8(shader);
+        out.push_back(line);
+    }
+    out.push_back(std::string("smart=") + (r.smart ? "1" : "0"));
+    if (!r.outputDir.empty()) out.push_back("outdir=" + WideToUtf8(r.outputDir));
+    return out;
+}
+
+static bool SplitSettingLine(std::string& line, std::string& key, std::string& value)
+{
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    if (line.empty() || line[0] == '#') return false;
+    size_t eq = line.find('=');
+    key = (eq == std::string::npos) ? line : line.substr(0, eq);
+    value = (eq == std::string::npos) ? std::string() : line.substr(eq + 1);
+    return true;
+}
+
+static bool LoadBatchFile(const std::wstring& path, std::vector<EncodeRequest>& out, int& concurrency,
+                          std::wstring& error)
+{
+    std::ifstream f(FsPath(path), std::ios::binary);
+    if (!f) {
+        error = L"can't read " + path;
+        return false;
+    }
+    EncodeRequest cur;
+    std::string line, key, value;
+    int lineNo = 0;
+    while (std::getline(f, line)) {
+        ++lineNo;
+        if (!SplitSettingLine(line, key, value)) continue;
+        if (key == "jobs") {
+            concurrency = std::max(1, atoi(value.c_str()));
+        } else if (!ApplyJobSetting(cur, key, value, error)) {
+            error = L"line " + std::to_wstring(lineNo) + L": " + error;
+            return false;
+        } else if (key == "input") {
+            out.push_back(cur);
+        }
+    }
+    return true;
+}
+
+// Source size and duration for a request, from the probe cache.
+static void FillRequestFromProbe(EncodeRequest& req)
+{
+    MediaProbeResult probe = ProbeMediaAsync(req.input).get();
+    if (!probe.ok) return;
+    if (const MediaStreamInfo* v = probe.info.FirstVideo()) {
+        req.srcWidth = v->width;
+        req.srcHeight = v->height;
+    }
+    req.durationSec = probe.info.durationUs / 1000000.0;
+}
+
+static std::string JsonString(const std::wstring& w)
+{
+    std::string s = WideToUtf8(w);
+    std::string out = "\"";
+    for (char c : s) {
+        switch (c) {
+        case '"':  out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if ((unsigned char)c < 0x20) {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", c);
+                out += buf;
+            } else {
+                out.push_back(c);
+            }
+        }
+    }
+    return out + "\"";
+}
+
+static bool WriteBatchSummary(const std::wstring& path, const std::vector<BatchResult>& results, double seconds)
+{
+    size_t ok = 0;
+    for (const auto& r : results) ok += r.result.ok ? 1 : 0;
+    std::ofstream o(FsPath(path), std::ios::binary | std::ios::trunc);
+    if (!o) return false;
+    char num[64];
+    snprintf(num, sizeof(num), "%.3f", seconds);
+    o << "{\n  \"jobs\": " << results.size() << ",\n  \"succeeded\": " << ok << ",\n  \"failed\": "
+      << (results.size() - ok) << ",\n  \"seconds\": " << num << ",\n  \"results\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BatchResult& r = results[i];
+        snprintf(num, sizeof(num), "%.3f", r.seconds);
+        o << (i ? ",\n" : "\n") << "    {\"input\": " << JsonString(r.input) << ", \"output\": " << JsonString(r.output)
+          << ", \"log\": " << JsonString(r.logPath) << ", \"ok\": " << (r.result.ok ? "true" : "false")
+          << ", \"failure\": " << JsonString(r.result.ok ? L"none" : FfmpegFailureName(r.result.failure))
+          << ", \"message\": " << JsonString(Utf8ToWide(r.result.message)) << ", \"seconds\": " << num << "}";
+    }
+    o << "\n  ]\n}\n";
+    return (bool)o;
+}
+
+static void BatchPrint(const std::wstring& line)
+{
+    static std::mutex m;
+    std::lock_guard<std::mutex> lock(m);
+    fputs(WideToUtf8(line).c_str(), stdout);
+    fflush(stdout);
+}
+
+static const int kBatchProgressMs = 1000;
+
+static int RunBatch(const std::wstring& jobFile, int concurrency, std::wstring summaryPath, bool showProgress)
+{
+    std::vector<EncodeRequest> requests;
+    int fileConcurrency = 0;
+    std::wstring error;
+    if (!LoadBatchFile(jobFile, requests, fileConcurrency, error)) {
+        BatchPrint(L"error: " + error + L"\n");
+        return 2;
+    }
+    if (concurrency <= 0) concurrency = (fileConcurrency > 0) ? fileConcurrency : 1;
+    concurrency = std::clamp(concurrency, 1, std::max(1, (int)requests.size()));
+    if (summaryPath.empty()) summaryPath = jobFile + L".results.json";
+
+    for (const auto& r : requests) PrefetchMediaProbe(r.input);
+
+    auto t0 = std::chrono::steady_clock::now();
+    std::vector<BatchResult> results(requests.size());
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> finished{0};
+    auto worker = [&]() {
+        for (size_t i = next++; i < requests.size(); i = next++) {
+            auto start = std::chrono::steady_clock::now();
+            EncodeRequest req = requests[i];
+            FillRequestFromProbe(req);
+
+            EncodeJob job;
+            CombinedShaderRef combined;
+            std::wstring warning;
+            PrepareEncodeJob(req, job, combined, warning);
+            if (!warning.empty()) BatchPrint(FilenameOnly(req.input) + L": " + warning + L"\n");
+            job.progressId = i + 1;
+
+            BatchResult& r = results[i];
+            r.input = job.input;
+            r.output = job.output;
+            r.logPath = job.logPath;
+            r.result = RunEncodeJob(job, combined);
+            r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            wchar_t line[128];
+            swprintf_s(line, L"[%zu/%zu] %ls (%.1f s) ", ++finished, requests.size(),
+                       r.result.ok ? L"ok" : FfmpegFailureName(r.result.failure), r.seconds);
+            BatchPrint(line + r.input + L" -> " + (r.result.ok ? r.output : r.logPath) + L"\n");
+        }
+    };
+    std::mutex tickMutex;
+    std::condition_variable tickCv;
+    bool done = false;
+    std::thread ticker;
+    if (showProgress) {
+        ticker = std::thread([&]() {
+            std::unique_lock<std::mutex> lock(tickMutex);
+            while (!tickCv.wait_for(lock, std::chrono::milliseconds(kBatchProgressMs), [&]() { return done; })) {
+                std::vector<ProgressSnapshot> jobs = SnapshotProgress();
+                if (jobs.size() == 1) BatchPrint(L"  " + jobs[0].name + L": " + FormatProgress(jobs[0], false) + L"\n");
+                else if (!jobs.empty()) BatchPrint(L"  " + FormatProgressLine(jobs) + L"\n");
+            }
+        });
+    }
+    std::vector<std::thread> threads;
+    for (int t = 1; t < concurrency; ++t) threads.emplace_back(worker);
+    worker();
+    for (auto& t : threads) t.join();
+    if (ticker.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(tickMutex);
+            done = true;
+        }
+        tickCv.notify_all();
+        ticker.join();
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    if (!WriteBatchSummary(summaryPath, results, seconds)) {
+        BatchPrint(L"error: can't write " + summaryPath + L"\n");
+        return 2;
+    }
+    size_t failed = 0;
+    for (const auto& r : results) failed += r.result.ok ? 0 : 1;
+    BatchPrint(std::to_wstring(results.size() - failed) + L" of " + std::to_wstring(results.size()) +
+               L" succeeded; summary: " + summaryPath + L"\n");
+    return failed ? 1 : 0;
+}
+
+#ifdef _WIN32
+// Off Windows --batch is the default mode, so only wWinMain asks.
+static bool IsBatchCommandLine(const std::vector<std::wstring>& args)
+{
+    return std::find(args.begin(), args.end(), L"--batch") != args.end();
+}
+#endif
+
+// Every headless mode. Off Windows a command line that names none of them
+// lands in BatchMain, so its usage has to list them all.
+static void PrintUsage()
+{
+    BatchPrint(L"usage: VfxEnc --batch <jobs.txt> [--jobs N] [--summary <results.json>] [--progress]\n"
+               L"       VfxEnc --serve <service.txt>\n"
+               L"       VfxEnc --bench [bench.txt] [--out results.json] [--baseline old.json] [--tolerance pct]\n"
+               L"       VfxEnc --profile <video> [--chain shaders.txt] [--alone] [--start S] [--seconds T]\n"
+               L"                        [--device name] [--out report.json] [--watch]\n"
+               L"       VfxEnc --selftest\n");
+}
+
+// Returns the process exit code: 0 all jobs ok, 1 some failed, 2 usage/setup.
+static int BatchMain(const std::vector<std::wstring>& args)
+{
+    std::wstring jobFile, summary;
+    int concurrency = 0;
+    bool progress = false;
+    for (size_t i = 0; i < args.size(); ++i) {
+        bool hasValue = i + 1 < args.size();
+        if (args[i] == L"--batch" && hasValue) jobFile = args[++i];
+        else if (args[i] == L"--progress") progress = true;
+        else if (args[i] == L"--jobs" && hasValue) concurrency = std::max(1, (int)wcstol(args[++i].c_str(), nullptr, 10));
+        else if (args[i] == L"--summary" && hasValue) summary = args[++i];
+        else jobFile.clear(), i = args.size();
+    }
+    if (jobFile.empty()) {
+        PrintUsage();
+        return 2;
+    }
+    LoadSettings();
+    return RunBatch(jobFile, concurrency, summary, progress);
+}
+
+// ----------------------------
+// Encode service (watch folders + socket)
+// ----------------------------
+// VfxEnc --serve service.txt
+//
+// Runs until Ctrl+C / SIGTERM or a "shutdown" request; a second signal quits
+// without waiting for running encodes. The config takes the job-file keys
+// (they are the defaults for submissions and apply to later watch= lines) plus:
+//   watch=D:\incoming                 (encode videos that land here)
+//   settle=5                          (seconds a file must stop growing first)
+//   socket=/run/user/1000/vfxenc.sock (Unix-domain listener; not on Windows)
+//   port=7878                         (loopback TCP listener, 0 = off)
+//   jobs=2                            (concurrent encodes)
+//   queue=D:\vfxenc\queue.txt         (journal, default <appdata>/service_queue.txt)
+// Requests are one JSON object per line, each answered with one line:
+//   {"op":"submit","input":"/in/a.mp4","shaders":["0|/s/grade.glsl"],"height":720}
+//   {"op":"status"}   {"op":"status","id":3}   {"op":"cancel","id":3}   {"op":"shutdown"}
+// Cancelling drops a queued job and stops a running one at its next frame (or
+// next chunk of ffmpeg output); either way it ends failed with "cancelled".
+// Running jobs in a status reply carry their live "progress" (stage, pct, fps,
+// speed, eta), read from the progress table. Every job is journaled, so queued
+// and interrupted jobs run again after a restart and a watched file version
+// (path, size, mtime) is only queued once.
+enum class ServiceJobState { Queued, Running, Done, Failed };
+
+static const char* const kServiceJobStateNames[] = { "queued", "running", "done", "failed" };
+
+struct ServiceJob {
+    uint64_t id = 0;
+    std::string fileKey; // path|size|mtime for watched files, empty for submissions
+    EncodeRequest req;
+    std::wstring output;
+    std::wstring logPath;
+    ServiceJobState state = ServiceJobState::Queued;
+    FfmpegFailure failure = FfmpegFailure::None;
+    std::string message;
+    double seconds = 0.0;
+    std::shared_ptr<std::atomic<bool>> cancel; // the running EncodeJob's flag
+};
+
+struct WatchFolder {
+    std::wstring dir;
+    EncodeRequest settings; // job-file settings in effect at the watch= line
+};
+
+// A watched file that hasn't held still for settleSec yet.
+struct PendingFile {
+    size_t folder = 0;
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    std::chrono::steady_clock::time_point since;
+};
+
+struct EncodeService {
+    std::mutex m;
+    std::condition_variable cv;
+    std::map<uint64_t, ServiceJob> jobs;
+    std::deque<uint64_t> queue;
+    std::unordered_set<std::string> knownFiles;
+    uint64_t nextId = 1;
+    std::wstring journalPath;
+    size_t journalRecords = 0; // records in the file, including superseded ones
+    std::atomic<bool> stop{false};
+
+    // Config (set before any thread starts).
+    EncodeRequest defaults;
+    std::vector<WatchFolder> folders;
+    int settleSec = 5;
+    int concurrency = 1;
+    std::wstring socketPath;
+    int port = 0;
+
+    std::unordered_map<std::wstring, PendingFile> pending; // watcher thread only
+};
+
+static EncodeService g_service;
+
+static bool LoadServiceConfig(const std::wstring& path, std::wstring& error)
+{
+    std::ifstream f(FsPath(path), std::ios::binary);
+    if (!f) {
+        error = L"can't read " + path;
+        return false;
+    }
+    EncodeRequest& cur = g_service.defaults;
+    std::string line, key, value;
+    int lineNo = 0;
+    while (std::getline(f, line)) {
+        ++lineNo;
+        if (!SplitSettingLine(line, key, value)) continue;
+        if (key == "watch") {
+            g_service.folders.push_back(WatchFolder{ Utf8ToWide(value), cur });
+        } else if (key == "settle") {
+            g_service.settleSec = std::max(0, atoi(value.c_str()));
+        } else if (key == "socket") {
+            g_service.socketPath = Utf8ToWide(value);
+        } else if (key == "port") {
+            g_service.port = std::clamp(atoi(value.c_str()), 0, 65535);
+        } else if (key == "jobs") {
+            g_service.concurrency = std::max(1, atoi(value.c_str()));
+        } else if (key == "queue") {
+            g_service.journalPath = Utf8ToWide(value);
+        } else if (key == "input") {
+            error = L"line " + std::to_wstring(lineNo) + L": input= is for batch files; submit over the socket";
+            return false;
+        } else if (!ApplyJobSetting(cur, key, value, error)) {
+            error = L"line " + std::to_wstring(lineNo) + L": " + error;
+            return false;
+        }
+    }
+    if (g_service.journalPath.empty()) g_service.journalPath = JoinPath(GetAppDataDir(), L"service_queue.txt");
+    return true;
+}
+
+// ---- journal ----
+// Text, one record per line, appended as jobs change:
+//   add <tab> id <tab> fileKey <tab> key=value <tab> ...
+//   state <tab> id <tab> state <tab> failure <tab> seconds <tab> message
+
+static std::string JournalField(std::string s)
+{
+    for (char& c : s) {
+        if (c == '\t' || c == '\r' || c == '\n') c = ' ';
+    }
+    return s;
+}
+
+static std::string ServiceAddRecord(const ServiceJob& j)
+{
+    std::string rec = "add\t" + std::to_string(j.id) + "\t" + j.fileKey;
+    for (const auto& setting : SerializeJobSettings(j.req)) rec += "\t" + setting;
+    return rec + "\n";
+}
+
+static std::string ServiceStateRecord(const ServiceJob& j)
+{
+    char num[32];
+    snprintf(num, sizeof(num), "%.3f", j.seconds);
+    return "state\t" + std::to_string(j.id) + "\t" + kServiceJobStateNames[(int)j.state] + "\t" +
+           std::to_string((int)j.failure) + "\t" + num + "\t" + JournalField(j.message) + "\n";
+}
+
+static void RewriteJournalLocked()
+{
+    std::string data = "# VfxEnc service queue\n";
+    for (const auto& kv : g_service.jobs) {
+        data += ServiceAddRecord(kv.second);
+        if (kv.second.state != ServiceJobState::Queued) data += ServiceStateRecord(kv.second);
+    }
+    std::wstring tmp = g_service.journalPath + L".tmp";
+    {
+        std::ofstream o(FsPath(tmp), std::ios::binary | std::ios::trunc);
+        if (!o) return;
+        o.write(data.data(), (std::streamsize)data.size());
+        if (!o) return;
+    }
+    std::error_code ec;
+    std::filesystem::rename(FsPath(tmp), FsPath(g_service.journalPath), ec);
+    g_service.journalRecords = g_service.jobs.size();
+}
+
+static void AppendJournalLocked(const std::string& record)
+{
+    std::ofstream o(FsPath(g_service.journalPath), std::ios::binary | std::ios::app);
+    if (o) o.write(record.data(), (std::streamsize)record.size());
+    // Append-only like the probe cache; compact once state records dominate.
+    if (++g_service.journalRecords > 2 * g_service.jobs.size() + 64) RewriteJournalLocked();
+}
+
+static void FillServiceJobPaths(ServiceJob& j)
+{
+    j.output = EncodeOutputPath(j.req);
+    j.logPath = JoinPath(GetLogDir(), BasenameNoExt(j.output) + L".log");
+}
+
+// Replays the journal. Jobs that were running when the service stopped are
+// queued again.
+static void LoadServiceJournal()
+{
+    std::lock_guard<std::mutex> lock(g_service.m);
+    std::string data;
+    if (!ReadTextFile(g_service.journalPath, data)) return;
+    std::istringstream in(data);
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty() || line[0] == '#') continue;
+        std::vector<std::string> fields;
+        for (size_t pos = 0;;) {
+            size_t tab = line.find('\t', pos);
+            fields.push_back(line.substr(pos, tab - pos));
+            if (tab == std::string::npos) break;
+            pos = tab + 1;
+        }
+        if (fields.size() < 3) continue; // torn tail from a crash mid-append
+        uint64_t id = strtoull(fields[1].c_str(), nullptr, 10);
+        g_service.journalRecords++;
+        if (fields[0] == "add") {
+            ServiceJob j;
+            j.id = id;
+            j.fileKey = fields[2];
+            std::wstring error;
+            bool ok = true;
+            for (size_t i = 3; i < fields.size() && ok; ++i) {
+                std::string key, value;
+                ok = SplitSettingLine(fields[i], key, value) && ApplyJobSetting(j.req, key, value, error);
+            }
+            if (!ok || j.req.input.empty()) continue;
+            FillServiceJobPaths(j);
+            if (!j.fileKey.empty()) g_service.knownFiles.insert(j.fileKey);
+            g_service.nextId = std::max(g_service.nextId, id + 1);
+            g_service.jobs[id] = std::move(j);
+        } else if (fields[0] == "state" && fields.size() >= 6) {
+            auto it = g_service.jobs.find(id);
+            if (it == g_service.jobs.end()) continue;
+            ServiceJob& j = it->second;
+            for (int s = 0; s < 4; ++s) {
+                if (fields[2] == kServiceJobStateNames[s]) j.state = (ServiceJobState)s;
+            }
+            j.failure = (FfmpegFailure)atoi(fields[3].c_str());
+            j.seconds = atof(fields[4].c_str());
+            j.message = fields[5];
+        }
+    }
+    for (auto& kv : g_service.jobs) {
+        if (kv.second.state == ServiceJobState::Running) kv.second.state = ServiceJobState::Queued;
+        if (kv.second.state == ServiceJobState::Queued) g_service.queue.push_back(kv.first);
+    }
+    RewriteJournalLocked();
+}
+
+// ---- queue and workers ----
+
+static uint64_t EnqueueServiceJobLocked(const EncodeRequest& req, const std::string& fileKey)
+{
+    uint64_t id = g_service.nextId++;
+    ServiceJob j;
+    j.id = id;
+    j.fileKey = fileKey;
+    j.req = req;
+    FillServiceJobPaths(j);
+    if (!fileKey.empty()) g_service.knownFiles.insert(fileKey);
+    AppendJournalLocked(ServiceAddRecord(j));
+    g_service.queue.push_back(j.id);
+    g_service.jobs[id] = std::move(j);
+    g_service.cv.notify_one();
+    return id;
+}
+
+// Runs queued jobs until the service stops; a job already running is finished.
+static void ServiceWorker()
+{
+    std::unique_lock<std::mutex> lock(g_service.m);
+    while (true) {
+        g_service.cv.wait(lock, []() { return g_service.stop || !g_service.queue.empty(); });
+        if (g_service.stop) return;
+        ServiceJob& sj = g_service.jobs[g_service.queue.front()]; // map nodes don't move
+        g_service.queue.pop_front();
+        sj.state = ServiceJobState::Running;
+        AppendJournalLocked(ServiceStateRecord(sj));
+        EncodeRequest req = sj.req;
+        lock.unlock();
+
+        auto start = std::chrono::steady_clock::now();
+        FillRequestFromProbe(req);
+        EncodeJob job;
+        CombinedShaderRef combined;
+        std::wstring warning;
+        PrepareEncodeJob(req, job, combined, warning);
+        if (!warning.empty()) BatchPrint(FilenameOnly(req.input) + L": " + warning + L"\n");
+        job.progressId = sj.id;
+        lock.lock();
+        sj.cancel = job.cancel;
+        bool cancelled = sj.state != ServiceJobState::Running;
+        lock.unlock();
+        if (cancelled) *job.cancel = true; // cancelled while preparing
+        FfmpegResult result = RunEncodeJob(job, combined);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        lock.lock();
+        sj.cancel.reset();
+        sj.state = result.ok ? ServiceJobState::Done : ServiceJobState::Failed;
+        sj.output = job.output;
+        sj.logPath = job.logPath;
+        sj.failure = result.failure;
+        sj.message = result.message;
+        sj.seconds = seconds;
+        AppendJournalLocked(ServiceStateRecord(sj));
+
+        wchar_t line[128];
+        swprintf_s(line, L"#%llu %ls (%.1f s) ", (unsigned long long)sj.id,
+                   result.ok ? L"ok" : FfmpegFailureName(result.failure), seconds);
+        BatchPrint(line + job.input + L" -> " + (result.ok ? job.output : job.logPath) + L"\n");
+    }
+}
+
+// ---- watch folders ----
+
+static std::string ServiceFileKey(const std::wstring& path, uint64_t size, int64_t mtime)
+{
+    return WideToUtf8(path) + "|" + std::to_string(size) + "|" + std::to_string(mtime);
+}
+
+// A watched file appeared or changed: (re)start its settle timer unless this
+// version is already queued.
+static void NoteWatchedFile(size_t folder, const std::wstring& path)
+{
+    if (!IsLikelyVideo(path) || IsEncodeOutputName(path)) return;
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    if (!StatFile(path, size, mtime)) return;
+    {
+        std::lock_guard<std::mutex> lock(g_service.m);
+        if (g_service.knownFiles.count(ServiceFileKey(path, size, mtime))) return;
+    }
+    PendingFile& p = g_service.pending[path];
+    if (p.since == std::chrono::steady_clock::time_point() || p.size != size || p.mtime != mtime) {
+        p = PendingFile{ folder, size, mtime, std::chrono::steady_clock::now() };
+    }
+}
+
+static void ScanWatchFolder(size_t folder)
+{
+    std::error_code ec;
+    for (std::filesystem::directory_iterator it(FsPath(g_service.folders[folder].dir), ec), end; !ec && it != end;
+         it.increment(ec)) {
+        if (it->is_regular_file(ec)) NoteWatchedFile(folder, FromFsPath(it->path()));
+    }
+}
+
+// Queues pending files whose size and mtime held for settleSec; a writer that
+// is still copying keeps moving one or the other.
+static void SettlePendingFiles()
+{
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = g_service.pending.begin(); it != g_service.pending.end();) {
+        PendingFile& p = it->second;
+        uint64_t size = 0;
+        int64_t mtime = 0;
+        if (!StatFile(it->first, size, mtime)) {
+            it = g_service.pending.erase(it); // deleted or renamed away
+            continue;
+        }
+        if (size != p.size || mtime != p.mtime) {
+            p = PendingFile{ p.folder, size, mtime, now };
+        } else if (size > 0 && now - p.since >= std::chrono::seconds(g_service.settleSec)) {
+            EncodeRequest req = g_service.folders[p.folder].settings;
+            req.input = it->first;
+            std::lock_guard<std::mutex> lock(g_service.m);
+            std::string key = ServiceFileKey(it->first, size, mtime);
+            if (!g_service.knownFiles.count(key)) {
+                uint64_t id = EnqueueServiceJobLocked(req, key);
+                BatchPrint(L"#" + std::to_wstring(id) + L" queued " + it->first + L"\n");
+            }
+            it = g_service.pending.erase(it);
+            continue;
+        }
+        ++it;
+    }
+}
+
+// inotify on Linux; elsewhere (or if inotify is unavailable) the folders are
+// rescanned every 2 s.
+static void ServiceWatcher()
+{
+    for (size_t i = 0; i < g_service.folders.size(); ++i) ScanWatchFolder(i);
+
+#ifdef __linux__
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    std::unordered_map<int, size_t> watches; // wd -> folder
+    for (size_t i = 0; fd >= 0 && i < g_service.folders.size(); ++i) {
+        int wd = inotify_add_watch(fd, WideToUtf8(g_service.folders[i].dir).c_str(),
+                                   IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+        if (wd >= 0) watches[wd] = i;
+        else BatchPrint(L"warning: can't watch " + g_service.folders[i].dir + L"; polling it\n");
+    }
+    bool polling = fd < 0 || watches.size() < g_service.folders.size();
+#else
+    bool polling = true;
+#endif
+
+    auto lastScan = std::chrono::steady_clock::now();
+    while (!g_service.stop) {
+#ifdef __linux__
+        if (fd >= 0) {
+            pollfd pfd{ fd, POLLIN, 0 };
+            if (poll(&pfd, 1, 500) > 0) {
+                alignas(inotify_event) char buf[16384];
+                ssize_t n;
+                while ((n = read(fd, buf, sizeof(buf))) > 0) {
+                    for (char* p = buf; p < buf + n;) {
+                        const inotify_event* ev = (const inotify_event*)p;
+                        auto w = watches.find(ev->wd);
+                        if (ev->len && w != watches.end() && !(ev->mask & IN_ISDIR)) {
+                            NoteWatchedFile(w->second, JoinPath(g_service.folders[w->second].dir, Utf8ToWide(ev->name)));
+                        }
+                        p += sizeof(inotify_event) + ev->len;
+                    }
+                }
+            }
+        } else
+#endif
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        }
+        if (polling && std::chrono::steady_clock::now() - lastScan >= std::chrono::seconds(2)) {
+            for (size_t i = 0; i < g_service.folders.size(); ++i) ScanWatchFolder(i);
+            lastScan = std::chrono::steady_clock::now();
+        }
+        SettlePendingFiles();
+    }
+#ifdef __linux__
+    if (fd >= 0) close(fd);
+#endif
+}
+
+// ---- request protocol ----
+
+// Flat JSON objects only: string, number, bool and null values, and arrays of
+// strings.
+struct JsonValue {
+    enum Type { Null, Bool, Number, String, Array } type = Null;
+    bool b = false;
+    double num = 0.0;
+    std::string str; // UTF-8
+    std::vector<std::string> items;
+};
+
+struct JsonReader {
+    const char* p;
+    const char* end;
+
+    void Ws()
+    {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) ++p;
+    }
+
+    bool Eat(char c)
+    {
+        Ws();
+        if (p == end || *p != c) return false;
+        ++p;
+        return true;
+    }
+
+    bool Hex4(uint32_t& v)
+    {
+        if (end - p < 4) return false;
+        v = 0;
+        for (int i = 0; i < 4; ++i, ++p) {
+            int d = (*p >= '0' && *p <= '9') ? *p - '0' : (*p | 0x20) >= 'a' && (*p | 0x20) <= 'f' ? (*p | 0x20) - 'a' + 10 : -1;
+            if (d < 0) return false;
+            v = v * 16 + (uint32_t)d;
+        }
+        return true;
+    }
+
+    bool Str(std::string& out)
+    {
+        if (!Eat('"')) return false;
+        while (p < end && *p != '"') {
+            if (*p != '\\') {
+                out.push_back(*p++);
+                continue;
+            }
+            if (++p == end) return false;
+            char c = *p++;
+            switch (c) {
+            case 'b': out.push_back('\b'); break;
+            case 'f': out.push_back('\f'); break;
+            case 'n': out.push_back('\n'); break;
+            case 'r': out.push_back('\r'); break;
+            case 't': out.push_back('\t'); break;
+            case 'u': {
+                uint32_t cp = 0, lo = 0;
+                if (!Hex4(cp)) return false;
+                if (cp >= 0xD800 && cp < 0xDC00 && end - p >= 2 && p[0] == '\\' && p[1] == 'u') {
+                    p += 2;
+                    if (!Hex4(lo) || lo < 0xDC00 || lo > 0xDFFF) return false;
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                }
+                if (cp < 0x80) {
+                    out.push_back((char)cp);
+                } else if (cp < 0x800) {
+                    out.push_back((char)(0xC0 | (cp >> 6)));
+                    out.push_back((char)(0x80 | (cp & 0x3F)));
+                } else if (cp < 0x10000) {
+                    out.push_back((char)(0xE0 | (cp >> 12)));
+                    out.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+                    out.push_back((char)(0x80 | (cp & 0x3F)));
+                } else {
+                    out.push_back((char)(0xF0 | (cp >> 18)));
+                    out.push_back((char)(0x80 | ((cp >> 12) & 0x3F)));
+                    out.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+                    out.push_back((char)(0x80 | (cp & 0x3F)));
+                }
+                break;
+            }
+            default: out.push_back(c); break; // \" \\ \/
+            }
+        }
+        return Eat('"');
+    }
+
+    bool Word(const char* w)
+    {
+        size_t n = strlen(w);
+        if ((size_t)(end - p) < n || memcmp(p, w, n) != 0) return false;
+        p += n;
+        return true;
+    }
+
+    bool Value(JsonValue& v)
+    {
+        Ws();
+        if (p == end) return false;
+        if (*p == '"') {
+            v.type = JsonValue::String;
+            return Str(v.str);
+        }
+        if (*p == '[') {
+            v.type = JsonValue::Array;
+            ++p;
+            if (Eat(']')) return true;
+            do {
+                v.items.emplace_back();
+                if (!Str(v.items.back())) return false;
+            } while (Eat(','));
+            return Eat(']');
+        }
+        if (Word("true")) { v.type = JsonValue::Bool; v.b = true; return true; }
+        if (Word("false")) { v.type = JsonValue::Bool; return true; }
+        if (Word("null")) return true;
+        std::string digits(p, (size_t)std::min<ptrdiff_t>(end - p, 64)); // strtod needs a terminator
+        char* numEnd = nullptr;
+        v.type = JsonValue::Number;
+        v.num = strtod(digits.c_str(), &numEnd);
+        p += numEnd - digits.c_str();
+        return numEnd != digits.c_str();
+    }
+};
+
+static bool ParseJsonObject(std::string_view text, std::unordered_map<std::string, JsonValue>& out)
+{
+    JsonReader r{ text.data(), text.data() + text.size() };
+    if (!r.Eat('{')) return false;
+    if (r.Eat('}')) return true;
+    do {
+        std::string key;
+        JsonValue v;
+        if (!r.Str(key) || !r.Eat(':') || !r.Value(v)) return false;
+        out[key] = std::move(v);
+    } while (r.Eat(','));
+    return r.Eat('}');
+}
+
+// live: SnapshotProgress() taken for this reply; a running job's entry adds
+// "progress".
+static std::string ServiceJobJson(const ServiceJob& j, const std::vector<ProgressSnapshot>& live)
+{
+    char num[32];
+    snprintf(num, sizeof(num), "%.3f", j.seconds);
+    std::string out = "{\"id\": " + std::to_string(j.id) + ", \"state\": \"" + kServiceJobStateNames[(int)j.state] +
+                      "\", \"input\": " + JsonString(j.req.input) + ", \"output\": " + JsonString(j.output) +
+                      ", \"log\": " + JsonString(j.logPath) + ", \"failure\": " +
+                      JsonString(j.state == ServiceJobState::Failed ? FfmpegFailureName(j.failure) : L"none") +
+                      ", \"message\": " + JsonString(Utf8ToWide(j.message)) + ", \"seconds\": " + num;
+    if (j.state == ServiceJobState::Running) {
+        for (const auto& p : live) {
+            if (p.jobId != j.id) continue;
+            char nums[160];
+            snprintf(nums, sizeof(nums), "\"pct\": %.1f, \"fps\": %.1f, \"speed\": %.2f, \"eta\": %.0f", p.pct, p.fps,
+                     p.speed, p.etaSec);
+            out += ", \"progress\": {\"stage\": " + JsonString(p.text) + ", " + nums + "}";
+            break;
+        }
+    }
+    return out + "}";
+}
+
+static std::string ServiceError(const std::wstring& error)
+{
+    return "{\"ok\": false, \"error\": " + JsonString(error) + "}";
+}
+
+static std::string HandleSubmit(const std::unordered_map<std::string, JsonValue>& msg)
+{
+    EncodeRequest req = g_service.defaults;
+    std::wstring error;
+    for (const auto& kv : msg) {
+        const JsonValue& v = kv.second;
+        if (kv.first == "op") continue;
+        if (kv.first == "shaders" && v.type == JsonValue::Array) {
+            req.shaders.clear();
+            req.shaderParams.clear();
+            for (const auto& s : v.items) {
+                if (!ApplyJobSetting(req, "shader", s, error)) return ServiceError(error);
+            }
+            continue;
+        }
+        if (v.type != JsonValue::String && v.type != JsonValue::Number) {
+            return ServiceError(L"bad value for " + Utf8ToWide(kv.first));
+        }
+        std::string value = (v.type == JsonValue::Number) ? std::to_string((long long)v.num) : v.str;
+        if (!ApplyJobSetting(req, kv.first, value, error)) return ServiceError(error);
+    }
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    if (req.input.empty()) return ServiceError(L"missing input");
+    if (req.input.find_first_of(L"\t\r\n") != std::wstring::npos) return ServiceError(L"bad input path");
+    if (!StatFile(req.input, size, mtime)) return ServiceError(L"can't read " + req.input);
+
+    std::lock_guard<std::mutex> lock(g_service.m);
+    uint64_t id = EnqueueServiceJobLocked(req, std::string());
+    BatchPrint(L"#" + std::to_wstring(id) + L" submitted " + req.input + L"\n");
+    return "{\"ok\": true, \"id\": " + std::to_string(id) + "}";
+}
+
+// Totals plus the 100 most recent jobs (or one job by id).
+static std::string HandleStatus(const std::unordered_map<std::string, JsonValue>& msg)
+{
+    std::vector<ProgressSnapshot> live = SnapshotProgress();
+    std::lock_guard<std::mutex> lock(g_service.m);
+    auto idIt = msg.find("id");
+    if (idIt != msg.end()) {
+        auto it = g_service.jobs.find((uint64_t)idIt->second.num);
+        if (it == g_service.jobs.end()) return ServiceError(L"no such job");
+        return "{\"ok\": true, \"job\": " + ServiceJobJson(it->second, live) + "}";
+    }
+    size_t counts[4] = {};
+    for (const auto& kv : g_service.jobs) counts[(int)kv.second.state]++;
+    std::string out = "{\"ok\": true";
+    for (int s = 0; s < 4; ++s) out += std::string(", \"") + kServiceJobStateNames[s] + "\": " + std::to_string(counts[s]);
+    out += ", \"jobs\": [";
+    auto it = g_service.jobs.end();
+    for (size_t n = 0; n < 100 && it != g_service.jobs.begin(); ++n) --it;
+    for (bool first = true; it != g_service.jobs.end(); ++it, first = false) {
+        out += (first ? "" : ", ") + ServiceJobJson(it->second, live);
+    }
+    return out + "]}";
+}
+
+static std::string HandleCancel(const std::unordered_map<std::string, JsonValue>& msg)
+{
+    auto idIt = msg.find("id");
+    if (idIt == msg.end()) return ServiceError(L"missing id");
+    std::lock_guard<std::mutex> lock(g_service.m);
+    auto it = g_service.jobs.find((uint64_t)idIt->second.num);
+    if (it == g_service.jobs.end()) return ServiceError(L"no such job");
+    ServiceJob& sj = it->second;
+    if (sj.state == ServiceJobState::Done || sj.state == ServiceJobState::Failed) {
+        return ServiceError(L"job already finished");
+    }
+    if (sj.cancel) {
+        *sj.cancel = true; // the worker records the result
+    } else {
+        // Queued, or still being prepared: the worker sees the state change.
+        g_service.queue.erase(std::remove(g_service.queue.begin(), g_service.queue.end(), sj.id), g_service.queue.end());
+        sj.state = ServiceJobState::Failed;
+        sj.failure = FfmpegFailure::MidStream;
+        sj.message = "cancelled";
+        AppendJournalLocked(ServiceStateRecord(sj));
+    }
+    BatchPrint(L"#" + std::to_wstring(sj.id) + L" cancel requested\n");
+    return "{\"ok\": true}";
+}
+
+static std::string HandleServiceRequest(std::string_view line)
+{
+    std::unordered_map<std::string, JsonValue> msg;
+    if (!ParseJsonObject(line, msg)) return ServiceError(L"expected a JSON object");
+    std::string op = msg["op"].str;
+    if (op == "submit") return HandleSubmit(msg);
+    if (op == "status") return HandleStatus(msg);
+    if (op == "cancel") return HandleCancel(msg);
+    if (op == "shutdown") {
+        g_service.stop = true;
+        return "{\"ok\": true}";
+    }
+    return ServiceError(L"unknown op " + Utf8ToWide(op));
+}
+
+// ---- listeners ----
+
+#ifdef _WIN32
+typedef SOCKET ServiceSocket;
+static const ServiceSocket kNoSocket = INVALID_SOCKET;
+static void CloseServiceSocket(ServiceSocket s) { closesocket(s); }
+#else
+typedef int ServiceSocket;
+static const ServiceSocket kNoSocket = -1;
+static void CloseServiceSocket(ServiceSocket s) { close(s); }
+#endif
+
+static void ServeClient(ServiceSocket s)
+{
+    LineSplitter lines;
+    char buf[4096];
+    bool open = true;
+    int n;
+    while (open && (n = (int)recv(s, buf, sizeof(buf), 0)) > 0) {
+        lines.Feed(buf, (size_t)n, [&](std::string_view line) {
+            if (!open || line.empty()) return;
+            std::string reply = HandleServiceRequest(line) + "\n";
+            for (size_t sent = 0; open && sent < reply.size();) {
+                int k = (int)send(s, reply.data() + sent, (int)(reply.size() - sent), 0);
+                open = k > 0;
+                sent += (size_t)std::max(k, 0);
+            }
+        });
+    }
+    CloseServiceSocket(s);
+}
+
+static ServiceSocket OpenTcpListener(int port, std::wstring& error)
+{
+    ServiceSocket s = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // local clients only
+    int yes = 1;
+    if (s != kNoSocket) setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
+    if (s == kNoSocket || bind(s, (const sockaddr*)&addr, sizeof(addr)) != 0 || listen(s, 16) != 0) {
+        error = L"can't listen on 127.0.0.1:" + std::to_wstring(port);
+        if (s != kNoSocket) CloseServiceSocket(s);
+        return kNoSocket;
+    }
+    return s;
+}
+
+#ifndef _WIN32
+static ServiceSocket OpenUnixListener(const std::wstring& path, std::wstring& error)
+{
+    std::string p = WideToUtf8(path);
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (p.size() >= sizeof(addr.sun_path)) {
+        error = L"socket path too long: " + path;
+        return kNoSocket;
+    }
+    memcpy(addr.sun_path, p.c_str(), p.size() + 1);
+    unlink(p.c_str()); // stale socket from a previous run
+    ServiceSocket s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s == kNoSocket || bind(s, (const sockaddr*)&addr, sizeof(addr)) != 0 || chmod(p.c_str(), 0600) != 0 ||
+        listen(s, 16) != 0) {
+        error = L"can't listen on " + path;
+        if (s != kNoSocket) CloseServiceSocket(s);
+        return kNoSocket;
+    }
+    return s;
+}
+#endif
+
+// One thread per client; the accept loop wakes every 500 ms to check stop.
+static void ServiceListener(std::vector<ServiceSocket> listeners)
+{
+    while (!g_service.stop) {
+        fd_set set;
+        FD_ZERO(&set);
+        ServiceSocket maxFd = 0;
+        for (ServiceSocket s : listeners) {
+            FD_SET(s, &set);
+            maxFd = std::max(maxFd, s);
+        }
+        timeval tv{ 0, 500000 };
+        if (select((int)maxFd + 1, &set, nullptr, nullptr, &tv) <= 0) continue;
+        for (ServiceSocket s : listeners) {
+            if (!FD_ISSET(s, &set)) continue;
+            ServiceSocket c = accept(s, nullptr, nullptr);
+            if (c != kNoSocket) std::thread(ServeClient, c).detach();
+        }
+    }
+}
+
+// ---- entry ----
+
+#ifdef _WIN32
+static BOOL WINAPI ServiceCtrlHandler(DWORD)
+{
+    if (g_service.stop) ExitProcess(130);
+    g_service.stop = true;
+    return TRUE;
+}
+#else
+static void ServiceSignalHandler(int)
+{
+    if (g_service.stop) _exit(130);
+    g_service.stop = true;
+}
+#endif
+
+static bool IsServiceCommandLine(const std::vector<std::wstring>& args)
+{
+    return std::find(args.begin(), args.end(), L"--serve") != args.end();
+}
+
+// Returns the process exit code: 0 after a clean stop, 2 usage/setup.
+static int ServiceMain(const std::vector<std::wstring>& args)
+{
+    if (args.size() != 2 || args[0] != L"--serve") {
+        BatchPrint(L"usage: VfxEnc --serve <service.txt>\n");
+        return 2;
+    }
+    LoadSettings();
+    std::wstring error;
+    if (!LoadServiceConfig(args[1], error)) {
+        BatchPrint(L"error: " + error + L"\n");
+        return 2;
+    }
+
+    std::vector<ServiceSocket> listeners;
+#ifdef _WIN32
+    WSADATA wsa;
+    WSAStartup(MAKEWORD(2, 2), &wsa);
+    if (!g_service.socketPath.empty()) {
+        BatchPrint(L"error: socket= needs Unix-domain sockets; use port=\n");
+        return 2;
+    }
+#else
+    if (!g_service.socketPath.empty()) listeners.push_back(OpenUnixListener(g_service.socketPath, error));
+#endif
+    if (g_service.port > 0) listeners.push_back(OpenTcpListener(g_service.port, error));
+    if (std::find(listeners.begin(), listeners.end(), kNoSocket) != listeners.end()) {
+        BatchPrint(L"error: " + error + L"\n");
+        return 2;
+    }
+    if (listeners.empty() && g_service.folders.empty()) {
+        BatchPrint(L"error: nothing to serve (no watch=, socket= or port=)\n");
+        return 2;
+    }
+
+    LoadServiceJournal();
+    BatchPrint(L"serving; " + std::to_wstring(g_service.queue.size()) + L" queued from " + g_service.journalPath +
+               L"\n");
+
+#ifdef _WIN32
+    SetConsoleCtrlHandler(ServiceCtrlHandler, TRUE);
+#else
+    signal(SIGINT, ServiceSignalHandler);
+    signal(SIGTERM, ServiceSignalHandler);
+#endif
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < g_service.concurrency; ++i) threads.emplace_back(ServiceWorker);
+    if (!g_service.folders.empty()) threads.emplace_back(ServiceWatcher);
+    if (!listeners.empty()) threads.emplace_back(ServiceListener, listeners);
+
+    // Signal handlers can only set the flag, so the workers are woken from here.
+    while (!g_service.stop) std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    BatchPrint(L"stopping; waiting for running jobs\n");
+    {
+        std::lock_guard<std::mutex> lock(g_service.m); // no worker is between its check and its wait
+    }
+    g_service.cv.notify_all();
+    for (auto& t : threads) t.join();
+
+    for (ServiceSocket s : listeners) CloseServiceSocket(s);
+#ifndef _WIN32
+    if (!g_service.socketPath.empty()) unlink(WideToUtf8(g_service.socketPath).c_str());
+#endif
+    BatchPrint(L"stopped\n");
+    return 0;
+}
+
+// ----------------------------
+// Benchmark (headless)
+// ----------------------------
+// VfxEnc --bench [bench.txt] [--out results.json] [--baseline old.json] [--tolerance 10]
+//
+// Encodes synthetic sources through the real pipeline (PrepareEncodeJob and
+// RunEncodeJob, so the same BuildEncoderArgs command lines and filter chains)
+// for every combination of the lists below. Every key is optional:
+//   sizes=1080p,1440p,4k
+//   sources=testsrc2,mandelbrot        (lavfi generators)
+//   seconds=10                         (30 fps)
+//   encoders=libx265,libx265:fast      (encoder[:preset]; default = available)
+//   engines=gpu,cpu,lut
+//   shader=0|D:\shaders\grade.glsl     (shader pool for chains, in order)
+//   chains=0,1,3                       (first N pool entries, the last repeated)
+//   bitrate=20                         (Mbps)
+//   repeat=3                           (runs per case; the fastest is kept)
+// Sources are generated once into <appdata>/bench. Results (one case per
+// line) go to --out, default <bench file>.results.json or bench_results.json.
+// With --baseline, cases that got slower or bigger in memory by more than the
+// tolerance (percent), or that now fail, are flagged and the exit code is 1.
+// A case only counts if it ran on the engine it names: there is no CPU
+// fallback when libplacebo fails, and one the pipeline switched anyway (a LUT
+// that didn't bake, a chain the CPU grade can't run) fails as "ran <engine>".
+struct BenchConfig {
+    std::vector<std::wstring> sizes{ L"1080p" };
+    std::vector<std::wstring> sources{ L"testsrc2" };
+    int seconds = 10;
+    std::vector<std::wstring> encoders; // empty = available
+    std::vector<int> engines{ 0 };
+    std::vector<std::wstring> shaderPool;
+    std::vector<ShaderParams> shaderPoolParams; // parallel to shaderPool
+    std::vector<int> chains{ 0 };
+    int bitrateMbps = 20;
+    int repeat = 1;
+};
+
+struct BenchCase {
+    std::wstring name; // size/source/encoder/engine/chainN, the baseline key
+    std::wstring size;
+    std::wstring source;
+    std::wstring encoder;
+    int engine = 0;
+    int engineRan = -1; // what RunEncodeJob actually used; -1 = didn't start
+    int chain = 0;
+    bool ok = false;
+    std::wstring failure = L"none";
+    std::wstring warning;
+    double wallSec = 0.0;
+    double fps = 0.0;
+    double speed = 0.0;
+    uint64_t peakRssKb = 0;
+    uint64_t outputBytes = 0;
+    std::wstring regression; // filled by the baseline comparison
+};
+
+static const int kBenchFps = 30;
+static const wchar_t* const kBenchEngines[] = { L"gpu", L"cpu", L"lut" };
+
+static std::vector<std::wstring> SplitCommaList(const std::string& value)
+{
+    std::vector<std::wstring> out;
+    std::wstringstream list(Utf8ToWide(value));
+    for (std::wstring item; std::getline(list, item, L',');) {
+        if (!item.empty()) out.push_back(item);
+    }
+    return out;
+}
+
+static bool LoadBenchConfig(const std::wstring& path, BenchConfig& cfg, std::wstring& error)
+{
+    std::ifstream f(FsPath(path), std::ios::binary);
+    if (!f) {
+        error = L"can't read " + path;
+        return false;
+    }
+    std::string line, key, value;
+    int lineNo = 0;
+    while (std::getline(f, line)) {
+        ++lineNo;
+        if (!SplitSettingLine(line, key, value)) continue;
+        if (key == "sizes") cfg.sizes = SplitCommaList(value);
+        else if (key == "sources") cfg.sources = SplitCommaList(value);
+        else if (key == "seconds") cfg.seconds = std::max(1, atoi(value.c_str()));
+        else if (key == "encoders") cfg.encoders = SplitCommaList(value);
+        else if (key == "bitrate") cfg.bitrateMbps = std::max(1, atoi(value.c_str()));
+        else if (key == "repeat") cfg.repeat = std::max(1, atoi(value.c_str()));
+        else if (key == "engines" || key == "chains") {
+            std::vector<int>& out = (key == "engines") ? cfg.engines : cfg.chains;
+            out.clear();
+            for (const auto& item : SplitCommaList(value)) {
+                if (key == "chains") out.push_back(std::max(0, (int)wcstol(item.c_str(), nullptr, 10)));
+                else out.push_back(item == L"cpu" ? 1 : item == L"lut" ? 2 : 0);
+            }
+        } else if (key == "shader") {
+            std::wstring shader;
+            bool bypass = false;
+            ShaderParams params;
+            if (!ParseShaderLine(value, shader, bypass, params)) {
+                error = L"line " + std::to_wstring(lineNo) + L": not a shader: " + Utf8ToWide(value);
+                return false;
+            }
+            if (!bypass) {
+                cfg.shaderPool.push_back(shader);
+                cfg.shaderPoolParams.push_back(params);
+            }
+        } else {
+            error = L"line " + std::to_wstring(lineNo) + L": unknown key " + Utf8ToWide(key);
+            return false;
+        }
+    }
+    return true;
+}
+
+// "1080p" (16:9), "4k" or "WxH".
+static bool ParseBenchSize(const std::wstring& size, int& w, int& h)
+{
+    if (size == L"4k" || size == L"4K") {
+        w = 3840;
+        h = 2160;
+        return true;
+    }
+    if (swscanf(size.c_str(), L"%dx%d", &w, &h) == 2) return w > 0 && h > 0;
+    h = (int)wcstol(size.c_str(), nullptr, 10);
+    w = ((h * 16 / 9) + 1) & ~1;
+    return h > 0 && EndsWithI(size, L"p");
+}
+
+// Generates (or reuses) <appdata>/bench/<source>_<W>x<H>_<sec>s.mp4: near
+// lossless x264, so decoding the source costs about the same on every run.
+static bool EnsureBenchSource(const std::wstring& ffmpeg, const std::wstring& source, int w, int h, int seconds,
+                              std::wstring& path)
+{
+    std::wstring dir = JoinPath(GetAppDataDir(), L"bench");
+    std::error_code ec;
+    std::filesystem::create_directories(FsPath(dir), ec);
+    wchar_t name[128];
+    swprintf_s(name, L"%ls_%dx%d_%ds.mp4", source.c_str(), w, h, seconds);
+    path = JoinPath(dir, name);
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    if (StatFile(path, size, mtime) && size > 0) return true;
+
+    wchar_t gen[128];
+    swprintf_s(gen, L"%ls=s=%dx%d:r=%d", source.c_str(), w, h, kBenchFps);
+    std::wstring tmp = path + L".tmp.mp4";
+    std::wstring cmd = Quote(ffmpeg) + L" -hide_banner -y -f lavfi -i " + gen + L" -t " + std::to_wstring(seconds) +
+                       L" -c:v libx264 -preset veryfast -crf 12 -g 60 -pix_fmt yuv420p -an " + Quote(tmp);
+    BatchPrint(L"generating " + path + L"\n");
+    if (RunProcessStreaming(cmd, GetExeDir(), nullptr) != 0) return false;
+    std::filesystem::rename(FsPath(tmp), FsPath(path), ec);
+    return !ec;
+}
+
+static std::string BenchCaseJson(const BenchCase& c)
+{
+    char nums[256];
+    snprintf(nums, sizeof(nums),
+             "\"seconds\": %.3f, \"fps\": %.2f, \"speed\": %.3f, \"peakRssMB\": %.1f, \"outputBytes\": %llu",
+             c.wallSec, c.fps, c.speed, c.peakRssKb / 1024.0, (unsigned long long)c.outputBytes);
+    return "{\"name\": " + JsonString(c.name) + ", \"size\": " + JsonString(c.size) + ", \"source\": " +
+           JsonString(c.source) + ", \"encoder\": " + JsonString(c.encoder) + ", \"engine\": " +
+           JsonString(kBenchEngines[c.engine]) + ", \"engineRan\": " +
+           JsonString(c.engineRan >= 0 ? kBenchEngines[c.engineRan] : L"") + ", \"chain\": " + std::to_string(c.chain) +
+           ", \"ok\": " + (c.ok ? "true" : "false") + ", \"failure\": " + JsonString(c.failure) +
+           ", \"warning\": " + JsonString(c.warning) + ", " + nums + ", \"regression\": " +
+           JsonString(c.regression) + "}";
+}
+
+static bool WriteBenchResults(const std::wstring& path, const std::wstring& ffmpegVersion,
+                              const std::vector<BenchCase>& cases)
+{
+    std::ofstream o(FsPath(path), std::ios::binary | std::ios::trunc);
+    if (!o) return false;
+    // One case per line, so --baseline can read a results file back with the
+    // flat object parser.
+    o << "{\n  \"ffmpeg\": " << JsonString(ffmpegVersion) << ",\n  \"cpus\": " << std::thread::hardware_concurrency()
+      << ",\n  \"cases\": [\n";
+    for (size_t i = 0; i < cases.size(); ++i) {
+        o << "    " << BenchCaseJson(cases[i]) << (i + 1 < cases.size() ? ",\n" : "\n");
+    }
+    o << "  ]\n}\n";
+    return (bool)o;
+}
+
+// Case objects of a results file, by name.
+static bool LoadBenchBaseline(const std::wstring& path,
+                              std::unordered_map<std::string, std::unordered_map<std::string, JsonValue>>& out)
+{
+    std::string data;
+    if (!ReadTextFile(path, data)) return false;
+    std::istringstream in(data);
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t open = line.find("{\"name\"");
+        size_t close = line.rfind('}');
+        if (open == std::string::npos || close == std::string::npos) continue;
+        std::unordered_map<std::string, JsonValue> obj;
+        if (ParseJsonObject(std::string_view(line).substr(open, close + 1 - open), obj)) {
+            std::string name = obj["name"].str;
+            out[name] = std::move(obj);
+        }
+    }
+    return true;
+}
+
+// Fills c.regression; size drift is reported but doesn't count.
+static bool CompareBenchCase(BenchCase& c, const std::unordered_map<std::string, JsonValue>& base, double tolerancePct,
+                             std::wstring& note)
+{
+    auto num = [&](const char* key) {
+        auto it = base.find(key);
+        return (it == base.end()) ? 0.0 : it->second.num;
+    };
+    auto okIt = base.find("ok");
+    bool baseOk = okIt != base.end() && okIt->second.b;
+    double tol = tolerancePct / 100.0;
+    wchar_t buf[128];
+    if (baseOk && !c.ok) {
+        c.regression = L"now fails (" + c.failure + L")";
+    } else if (baseOk && num("fps") > 0.0 && c.fps < num("fps") * (1.0 - tol)) {
+        swprintf_s(buf, L"fps %.1f -> %.1f (%.0f%%)", num("fps"), c.fps, (c.fps / num("fps") - 1.0) * 100.0);
+        c.regression = buf;
+    } else if (baseOk && num("peakRssMB") > 0.0 && c.peakRssKb / 1024.0 > num("peakRssMB") * (1.0 + tol) &&
+               c.peakRssKb / 1024.0 - num("peakRssMB") > 16.0) {
+        swprintf_s(buf, L"peak RSS %.0f -> %.0f MB", num("peakRssMB"), c.peakRssKb / 1024.0);
+        c.regression = buf;
+    }
+    double baseBytes = num("outputBytes");
+    if (c.ok && baseBytes > 0.0 && std::fabs(c.outputBytes / baseBytes - 1.0) > tol) {
+        swprintf_s(buf, L"output size %+.0f%%", (c.outputBytes / baseBytes - 1.0) * 100.0);
+        note = buf;
+    }
+    return !c.regression.empty();
+}
+
+static std::wstring FfmpegVersionLine(const std::wstring& ffmpeg)
+{
+    std::string out;
+    RunProcessStreaming(Quote(ffmpeg) + L" -hide_banner -version", L"", [&](const char* data, size_t n) {
+        out.append(data, n);
+        return out.size() < 4096;
+    });
+    return Utf8ToWide(out.substr(0, out.find('\n')));
+}
+
+static int RunBenchmark(const BenchConfig& cfg, const std::wstring& outPath, const std::wstring& baselinePath,
+                        double tolerancePct)
+{
+    std::wstring ffmpeg;
+    if (!FindFfmpeg(ffmpeg)) {
+        BatchPrint(L"error: ffmpeg not found\n");
+        return 2;
+    }
+    std::unordered_map<std::string, std::unordered_map<std::string, JsonValue>> baseline;
+    if (!baselinePath.empty() && !LoadBenchBaseline(baselinePath, baseline)) {
+        BatchPrint(L"error: can't read " + baselinePath + L"\n");
+        return 2;
+    }
+    std::vector<std::wstring> encoders = cfg.encoders.empty() ? GetAvailableEncoders(ffmpeg) : cfg.encoders;
+    if (encoders.empty()) {
+        BatchPrint(L"error: no working encoder found\n");
+        return 2;
+    }
+    std::wstring outDir = JoinPath(JoinPath(GetAppDataDir(), L"bench"), L"out");
+    std::error_code ec;
+    std::filesystem::create_directories(FsPath(outDir), ec);
+
+    // Without a shader pool every chain length is the empty chain; run it once.
+    std::vector<int> chains;
+    for (int chain : cfg.chains) {
+        int n = cfg.shaderPool.empty() ? 0 : chain;
+        if (std::find(chains.begin(), chains.end(), n) == chains.end()) chains.push_back(n);
+    }
+
+    std::vector<BenchCase> cases;
+    int regressions = 0;
+    for (const auto& size : cfg.sizes) {
+        int w = 0, h = 0;
+        if (!ParseBenchSize(size, w, h)) {
+            BatchPrint(L"error: bad size " + size + L"\n");
+            return 2;
+        }
+        for (const auto& source : cfg.sources) {
+            std::wstring input;
+            if (!EnsureBenchSource(ffmpeg, source, w, h, cfg.seconds, input)) {
+                BatchPrint(L"error: can't generate " + source + L" at " + size + L"\n");
+                return 2;
+            }
+            for (const auto& encoder : encoders) {
+                for (int engine : cfg.engines) {
+                    for (int chain : chains) {
+                        BenchCase c;
+                        c.size = size;
+                        c.source = source;
+                        c.encoder = encoder;
+                        c.engine = engine;
+                        c.chain = chain;
+                        c.name = size + L"/" + source + L"/" + encoder + L"/" + kBenchEngines[engine] + L"/chain" +
+                                 std::to_wstring(c.chain);
+
+                        EncodeRequest req;
+                        req.input = input;
+                        req.outputDir = outDir;
+                        for (int i = 0; i < c.chain; ++i) {
+                            size_t pick = std::min<size_t>(i, cfg.shaderPool.size() - 1);
+                            req.shaders.push_back(cfg.shaderPool[pick]);
+                            req.shaderParams.push_back(cfg.shaderPoolParams[pick]);
+                        }
+                        req.bitrateMbps = cfg.bitrateMbps;
+                        req.encoder = encoder;
+                        req.engine = engine;
+                        req.srcWidth = w;
+                        req.srcHeight = h;
+                        req.durationSec = cfg.seconds;
+
+                        for (int run = 0; run < cfg.repeat; ++run) {
+                            EncodeJob job;
+                            CombinedShaderRef combined;
+                            PrepareEncodeJob(req, job, combined, c.warning);
+                            job.cpuFallback = false;
+                            g_childPeakRssKb = 0;
+                            auto start = std::chrono::steady_clock::now();
+                            FfmpegResult r = RunEncodeJob(job, combined);
+                            double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                            c.engineRan = job.engineRan;
+                            c.ok = r.ok;
+                            c.failure = r.ok ? L"none" : FfmpegFailureName(r.failure);
+                            if (r.ok && job.engineRan != engine) {
+                                c.ok = false;
+                                c.failure = std::wstring(L"ran ") + kBenchEngines[job.engineRan];
+                            }
+                            c.peakRssKb = std::max(c.peakRssKb, g_childPeakRssKb.load());
+                            if (!r.ok) break;
+                            if (run == 0 || wall < c.wallSec) c.wallSec = wall;
+                            int64_t mtime = 0;
+                            StatFile(job.output, c.outputBytes, mtime);
+                        }
+                        if (c.ok) {
+                            c.fps = cfg.seconds * kBenchFps / c.wallSec;
+                            c.speed = cfg.seconds / c.wallSec;
+                        }
+
+                        std::wstring note;
+                        auto base = baseline.find(WideToUtf8(c.name));
+                        if (base != baseline.end() && CompareBenchCase(c, base->second, tolerancePct, note)) {
+                            regressions++;
+                        }
+                        wchar_t line[160];
+                        swprintf_s(line, L"%-48ls %ls %7.1f fps %6.2fx %6.0f MB  ", c.name.c_str(),
+                                   c.ok ? L"ok  " : L"FAIL", c.fps, c.speed, c.peakRssKb / 1024.0);
+                        std::wstring flags = !c.regression.empty() ? L"REGRESSION: " + c.regression : !c.ok ? c.failure : note;
+                        BatchPrint(line + flags + L"\n");
+                        cases.push_back(c);
+                    }
+                }
+            }
+        }
+    }
+
+    if (!WriteBenchResults(outPath, FfmpegVersionLine(ffmpeg), cases)) {
+        BatchPrint(L"error: can't write " + outPath + L"\n");
+        return 2;
+    }
+    BatchPrint(std::to_wstring(cases.size()) + L" cases; results: " + outPath + L"\n");
+    if (!baselinePath.empty()) {
+        BatchPrint(std::to_wstring(regressions) + L" regression(s) against " + baselinePath + L"\n");
+    }
+    return regressions ? 1 : 0;
+}
+
+static bool IsBenchCommandLine(const std::vector<std::wstring>& args)
+{
+    return std::find(args.begin(), args.end(), L"--bench") != args.end();
+}
+
+// Returns the process exit code: 0 ok, 1 regressions against the baseline, 2 usage/setup.
+static int BenchMain(const std::vector<std::wstring>& args)
+{
+    std::wstring benchFile, outPath, baseline;
+    double tolerance = 10.0;
+    bool usage = false;
+    for (size_t i = 0; i < args.size(); ++i) {
+        bool hasValue = i + 1 < args.size() && args[i + 1].compare(0, 2, L"--") != 0;
+        if (args[i] == L"--bench") { if (hasValue) benchFile = args[++i]; }
+        else if (args[i] == L"--out" && hasValue) outPath = args[++i];
+        else if (args[i] == L"--baseline" && hasValue) baseline = args[++i];
+        else if (args[i] == L"--tolerance" && hasValue) tolerance = std::max(0.0, wcstod(args[++i].c_str(), nullptr));
+        else usage = true;
+    }
+    if (usage) {
+        BatchPrint(L"usage: VfxEnc --bench [bench.txt] [--out results.json] [--baseline old.json] [--tolerance pct]\n");
+        return 2;
+    }
+    LoadSettings();
+    BenchConfig cfg;
+    std::wstring error;
+    if (!benchFile.empty() && !LoadBenchConfig(benchFile, cfg, error)) {
+        BatchPrint(L"error: " + error + L"\n");
+        return 2;
+    }
+    if (outPath.empty()) outPath = benchFile.empty() ? L"bench_results.json" : benchFile + L".results.json";
+    return RunBenchmark(cfg, outPath, baseline, tolerance);
+}
+
+// ----------------------------
+// Shader profiler
+// ----------------------------
+// VfxEnc --profile video.mp4 [--chain shaders.txt] [--alone] [--start S] [--seconds T]
+//        [--device llvmpipe] [--out report.json]
+//
+// Runs a short sample of the video through libplacebo=custom_shader_path with
+// growing prefixes of the active chain (or, with --alone, each shader by
+// itself), combined exactly as an encode would combine them, into -f null.
+// ms/frame is measured between the first decoded frame and the end of the
+// sample, so Vulkan setup and shader compilation are reported separately as
+// startup. The default chain is the saved one (shaders.txt, bypassed entries
+// skipped). --device picks the Vulkan device by name; without one, a POSIX box
+// whose default device fails retries on llvmpipe (lavapipe).
+struct ProfileRequest {
+    std::wstring input;
+    std::vector<std::wstring> shaders;
+    std::vector<ShaderParams> shaderParams; // per shaders[i] overrides
+    bool alone = false;       // each shader by itself instead of prefixes
+    double startSec = -1.0;   // -1 = 10% into the video
+    double seconds = 5.0;
+    std::wstring device;      // Vulkan device name; empty = ffmpeg's default
+};
+
+struct ProfileRow {
+    std::wstring shader;      // empty = no shaders (the baseline)
+    int passes = 0;           // after pruning and fusing, as encodes run them
+    double msPerFrame = 0.0;
+    double marginalMs = 0.0;  // vs. the previous prefix (or the baseline when alone)
+    double startupMs = 0.0;
+    bool ok = false;
+};
+
+struct ProfileReport {
+    std::wstring input;
+    std::wstring device;
+    bool alone = false;
+    double startSec = 0.0;
+    double seconds = 0.0;
+    int64_t frames = 0;
+    std::vector<ProfileRow> rows; // rows[0] is the baseline
+    std::wstring error;
+};
+
+// One pass over the sample; the faster of two runs counts.
+static bool MeasureShaderChain(const ProfileRequest& pr, const std::wstring& ffmpeg, const std::vector<std::wstring>& shaders,
+                               const std::vector<ShaderParams>& params, const std::wstring& device, ProfileRow& row,
+                               int64_t& frames, FfmpegResult& result, EncodeLog& log)
+{
+    CombinedShaderRef combined;
+    std::wstring error;
+    row.ok = false;
+    if (!shaders.empty() && !AcquireCombinedShader(shaders, params, combined, &error) && !error.empty()) {
+        log.WriteLine(error + L"\r\n");
+        result = FfmpegResult();
+        result.failure = FfmpegFailure::InputIO;
+        result.message = WideToUtf8(error);
+        return false;
+    }
+    row.passes = combined.passes.passesOut;
+    std::wstring vf = PlanLibplaceboFilter(combined.path.empty() ? L"" : FfmpegEscapeFilterValue(combined.relName),
+                                           OutputTarget(), 0, 0);
+    wchar_t sample[96];
+    swprintf_s(sample, L" -ss %.3f -t %.3f", pr.startSec, pr.seconds);
+    std::wstring cmd = Quote(ffmpeg) + L" -hide_banner" + sample + L" -i " + Quote(pr.input) + L" -an";
+    if (!device.empty()) cmd += L" -init_hw_device " + Quote(L"vulkan=vk:" + device) + L" -filter_hw_device vk";
+    cmd += L" -vf " + Quote(vf) + L" -f null - -stats_period 0.1 -progress pipe:1 -nostats";
+
+    row.ok = false;
+    for (int run = 0; run < 2; ++run) {
+        auto start = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point first, last;
+        int64_t firstFrame = -1, lastFrame = 0;
+        result = RunFfmpegLogged(cmd, GetExeDir(), log, [&](const FfmpegProgress& p) {
+            auto now = std::chrono::steady_clock::now();
+            if (p.frame > 0 && firstFrame < 0) {
+                first = now;
+                firstFrame = p.frame;
+            }
+            last = now;
+            lastFrame = p.frame;
+        });
+        if (!result.ok) break;
+        if (firstFrame < 0 || lastFrame <= firstFrame) {
+            result.ok = false;
+            result.failure = FfmpegFailure::InputIO;
+            result.message = "sample too short to time (use a longer --seconds)";
+            break;
+        }
+        double ms = std::chrono::duration<double, std::milli>(last - first).count() / (double)(lastFrame - firstFrame);
+        double startupMs = std::chrono::duration<double, std::milli>(first - start).count();
+        if (!row.ok || ms < row.msPerFrame) {
+            row.msPerFrame = ms;
+            row.startupMs = startupMs;
+        }
+        row.ok = true;
+        frames = lastFrame;
+    }
+    ReleaseCombinedShader(combined);
+    return row.ok;
+}
+
+static bool RunShaderProfile(ProfileRequest pr, ProfileReport& report, EncodeLog& log)
+{
+    std::wstring ffmpeg;
+    if (!FindFfmpeg(ffmpeg)) {
+        report.error = L"ffmpeg not found";
+        return false;
+    }
+    if (pr.startSec < 0.0) {
+        MediaProbeResult probe = ProbeMediaAsync(pr.input).get();
+        double duration = probe.ok ? probe.info.durationUs / 1000000.0 : 0.0;
+        pr.startSec = std::max(0.0, std::min(duration * 0.1, duration - pr.seconds));
+    }
+    report.input = pr.input;
+    report.alone = pr.alone;
+    report.startSec = pr.startSec;
+    report.seconds = pr.seconds;
+    report.device = pr.device;
+
+    ProfileRow base;
+    FfmpegResult result;
+    MeasureShaderChain(pr, ffmpeg, {}, {}, report.device, base, report.frames, result, log);
+#ifndef _WIN32
+    if (!base.ok && report.device.empty() && result.failure == FfmpegFailure::FilterInit) {
+        log.WriteLine(L"\r\n=== Default Vulkan device failed; retrying on llvmpipe ===\r\n");
+        report.device = L"llvmpipe";
+        MeasureShaderChain(pr, ffmpeg, {}, {}, report.device, base, report.frames, result, log);
+    }
+#endif
+    if (!base.ok) {
+        report.error = L"libplacebo baseline failed (" + std::wstring(FfmpegFailureName(result.failure)) + L")";
+        if (!result.message.empty()) report.error += L": " + Utf8ToWide(result.message);
+        return false;
+    }
+    report.rows.push_back(base);
+
+    double prev = base.msPerFrame;
+    for (size_t i = 0; i < pr.shaders.size(); ++i) {
+        std::vector<std::wstring> chain;
+        std::vector<ShaderParams> params;
+        if (pr.alone) {
+            chain.push_back(pr.shaders[i]);
+            if (i < pr.shaderParams.size()) params.push_back(pr.shaderParams[i]);
+        } else {
+            chain.assign(pr.shaders.begin(), pr.shaders.begin() + i + 1);
+            params = pr.shaderParams;
+        }
+        ProfileRow row;
+        row.shader = pr.shaders[i];
+        int64_t frames = 0;
+        if (MeasureShaderChain(pr, ffmpeg, chain, params, report.device, row, frames, result, log)) {
+            row.marginalMs = row.msPerFrame - (pr.alone ? base.msPerFrame : prev);
+            prev = row.msPerFrame;
+        }
+        report.rows.push_back(row);
+    }
+    return true;
+}
+
+static std::wstring FormatProfileTable(const ProfileReport& r)
+{
+    double total = 0.0;
+    for (size_t i = 1; i < r.rows.size(); ++i) total += std::max(0.0, r.rows[i].marginalMs);
+    wchar_t line[512];
+    swprintf_s(line, L"%ls: %lld frames from %.1f s%ls%ls\n", FilenameOnly(r.input).c_str(), (long long)r.frames,
+               r.startSec, r.device.empty() ? L"" : L", Vulkan device ", r.device.c_str());
+    std::wstring out = line;
+    swprintf_s(line, L"%-3ls %-36ls %6ls %9ls %10ls %6ls %10ls\n", L"#", r.alone ? L"shader (alone)" : L"shader (prefix)",
+               L"passes", L"ms/frame", L"+ms/frame", L"share", L"startup");
+    out += line;
+    for (size_t i = 0; i < r.rows.size(); ++i) {
+        const ProfileRow& row = r.rows[i];
+        std::wstring name = (i == 0) ? L"(libplacebo, no shaders)" : FilenameOnly(row.shader);
+        if (!row.ok) {
+            swprintf_s(line, L"%-3zu %-36ls failed (see log)\n", i, name.c_str());
+        } else if (i == 0) {
+            swprintf_s(line, L"%-3ls %-36ls %6d %9.2f %10ls %6ls %7.0f ms\n", L"-", name.c_str(), row.passes,
+                       row.msPerFrame, L"-", L"-", row.startupMs);
+        } else {
+            swprintf_s(line, L"%-3zu %-36ls %6d %9.2f %+10.2f %5.0f%% %7.0f ms\n", i, name.c_str(), row.passes,
+                       row.msPerFrame, row.marginalMs, total > 0.0 ? std::max(0.0, row.marginalMs) / total * 100.0 : 0.0,
+                       row.startupMs);
+        }
+        out += line;
+    }
+    return out;
+}
+
+static bool WriteProfileJson(const std::wstring& path, const ProfileReport& r)
+{
+    std::ofstream o(FsPath(path), std::ios::binary | std::ios::trunc);
+    if (!o) return false;
+    char num[160];
+    snprintf(num, sizeof(num), "\"sampleStart\": %.3f, \"sampleSeconds\": %.3f, \"frames\": %lld", r.startSec, r.seconds,
+             (long long)r.frames);
+    o << "{\n  \"input\": " << JsonString(r.input) << ",\n  \"mode\": \"" << (r.alone ? "alone" : "prefix")
+      << "\",\n  \"device\": " << JsonString(r.device) << ",\n  " << num << ",\n  \"rows\": [";
+    for (size_t i = 0; i < r.rows.size(); ++i) {
+        const ProfileRow& row = r.rows[i];
+        snprintf(num, sizeof(num), "\"msPerFrame\": %.3f, \"marginalMs\": %.3f, \"startupMs\": %.1f", row.msPerFrame,
+                 row.marginalMs, row.startupMs);
+        o << (i ? ",\n" : "\n") << "    {\"index\": " << i << ", \"shader\": " << JsonString(row.shader)
+          << ", \"passes\": " << row.passes << ", \"ok\": " << (row.ok ? "true" : "false") << ", " << num << "}";
+    }
+    o << "\n  ]\n}\n";
+    return (bool)o;
+}
+
+static bool IsProfileCommandLine(const std::vector<std::wstring>& args)
+{
+    return std::find(args.begin(), args.end(), L"--profile") != args.end();
+}
+
+// Returns the process exit code: 0 ok, 1 profiling failed, 2 usage.
+static int ProfileMain(const std::vector<std::wstring>& args)
+{
+    ProfileRequest pr;
+    std::wstring chainFile, outPath;
+    bool usage = false, watch = false;
+    for (size_t i = 0; i < args.size(); ++i) {
+        bool hasValue = i + 1 < args.size();
+        if (args[i] == L"--profile" && hasValue) pr.input = args[++i];
+        else if (args[i] == L"--chain" && hasValue) chainFile = args[++i];
+        else if (args[i] == L"--alone") pr.alone = true;
+        else if (args[i] == L"--start" && hasValue) pr.startSec = std::max(0.0, wcstod(args[++i].c_str(), nullptr));
+        else if (args[i] == L"--seconds" && hasValue) pr.seconds = std::max(1.0, wcstod(args[++i].c_str(), nullptr));
+        else if (args[i] == L"--device" && hasValue) pr.device = args[++i];
+        else if (args[i] == L"--out" && hasValue) outPath = args[++i];
+        else if (args[i] == L"--watch") watch = true;
+        else usage = true;
+    }
+    if (usage || pr.input.empty()) {
+        BatchPrint(L"usage: VfxEnc --profile <video> [--chain shaders.txt] [--alone] [--start S] [--seconds T] "
+                   L"[--device name] [--out report.json] [--watch]\n");
+        return 2;
+    }
+    LoadSettings();
+    if (chainFile.empty()) {
+        LoadShaders();
+        pr.shaders = GetActiveShaders();
+        pr.shaderParams = GetActiveShaderParams();
+    } else {
+        std::ifstream f(FsPath(chainFile), std::ios::binary);
+        std::string line;
+        while (std::getline(f, line)) {
+            std::wstring shader;
+            bool bypass = false;
+            ShaderParams params;
+            if (ParseShaderLine(line, shader, bypass, params) && !bypass) {
+                pr.shaders.push_back(shader);
+                pr.shaderParams.push_back(params);
+            }
+        }
+    }
+    if (outPath.empty()) outPath = JoinPath(GetLogDir(), BasenameNoExt(pr.input) + L"_profile.json");
+
+    auto profile = [&]() {
+        EncodeLog log;
+        log.Open(JoinPath(GetLogDir(), BasenameNoExt(pr.input) + L"_profile.log"), (uint64_t)g_logMaxMB << 20,
+                 g_logKeep);
+        ProfileReport report;
+        bool ok = RunShaderProfile(pr, report, log);
+        log.Close();
+        if (!ok) {
+            BatchPrint(L"error: " + report.error + L"\n");
+            return 1;
+        }
+        BatchPrint(FormatProfileTable(report));
+        if (!WriteProfileJson(outPath, report)) {
+            BatchPrint(L"error: can't write " + outPath + L"\n");
+            return 1;
+        }
+        BatchPrint(L"report: " + outPath + L"\n");
+        return 0;
+    };
+    int rc = profile();
+    if (!watch || pr.shaders.empty()) return rc;
+
+    // --watch: profile again whenever a shader in the chain is saved with new
+    // contents, until interrupted.
+    std::mutex m;
+    std::condition_variable cv;
+    std::vector<std::wstring> changed;
+    double sinceSaveMs = 0.0;
+    SetWatchedShaders(pr.shaders);
+    StartShaderWatcher([&](const std::vector<std::wstring>& c, double ms) {
+        std::lock_guard<std::mutex> lock(m);
+        changed.insert(changed.end(), c.begin(), c.end());
+        sinceSaveMs = ms;
+        cv.notify_one();
+    });
+    BatchPrint(L"watching " + std::to_wstring(pr.shaders.size()) + L" shader(s); Ctrl+C to stop\n");
+    for (;;) {
+        std::vector<std::wstring> batch;
+        double ms = 0.0;
+        {
+            std::unique_lock<std::mutex> lock(m);
+            cv.wait(lock, [&]() { return !changed.empty(); });
+            batch.swap(changed);
+            ms = sinceSaveMs;
+        }
+        std::wstring names;
+        for (const auto& p : batch) names += (names.empty() ? L"" : L", ") + FilenameOnly(p);
+        wchar_t timing[64];
+        swprintf_s(timing, L" (seen %.0f ms after save)", ms);
+        BatchPrint(L"\nchanged: " + names + timing + L"\n");
+        profile();
+    }
+}
+
+// ----------------------------
+// Self-test (headless)
+// ----------------------------
+// VfxEnc --selftest
+//
+// Checks the shader rewriting that has no other reference: FuseHookBlocks on
+// hand-written chains (what fuses, what must not, renaming, call order), and
+// the fused colortrans3 pass executed by a small GLSL interpreter against the
+// unfused passes and against GradePlanesScalar. Exit code 0 if all pass.
+// The interpreter and the cases are only compiled with VFXENC_SELFTEST
+// ("build.bat selftest"); release builds just say how to get them.
+
+static bool IsSelfTestCommandLine(const std::vector<std::wstring>& args)
+{
+    return std::find(args.begin(), args.end(), L"--selftest") != args.end();
+}
+
+#ifdef VFXENC_SELFTEST
+
+// Enough GLSL to run a point-wise pass on one pixel: scalars and vec2-4,
+// declarations, assignment (also to swizzles), if/else, return, user
+// functions and the usual math builtins. HOOKED reads return `pixel`; any
+// other HOOKED access is an error. Values carry float components only.
+struct GlslValue {
+    int n = 1;
+    float v[4] = {};
+};
+
+class GlslInterpreter {
+public:
+    explicit GlslInterpreter(const std::string& body)
+    {
+        std::string src = StripGlslComments(body);
+        for (size_t i = 0; i < src.size();) {
+            char c = src[i];
+            if (c == ' ' || c == '\t' || c == '\r' || c == '\n') { ++i; continue; }
+            if (c == '#') { Fail("preprocessor directives are not supported"); return; }
+            size_t j = i + 1;
+            if (IsIdentChar(c) && !(c >= '0' && c <= '9')) {
+                while (j < src.size() && IsIdentChar(src[j])) ++j;
+            } else if ((c >= '0' && c <= '9') || (c == '.' && i + 1 < src.size() && src[i + 1] >= '0' && src[i + 1] <= '9')) {
+                while (j < src.size() && (IsIdentChar(src[j]) || src[j] == '.' ||
+                                          ((src[j] == '-' || src[j] == '+') && (src[j - 1] == 'e' || src[j - 1] == 'E')))) ++j;
+            } else if (i + 1 < src.size()) {
+                static const char* const kOps[] = { "==", "!=", "<=", ">=", "&&", "||", "+=", "-=", "*=", "/=" };
+                for (const char* op : kOps) {
+                    if (src.compare(i, 2, op) == 0) j = i + 2;
+                }
+            }
+            tok.push_back(src.substr(i, j - i));
+            i = j;
+        }
+    }
+
+    // Runs hook() for one pixel. Globals are re-initialized on every call.
+    bool Run(const GlslValue& in, GlslValue& out)
+    {
+        pixel = in;
+        globals.clear();
+        funcs.clear();
+        pos = 0;
+        while (error.empty() && pos < tok.size()) {
+            if (Peek() == "const") ++pos;
+            if (TypeWidth(Peek()) == 0) { Fail("unexpected '" + Peek() + "' at file scope"); break; }
+            int width = TypeWidth(tok[pos++]);
+            std::string name = Peek();
+            ++pos;
+            if (Peek() == "(") {
+                funcs[name] = pos;
+                SkipBalanced("(", ")");
+                SkipBalanced("{", "}");
+                continue;
+            }
+            for (;;) {
+                GlslValue v = Zero(width);
+                if (Accept("=")) v = Convert(Assignment(true), width);
+                globals[name] = v;
+                if (!Accept(",")) break;
+                name = Peek();
+                ++pos;
+            }
+            Expect(";");
+        }
+        if (error.empty()) out = CallUser("hook", {});
+        return error.empty();
+    }
+
+    std::string error;
+
+private:
+    std::vector<std::string> tok;
+    size_t pos = 0;
+    std::map<std::string, size_t> funcs;   // name -> index of its '('
+    std::map<std::string, GlslValue> globals;
+    std::vector<std::map<std::string, GlslValue>> locals;   // one per open block
+    size_t frame = 0;                                        // first block of the current call
+    GlslValue pixel;
+    bool returning = false;
+    GlslValue ret;
+    int depth = 0;
+
+    void Fail(const std::string& what)
+    {
+        if (error.empty()) error = what;
+        pos = tok.size();
+    }
+    const std::string& Peek(size_t ahead = 0) const
+    {
+        static const std::string kEnd;
+        return pos + ahead < tok.size() ? tok[pos + ahead] : kEnd;
+    }
+    bool Accept(const char* t)
+    {
+        if (Peek() != t) return false;
+        ++pos;
+        return true;
+    }
+    void Expect(const char* t)
+    {
+        if (!Accept(t)) Fail(std::string("expected '") + t + "' before '" + Peek() + "'");
+    }
+    void SkipBalanced(const char* open, const char* close)
+    {
+        if (Peek() != open) { Fail(std::string("expected '") + open + "'"); return; }
+        int level = 0;
+        do {
+            if (Peek() == open) ++level;
+            else if (Peek() == close) --level;
+            ++pos;
+        } while (level > 0 && pos < tok.size());
+    }
+    static int TypeWidth(const std::string& t)
+    {
+        if (t == "float" || t == "int" || t == "uint" || t == "bool") return 1;
+        if (t == "vec2") return 2;
+        if (t == "vec3") return 3;
+        if (t == "vec4") return 4;
+        return 0;
+    }
+    static GlslValue Zero(int n)
+    {
+        GlslValue v;
+        v.n = n;
+        return v;
+    }
+    static GlslValue Scalar(float f)
+    {
+        GlslValue v;
+        v.v[0] = f;
+        return v;
+    }
+    GlslValue Convert(const GlslValue& v, int n)
+    {
+        if (v.n == n) return v;
+        if (v.n != 1) { Fail("cannot convert vec" + std::to_string(v.n) + " to width " + std::to_string(n)); return Zero(n); }
+        GlslValue r = Zero(n);
+        for (int i = 0; i < n; ++i) r.v[i] = v.v[0];
+        return r;
+    }
+    GlslValue* Lookup(const std::string& name)
+    {
+        for (size_t i = locals.size(); i > frame; --i) {
+            auto it = locals[i - 1].find(name);
+            if (it != locals[i - 1].end()) return &it->second;
+        }
+        auto it = globals.find(name);
+        return it == globals.end() ? nullptr : &it->second;
+    }
+    static int SwizzleIndex(char c)
+    {
+        const char* sets[] = { "xyzw", "rgba", "stpq" };
+        for (const char* s : sets) {
+            const char* p = strchr(s, c);
+            if (p && c) return (int)(p - s);
+        }
+        return -1;
+    }
+
+    // Component-wise binary op with scalar broadcast.
+    template <typename F>
+    GlslValue Map2(const GlslValue& a, const GlslValue& b, bool ex, F f)
+    {
+        if (!ex) return a;
+        if (a.n != b.n && a.n != 1 && b.n != 1) { Fail("width mismatch"); return a; }
+        GlslValue r = Zero(std::max(a.n, b.n));
+        for (int i = 0; i < r.n; ++i) r.v[i] = f(a.v[a.n == 1 ? 0 : i], b.v[b.n == 1 ? 0 : i]);
+        return r;
+    }
+    GlslValue Arith(const GlslValue& a, const GlslValue& b, char op, bool ex)
+    {
+        switch (op) {
+        case '+': return Map2(a, b, ex, [](float x, float y) { return x + y; });
+        case '-': return Map2(a, b, ex, [](float x, float y) { return x - y; });
+        case '*': return Map2(a, b, ex, [](float x, float y) { return x * y; });
+        default: return Map2(a, b, ex, [](float x, float y) { return x / y; });
+        }
+    }
+
+    void Block(bool ex)
+    {
+        Expect("{");
+        locals.emplace_back();
+        while (error.empty() && Peek() != "}") Statement(ex);
+        Expect("}");
+        locals.pop_back();
+    }
+
+    void Statement(bool ex)
+    {
+        ex = ex && !returning && error.empty();
+        if (Peek() == "{") return Block(ex);
+        if (Accept("if")) {
+            Expect("(");
+            bool take = Assignment(ex).v[0] != 0.0f;
+            Expect(")");
+            Statement(ex && take);
+            if (Accept("else")) Statement(ex && !take);
+            return;
+        }
+        if (Accept("return")) {
+            GlslValue v;
+            if (Peek() != ";") v = Assignment(ex);
+            if (ex) {
+                ret = v;
+                returning = true;
+            }
+            Expect(";");
+            return;
+        }
+        if (Peek() == "for" || Peek() == "while" || Peek() == "do" || Peek() == "switch") {
+            Fail("'" + Peek() + "' is not supported");
+            return;
+        }
+        bool isConst = Accept("const");
+        if (TypeWidth(Peek()) && Peek(1) != "(") {
+            int width = TypeWidth(tok[pos++]);
+            do {
+                std::string name = Peek();
+                ++pos;
+                GlslValue v = Zero(width);
+                if (Accept("=")) v = Convert(Assignment(ex), width);
+                if (ex) locals.back()[name] = v;
+            } while (Accept(","));
+            Expect(";");
+            return;
+        }
+        if (isConst) { Fail("expected a type after const"); return; }
+        Assignment(ex);
+        Expect(";");
+    }
+
+    GlslValue Assignment(bool ex)
+    {
+        bool whole = IsAssignOp(Peek(1));
+        bool swizzled = Peek(1) == "." && IsAssignOp(Peek(3));
+        if (!(whole || swizzled) || TypeWidth(Peek()) || !IsIdentChar(Peek()[0])) return Ternary(ex);
+
+        std::string name = tok[pos];
+        std::string mask = swizzled ? tok[pos + 2] : std::string();
+        pos += swizzled ? 3 : 1;
+        std::string op = tok[pos++];
+        GlslValue rhs = Assignment(ex);
+        if (!ex) return rhs;
+        GlslValue* var = Lookup(name);
+        if (!var) { Fail("assignment to undeclared '" + name + "'"); return rhs; }
+        GlslValue cur = swizzled ? Swizzle(*var, mask, true) : *var;
+        GlslValue val = op == "=" ? rhs : Arith(cur, rhs, op[0], true);
+        val = Convert(val, cur.n);
+        if (!swizzled) {
+            *var = val;
+        } else {
+            for (size_t i = 0; i < mask.size(); ++i) var->v[SwizzleIndex(mask[i])] = val.v[i];
+        }
+        return val;
+    }
+    static bool IsAssignOp(const std::string& t) { return t == "=" || t == "+=" || t == "-=" || t == "*=" || t == "/="; }
+
+    GlslValue Ternary(bool ex)
+    {
+        GlslValue c = LogicalOr(ex);
+        if (!Accept("?")) return c;
+        bool take = c.v[0] != 0.0f;
+        GlslValue a = Assignment(ex && take);
+        Expect(":");
+        GlslValue b = Assignment(ex && !take);
+        return take ? a : b;
+    }
+    GlslValue LogicalOr(bool ex)
+    {
+        GlslValue a = LogicalAnd(ex);
+        while (Accept("||")) {
+            bool left = a.v[0] != 0.0f;
+            GlslValue b = LogicalAnd(ex && !left);
+            a = Scalar(left || b.v[0] != 0.0f);
+        }
+        return a;
+    }
+    GlslValue LogicalAnd(bool ex)
+    {
+        GlslValue a = Comparison(ex);
+        while (Accept("&&")) {
+            bool left = a.v[0] != 0.0f;
+            GlslValue b = Comparison(ex && left);
+            a = Scalar(left && b.v[0] != 0.0f);
+        }
+        return a;
+    }
+    GlslValue Comparison(bool ex)
+    {
+        GlslValue a = Additive(ex);
+        for (;;) {
+            std::string op = Peek();
+            if (op != "==" && op != "!=" && op != "<" && op != ">" && op != "<=" && op != ">=") return a;
+            ++pos;
+            GlslValue b = Additive(ex);
+            bool eq = a.n == b.n && std::equal(a.v, a.v + a.n, b.v);
+            float x = a.v[0], y = b.v[0];
+            bool r = op == "==" ? eq : op == "!=" ? !eq : op == "<" ? x < y : op == ">" ? x > y : op == "<=" ? x <= y : x >= y;
+            a = Scalar(r);
+        }
+    }
+    GlslValue Additive(bool ex)
+    {
+        GlslValue a = Multiplicative(ex);
+        while (Peek() == "+" || Peek() == "-") {
+            char op = tok[pos++][0];
+            a = Arith(a, Multiplicative(ex), op, ex);
+        }
+        return a;
+    }
+    GlslValue Multiplicative(bool ex)
+    {
+        GlslValue a = Unary(ex);
+        while (Peek() == "*" || Peek() == "/") {
+            char op = tok[pos++][0];
+            a = Arith(a, Unary(ex), op, ex);
+        }
+        return a;
+    }
+    GlslValue Unary(bool ex)
+    {
+        if (Accept("-")) {
+            GlslValue v = Unary(ex);
+            for (int i = 0; i < v.n; ++i) v.v[i] = -v.v[i];
+            return v;
+        }
+        if (Accept("+")) return Unary(ex);
+        if (Accept("!")) return Scalar(Unary(ex).v[0] == 0.0f);
+        return Postfix(ex);
+    }
+    GlslValue Swizzle(const GlslValue& v, const std::string& mask, bool ex)
+    {
+        GlslValue r = Zero((int)mask.size());
+        if (mask.empty() || mask.size() > 4) { if (ex) Fail("bad swizzle ." + mask); return Zero(1); }
+        for (size_t i = 0; i < mask.size(); ++i) {
+            int k = SwizzleIndex(mask[i]);
+            if (k < 0 || k >= v.n) { if (ex) Fail("bad swizzle ." + mask); return r; }
+            r.v[i] = v.v[k];
+        }
+        return r;
+    }
+    GlslValue Postfix(bool ex)
+    {
+        GlslValue v = Primary(ex);
+        while (Accept(".")) {
+            std::string mask = Peek();
+            ++pos;
+            v = Swizzle(v, mask, ex);
+        }
+        return v;
+    }
+    GlslValue Primary(bool ex)
+    {
+        if (pos >= tok.size()) { Fail("unexpected end of code"); return Zero(1); }
+        std::string t = tok[pos++];
+        if (t == "(") {
+            GlslValue v = Assignment(ex);
+            Expect(")");
+            return v;
+        }
+        if ((t[0] >= '0' && t[0] <= '9') || t[0] == '.') return Scalar(strtof(t.c_str(), nullptr));
+        if (t == "true" || t == "false") return Scalar(t == "true");
+        if (!IsIdentChar(t[0])) { Fail("unexpected '" + t + "'"); return Zero(1); }
+        if (Accept("(")) {
+            std::vector<GlslValue> args;
+            if (!Accept(")")) {
+                do args.push_back(Assignment(ex));
+                while (Accept(","));
+                Expect(")");
+            }
+            return ex ? Call(t, args) : Zero(1);
+        }
+        if (!ex) return Zero(1);
+        if (t == "HOOKED_pos") return HookedPos();
+        GlslValue* var = Lookup(t);
+        if (!var) { Fail("undeclared '" + t + "'"); return Zero(1); }
+        return *var;
     }
-}
-
-static bool MpvInit(HWND hwndVideo)
-{
-    g_mpv = mpv_create();
-    if (!g_mpv) return false;
-
-    // Keep UI snappy / no console noise
-    mpv_set_option_string(g_mpv, "terminal", "no");
-    mpv_set_option_string(g_mpv, "msg-level", "all=no");
-
-    // Tell mpv to render inside our child window
-    int64_t wid = (int64_t)(intptr_t)hwndVideo;
-    mpv_set_option(g_mpv, "wid", MPV_FORMAT_INT64, &wid);
-
-    // Useful defaults
-    mpv_set_option_string(g_mpv, "keep-open", "yes");
-    mpv_set_option_string(g_mpv, "loop-file", "inf");
-
-    if (mpv_initialize(g_mpv) < 0) return false;
-
-    return true;
-}
-
-static void MpvShutdown()
-{
-    if (g_mpv) {
-        mpv_terminate_destroy(g_mpv);
-        g_mpv = nullptr;
-    }
-}
-
-// ----------------------------
-// UI list helpers
-// ----------------------------
-static void ListRefresh()
-{
-    SendMessageW(g_hwndList, LB_RESETCONTENT, 0, 0);
-    for (size_t i = 0; i < g_shaders.size(); ++i) {
-        std::wstring name = FilenameOnly(g_shaders[i]);
-        if (i < g_shaderBypass.size() && g_shaderBypass[i]) {
-            name += L" (Bypassed)";
+    // Stand-in coordinate: only HOOKED_tex(HOOKED_pos) is a current-pixel read.
+    static GlslValue HookedPos()
+    {
+        GlslValue p = Zero(2);
+        p.v[0] = p.v[1] = -1.0f;
+        return p;
+    }
+
+    GlslValue Call(const std::string& name, const std::vector<GlslValue>& a)
+    {
+        int width = TypeWidth(name);
+        if (width && name != "bool" && name != "int" && name != "uint" && name != "float") {
+            std::vector<float> comps;
+            for (const auto& v : a) comps.insert(comps.end(), v.v, v.v + v.n);
+            if (comps.size() == 1) return Convert(a[0], width);
+            if ((int)comps.size() < width) { Fail(name + "() with too few components"); return Zero(width); }
+            GlslValue r = Zero(width);
+            std::copy(comps.begin(), comps.begin() + width, r.v);
+            return r;
         }
-        SendMessageW(g_hwndList, LB_ADDSTRING, 0, (LPARAM)name.c_str());
+        auto arity = [&](size_t n) {
+            if (a.size() == n) return true;
+            Fail(name + "() takes " + std::to_string(n) + " argument(s)");
+            return false;
+        };
+        if (width) {
+            if (!arity(1)) return Zero(1);
+            float f = a[0].v[0];
+            return Scalar(name == "bool" ? (f != 0.0f) : name == "float" ? f : std::trunc(f));
+        }
+        if (name == "HOOKED_texOff" || name == "HOOKED_tex") {
+            if (!arity(1)) return Zero(4);
+            GlslValue want = name == "HOOKED_tex" ? HookedPos() : Zero(a[0].n);
+            if (!std::equal(a[0].v, a[0].v + a[0].n, want.v) || a[0].n != want.n) Fail(name + " reads another pixel");
+            return pixel;
+        }
+        if (name == "dot") {
+            if (!arity(2) || a[0].n != a[1].n) return Zero(1);
+            float s = 0.0f;
+            for (int i = 0; i < a[0].n; ++i) s += a[0].v[i] * a[1].v[i];
+            return Scalar(s);
+        }
+        if (name == "clamp") {
+            if (!arity(3)) return Zero(1);
+            GlslValue lo = Map2(a[0], a[1], true, [](float x, float y) { return std::max(x, y); });
+            return Map2(lo, a[2], true, [](float x, float y) { return std::min(x, y); });
+        }
+        if (name == "mix") {
+            if (!arity(3)) return Zero(1);
+            GlslValue r = Zero(std::max(a[0].n, a[1].n));
+            for (int i = 0; i < r.n; ++i) {
+                float t = a[2].v[a[2].n == 1 ? 0 : i];
+                r.v[i] = a[0].v[a[0].n == 1 ? 0 : i] * (1.0f - t) + a[1].v[a[1].n == 1 ? 0 : i] * t;
+            }
+            return r;
+        }
+        struct Fn1 { const char* name; float (*f)(float); };
+        static const Fn1 kFn1[] = {
+            { "abs", [](float x) { return std::fabs(x); } },   { "sqrt", [](float x) { return std::sqrt(x); } },
+            { "exp", [](float x) { return std::exp(x); } },    { "log", [](float x) { return std::log(x); } },
+            { "exp2", [](float x) { return std::exp2(x); } },  { "log2", [](float x) { return std::log2(x); } },
+            { "floor", [](float x) { return std::floor(x); } }, { "fract", [](float x) { return x - std::floor(x); } },
+        };
+        for (const auto& fn : kFn1) {
+            if (name != fn.name) continue;
+            if (!arity(1)) return Zero(1);
+            GlslValue r = a[0];
+            for (int i = 0; i < r.n; ++i) r.v[i] = fn.f(r.v[i]);
+            return r;
+        }
+        if (name == "pow" && arity(2)) return Map2(a[0], a[1], true, [](float x, float y) { return std::pow(x, y); });
+        if (name == "min" && arity(2)) return Map2(a[0], a[1], true, [](float x, float y) { return std::min(x, y); });
+        if (name == "max" && arity(2)) return Map2(a[0], a[1], true, [](float x, float y) { return std::max(x, y); });
+        if (name == "step" && arity(2)) return Map2(a[0], a[1], true, [](float e, float x) { return x < e ? 0.0f : 1.0f; });
+        if (!error.empty()) return Zero(1);
+        return CallUser(name, a);
     }
-}
-
-static void AddShaderPath(const std::wstring& path)
-{
-    if (std::find(g_shaders.begin(), g_shaders.end(), path) != g_shaders.end())
-        return;
 
-    g_shaders.push_back(path);
-    g_shaderBypass.push_back(false);
-    UpdateLastShaderDir(path);
-    ListRefresh();
-    MpvApplyShaderList();
-    SaveShaders();
-}
-
-static void RemoveSelectedShader()
-{
-    int sel = (int)SendMessageW(g_hwndList, LB_GETCURSEL, 0, 0);
-    if (sel == LB_ERR) return;
+    GlslValue CallUser(const std::string& name, const std::vector<GlslValue>& a)
+    {
+        auto it = funcs.find(name);
+        if (it == funcs.end()) { Fail("unknown function '" + name + "'"); return Zero(1); }
+        if (++depth > 64) { Fail("recursion in '" + name + "'"); return Zero(1); }
+        size_t savedPos = pos, savedFrame = frame;
+        pos = it->second + 1;
+        frame = locals.size();
+        locals.emplace_back();
+        size_t k = 0;
+        while (error.empty() && !Accept(")")) {
+            while (Peek() == "in" || Peek() == "const") ++pos;
+            if (Peek() == "out" || Peek() == "inout") { Fail("out parameters are not supported"); break; }
+            int width = TypeWidth(Peek());
+            if (width == 0 && Peek() == "void") { ++pos; continue; }
+            ++pos;
+            std::string param = Peek();
+            ++pos;
+            if (k >= a.size()) { Fail(name + "() called with too few arguments"); break; }
+            locals.back()[param] = Convert(a[k++], width);
+            Accept(",");
+        }
+        if (error.empty() && k != a.size()) Fail(name + "() called with too many arguments");
+        returning = false;
+        ret = Zero(1);
+        if (error.empty()) Block(true);
+        GlslValue r = ret;
+        returning = false;
+        locals.resize(frame);
+        frame = savedFrame;
+        --depth;
+        pos = savedPos;
+        return r;
+    }
+};
 
-    g_shaders.erase(g_shaders.begin() + sel);
-    if (sel >= 0 && sel < (int)g_shaderBypass.size()) {
-        g_shaderBypass.erase(g_shaderBypass.begin() + sel);
+// Runs every pass of `blocks` in order on one pixel.
+static bool RunHookPasses(const std::vector<HookBlock>& blocks, GlslValue& px, std::string& error)
+{
+    for (const auto& b : blocks) {
+        if (b.kind != HookBlockKind::Pass) continue;
+        GlslInterpreter glsl(b.body);
+        GlslValue out;
+        if (!glsl.Run(px, out)) {
+            error = (b.desc.empty() ? std::string("pass") : b.desc) + ": " + glsl.error;
+            return false;
+        }
+        if (out.n != 4) {
+            error = "hook() did not return a vec4";
+            return false;
+        }
+        px = out;
     }
-    ListRefresh();
-    MpvApplyShaderList();
-    SaveShaders();
+    return true;
 }
-
-static void ClearShaders()
+
+static int CountHookPasses(const std::vector<HookBlock>& blocks)
 {
-    g_shaders.clear();
-    g_shaderBypass.clear();
-    ListRefresh();
-    MpvApplyShaderList();
-    SaveShaders();
+    int n = 0;
+    for (const auto& b : blocks) n += b.kind == HookBlockKind::Pass;
+    return n;
 }
 
-static std::vector<std::wstring> GetActiveShaders()
+// Pass snippets for the text-level cases. Both point-wise ones declare `k` and
+// `scale`, so fusing them only compiles if the renaming works.
+static const char kTestGain[] =
+    "//!HOOK MAIN\n//!BIND HOOKED\n//!DESC gain\n"
+    "const float k = 1.5;\nvec4 scale(vec4 c) { return c * vec4(k, k, k, 1.0); }\n"
+    "vec4 hook() { return scale(HOOKED_texOff(0)); }\n";
+static const char kTestLift[] =
+    "//!HOOK MAIN\n//!BIND HOOKED\n//!DESC lift\n"
+    "const float k = 0.1;\nvec4 scale(vec4 c) { return c + vec4(k, k, k, 0.0); }\n"
+    "vec4 hook()\n{\n    // HOOKED_texOff(1) in a comment is not a read\n"
+    "    vec4 c = HOOKED_texOff( 0 );\n    c.rg = c.gr;\n    return scale(c);\n}\n";
+static const char kTestSaturate[] =
+    "//!HOOK MAIN\n//!BIND HOOKED\n//!DESC saturate\n"
+    "vec4 hook() { vec4 c = HOOKED_tex(HOOKED_pos); if (c.r > 0.5) c.r = 1.0; else c.r *= 0.5; return c; }\n";
+static const char kTestBlur[] =
+    "//!HOOK MAIN\n//!BIND HOOKED\n//!DESC blur\n"
+    "vec4 hook() { return 0.5 * (HOOKED_texOff(0) + HOOKED_texOff(vec2(1.0, 0.0))); }\n";
+static const char kTestHalf[] =
+    "//!HOOK MAIN\n//!BIND HOOKED\n//!WIDTH HOOKED.w 2 /\n//!DESC half\n"
+    "vec4 hook() { return HOOKED_texOff(0); }\n";
+static const char kTestSaved[] =
+    "//!HOOK MAIN\n//!BIND HOOKED\n//!SAVE GRADED\n//!DESC saved\n"
+    "vec4 hook() { return HOOKED_texOff(0); }\n";
+static const char kTestWhen[] =
+    "//!HOOK MAIN\n//!BIND HOOKED\n//!WHEN OUTPUT.w 1920 >\n//!DESC when\n"
+    "vec4 hook() { return HOOKED_texOff(0) * 0.5; }\n";
+static const char kTestLuma[] =
+    "//!HOOK LUMA\n//!BIND HOOKED\n//!DESC luma\n"
+    "vec4 hook() { return HOOKED_texOff(0) * 0.5; }\n";
+static const char kTestParam[] =
+    "//!PARAM strength\n//!TYPE float\n0.5\n";
+
+static std::vector<HookBlock> ParseHookChain(const std::vector<const char*>& texts)
 {
-    std::vector<std::wstring> out;
-    out.reserve(g_shaders.size());
-    for (size_t i = 0; i < g_shaders.size(); ++i) {
-        if (i < g_shaderBypass.size() && g_shaderBypass[i]) continue;
-        out.push_back(g_shaders[i]);
-    }
-    return out;
+    std::vector<HookBlock> blocks;
+    for (size_t i = 0; i < texts.size(); ++i) ParseHookShader(texts[i], "test" + std::to_string(i), blocks);
+    return blocks;
 }
 
-// ----------------------------
-// Encoding (ffmpeg + libplacebo)
-// ----------------------------
-static bool GetMpvVideoSize(int& w, int& h)
+static size_t CountSubstr(const std::string& s, const std::string& what)
 {
-    w = h = 0;
-    if (!g_mpv) return false;
-
-    // mpv properties "width"/"height" refer to current video size
-    mpv_get_property(g_mpv, "width", MPV_FORMAT_INT64, &w);
-    mpv_get_property(g_mpv, "height", MPV_FORMAT_INT64, &h);
-    return (w > 0 && h > 0);
+    size_t n = 0;
+    for (size_t p = s.find(what); p != std::string::npos; p = s.find(what, p + 1)) ++n;
+    return n;
 }
 
-static int GetInputBitrateMbps()
+// Whole-identifier occurrences of `word`.
+static size_t CountIdentifier(const std::string& s, const std::string& word)
 {
-    if (!g_mpv) return 0;
-    int64_t bps = 0;
-    if (mpv_get_property(g_mpv, "video-bitrate", MPV_FORMAT_INT64, &bps) >= 0 && bps > 0) {
-        int mbps = (int)((bps + 500000) / 1000000);
-        if (mbps < 1) mbps = 1;
-        return mbps;
+    size_t n = 0;
+    for (size_t p = s.find(word); p != std::string::npos; p = s.find(word, p + 1)) {
+        bool start = p == 0 || !IsIdentChar(s[p - 1]);
+        bool end = p + word.size() == s.size() || !IsIdentChar(s[p + word.size()]);
+        n += start && end;
     }
+    return n;
+}
 
-    // Fallback: estimate from file size and duration
-    double duration = 0.0;
-    if (mpv_get_property(g_mpv, "duration", MPV_FORMAT_DOUBLE, &duration) >= 0 && duration > 0.0) {
-        WIN32_FILE_ATTRIBUTE_DATA fad{};
-        if (GetFileAttributesExW(g_loadedVideo.c_str(), GetFileExInfoStandard, &fad)) {
-            ULARGE_INTEGER sz{};
-            sz.HighPart = fad.nFileSizeHigh;
-            sz.LowPart = fad.nFileSizeLow;
-            double bits = (double)sz.QuadPart * 8.0;
-            int mbps = (int)((bits / duration) / 1000000.0 + 0.5);
-            if (mbps < 1) mbps = 1;
-            return mbps;
+// Pixels spread over [0,1] plus the edges, same sequence every run.
+static std::vector<GlslValue> SelfTestPixels(int count)
+{
+    std::vector<GlslValue> px;
+    uint32_t seed = 12345;
+    for (int i = 0; i < count; ++i) {
+        GlslValue p;
+        p.n = 4;
+        for (int c = 0; c < 4; ++c) {
+            seed = seed * 1664525u + 1013904223u;
+            p.v[c] = (float)(seed >> 8) / 16777215.0f;
         }
+        if (i < 2) p.v[0] = p.v[1] = p.v[2] = (float)i;
+        px.push_back(p);
     }
+    return px;
+}
 
-    // Final fallback: ask ffmpeg for container bitrate
-    std::wstring ffmpeg;
-    if (FindFfmpeg(ffmpeg)) {
-        int kbps = ProbeBitrateKbpsWithFfmpeg(ffmpeg, g_loadedVideo);
-        if (kbps > 0) {
-            int mbps = (kbps + 500) / 1000;
-            if (mbps < 1) mbps = 1;
-            return mbps;
+// Fused and unfused chains must agree exactly: fusion only renames and
+// substitutes, the arithmetic is untouched.
+static bool SameOnPixels(const std::vector<HookBlock>& a, const std::vector<HookBlock>& b, std::string& error)
+{
+    for (const auto& p : SelfTestPixels(64)) {
+        GlslValue x = p, y = p;
+        if (!RunHookPasses(a, x, error) || !RunHookPasses(b, y, error)) return false;
+        if (!std::equal(x.v, x.v + 4, y.v)) {
+            char msg[160];
+            snprintf(msg, sizeof(msg), "outputs differ: (%g %g %g %g) vs (%g %g %g %g)", x.v[0], x.v[1], x.v[2],
+                     x.v[3], y.v[0], y.v[1], y.v[2], y.v[3]);
+            error = msg;
+            return false;
         }
     }
-
-    return 0;
+    return true;
 }
 
-static void RunEncode(bool to1440p)
+// Text-level FuseHookBlocks cases; returns the number of failures.
+static int FuseTextSelfTest()
 {
-    if (g_loadedVideo.empty()) {
-        SetStatus(L"No video loaded.");
-        return;
-    }
-
-    std::wstring ffmpeg;
-    FindFfmpeg(ffmpeg);
-
-    // Combine shaders into one file for libplacebo custom_shader_path
-    std::wstring combinedName;
-    std::vector<std::wstring> activeShaders = GetActiveShaders();
-    std::wstring combined = WriteCombinedShaderTemp(activeShaders, &combinedName);
-
-    // Output file
-    std::wstring dir = Dirname(g_loadedVideo);
-    std::wstring base = BasenameNoExt(g_loadedVideo);
-    std::wstring out = JoinPath(dir, base + (to1440p ? L"_shaded_1440p.mp4" : L"_shaded.mp4"));
-
-    // Build libplacebo filter string
-    std::wstringstream vf;
-    if (!combined.empty()) {
-        // libplacebo supports mpv .hook shaders via custom_shader_path :contentReference[oaicite:3]{index=3}
-        const std::wstring& shaderArg = combinedName.empty() ? combined : combinedName;
-        vf << L"libplacebo=custom_shader_path=" << FfmpegEscapeFilterValue(shaderArg);
-    } else {
-        vf << L"libplacebo";
-    }
-
-    if (to1440p) {
-        // Compute aspect-correct width for 1440p, keep even width
-        int iw=0, ih=0;
-        if (!GetMpvVideoSize(iw, ih) || ih <= 0) {
-            iw = 1920; ih = 1080; // fallback
-        }
-        int outH = 1440;
-        int outW = (int)((double)iw * (double)outH / (double)ih + 0.5);
-        outW &= ~1; // make even
-
-        // libplacebo can scale using w/h parameters; see docs/examples :contentReference[oaicite:4]{index=4}
-        // We just append another libplacebo stage to scale (clean and GPU-friendly).
-        vf << L",libplacebo=w=" << outW << L":h=" << outH;
-    }
-
-    std::vector<std::wstring> encoders;
-    if (g_encoderChoice != L"auto") {
-        encoders.push_back(g_encoderChoice);
-    } else {
-        encoders = {
-            L"hevc_amf",
-            L"hevc_nvenc",
-            L"hevc_qsv",
-            L"hevc_mf",
-            L"libx265"
-        };
-    }
+    int failures = 0;
+    auto check = [&](bool ok, const std::string& what) {
+        BatchPrint(Utf8ToWide((ok ? "  ok    " : "  FAIL  ") + what + "\n"));
+        failures += !ok;
+    };
 
-    int targetMbps = g_bitrateMbps;
-    if (targetMbps <= 0) {
-        targetMbps = GetInputBitrateMbps();
-        if (targetMbps <= 0) targetMbps = 20;
+    struct Case {
+        const char* name;
+        std::vector<const char*> chain;
+        int folded;   // passes FuseHookBlocks folds away
+        int blocks;   // blocks left afterwards
+    };
+    const Case cases[] = {
+        { "gain + lift fuse", { kTestGain, kTestLift }, 1, 1 },
+        { "three point-wise passes fuse", { kTestGain, kTestLift, kTestSaturate }, 2, 1 },
+        { "neighbour tap breaks the run", { kTestGain, kTestBlur, kTestLift }, 0, 3 },
+        { "resizing pass is not fused", { kTestGain, kTestHalf, kTestLift }, 0, 3 },
+        { "SAVE to another texture is not fused", { kTestGain, kTestSaved, kTestLift }, 0, 3 },
+        { "different WHEN is not fused", { kTestGain, kTestWhen }, 0, 2 },
+        { "different stage is not fused", { kTestGain, kTestLuma }, 0, 2 },
+        { "PARAM between passes is kept", { kTestGain, kTestParam, kTestLift }, 1, 2 },
+        { "run restarts after a barrier", { kTestGain, kTestLift, kTestBlur, kTestGain, kTestSaturate }, 2, 3 },
+    };
+    for (const Case& c : cases) {
+        std::vector<HookBlock> before = ParseHookChain(c.chain);
+        std::vector<HookBlock> blocks = before;
+        int folded = FuseHookBlocks(blocks);
+        check(folded == c.folded && (int)blocks.size() == c.blocks,
+              std::string(c.name) + " (folded " + std::to_string(folded) + ", " + std::to_string(blocks.size()) +
+                  " blocks)");
+        // Only all-point-wise chains can run per pixel.
+        std::string error;
+        if (c.folded > 0 && c.blocks == 1) {
+            check(SameOnPixels(before, blocks, error), std::string(c.name) + ": same pixels" +
+                                                           (error.empty() ? "" : " - " + error));
+        }
     }
 
-    // Log path next to exe (helps troubleshooting ffmpeg failures).
-    std::wstring logPath = JoinPath(GetExeDir(), BasenameNoExt(out) + L".log");
-
-    SetStatus(L"Encoding...");
+    // Shape of a fused body.
+    std::vector<HookBlock> blocks = ParseHookChain({ kTestGain, kTestLift });
+    FuseHookBlocks(blocks);
+    const HookBlock& f = blocks.front();
+    std::string code = StripGlslComments(f.body);
+    check(f.desc == "fused: gain + lift", "fused DESC lists the passes");
+    check(f.binds.size() == 1 && f.binds[0] == "HOOKED" && f.hooks.size() == 1 && f.hooks[0] == "MAIN",
+          "fused pass hooks MAIN and binds HOOKED only");
+    check(CountSubstr(code, "const float k_f0") == 1 && CountSubstr(code, "const float k_f1") == 1 &&
+              CountSubstr(code, "scale_f0(") == 2 && CountSubstr(code, "scale_f1(") == 2,
+          "top-level names get per-pass suffixes");
+    check(CountIdentifier(code, "k") == 0 && CountIdentifier(code, "scale") == 0 && CountIdentifier(code, "hook") == 1,
+          "no unsuffixed top-level names remain");
+    check(CountSubstr(code, "HOOKED") == 1 && CountSubstr(code, "vfx_in = HOOKED_texOff(0);") == 1,
+          "only the generated hook() samples HOOKED");
+    size_t call0 = code.find("vfx_in = hook_f0();"), call1 = code.find("vfx_in = hook_f1();");
+    check(call0 != std::string::npos && call1 != std::string::npos && call0 < call1, "stages are called in chain order");
+    check(CountSubstr(f.body, "HOOKED_texOff(1) in a comment") == 1, "comments are carried over");
+
+    // Emitted text parses back to one point-wise pass and is a fixed point.
+    std::vector<HookBlock> again;
+    ParseHookShader(EmitHookBlocks(blocks), "emitted", again);
+    check(again.size() == 1 && IsPointwiseHookPass(again[0]), "emitted fused pass re-parses as point-wise");
+    check(FuseHookBlocks(again) == 0, "fusing the emitted chain again changes nothing");
+    return failures;
+}
 
-    double durationSec = GetMpvDurationSeconds();
+// glsl/colortrans3.glsl's pass, the CPU grade's reference shader.
+static const char kTestColorTrans3[] = R"glsl(//!HOOK MAIN
+//!BIND HOOKED
+//!DESC colortrans3: reverse ColorTrans
 
-    // Run in background thread
-    std::thread([ffmpeg, vfStr = vf.str(), out, logPath, encoders, targetMbps, combined, durationSec]() {
-        STARTUPINFOW si{};
-        si.cb = sizeof(si);
-        PROCESS_INFORMATION pi{};
-
-        SECURITY_ATTRIBUTES sa{};
-        sa.nLength = sizeof(sa);
-        sa.bInheritHandle = TRUE;
-        sa.lpSecurityDescriptor = nullptr;
-
-        HANDLE hLog = CreateFileW(
-            logPath.c_str(),
-            GENERIC_WRITE,
-            FILE_SHARE_READ,
-            &sa,
-            CREATE_ALWAYS,
-            FILE_ATTRIBUTE_NORMAL,
-            nullptr
-        );
+vec3 apply_saturation_mpv(vec3 c, float mpv_sat)
+{
+    float sat = 1.0 + (mpv_sat / 100.0);
+    sat = clamp(sat, 0.0, 3.0);
+    float y = dot(c, vec3(0.2126, 0.7152, 0.0722));
+    return mix(vec3(y), c, sat);
+}
 
-        if (hLog != INVALID_HANDLE_VALUE) {
-            si.dwFlags |= STARTF_USESTDHANDLES;
-            si.hStdOutput = hLog;
-            si.hStdError = hLog;
-            si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
-        }
+vec3 reverse_colortrans(vec3 rgb_in)
+{
+    const float colortrans_y_offset_10b  = 200.0;
+    const float colortrans_yoff_strength = 0.25;
+    const float colortrans_yoff =
+        (colortrans_y_offset_10b / 1023.0) * colortrans_yoff_strength;
+    const float reverse_black_lift = 0.020;
+    const vec3 row0 = vec3( 1.17866031,  0.17460893,  0.01571472);
+    const vec3 row1 = vec3(-0.11147506,  1.55408099, -0.07362197);
+    const vec3 row2 = vec3( 0.03243649,  0.11275820,  1.22378927);
+    vec3 x = rgb_in - vec3(colortrans_yoff);
+    vec3 y = vec3(
+        dot(row0, x),
+        dot(row1, x),
+        dot(row2, x)
+    );
+    y += vec3(reverse_black_lift);
+    return y;
+}
 
-        bool success = false;
-        std::wstring workDir = GetExeDir();
+vec3 apply_grade(vec3 c)
+{
+    const float gamma_pow = 1.0;
+    const float lift      = -0.15;
+    const float gain      = 1.75;
+    const vec3  rgb_mult  = vec3(1.0, 1.0, 1.0);
+    const float mpv_saturation_default = -22.5;
+    c = clamp(c, 0.0, 1.0);
+    float g = clamp(gamma_pow, 0.10, 5.0);
+    float l = clamp(lift,     -1.0,  1.0);
+    float k = clamp(gain,      0.0, 10.0);
+    vec3  m = clamp(rgb_mult,  vec3(0.0), vec3(4.0));
+    vec3 y = pow(c, vec3(g));
+    y += vec3(l);
+    y *= k;
+    y *= m;
+    y = apply_saturation_mpv(y, mpv_saturation_default);
+    return clamp(y, 0.0, 1.0);
+}
 
-        for (const auto& enc : encoders) {
-            std::wstring cmd =
-                Quote(ffmpeg) + L" -hide_banner -y -i " + Quote(g_loadedVideo) +
-                L" -vf " + Quote(vfStr) + L" " + BuildEncoderArgs(enc, targetMbps) +
-                L" -c:a copy ";
-            if (durationSec > 0.0) {
-                cmd += L"-progress pipe:1 -nostats ";
-            }
-            cmd += Quote(out);
+vec4 hook()
+{
+    vec4 src = HOOKED_texOff(0);
+    vec3 c = src.rgb;
+    const bool REVERSE_COLORTRANS_ENABLE = true;
+    if (REVERSE_COLORTRANS_ENABLE) {
+        c = reverse_colortrans(c);
+    }
+    vec3 out_rgb = apply_grade(c);
+    return vec4(out_rgb, src.a);
+}
+)glsl";
 
-            if (hLog != INVALID_HANDLE_VALUE) {
-                SetFilePointer(hLog, 0, nullptr, FILE_END);
-                WriteLogLine(hLog, L"\r\n=== Attempt encoder: " + enc + L" ===\r\n");
-                WriteLogLine(hLog, cmd + L"\r\n");
-            }
+// Two differently tuned colortrans3 passes, fused, against the unfused passes
+// and against GradePlanesScalar applied once per pass. Returns failures.
+static int FuseReferenceSelfTest()
+{
+    int failures = 0;
+    auto check = [&](bool ok, const std::string& what) {
+        BatchPrint(Utf8ToWide((ok ? "  ok    " : "  FAIL  ") + what + "\n"));
+        failures += !ok;
+    };
 
-            std::wstring status = L"Encoding (" + enc + L")...";
-            PostMessageW(g_hwndMain, WM_APP + 1, 0, (LPARAM)new std::wstring(status));
+    ShaderParams curved;
+    curved["gamma_pow"] = { 0.8 };
+    curved["rgb_mult"] = { 1.0, 1.0, 1.1 };
+    curved["mpv_saturation_default"] = { 30.0 };
+    curved["REVERSE_COLORTRANS_ENABLE"] = { 0.0 };
+    const std::string texts[2] = { kTestColorTrans3, SpecializeShader(kTestColorTrans3, curved) };
+
+    std::vector<CpuGradeParams> grades(2);
+    bool parsed = ParseColorTrans3(texts[0], grades[0]) && ParseColorTrans3(texts[1], grades[1]);
+    check(parsed, "both colortrans3 variants parse as CPU grades");
+    check(parsed && grades[1].gamma == 0.8f && !grades[1].reverse && grades[1].rgbMult[2] == 1.1f,
+          "specialized constants reach the CPU grade");
+    ShaderParams flat;
+    flat["rgb_mult"] = { 1.1 };
+    CpuGradeParams flatGrade;
+    bool flatParsed = ParseColorTrans3(SpecializeShader(kTestColorTrans3, flat), flatGrade);
+    check(flatParsed && flatGrade.rgbMult[0] == 1.1f && flatGrade.rgbMult[1] == 1.1f && flatGrade.rgbMult[2] == 1.1f,
+          "a single value for rgb_mult fills all three and still parses as a CPU grade");
+    if (!parsed) return failures;
+
+    std::vector<HookBlock> unfused;
+    for (int i = 0; i < 2; ++i) ParseHookShader(texts[i], "colortrans3_" + std::to_string(i), unfused);
+    std::vector<HookBlock> fused = unfused;
+    HookPruneStats stats = PruneHookBlocks(fused);
+    stats.passesFused = FuseHookBlocks(fused);
+    check(stats.passesIn == 2 && stats.passesFused == 1 && CountHookPasses(fused) == 1,
+          "two colortrans3 passes fuse into one");
+    std::vector<HookBlock> emitted;
+    ParseHookShader(EmitHookBlocks(fused), "fused", emitted);
+
+    float maxRef = 0.0f;
+    int mismatches = 0;
+    std::string error;
+    for (const auto& p : SelfTestPixels(4096)) {
+        GlslValue a = p, b = p;
+        if (!RunHookPasses(unfused, a, error) || !RunHookPasses(emitted, b, error)) break;
+        if (!std::equal(a.v, a.v + 4, b.v)) ++mismatches;
+
+        float r = p.v[0], g = p.v[1], bl = p.v[2];
+        for (const auto& grade : grades) GradePlanesScalar(grade, &r, &g, &bl, 1);
+        maxRef = std::max({ maxRef, std::fabs(b.v[0] - r), std::fabs(b.v[1] - g), std::fabs(b.v[2] - bl),
+                            std::fabs(b.v[3] - p.v[3]) });
+    }
+    check(error.empty(), "interpreter ran both chains" + (error.empty() ? "" : " - " + error));
+    check(error.empty() && mismatches == 0,
+          "fused pass matches the unfused passes exactly (" + std::to_string(mismatches) + " of 4096 differ)");
+    // The interpreter's float math and the scalar grade differ only in
+    // rounding order; one 16-bit code value is far above that.
+    char diff[64];
+    snprintf(diff, sizeof(diff), "%.2e", maxRef);
+    check(error.empty() && maxRef < 1.0f / 65535.0f,
+          std::string("fused pass matches GradePlanesScalar x2 (max diff ") + diff + ")");
+    return failures;
+}
 
-            HANDLE hRead = nullptr;
-            HANDLE hWrite = nullptr;
-            if (!CreatePipe(&hRead, &hWrite, &sa, 0)) {
-                continue;
-            }
-            SetHandleInformation(hRead, HANDLE_FLAG_INHERIT, 0);
-            si.hStdOutput = hWrite;
-            si.hStdError = hWrite;
-
-            // CreateProcess wants mutable buffer
-            std::wstring mutableCmd = cmd;
-
-            BOOL ok = CreateProcessW(
-                nullptr,
-                mutableCmd.data(),
-                nullptr, nullptr,
-                TRUE,
-                CREATE_NO_WINDOW,
-                nullptr,
-                workDir.c_str(),
-                &si, &pi
-            );
-
-            CloseHandle(hWrite);
-            if (!ok) {
-                CloseHandle(hRead);
-                continue;
-            }
+// Returns the process exit code: 0 all passed, 1 a check failed.
+static int SelfTestMain(const std::vector<std::wstring>&)
+{
+    BatchPrint(L"pass fusion, text cases:\n");
+    int failures = FuseTextSelfTest();
+    BatchPrint(L"pass fusion, colortrans3 reference:\n");
+    failures += FuseReferenceSelfTest();
+    BatchPrint(failures ? std::to_wstring(failures) + L" check(s) failed\n" : std::wstring(L"all checks passed\n"));
+    return failures ? 1 : 0;
+}
+#else
+static int SelfTestMain(const std::vector<std::wstring>&)
+{
+    BatchPrint(L"--selftest needs a build with VFXENC_SELFTEST defined\n");
+    return 1;
+}
+#endif // VFXENC_SELFTEST
 
-            std::string buffer;
-            buffer.reserve(8192);
-            char chunk[4096];
-            DWORD read = 0;
-            double lastPct = -1.0;
+#ifdef _WIN32
+// preview: only the mpv A-B loop, if one is set, else samples around the
+// playback position (see RunPreviewEncode).
+static void RunEncode(bool to1440p, bool preview = false)
+{
+    if (g_loadedVideo.empty()) {
+        SetStatus(L"No video loaded.");
+        return;
+    }
 
-            while (ReadFile(hRead, chunk, sizeof(chunk), &read, nullptr) && read > 0) {
-                if (hLog != INVALID_HANDLE_VALUE) {
-                    DWORD written = 0;
-                    WriteFile(hLog, chunk, read, &written, nullptr);
-                }
-                buffer.append(chunk, chunk + read);
-                size_t pos = 0;
-                while (true) {
-                    size_t nl = buffer.find('\n', pos);
-                    if (nl == std::string::npos) break;
-                    std::string line = buffer.substr(pos, nl - pos);
-                    if (!line.empty() && line.back() == '\r') line.pop_back();
-                    int64_t outMs = ParseOutTimeMs(line);
-                    if (outMs >= 0 && durationSec > 0.0) {
-                        double pct = (outMs / (durationSec * 1000000.0)) * 100.0;
-                        if (pct > 100.0) pct = 100.0;
-                        if (pct - lastPct >= 0.5 || lastPct < 0.0) {
-                            wchar_t buf[128];
-                            swprintf_s(buf, L"Encoding (%s)... %.1f%%", enc.c_str(), pct);
-                            PostMessageW(g_hwndMain, WM_APP + 1, 0, (LPARAM)new std::wstring(buf));
-                            lastPct = pct;
-                        }
-                    }
-                    pos = nl + 1;
-                }
-                if (pos > 0) {
-                    buffer.erase(0, pos);
-                }
-            }
-            CloseHandle(hRead);
+    EncodeRequest req;
+    req.input = g_loadedVideo;
+    req.shaders = GetActiveShaders();
+    req.shaderParams = GetActiveShaderParams();
+    req.target.height = to1440p ? 1440 : 0;
+    req.encoder = g_encoderChoice;
+    req.segmentWorkers = g_segmentWorkers;
+    req.checkpoint = g_checkpoint;
+    req.smart = g_smartRender;
+    req.engine = g_shaderEngine;
+    GetMpvVideoSize(req.srcWidth, req.srcHeight);
+    if (preview && g_mpv) {
+        PreviewRange ab;
+        if (mpv_get_property(g_mpv, "ab-loop-a", MPV_FORMAT_DOUBLE, &ab.inSec) >= 0 &&
+            mpv_get_property(g_mpv, "ab-loop-b", MPV_FORMAT_DOUBLE, &ab.outSec) >= 0 && ab.outSec > ab.inSec) {
+            req.previewRanges.push_back(ab);
+        } else {
+            req.previewSamples = kPreviewDefaultSamples;
+            mpv_get_property(g_mpv, "time-pos", MPV_FORMAT_DOUBLE, &req.previewAt);
+        }
+    }
 
-            WaitForSingleObject(pi.hProcess, INFINITE);
+    // 0 = same as input; resolved on the encode thread if mpv doesn't know yet.
+    req.bitrateMbps = g_bitrateMbps;
+    if (req.bitrateMbps <= 0) {
+        req.bitrateMbps = GetMpvVideoBitrateMbps();
+    }
+    req.durationSec = GetMpvDurationSeconds();
 
-            DWORD exitCode = 1;
-            GetExitCodeProcess(pi.hProcess, &exitCode);
-            CloseHandle(pi.hThread);
-            CloseHandle(pi.hProcess);
+    static uint64_t jobCount = 0;
+    EncodeJob job;
+    CombinedShaderRef combined;
+    std::wstring warning;
+    PrepareEncodeJob(req, job, combined, warning);
+    job.progressId = ++jobCount;
+    SetStatus(warning.empty() ? L"Encoding..." : warning);
 
-            if (exitCode == 0) {
-                success = true;
-                break;
-            }
+    // Run in background thread
+    std::thread([job, combined]() mutable {
+        FfmpegResult result = RunEncodeJob(job, combined);
+        if (result.ok) {
+            PostStatus(L"Done: " + job.output);
+        } else {
+            PostStatus(L"Encode failed (" + std::wstring(FfmpegFailureName(result.failure)) +
+                       L"). See log: " + job.logPath);
         }
+    }).detach();
+}
 
-        if (hLog != INVALID_HANDLE_VALUE) CloseHandle(hLog);
-
-        if (!combined.empty()) {
-            DeleteFileW(combined.c_str());
+// Shader list context menu: profile the active chain on the loaded video.
+static void RunProfile()
+{
+    if (g_loadedVideo.empty()) {
+        SetStatus(L"No video loaded.");
+        return;
+    }
+    ProfileRequest pr;
+    pr.input = g_loadedVideo;
+    pr.shaders = GetActiveShaders();
+    pr.shaderParams = GetActiveShaderParams();
+    SetStatus(L"Profiling shaders...");
+
+    std::thread([pr]() {
+        std::wstring base = JoinPath(GetLogDir(), BasenameNoExt(pr.input) + L"_profile");
+        EncodeLog log;
+        log.Open(base + L".log", (uint64_t)g_logMaxMB << 20, g_logKeep);
+        ProfileReport report;
+        bool ok = RunShaderProfile(pr, report, log);
+        log.Close();
+        if (!ok) {
+            PostStatus(L"Profile failed: " + report.error);
+            return;
         }
-
-        if (success) {
-            PostMessageW(g_hwndMain, WM_APP + 1, 0, (LPARAM)new std::wstring(L"Done: " + out));
+        WriteProfileJson(base + L".json", report);
+        std::ofstream(FsPath(base + L".txt"), std::ios::binary | std::ios::trunc) << WideToUtf8(FormatProfileTable(report));
+        size_t worst = 0;
+        for (size_t i = 1; i < report.rows.size(); ++i) {
+            if (report.rows[i].ok && (worst == 0 || report.rows[i].marginalMs > report.rows[worst].marginalMs)) worst = i;
+        }
+        wchar_t msg[160];
+        if (worst) {
+            swprintf_s(msg, L"Profile: %.2f ms/frame, costliest %ls (+%.2f). ", report.rows.back().msPerFrame,
+                       FilenameOnly(report.rows[worst].shader).c_str(), report.rows[worst].marginalMs);
         } else {
-            PostMessageW(g_hwndMain, WM_APP + 1, 0, (LPARAM)new std::wstring(L"Encode failed. See log: " + logPath));
+            swprintf_s(msg, L"Profile: %.2f ms/frame without shaders. ", report.rows[0].msPerFrame);
         }
+        PostStatus(msg + std::wstring(L"Report: ") + base + L".txt");
     }).detach();
 }
 
@@ -1133,13 +10149,17 @@ enum {
     ID_BTN_CLEAR,
     ID_BTN_ENCODE_SAME,
     ID_BTN_ENCODE_1440,
+    ID_BTN_PREVIEW,
     ID_CB_BITRATE,
     ID_CB_ENCODER,
+    ID_CB_SEGMENTS,
+    ID_CB_ENGINE,
     ID_CTX_REMOVE = 2001,
     ID_CTX_MOVEUP,
     ID_CTX_MOVEDOWN,
     ID_CTX_EDIT,
     ID_CTX_BYPASS,
+    ID_CTX_PROFILE,
 };
 
 static void Layout(HWND hwnd)
@@ -1194,7 +10214,7 @@ static void Layout(HWND hwnd)
     y += labelH + 6;
 
     // Listbox
-    int listH = (rc.bottom - statusH - pad*3) - y - (btnH + 6)*2 - (labelH + 6 + comboH + 8) - (labelH + 6 + encoderH + 8) - 10;
+    int listH = (rc.bottom - statusH - pad*3) - y - (btnH + 6)*3 - (labelH + 6 + comboH + 8) - (labelH + 6 + encoderH + 8) - (labelH + 6 + comboH + 8)*2 - 10;
     if (listH < 120) listH = 120;
     MoveWindow(g_hwndList, x, y, btnW, listH, TRUE);
     y += listH + 8;
@@ -1212,9 +10232,22 @@ static void Layout(HWND hwnd)
     MoveWindow(g_hwndEncoder, x, y, btnW, comboH * 7, TRUE);
     y += comboH + 8;
 
+    // Parallel segments label + combo
+    MoveWindow(g_hwndSegmentsLabel, x, y, btnW, labelH, TRUE);
+    y += labelH + 6;
+    MoveWindow(g_hwndSegments, x, y, btnW, comboH * 7, TRUE);
+    y += comboH + 8;
+
+    // Shader engine label + combo
+    MoveWindow(g_hwndEngineLabel, x, y, btnW, labelH, TRUE);
+    y += labelH + 6;
+    MoveWindow(g_hwndEngine, x, y, btnW, comboH * 7, TRUE);
+    y += comboH + 8;
+
     y += 6;
     placeBtn(ID_BTN_ENCODE_SAME, L"Re-encode (same res)");
     placeBtn(ID_BTN_ENCODE_1440, L"Re-encode (1440p)");
+    placeBtn(ID_BTN_PREVIEW, L"Preview samples");
 }
 
 static void CreateUi(HWND hwnd)
@@ -1293,10 +10326,46 @@ static void CreateUi(HWND hwnd)
     SendMessageW(g_hwndEncoder, CB_ADDSTRING, 0, (LPARAM)L"hevc_qsv");
     SendMessageW(g_hwndEncoder, CB_ADDSTRING, 0, (LPARAM)L"hevc_mf");
     SendMessageW(g_hwndEncoder, CB_ADDSTRING, 0, (LPARAM)L"libx265");
+    SendMessageW(g_hwndEncoder, CB_ADDSTRING, 0, (LPARAM)L"All at once (segmented)");
     SendMessageW(g_hwndEncoder, CB_SETCURSEL, 0, 0);
     SendMessageW(g_hwndEncoder, CB_SETITEMHEIGHT, (WPARAM)-1, (LPARAM)22);
     SendMessageW(g_hwndEncoder, CB_SETITEMHEIGHT, 0, (LPARAM)20);
 
+    g_hwndSegmentsLabel = CreateWindowExW(0, L"STATIC", L"Parallel segments",
+        WS_CHILD | WS_VISIBLE,
+        0, 0, 100, 18, hwnd, nullptr, g_hInst, nullptr);
+
+    g_hwndSegments = CreateWindowExW(0, L"COMBOBOX", L"",
+        WS_CHILD | WS_VISIBLE | CBS_DROPDOWNLIST | WS_VSCROLL,
+        0, 0, 100, 200, hwnd, (HMENU)(INT_PTR)ID_CB_SEGMENTS, g_hInst, nullptr);
+
+    SendMessageW(g_hwndSegments, CB_ADDSTRING, 0, (LPARAM)L"Off (single process)");
+    SendMessageW(g_hwndSegments, CB_ADDSTRING, 0, (LPARAM)L"Auto");
+    SendMessageW(g_hwndSegments, CB_ADDSTRING, 0, (LPARAM)L"2");
+    SendMessageW(g_hwndSegments, CB_ADDSTRING, 0, (LPARAM)L"4");
+    SendMessageW(g_hwndSegments, CB_ADDSTRING, 0, (LPARAM)L"8");
+    SendMessageW(g_hwndSegments, CB_ADDSTRING, 0, (LPARAM)L"16");
+    SendMessageW(g_hwndSegments, CB_ADDSTRING, 0, (LPARAM)L"Auto, resumable");
+    SendMessageW(g_hwndSegments, CB_ADDSTRING, 0, (LPARAM)L"Auto, smart re-encode");
+    SendMessageW(g_hwndSegments, CB_SETCURSEL, 0, 0);
+    SendMessageW(g_hwndSegments, CB_SETITEMHEIGHT, (WPARAM)-1, (LPARAM)22);
+    SendMessageW(g_hwndSegments, CB_SETITEMHEIGHT, 0, (LPARAM)20);
+
+    g_hwndEngineLabel = CreateWindowExW(0, L"STATIC", L"Shader engine",
+        WS_CHILD | WS_VISIBLE,
+        0, 0, 100, 18, hwnd, nullptr, g_hInst, nullptr);
+
+    g_hwndEngine = CreateWindowExW(0, L"COMBOBOX", L"",
+        WS_CHILD | WS_VISIBLE | CBS_DROPDOWNLIST | WS_VSCROLL,
+        0, 0, 100, 200, hwnd, (HMENU)(INT_PTR)ID_CB_ENGINE, g_hInst, nullptr);
+
+    SendMessageW(g_hwndEngine, CB_ADDSTRING, 0, (LPARAM)L"GPU (libplacebo)");
+    SendMessageW(g_hwndEngine, CB_ADDSTRING, 0, (LPARAM)L"CPU (colortrans3 grades)");
+    SendMessageW(g_hwndEngine, CB_ADDSTRING, 0, (LPARAM)L"3D LUT (baked grades)");
+    SendMessageW(g_hwndEngine, CB_SETCURSEL, 0, 0);
+    SendMessageW(g_hwndEngine, CB_SETITEMHEIGHT, (WPARAM)-1, (LPARAM)22);
+    SendMessageW(g_hwndEngine, CB_SETITEMHEIGHT, 0, (LPARAM)20);
+
     auto mkBtn = [&](int id, const wchar_t* text) {
         CreateWindowExW(0, L"BUTTON", text,
             WS_CHILD | WS_VISIBLE,
@@ -1305,6 +10374,7 @@ static void CreateUi(HWND hwnd)
 
     mkBtn(ID_BTN_ENCODE_SAME, L"Re-encode (same res)");
     mkBtn(ID_BTN_ENCODE_1440, L"Re-encode (1440p)");
+    mkBtn(ID_BTN_PREVIEW, L"Preview samples");
 
     DragAcceptFiles(hwnd, TRUE);
 }
@@ -1312,6 +10382,16 @@ static void CreateUi(HWND hwnd)
 // ----------------------------
 // WndProc
 // ----------------------------
+// Shader watcher thread -> UI thread (WM_APP + 2).
+struct ShaderReload {
+    std::vector<std::wstring> changed;
+    double sinceSaveMs = 0.0;
+};
+
+// Running jobs' progress is read from the progress table at this rate.
+static const UINT_PTR kProgressTimerId = 1;
+static const UINT kProgressTimerMs = 250;
+
 static LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
 {
     switch (msg) {
@@ -1324,10 +10404,21 @@ static LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lPara
         }
         LoadSettings();
         LoadShaders();
+        // Warm the encoder capability cache so the first "auto" job doesn't wait.
+        std::thread([]() {
+            std::wstring ffmpeg;
+            FindFfmpeg(ffmpeg);
+            GetAvailableEncoders(ffmpeg);
+        }).detach();
         if (!g_shaders.empty()) {
             ListRefresh();
             MpvApplyShaderList();
         }
+        StartShaderWatcher([](const std::vector<std::wstring>& changed, double sinceSaveMs) {
+            auto* r = new ShaderReload{ changed, sinceSaveMs };
+            if (!PostMessageW(g_hwndMain, WM_APP + 2, 0, (LPARAM)r)) delete r;
+        });
+        SetTimer(hwnd, kProgressTimerId, kProgressTimerMs, nullptr);
         UpdatePlayPauseLabel();
         SetStatus(L"Drop a video file to start. Drop .glsl shader files to add filters.");
         return 0;
@@ -1380,6 +10471,8 @@ static LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lPara
             AppendMenuW(menu, MF_SEPARATOR, 0, nullptr);
             AppendMenuW(menu, MF_STRING, ID_CTX_EDIT, L"Edit with Notepad++");
             AppendMenuW(menu, MF_STRING | (bypassed ? MF_CHECKED : 0), ID_CTX_BYPASS, L"Bypass");
+            AppendMenuW(menu, MF_STRING | (g_loadedVideo.empty() ? MF_GRAYED : 0), ID_CTX_PROFILE,
+                        L"Profile Shader Cost");
             if (!fullPath.empty()) {
                 AppendMenuW(menu, MF_SEPARATOR, 0, nullptr);
                 std::wstring label = L"Path: " + fullPath;
@@ -1475,16 +10568,40 @@ static LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lPara
             case 3: g_encoderChoice = L"hevc_qsv"; break;
             case 4: g_encoderChoice = L"hevc_mf"; break;
             case 5: g_encoderChoice = L"libx265"; break;
+            case 6: g_encoderChoice = L"all"; break;
             default: g_encoderChoice = L"auto"; break;
             }
             return 0;
         }
+        if (id == ID_CB_SEGMENTS && HIWORD(wParam) == CBN_SELCHANGE) {
+            int sel = (int)SendMessageW(g_hwndSegments, CB_GETCURSEL, 0, 0);
+            switch (sel) {
+            case 0: g_segmentWorkers = 0; break;
+            case 1: g_segmentWorkers = -1; break;
+            case 2: g_segmentWorkers = 2; break;
+            case 3: g_segmentWorkers = 4; break;
+            case 4: g_segmentWorkers = 8; break;
+            case 5: g_segmentWorkers = 16; break;
+            case 6: g_segmentWorkers = -1; break;
+            case 7: g_segmentWorkers = -1; break;
+            default: g_segmentWorkers = 0; break;
+            }
+            g_checkpoint = (sel == 6);
+            g_smartRender = (sel == 7);
+            return 0;
+        }
+        if (id == ID_CB_ENGINE && HIWORD(wParam) == CBN_SELCHANGE) {
+            int sel = (int)SendMessageW(g_hwndEngine, CB_GETCURSEL, 0, 0);
+            g_shaderEngine = (sel == 1 || sel == 2) ? sel : 0;
+            return 0;
+        }
         switch (id) {
         case ID_BTN_PLAYPAUSE: MpvTogglePause(); break;
         case ID_BTN_ADDVIDEO: OpenVideoDialog(); break;
         case ID_BTN_ADDSHADER: OpenShaderDialog(); break;
         case ID_BTN_ENCODE_SAME: RunEncode(false); break;
         case ID_BTN_ENCODE_1440: RunEncode(true); break;
+        case ID_BTN_PREVIEW: RunEncode(false, true); break;
         case ID_CTX_REMOVE:    RemoveSelectedShader(); break;
         case ID_CTX_MOVEUP: {
             int sel = (int)SendMessageW(g_hwndList, LB_GETCURSEL, 0, 0);
@@ -1511,12 +10628,31 @@ static LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lPara
             }
             break;
         }
+        case ID_CTX_PROFILE:
+            RunProfile();
+            break;
         }
         return 0;
     }
 
+    case WM_TIMER:
+        if (wParam == kProgressTimerId) {
+            // Only touch the status line while something is running, and only
+            // when the text changed.
+            static std::wstring shown;
+            std::vector<ProgressSnapshot> jobs = SnapshotProgress();
+            if (!jobs.empty()) {
+                std::wstring line = FormatProgressLine(jobs);
+                if (line != shown) SetStatus(line);
+                shown = line;
+            } else {
+                shown.clear();
+            }
+        }
+        return 0;
+
     case WM_APP + 1: {
-        // status update from encode thread
+        // one-off status message from a worker thread
         auto* p = (std::wstring*)lParam;
         if (p) {
             SetStatus(*p);
@@ -1525,7 +10661,26 @@ static LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lPara
         return 0;
     }
 
+    case WM_APP + 2: {
+        // an active shader's contents changed on disk
+        auto* r = (ShaderReload*)lParam;
+        if (r) {
+            auto start = std::chrono::steady_clock::now();
+            MpvApplyShaderList();
+            double applyMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            wchar_t timing[96];
+            swprintf_s(timing, L": %.0f ms after save (apply %.0f ms)", r->sinceSaveMs + applyMs, applyMs);
+            std::wstring names;
+            for (const auto& p : r->changed) names += (names.empty() ? L"" : L", ") + FilenameOnly(p);
+            SetStatus(L"Reloaded " + names + timing);
+            delete r;
+        }
+        return 0;
+    }
+
     case WM_DESTROY:
+        KillTimer(hwnd, kProgressTimerId);
+        StopShaderWatcher();
         MpvShutdown();
         PostQuitMessage(0);
         return 0;
@@ -1539,6 +10694,25 @@ int WINAPI wWinMain(HINSTANCE hInst, HINSTANCE, PWSTR, int nCmdShow)
 
     SetupDllSearchPath();
 
+    int argc = 0;
+    LPWSTR* argv = CommandLineToArgvW(GetCommandLineW(), &argc);
+    std::vector<std::wstring> args;
+    for (int i = 1; argv && i < argc; ++i) args.push_back(argv[i]);
+    if (argv) LocalFree(argv);
+    if (IsBatchCommandLine(args) || IsServiceCommandLine(args) || IsBenchCommandLine(args) ||
+        IsProfileCommandLine(args) || IsSelfTestCommandLine(args)) {
+        // GUI-subsystem exe: report on the console we were started from, if any.
+        if (AttachConsole(ATTACH_PARENT_PROCESS)) {
+            FILE* f = nullptr;
+            freopen_s(&f, "CONOUT$", "w", stdout);
+            SetConsoleOutputCP(CP_UTF8);
+        }
+        if (IsBenchCommandLine(args)) return BenchMain(args);
+        if (IsProfileCommandLine(args)) return ProfileMain(args);
+        if (IsSelfTestCommandLine(args)) return SelfTestMain(args);
+        return IsServiceCommandLine(args) ? ServiceMain(args) : BatchMain(args);
+    }
+
     INITCOMMONCONTROLSEX icc{};
     icc.dwSize = sizeof(icc);
     icc.dwICC = ICC_STANDARD_CLASSES;
@@ -1573,3 +10747,19 @@ int WINAPI wWinMain(HINSTANCE hInst, HINSTANCE, PWSTR, int nCmdShow)
     }
     return 0;
 }
+#else
+int main(int argc, char** argv)
+{
+    signal(SIGPIPE, SIG_IGN); // a child exiting early must not kill the feeder
+    std::vector<std::wstring> args;
+    for (int i = 1; i < argc; ++i) args.push_back(Utf8ToWide(argv[i]));
+    int rc = IsBenchCommandLine(args) ? BenchMain(args)
+           : IsProfileCommandLine(args) ? ProfileMain(args)
+           : IsSelfTestCommandLine(args) ? SelfTestMain(args)
+           : IsServiceCommandLine(args) ? ServiceMain(args) : BatchMain(args);
+    // Skip static destructors: the detached probe workers still wait on
+    // g_probeQueueCv, and glibc's condition variable destructor waits for them.
+    fflush(stdout);
+    _exit(rc);
+}
+#endif
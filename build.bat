@@ -19,9 +19,13 @@ rem Ensure previous instance isn't locking the exe
 taskkill /im VfxEnc.exe /f /t >nul 2>&1
 
 set "CLEAN_ONLY=0"
+set "WITH_LIBAV=0"
+set "WITH_SELFTEST=0"
 for %%A in (%*) do (
   if /I "%%~A"=="clean" set "CLEAN_ONLY=1"
   if /I "%%~A"=="/clean" set "CLEAN_ONLY=1"
+  if /I "%%~A"=="libav" set "WITH_LIBAV=1"
+  if /I "%%~A"=="selftest" set "WITH_SELFTEST=1"
 )
 
 if "%CLEAN_ONLY%"=="1" (
@@ -32,6 +36,8 @@ if "%CLEAN_ONLY%"=="1" (
   del /f /q "%ROOT%\*.lib" >nul 2>&1
   del /f /q "%ROOT%\*.log" >nul 2>&1
   del /f /q "%ROOT%\combined_shaders_*.glsl" >nul 2>&1
+  if exist "%ROOT%\shader_cache" rmdir /s /q "%ROOT%\shader_cache" >nul 2>&1
+  if exist "%ROOT%\lut_cache" rmdir /s /q "%ROOT%\lut_cache" >nul 2>&1
   if exist "%DIST_DIR%" rmdir /s /q "%DIST_DIR%" >nul 2>&1
   if exist "%BUILD_DIR%" rmdir /s /q "%BUILD_DIR%" >nul 2>&1
   if exist "%DEPS_DIR%" rmdir /s /q "%DEPS_DIR%" >nul 2>&1
@@ -181,10 +187,30 @@ if not defined MPV_INCLUDE (
 echo [build] MPV_LIB_DIR=%MPV_LIB_DIR%
 echo [build] MPV_INCLUDE=%MPV_INCLUDE%
 
+rem "build.bat libav" links the libav* libraries and encodes in-process.
+rem LIBAV_DIR is a shared FFmpeg dev build (include\, lib\, bin\).
+set "LIBAV_FLAGS="
+set "LIBAV_LINK="
+if "%WITH_LIBAV%"=="1" (
+  if not defined LIBAV_DIR set "LIBAV_DIR=%DEPS_DIR%\ffmpeg-shared"
+  if not exist "!LIBAV_DIR!\include\libavfilter\avfilter.h" (
+    echo ERROR: libav headers not found in !LIBAV_DIR! ^(set LIBAV_DIR^)
+    exit /b 1
+  )
+  echo [build] LIBAV_DIR=!LIBAV_DIR!
+  set "LIBAV_FLAGS=/DVFXENC_WITH_LIBAV /I"!LIBAV_DIR!\include""
+  set "LIBAV_LINK=/LIBPATH:"!LIBAV_DIR!\lib""
+  for %%F in ("!LIBAV_DIR!\bin\*.dll") do copy /y "%%~fF" "%DIST_DIR%" >nul
+)
+
+rem "build.bat selftest" compiles in the --selftest checks (not for release).
+set "SELFTEST_FLAGS="
+if "%WITH_SELFTEST%"=="1" set "SELFTEST_FLAGS=/DVFXENC_SELFTEST"
+
 cl /nologo /std:c++17 /EHsc /O2 /MD /DNDEBUG /DUNICODE /D_UNICODE ^
-  /I"%MPV_INCLUDE%" ^
+  /I"%MPV_INCLUDE%" %LIBAV_FLAGS% %SELFTEST_FLAGS% ^
   /Fe:"%DIST_DIR%\VfxEnc.exe" "%ROOT%\VfxEnc.cpp" ^
-  /link /SUBSYSTEM:WINDOWS /DELAYLOAD:mpv-2.dll /LIBPATH:"%MPV_LIB_DIR%" mpv.lib delayimp.lib User32.lib Gdi32.lib Comdlg32.lib Shell32.lib
+  /link /SUBSYSTEM:WINDOWS /DELAYLOAD:mpv-2.dll /LIBPATH:"%MPV_LIB_DIR%" %LIBAV_LINK% mpv.lib delayimp.lib User32.lib Gdi32.lib Comdlg32.lib Shell32.lib
 if errorlevel 1 exit /b 1
 
 exit /b 0